@@ -0,0 +1,28 @@
+#include "fuzz_descs.h"
+#include "message_encoder.h"
+#include "message_hash.h"
+#include <cstdlib>
+
+// decodeMessage over every seed descriptor. Anything that decodes must
+// re-encode, and the re-encoding must decode back to an equal message.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  std::vector<uint8_t> in(data, data + size);
+
+  for (const auto &desc : seedDescs()) {
+    auto [msg, err] = decodeMessage(in, desc, fuzzDecodeOptions());
+    if (!msg.has_value()) {
+      if (err.code == DecodeErrc::None || err.offset > in.size())
+        std::abort();
+      continue;
+    }
+
+    auto [bytes, encErr] = encodeMessage(*msg);
+    if (!bytes.has_value() || bytes->size() != byteSize(*msg))
+      std::abort();
+    auto [again, againErr] = decodeMessage(*bytes, desc, fuzzDecodeOptions());
+    if (!again.has_value() || !messagesEqual(*msg, *again) ||
+        hashMessage(*msg) != hashMessage(*again))
+      std::abort();
+  }
+  return 0;
+}
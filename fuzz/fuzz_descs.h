@@ -0,0 +1,84 @@
+#pragma once
+
+#include "message_encoder.h"
+#include "proto_desc.h"
+#include <memory>
+#include <vector>
+
+// Descriptors every message-level fuzz target decodes against. Together they
+// cover each FieldType, singular/packed/unpacked repetition, maps and nesting.
+inline const std::vector<std::shared_ptr<const ProtoDesc>> &seedDescs() {
+  static const auto descs = [] {
+    std::vector<std::shared_ptr<const ProtoDesc>> out;
+
+    auto leaf = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+        {"name", 1, FieldType::String},
+        {"blob", 2, FieldType::Bytes},
+        {"flag", 3, FieldType::Bool},
+    });
+    out.push_back(leaf);
+
+    out.push_back(std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+        {"id", 1, FieldType::Int},
+        {"value", 2, FieldType::Double},
+        {"name", 3, FieldType::String},
+        {"count", 4, FieldType::UInt},
+        {"active", 5, FieldType::Bool},
+        {"tags", 6, FieldType::Int, /*repeated=*/true},
+        {"ratio", 7, FieldType::Float},
+        {"blob", 8, FieldType::Bytes},
+        {"kind", 9, FieldType::Enum},
+        {"i32", 10, FieldType::Int32},
+        {"i64", 11, FieldType::Int64},
+        {"u32", 12, FieldType::UInt32},
+        {"f64", 13, FieldType::Fixed64},
+        {"sf32", 14, FieldType::SFixed32},
+        {"sf64", 15, FieldType::SFixed64},
+    }));
+
+    out.push_back(std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+        {"ids", 1, FieldType::Int, /*repeated=*/true, /*packed=*/false},
+        {"vals", 2, FieldType::Double, /*repeated=*/true},
+        {"ratios", 3, FieldType::Float, /*repeated=*/true},
+        {"flags", 4, FieldType::Bool, /*repeated=*/true},
+        {"names", 5, FieldType::String, /*repeated=*/true, /*packed=*/false},
+        {"counts", 6, FieldType::UInt, /*repeated=*/true, /*packed=*/false},
+        {"kinds", 7, FieldType::Enum, /*repeated=*/true},
+        {"fixed", 8, FieldType::Fixed32, /*repeated=*/true},
+        {"zz", 9, FieldType::SInt32, /*repeated=*/true, /*packed=*/false},
+    }));
+
+    auto mid = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+        {"id", 1, FieldType::UInt},
+        {"leaf", 2, FieldType::Message, /*repeated=*/false, /*packed=*/false,
+         leaf},
+        {"leaves", 3, FieldType::Message, /*repeated=*/true, /*packed=*/false,
+         leaf},
+        FieldDesc::map("byName", 4, FieldType::String, FieldType::Message,
+                       leaf),
+    });
+    out.push_back(std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+        {"mid", 1, FieldType::Message, /*repeated=*/false, /*packed=*/false,
+         mid},
+        {"mids", 2, FieldType::Message, /*repeated=*/true, /*packed=*/false,
+         mid},
+        {"tag", 3, FieldType::Int},
+        FieldDesc::map("counts", 4, FieldType::Int, FieldType::UInt),
+    }));
+
+    // No fields: every input field is unknown and goes through skipUnknown
+    out.push_back(std::make_shared<ProtoDesc>(std::vector<FieldDesc>{}));
+    return out;
+  }();
+  return descs;
+}
+
+// Limits small enough that hostile inputs fail fast instead of timing out
+inline DecodeOptions fuzzDecodeOptions() {
+  DecodeOptions opts;
+  opts.maxDepth = 32;
+  opts.maxFieldSize = 1 << 20;
+  opts.maxRepeated = 1 << 16;
+  opts.maxAllocations = 1 << 16;
+  return opts;
+}
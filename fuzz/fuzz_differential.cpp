@@ -0,0 +1,138 @@
+#include "columnar.h"
+#include "encoder.h"
+#include "fuzz_descs.h"
+#include "json_format.h"
+#include "message_encoder.h"
+#include "message_hash.h"
+#include "predicate.h"
+#include "reference_decoders.h"
+#include "text_format.h"
+#include "wire_scanner.h"
+#include <cstdlib>
+#include <sstream>
+
+// Differential checks: the library's primitive decoders against the naive
+// reference ones, decode(encode(m)) == m in both encoding modes, and the
+// direct binary to JSON path against decoding then writing JSON. Text and
+// JSON output must parse back to the same text, columnar decoding must
+// reject exactly what decodeMessage does and encode back to the same
+// message, the wire scanner must frame fields as decodeMessage skips
+// unknown ones, and predicates must read fields as decoding leaves them.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  std::vector<uint8_t> in(data, data + size);
+
+  for (size_t i = 0; i <= in.size(); ++i) {
+    if (decodeVarint(in, i) != reference::varint(in, i))
+      std::abort();
+    if (decodeFixed64(in, i) != reference::fixed(in, i, 8))
+      std::abort();
+    auto f32 = decodeFixed32(in, i);
+    auto ref32 = reference::fixed(in, i, 4);
+    if (f32.has_value() != ref32.has_value() ||
+        (f32.has_value() && *f32 != *ref32))
+      std::abort();
+    if (decodeBytes(in, i) != reference::lengthDelimited(in, i))
+      std::abort();
+  }
+
+  // With no fields declared, decodeMessage only checks framing
+  WireScanner scan(in);
+  for (WireField f; scan.next(f);) {
+  }
+  auto [framed, frameErr] = decodeMessage(
+      in, std::make_shared<ProtoDesc>(std::vector<FieldDesc>{}),
+      fuzzDecodeOptions());
+  if (scan.error() != frameErr.code ||
+      (!framed.has_value() && scan.offset() != frameErr.offset))
+    std::abort();
+
+  static const Predicate outerFilter =
+      *compilePredicate("mid.leaf.flag || mid.id >= 5 && !has(mid.leaf.name)"
+                        " || tag == -1",
+                        seedDescs()[3])
+           .first;
+
+  for (const auto &desc : seedDescs()) {
+    auto [msg, err] = decodeMessage(in, desc, fuzzDecodeOptions());
+    ColumnarDecoder columns(desc, fuzzDecodeOptions());
+    if (columns.append(in).code != err.code)
+      std::abort();
+    TextOptions textOpts{.maxDepth = fuzzDecodeOptions().maxDepth};
+    std::ostringstream raw;
+    printText(in, *desc, raw, textOpts);
+    JsonOptions jsonOpts{.maxDepth = fuzzDecodeOptions().maxDepth};
+    std::string direct, json;
+    bool directOk = binaryToJson(in, *desc, direct, jsonOpts).message.empty();
+    if (!msg.has_value()) {
+      if (directOk)
+        std::abort();
+      continue;
+    }
+    if (desc == seedDescs()[3]) {
+      bool flag = false, named = false, big = false, tagged = false;
+      if (auto mid = msg->get("mid")) {
+        const Message &m = std::get<Message>(mid->get());
+        if (auto leaf = m.get("leaf")) {
+          const Message &l = std::get<Message>(leaf->get());
+          auto f = l.get("flag");
+          flag = f.has_value() && std::get<bool>(f->get());
+          named = l.get("name").has_value();
+        }
+        auto id = m.get("id");
+        big = id.has_value() && std::get<uint64_t>(id->get()) >= 5;
+      }
+      if (auto tag = msg->get("tag"))
+        tagged = std::get<int64_t>(tag->get()) == -1;
+      if (outerFilter.matches(in) != (flag || (big && !named) || tagged))
+        std::abort();
+    }
+
+    auto [rows, rowsErr] = encodeColumns(columns.finish());
+    if (!rows.has_value() || rows->size() != 1)
+      std::abort();
+    auto [fromColumns, columnsErr] =
+        decodeMessage(rows->front(), desc, fuzzDecodeOptions());
+    if (!fromColumns.has_value() || !messagesEqual(*msg, *fromColumns))
+      std::abort();
+
+    // Writing fails only for invalid UTF-8, which both paths reject
+    bool jsonOk = messageToJson(*msg, json, jsonOpts).message.empty();
+    if (directOk != jsonOk || (jsonOk && direct != json))
+      std::abort();
+    if (jsonOk) {
+      auto [parsed, parseErr] = jsonToMessage(json, desc, jsonOpts);
+      std::string again;
+      if (!parsed.has_value() ||
+          !messageToJson(*parsed, again).message.empty() || again != json)
+        std::abort();
+    }
+
+    std::ostringstream text, textAgain;
+    if (!printText(*msg, text, textOpts).message.empty())
+      std::abort();
+    auto [fromText, textErr] = parseText(text.str(), desc, textOpts);
+    if (!fromText.has_value() ||
+        !printText(*fromText, textAgain, textOpts).message.empty() ||
+        textAgain.str() != text.str())
+      std::abort();
+
+    for (bool canonical : {false, true}) {
+      EncodeOptions opts{.canonical = canonical};
+      auto [bytes, encErr] = encodeMessage(*msg, opts);
+      if (!bytes.has_value())
+        std::abort();
+      auto [again, againErr] =
+          decodeMessage(*bytes, desc, fuzzDecodeOptions());
+      if (!again.has_value() || !messagesEqual(*msg, *again))
+        std::abort();
+      // Scatter-gather output carries the same bytes
+      auto [chain, chainErr] = encodeChain(*msg, opts, 1);
+      if (!chain.has_value() || chain->flatten() != *bytes)
+        std::abort();
+      // Canonical bytes are a fixed point
+      if (canonical && encodeMessage(*again, opts).first != bytes)
+        std::abort();
+    }
+  }
+  return 0;
+}
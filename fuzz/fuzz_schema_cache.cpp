@@ -0,0 +1,23 @@
+#include "proto_schema.h"
+#include <cstdlib>
+
+// Loads arbitrary bytes as a descriptor cache. Anything that loads must
+// serialize to a cache that loads again and is stable from then on.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  auto [schema, err] = loadSchema(data, size);
+  if (schema.has_value() != err.message.empty())
+    std::abort();
+  if (!schema.has_value()) {
+    if (err.offset > size)
+      std::abort();
+    return 0;
+  }
+
+  auto cache = serializeSchema(*schema);
+  auto [again, againErr] = loadSchema(cache);
+  if (!again.has_value() || again->messages.size() != schema->messages.size())
+    std::abort();
+  if (serializeSchema(*again) != cache)
+    std::abort();
+  return 0;
+}
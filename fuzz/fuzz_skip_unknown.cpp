@@ -0,0 +1,19 @@
+#include "fuzz_descs.h"
+#include "message_encoder.h"
+#include <cstdlib>
+
+// Decodes against a descriptor with no fields, so every field in the input
+// is unknown and walked by skipUnknown. Success must consume everything.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  std::vector<uint8_t> in(data, data + size);
+  auto empty = seedDescs().back();
+
+  auto [msg, err] = decodeMessage(in, empty, fuzzDecodeOptions());
+  if (msg.has_value() == (err.code != DecodeErrc::None))
+    std::abort();
+  if (!msg.has_value() && err.offset > in.size())
+    std::abort();
+  if (msg.has_value() && byteSize(*msg) != 0)
+    std::abort();
+  return 0;
+}
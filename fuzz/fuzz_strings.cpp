@@ -0,0 +1,39 @@
+#include "encoder.h"
+#include <algorithm>
+#include <cstdlib>
+
+// decodeStr / decodeBytes and the fixed-width decoders at every offset
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  std::vector<uint8_t> in(data, data + size);
+
+  for (size_t i = 0; i <= in.size(); ++i) {
+    auto [str, next] = decodeStr(in, i);
+    auto [bytes, bnext] = decodeBytes(in, i);
+    if (str.has_value() != bytes.has_value() || next != bnext)
+      std::abort();
+    if (str.has_value()) {
+      if (next > in.size() || str->size() != bytes->size())
+        std::abort();
+      if (!std::equal(str->begin(), str->end(), bytes->begin(),
+                      [](char c, uint8_t b) { return uint8_t(c) == b; }))
+        std::abort();
+      if (decodeStr(encodeStr(*str), 0).first != str)
+        std::abort();
+    } else if (next != i) {
+      std::abort();
+    }
+
+    auto f64 = decodeFixed64(in, i);
+    auto f32 = decodeFixed32(in, i);
+    if (f64.has_value() != (in.size() - i >= 8) ||
+        f32.has_value() != (in.size() - i >= 4))
+      std::abort();
+    if (f64.has_value() &&
+        !std::equal(in.begin() + i, in.begin() + i + 8,
+                    encodeFixed64(*f64).begin()))
+      std::abort();
+    (void)decodeDouble(in, i);
+    (void)decodeFloat(in, i);
+  }
+  return 0;
+}
@@ -0,0 +1,39 @@
+#include "encoder.h"
+#include <cstdlib>
+
+// decodeVarint / decodeSignedVarint / decodeVarint32 at every offset, plus
+// re-encoding
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  std::vector<uint8_t> in(data, data + size);
+
+  for (size_t i = 0; i <= in.size(); ++i) {
+    auto [u, next] = decodeVarint(in, i);
+    // The 32-bit decoder accepts exactly the same encodings, keeping the low
+    // 32 bits
+    auto [u32, next32] = decodeVarint32(in, i);
+    if (u32.has_value() != u.has_value() || next32 != next)
+      std::abort();
+    if (!u.has_value()) {
+      if (next != i)
+        std::abort();
+      continue;
+    }
+    if (*u32 != static_cast<uint32_t>(*u))
+      std::abort();
+    if (next <= i || next > in.size() || next - i > 10)
+      std::abort();
+    // Re-encoding is minimal, so never longer than what was consumed
+    auto enc = encodeVarint(*u);
+    if (enc.size() > next - i || enc.size() != varintSize(*u))
+      std::abort();
+    if (decodeVarint(enc, 0).first != u)
+      std::abort();
+
+    auto [s, snext] = decodeSignedVarint(in, i);
+    if (!s.has_value() || snext != next)
+      std::abort();
+    if (encodeSignedVarint(*s) != enc)
+      std::abort();
+  }
+  return 0;
+}
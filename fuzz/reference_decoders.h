@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Deliberately naive decoders: one byte at a time, no shortcuts. The
+// differential target checks the library's (faster) primitives against
+// these, so optimisations must keep byte-for-byte identical behaviour.
+namespace reference {
+
+inline std::pair<std::optional<uint64_t>, size_t>
+varint(const std::vector<uint8_t> &in, size_t index) {
+  uint64_t out = 0;
+  for (size_t n = 0; n < 10; ++n) {
+    if (index + n >= in.size())
+      return {std::nullopt, index};
+    uint8_t b = in[index + n];
+    uint64_t bits = b & 0x7F;
+    // The 10th byte may only carry the top bit of a uint64
+    if (n == 9 && bits > 1)
+      return {std::nullopt, index};
+    out |= bits << (7 * n);
+    if (!(b & 0x80))
+      return {out, index + n + 1};
+  }
+  return {std::nullopt, index};
+}
+
+inline std::optional<uint64_t> fixed(const std::vector<uint8_t> &in,
+                                     size_t index, size_t width) {
+  if (index > in.size() || in.size() - index < width)
+    return std::nullopt;
+  uint64_t out = 0;
+  for (size_t i = 0; i < width; ++i)
+    out |= uint64_t(in[index + i]) << (8 * i);
+  return out;
+}
+
+inline std::pair<std::optional<std::vector<uint8_t>>, size_t>
+lengthDelimited(const std::vector<uint8_t> &in, size_t index) {
+  auto [len, next] = varint(in, index);
+  if (!len.has_value() || *len > in.size() - next)
+    return {std::nullopt, index};
+  std::vector<uint8_t> out;
+  for (uint64_t i = 0; i < *len; ++i)
+    out.push_back(in[next + i]);
+  return {out, next + *len};
+}
+
+} // namespace reference
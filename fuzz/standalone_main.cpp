@@ -0,0 +1,37 @@
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <vector>
+
+// Replays corpus files or crash reproducers through a fuzz target without
+// libFuzzer, e.g. under gdb or with a compiler that lacks -fsanitize=fuzzer.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static void runFile(const std::filesystem::path &path) {
+  std::ifstream f(path, std::ios::binary);
+  std::vector<uint8_t> buf((std::istreambuf_iterator<char>(f)),
+                           std::istreambuf_iterator<char>());
+  LLVMFuzzerTestOneInput(buf.data(), buf.size());
+}
+
+int main(int argc, char **argv) {
+  size_t runs = 0;
+  for (int i = 1; i < argc; ++i) {
+    std::filesystem::path p(argv[i]);
+    if (std::filesystem::is_directory(p)) {
+      for (const auto &entry : std::filesystem::directory_iterator(p)) {
+        if (entry.is_regular_file()) {
+          runFile(entry.path());
+          ++runs;
+        }
+      }
+    } else {
+      runFile(p);
+      ++runs;
+    }
+  }
+  std::cout << "replayed " << runs << " inputs\n";
+  return 0;
+}
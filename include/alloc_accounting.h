@@ -0,0 +1,133 @@
+#pragma once
+#include "proto_desc.h"
+#include <cstdint>
+#include <iosfwd>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Attribution of heap allocations and deep copies to the codec stage and
+// field path that made them, for checking allocation-reduction work:
+//
+//   AllocationTrace trace;
+//   auto [msg, err] = decodeMessage(bytes, order, {});
+//   std::cout << trace.report(); // e.g. decode  lines.sku  3  96  0  0
+//
+// Compiled in like the copy counters (PROTO_ALLOC_ACCOUNTING, on without
+// NDEBUG) and active on a thread only while an AllocationTrace is alive
+// there. encodeMessage, encodeChain, decodeMessage, decodeInto and the
+// Message mutators mark their stage and the field they are working on;
+// allocations and copies outside them are charged to Other. Deep copies
+// are seen through CopyStats' counters. Heap allocations are seen only
+// when the program's replacement operator new reports them:
+//
+//   void *operator new(size_t n) {
+//     accountAllocation(n);
+//     ...
+//   }
+#ifndef PROTO_ALLOC_ACCOUNTING
+#ifdef NDEBUG
+#define PROTO_ALLOC_ACCOUNTING 0
+#else
+#define PROTO_ALLOC_ACCOUNTING 1
+#endif
+#endif
+
+// The outermost instrumented call in progress: work the decoder does
+// through Message's mutators counts as Decode
+enum class AllocStage { Other, Encode, Decode, Mutate };
+const char *allocStageName(AllocStage stage); // "other", "encode", ...
+
+struct AllocationSite {
+  AllocStage stage = AllocStage::Other;
+  // Field names from the message the call was made on, e.g. "lines.sku"
+  // (map values under the map's name); empty for the message itself
+  std::string fieldPath;
+  uint64_t allocations = 0;
+  uint64_t bytes = 0;
+  uint64_t messageCopies = 0;  // as CopyStats::messages
+  uint64_t repeatedCopies = 0; // as CopyStats::repeated
+};
+
+struct AllocationReport {
+  std::vector<AllocationSite> sites; // in order of first charge
+
+  uint64_t allocations() const;
+  uint64_t bytes() const;
+  uint64_t copies() const; // message and repeated
+  const AllocationSite *find(AllocStage stage, std::string_view path) const;
+};
+// One line per site: stage, path (or "-"), allocations, bytes, message
+// copies, repeated copies
+std::ostream &operator<<(std::ostream &out, const AllocationReport &report);
+
+// Accounting on the calling thread for as long as it is alive. Traces nest;
+// only the innermost is charged. Allocations the accounting makes itself
+// are not.
+class AllocationTrace {
+public:
+  AllocationTrace();
+  ~AllocationTrace();
+  AllocationTrace(const AllocationTrace &) = delete;
+  AllocationTrace &operator=(const AllocationTrace &) = delete;
+
+  AllocationReport report() const; // charges so far
+
+private:
+  friend void accountAllocation(size_t bytes);
+  friend void detail::countCopy(uint64_t CopyStats::*counter);
+  AllocationSite &siteHere();
+
+  AllocationTrace *outer;
+  AllocationReport charged;
+  std::map<std::pair<AllocStage, std::string>, size_t> siteIndex;
+};
+
+// For replacement operator new: charges one allocation of n bytes to the
+// calling thread's trace, if it has one. Cheap when it does not.
+void accountAllocation(size_t bytes);
+
+namespace detail {
+// A stage and field the calling thread is working on, kept on the C++ stack
+// and linked to the enclosing one while a trace is active
+class AllocFrame;
+struct AllocTraceState {
+  AllocationTrace *trace = nullptr;
+  const AllocFrame *frame = nullptr;
+  bool charging = false; // inside a charge: its own allocations are ignored
+};
+extern constinit thread_local AllocTraceState allocTrace;
+
+class AllocFrame {
+public:
+  AllocFrame(AllocStage stage, const FieldDesc *field) {
+#if PROTO_ALLOC_ACCOUNTING
+    if (allocTrace.trace != nullptr) {
+      parent = allocTrace.frame;
+      this->stage = parent != nullptr ? parent->stage : stage;
+      this->field = field;
+      allocTrace.frame = this;
+      linked = true;
+    }
+#else
+    (void)stage;
+    (void)field;
+#endif
+  }
+  ~AllocFrame() {
+    if (linked)
+      allocTrace.frame = parent;
+  }
+  AllocFrame(const AllocFrame &) = delete;
+  AllocFrame &operator=(const AllocFrame &) = delete;
+
+  AllocStage stage = AllocStage::Other;
+  const FieldDesc *field = nullptr; // nullptr for a call's top level
+  const AllocFrame *parent = nullptr;
+
+private:
+  bool linked = false;
+};
+} // namespace detail
@@ -0,0 +1,110 @@
+#pragma once
+#include "message_encoder.h"
+#include "proto_desc.h"
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// One field's values across a batch of messages, in the Apache Arrow
+// columnar layout (without depending on Arrow). Buffers are little-endian
+// and bitmaps LSB-first:
+//
+//   integer, float, double, enum  validity + values (int32, uint32, int64,
+//                                 uint64, float, double per FieldType)
+//   bool                          validity + bit-packed values
+//   string, bytes                 validity + int32 offsets + data
+//   message                       validity + one child per field (a struct)
+//   repeated field                int32 offsets + one child of the element
+//                                 type (a list; never null, unset is empty)
+//   map                           offsets + an "entries" struct child with
+//                                 "key" and "value" children (Arrow's map)
+//
+// A null slot (an unset field) still occupies its place in every buffer:
+// zeroed values, a repeated offset, null children.
+struct Column {
+  std::string name;
+  FieldType type;      // element type of repeated fields; Map for maps
+  bool isList = false; // repeated field or map
+  size_t length = 0;   // slots: rows, or elements for a list's child
+  size_t nullCount = 0;
+  std::vector<uint8_t> validity; // bit i set: slot i is not null
+  std::vector<uint8_t> values;   // fixed-width values
+  std::vector<int32_t> offsets;  // length + 1, for strings, bytes and lists
+  std::vector<uint8_t> data;     // string and bytes payloads
+  std::vector<Column> children;
+
+  bool isValid(size_t i) const { return validity[i / 8] >> (i % 8) & 1; }
+  // Fixed-width values as T (which must match type); bools are bits
+  template <typename T> const T *valuesAs() const {
+    return reinterpret_cast<const T *>(values.data());
+  }
+  bool boolAt(size_t i) const { return values[i / 8] >> (i % 8) & 1; }
+  std::string_view bytesAt(size_t i) const {
+    return {reinterpret_cast<const char *>(data.data()) + offsets[i],
+            size_t(offsets[i + 1] - offsets[i])};
+  }
+};
+
+// Messages of one type as columns, one per field in declaration order
+struct ColumnBatch {
+  std::shared_ptr<const ProtoDesc> desc;
+  size_t rows = 0;
+  std::vector<Column> columns;
+
+  const Column *column(const std::string &name) const; // nullptr if none
+};
+
+// Decodes messages straight into a ColumnBatch, one row each, without
+// building a Message. Rows follow decodeMessage: singular fields and oneofs
+// keep the last occurrence, repeated fields accept packed and unpacked
+// runs, unknown fields are skipped, and the same inputs are rejected under
+// the same DecodeOptions (maxAllocations aside, which does not apply). Map
+// entries stay in wire order, including any duplicate keys, which
+// decodeMessage would collapse to the last; maxRepeated counts entries.
+class ColumnarDecoder {
+public:
+  // Throws std::runtime_error for recursive or unlinked descriptors, which
+  // have no finite column layout
+  explicit ColumnarDecoder(std::shared_ptr<const ProtoDesc> desc,
+                           DecodeOptions opts = {});
+
+  // Appends msg as the next row; on failure the batch is left as it was
+  DecodeError append(const std::vector<uint8_t> &msg);
+  size_t rows() const { return batch.rows; }
+  // Hands over the rows so far and starts an empty batch
+  ColumnBatch finish();
+
+private:
+  ColumnBatch batch;
+  DecodeOptions opts;
+};
+
+// Decodes every message; fails with the first error (fieldPath starts with
+// the row, "[12].lines[0].sku")
+std::pair<std::optional<ColumnBatch>, DecodeError>
+decodeColumns(const std::vector<std::vector<uint8_t>> &messages,
+              std::shared_ptr<const ProtoDesc> desc,
+              const DecodeOptions &opts = {});
+
+// No rows, with a column for every field of desc, to be filled in and
+// encoded. Throws as ColumnarDecoder does.
+ColumnBatch makeColumnBatch(std::shared_ptr<const ProtoDesc> desc);
+
+// Encodes each row of batch as one message without building a Message:
+// sizes and then bytes are produced a column at a time. Fields go out in
+// declaration order as encodeMessage writes them; null slots and empty
+// repeated fields are left out, as are null map keys and values. Buffers
+// that do not fit the descriptor (wrong type, short buffers, offsets out of
+// range, null repeated elements) fail with MalformedColumn and the column's
+// path, "lines.sku".
+std::pair<std::optional<std::vector<std::vector<uint8_t>>>, EncodeError>
+encodeColumns(const ColumnBatch &batch);
+
+// The same rows appended to out as one stream of varint length-prefixed
+// messages. On failure out is left as it was.
+EncodeError encodeColumnsDelimited(const ColumnBatch &batch,
+                                   std::vector<uint8_t> &out);
@@ -0,0 +1,61 @@
+#pragma once
+#include "proto_desc.h"
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Owns message and enum descriptors for its whole lifetime and links them by
+// name. Fields name their type with FieldDesc::ofType instead of holding it;
+// the names resolve when a type is first looked up, so types may refer to
+// types registered later, to each other, and to themselves. Links between
+// pool descriptors are borrowed (see borrowed()), so nested messages created
+// while decoding do no reference counting on their descriptors.
+//
+// All members are thread-safe. Descriptors returned by find() and intern()
+// are fully linked and never change afterwards; they stay valid until the
+// pool is destroyed, which must outlive every Message that uses them.
+class DescriptorPool {
+public:
+  DescriptorPool();
+  ~DescriptorPool();
+  DescriptorPool(const DescriptorPool &) = delete;
+  DescriptorPool &operator=(const DescriptorPool &) = delete;
+
+  // Registers a type under its fully-qualified name (without leading dot).
+  // Throws std::runtime_error for a name already in use and for anything
+  // ProtoDesc or EnumDesc rejects.
+  void add(const std::string &name, std::vector<FieldDesc> fields);
+  void addEnum(const std::string &name, std::vector<EnumValueDesc> values);
+
+  // The message type, linked together with every type it reaches, or nullptr
+  // if there is none. Throws std::runtime_error if a reachable field names a
+  // type the pool lacks; nothing is linked in that case.
+  const ProtoDesc *find(const std::string &name);
+  const EnumDesc *findEnum(const std::string &name) const;
+  bool contains(const std::string &name) const; // message type registered
+
+  // Anonymous descriptor shared with every structurally identical one: same
+  // fields, and the same nested and enum descriptors by identity, so
+  // interning bottom-up deduplicates whole subtrees. The fields must not
+  // name types (std::runtime_error).
+  const ProtoDesc *intern(std::vector<FieldDesc> fields);
+
+  size_t size() const; // message descriptors owned, map entries included
+
+private:
+  struct Owned {
+    std::unique_ptr<ProtoDesc> desc;
+    bool linked;
+  };
+
+  mutable std::mutex mu;
+  std::unordered_map<const ProtoDesc *, Owned> owned;
+  std::unordered_map<std::string, const ProtoDesc *> named;
+  std::unordered_map<std::string, std::unique_ptr<EnumDesc>> enums;
+  std::unordered_multimap<uint64_t, const ProtoDesc *> interned;
+
+  const ProtoDesc *adopt(std::unique_ptr<ProtoDesc> desc, bool linked);
+  void link(const ProtoDesc *root);
+};
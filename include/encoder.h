@@ -1,5 +1,7 @@
 #pragma once
 
+#include <bit>
+#include <cstddef>
 #include <cstdint>
 #include <optional>
 #include <string>
@@ -8,40 +10,75 @@
 
 // Varint (protobuf wire type 0 uses this for unsigned integers, keys, lengths)
 std::vector<std::uint8_t> encodeVarint(std::uint64_t);
-std::pair<std::optional<std::uint64_t>, int>
-decodeVarint(const std::vector<std::uint8_t> &, int);
+std::pair<std::optional<std::uint64_t>, std::size_t>
+decodeVarint(const std::vector<std::uint8_t> &, std::size_t);
+
+// 32-bit varint (int32/uint32/sint32/enum). The value comes from at most
+// five bytes; like protobuf, the extra bytes of an over-long (e.g. sign
+// extended) encoding are validated and dropped.
+std::pair<std::optional<std::uint32_t>, std::size_t>
+decodeVarint32(const std::vector<std::uint8_t> &, std::size_t);
 
 // Signed varint (zigzag encoding for signed integers)
 std::vector<std::uint8_t> encodeSignedVarint(int64_t);
-std::pair<std::optional<int64_t>, int>
-decodeSignedVarint(const std::vector<uint8_t> &, int);
+std::pair<std::optional<int64_t>, std::size_t>
+decodeSignedVarint(const std::vector<uint8_t> &, std::size_t);
 
 // Fixed-width 64-bit (protobuf wire type 1 uses little-endian fixed64/double)
 std::vector<std::uint8_t> encodeFixed64(std::uint64_t);
 std::optional<std::uint64_t> decodeFixed64(const std::vector<std::uint8_t> &,
-                                           int);
+                                           std::size_t);
 
 // Fixed-width 32-bit (protobuf wire type 5 uses little-endian fixed32/float)
 std::vector<std::uint8_t> encodeFixed32(std::uint32_t);
 std::optional<std::uint32_t> decodeFixed32(const std::vector<std::uint8_t> &,
-                                           int);
+                                           std::size_t);
 
 // Double <-> fixed64 bitwise encoding (little-endian on the wire)
 std::vector<std::uint8_t> encodeDouble(double);
-std::optional<double> decodeDouble(const std::vector<std::uint8_t> &, int);
+std::optional<double> decodeDouble(const std::vector<std::uint8_t> &,
+                                   std::size_t);
 
 // Float <-> fixed32 bitwise encoding (little-endian on the wire)
 std::vector<std::uint8_t> encodeFloat(float);
-std::optional<float> decodeFloat(const std::vector<std::uint8_t> &, int);
+std::optional<float> decodeFloat(const std::vector<std::uint8_t> &,
+                                 std::size_t);
 
 // Length-delimited string (protobuf wire type 2: varint length + raw bytes)
 std::vector<std::uint8_t> encodeStr(const std::string &);
-std::pair<std::optional<std::string>, int>
-decodeStr(const std::vector<std::uint8_t> &, int);
+std::pair<std::optional<std::string>, std::size_t>
+decodeStr(const std::vector<std::uint8_t> &, std::size_t);
 
 // Length-delimited bytes (wire type 2: varint length + raw bytes)
 std::vector<std::uint8_t> encodeBytes(const std::vector<std::uint8_t> &);
-std::pair<std::optional<std::vector<std::uint8_t>>, int>
-decodeBytes(const std::vector<std::uint8_t> &, int);
+std::pair<std::optional<std::vector<std::uint8_t>>, std::size_t>
+decodeBytes(const std::vector<std::uint8_t> &, std::size_t);
+
+// Append-style encoders write straight into an existing buffer
+void appendVarint(std::vector<std::uint8_t> &, std::uint64_t);
+void appendVarint32(std::vector<std::uint8_t> &, std::uint32_t);
+void appendSignedVarint(std::vector<std::uint8_t> &, int64_t);
+void appendFixed64(std::vector<std::uint8_t> &, std::uint64_t);
+void appendFixed32(std::vector<std::uint8_t> &, std::uint32_t);
+
+// Encoded sizes, computed arithmetically without encoding
+inline std::size_t varintSize(std::uint64_t num) {
+  // 1 byte per started group of 7 significant bits, 0 takes one byte
+  return (std::bit_width(num | 1) * 9 + 64) / 64;
+}
+inline std::uint64_t zigzag(int64_t num) {
+  return (static_cast<std::uint64_t>(num) << 1) ^
+         static_cast<std::uint64_t>(-(num < 0));
+}
+inline std::size_t signedVarintSize(int64_t num) {
+  return varintSize(zigzag(num));
+}
+inline std::uint32_t zigzag32(int32_t num) {
+  return (static_cast<std::uint32_t>(num) << 1) ^
+         static_cast<std::uint32_t>(-(num < 0));
+}
+inline int32_t unzigzag32(std::uint32_t num) {
+  return static_cast<int32_t>((num >> 1) ^ (~(num & 1) + 1));
+}
 
 std::ostream &operator<<(std::ostream &os, const std::vector<uint8_t> &vec);
@@ -0,0 +1,52 @@
+#pragma once
+#include "proto_desc.h"
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Proto3 JSON mapping for the types this library models. Messages are
+// objects keyed by lowerCamelCase field name (FieldDesc::jsonName), repeated
+// fields arrays and maps objects with string keys. 64-bit integers are
+// quoted decimal strings and 32-bit ones plain numbers; floats and doubles
+// are numbers in shortest round-trip form, or "NaN", "Infinity" and
+// "-Infinity". Bytes are base64, enums their value name (the number if it
+// has none). Fields are written in declaration order when they are set;
+// empty repeated fields and maps are left out.
+struct JsonOptions {
+  bool useProtoNames = false; // write field names as declared
+  bool enumsAsInts = false;   // write enum numbers instead of names
+  // Parsing: skip object members naming no field instead of failing
+  bool ignoreUnknownFields = false;
+  size_t maxDepth = 100; // nested messages, as DecodeOptions::maxDepth
+};
+
+struct JsonError {
+  std::string message; // empty on success
+  // Parsing: offset into the JSON text. binaryToJson: offset into the
+  // binary input. messageToJson: size of the output when it failed.
+  size_t offset = 0;
+};
+
+// Appends msg to out, which callers can reuse across messages. Fails if a
+// value does not hold its field's type or a string is not valid UTF-8; out
+// then holds a partial document.
+JsonError messageToJson(const Message &msg, std::string &out,
+                        const JsonOptions &opts = {});
+
+// Parses a JSON object. Members may use the JSON or the declared field
+// name; null leaves a field unset. Integer fields accept numbers and
+// numeric strings, bytes fields standard and URL-safe base64 with or
+// without padding, enum fields names and numbers.
+std::pair<std::optional<Message>, JsonError>
+jsonToMessage(std::string_view json, std::shared_ptr<const ProtoDesc> desc,
+              const JsonOptions &opts = {});
+
+// Transcodes protobuf binary straight to JSON without building a Message.
+// The output, and what input it rejects, match decodeMessage followed by
+// messageToJson.
+JsonError binaryToJson(const std::vector<uint8_t> &data, const ProtoDesc &desc,
+                       std::string &out, const JsonOptions &opts = {});
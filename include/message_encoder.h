@@ -1,10 +1,134 @@
 #pragma once
 #include "proto_desc.h"
 #include <cstdint>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
 
 enum WireType { VARINT = 0, I64 = 1, LEN = 2, I32 = 5 };
 
-std::vector<uint8_t> encodeMessage(const Message &);
+struct EncodeOptions {
+  // Canonical form: fields in ascending field-number order, empty repeated
+  // fields omitted, map entries sorted by key, applied recursively. Equal
+  // messages produce equal bytes.
+  bool canonical = false;
+  // Map entries sorted by key rather than in insertion order (implied by
+  // canonical)
+  bool deterministic = false;
+};
 
-std::pair<std::optional<Message>, int>
+enum class EncodeErrc {
+  None,
+  TypeMismatch,     // value does not hold the field's declared type
+  NotRepeated,      // repeated field whose value is not a RepeatedVal
+  NotPackable,      // packed encoding requested for a LEN-typed field
+  UnknownFieldType, // descriptor carries a FieldType with no codec
+  MalformedColumn,  // encodeColumns: buffers that do not fit the descriptor
+};
+
+struct EncodeError {
+  EncodeErrc code = EncodeErrc::None;
+  std::string fieldPath; // e.g. "children[2].name", built only on failure
+  size_t offset = 0;     // output offset where the failing field starts
+};
+
+// Returns the encoded bytes, or nullopt plus the first error encountered
+std::pair<std::optional<std::vector<uint8_t>>, EncodeError>
+encodeMessage(const Message &, const EncodeOptions &opts = {});
+
+// One piece of scatter-gather output, laid out like POSIX struct iovec
+struct OutputSegment {
+  const void *base;
+  size_t len;
+};
+
+// A message encoded as a chain of segments: runs of generated bytes (tags,
+// lengths, scalars, short payloads) interleaved with string and bytes
+// payloads referenced where they live in the message. The chain is only
+// valid while the message is alive and unmodified.
+struct EncodedChain {
+  // Either the run [offset, offset + len) of inlineBytes, or len bytes at
+  // external
+  struct Piece {
+    const uint8_t *external;
+    size_t offset;
+    size_t len;
+  };
+  std::vector<uint8_t> inlineBytes;
+  std::vector<Piece> pieces; // in output order
+
+  size_t size() const; // total encoded bytes
+  // In output order, ready for writev()/sendmsg() (reinterpret the data()
+  // as iovec*); they point into this chain, so it must outlive them
+  std::vector<OutputSegment> segments() const;
+  std::vector<uint8_t> flatten() const; // the bytes encodeMessage returns
+};
+
+// Like encodeMessage, but string and bytes payloads of at least
+// minReferenced bytes are referenced rather than copied. Error offsets count
+// the referenced bytes too, as if the output were flat.
+std::pair<std::optional<EncodedChain>, EncodeError>
+encodeChain(const Message &, const EncodeOptions &opts = {},
+            size_t minReferenced = 1024);
+
+// Encoded size of a message, computed without serializing it
+size_t byteSize(const Message &, const EncodeOptions &opts = {});
+
+// Per-field share of byteSize (tag + payload), in emission order
+struct FieldByteSize {
+  size_t fieldIndex; // index into ProtoDesc::fields
+  uint32_t number;
+  size_t bytes;
+};
+std::vector<FieldByteSize> byteSizeByField(const Message &,
+                                           const EncodeOptions &opts = {});
+
+// Resource limits for decoding untrusted input. The defaults follow the usual
+// protobuf limits; tighten them for client-supplied payloads.
+struct DecodeOptions {
+  size_t maxDepth = 100;            // nested message depth
+  size_t maxTotalBytes = INT32_MAX; // size of the whole input
+  size_t maxFieldSize = INT32_MAX;  // any single LEN payload
+  size_t maxRepeated = SIZE_MAX;    // elements of one repeated field
+  size_t maxAllocations = SIZE_MAX; // strings, bytes, messages, repeated
+  // Reject enum numbers their EnumDesc does not name, instead of keeping
+  // them (open enums, the default)
+  bool closedEnums = false;
+};
+
+enum class DecodeErrc {
+  None,
+  Malformed,          // bad varint, or a value runs past its enclosing bounds
+  InvalidTag,         // field number 0 / out of range, or unknown wire type
+  WireTypeMismatch,   // known field with a wire type its type cannot use
+  InvalidValue,       // e.g. a bool that is neither 0 nor 1, closed enums
+  UnknownFieldType,   // descriptor carries a FieldType with no codec
+  DepthExceeded,      // DecodeOptions::maxDepth
+  TotalSizeExceeded,  // DecodeOptions::maxTotalBytes
+  FieldTooLarge,      // DecodeOptions::maxFieldSize
+  TooManyElements,    // DecodeOptions::maxRepeated
+  TooManyAllocations, // DecodeOptions::maxAllocations
+};
+
+struct DecodeError {
+  DecodeErrc code = DecodeErrc::None;
+  std::string fieldPath; // e.g. "children[2].name", built only on failure
+  size_t offset = 0;     // input offset of the innermost failure
+};
+
+std::pair<std::optional<Message>, DecodeError>
+decodeMessage(const std::vector<uint8_t> &, std::shared_ptr<const ProtoDesc>,
+              const DecodeOptions &);
+
+// Decodes into msg, replacing its contents, for loops that decode many
+// messages of one type. Storage msg's fields allocated for earlier messages
+// is reused (see Message::clear), so once it has seen messages of similar
+// shape, decoding allocates only for map entries. On failure msg holds the
+// fields decoded before the error.
+DecodeError decodeInto(Message &msg, const std::vector<uint8_t> &,
+                       const DecodeOptions &opts = {});
+
+// Decodes with default limits; on failure the index is the error offset
+std::pair<std::optional<Message>, size_t>
 decodeMessage(const std::vector<uint8_t> &, std::shared_ptr<const ProtoDesc>);
@@ -0,0 +1,12 @@
+#pragma once
+#include "proto_desc.h"
+#include <cstdint>
+
+// Structural hash and equality over Message, computed without serializing.
+// Both follow the canonical encoding (EncodeOptions::canonical): messages
+// whose canonical bytes are equal compare equal and hash equal, so the hash
+// can be used as a content-addressed cache key. Floating point values are
+// compared bitwise (NaN == NaN, 0.0 != -0.0) and empty repeated fields are
+// treated as unset, exactly as they appear on the wire.
+uint64_t hashMessage(const Message &);
+bool messagesEqual(const Message &, const Message &);
@@ -0,0 +1,106 @@
+#pragma once
+#include "message_encoder.h"
+#include "proto_desc.h"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+// Per-descriptor counters for encodeMessage, encodeChain, decodeMessage and
+// decodeInto, keyed by the top-level ProtoDesc of each call. Compiled in
+// unless PROTO_METRICS is defined to 0, and off until enableMetrics(true):
+// while off, each call pays one relaxed atomic load.
+//
+// Counters live per thread and are written without locks or atomic
+// read-modify-writes; reads (metricsSnapshot, writePrometheus) lock and sum
+// every thread's counters, including those of threads that have exited.
+#ifndef PROTO_METRICS
+#define PROTO_METRICS 1
+#endif
+
+// Call latency in power-of-two buckets: bucket i counts calls of at most
+// upperBoundNs(i) nanoseconds, the last one everything slower
+struct LatencyHistogram {
+  static constexpr size_t kBuckets = 20; // 256ns ... 67ms, then +Inf
+  std::array<uint64_t, kBuckets> buckets{};
+  uint64_t sumNs = 0;
+
+  static uint64_t upperBoundNs(size_t i) { return uint64_t(256) << i; }
+  static size_t bucketOf(uint64_t ns);
+  uint64_t count() const;
+};
+
+constexpr size_t kDecodeErrcCount =
+    static_cast<size_t>(DecodeErrc::TooManyAllocations) + 1;
+
+struct DescMetrics {
+  const ProtoDesc *desc = nullptr;
+  std::string name; // from nameMetrics, else empty
+
+  uint64_t encoded = 0;        // successful encodes
+  uint64_t encodedBytes = 0;   // their output size
+  uint64_t encodeFailures = 0; // any EncodeErrc
+  uint64_t decoded = 0;        // successful decodes
+  uint64_t decodedBytes = 0;   // their input size
+  // Unknown fields skipped by successful decodes, at any nesting level
+  uint64_t unknownFields = 0;
+  // Deepest message nesting a successful decode reached (0: no nested
+  // messages)
+  uint64_t maxDepth = 0;
+  std::array<uint64_t, kDecodeErrcCount> decodeFailures{}; // by DecodeErrc
+  LatencyHistogram encodeLatency; // successful and failed calls
+  LatencyHistogram decodeLatency;
+};
+
+void enableMetrics(bool on);
+
+// Labels desc's counters in snapshots and Prometheus output. Descriptors
+// are identified by address, so the counters and name of one that is
+// destroyed carry over to any later descriptor at the same address.
+void nameMetrics(const ProtoDesc &desc, std::string name);
+struct ProtoSchema;
+void nameMetrics(const ProtoSchema &schema); // every message, by full name
+
+// Totals over all threads, one entry per descriptor seen, sorted by name
+// (unnamed ones last, by address)
+std::vector<DescMetrics> metricsSnapshot();
+// Zeroes every counter; names are kept. Calls running concurrently on other
+// threads may keep their counts.
+void resetMetrics();
+
+// The snapshot in the Prometheus text exposition format: protoenc_* counters
+// labelled desc="<name>" (the address for unnamed descriptors), decode
+// failures also by reason="<errc>", and latency histograms in seconds
+void writePrometheus(std::ostream &out);
+
+// The name writePrometheus uses for code in reason labels, e.g.
+// "wire_type_mismatch"
+const char *decodeErrcName(DecodeErrc code);
+
+namespace detail {
+#if PROTO_METRICS
+extern std::atomic<bool> metricsOn;
+inline bool metricsEnabled() {
+  return metricsOn.load(std::memory_order_relaxed);
+}
+#else
+inline bool metricsEnabled() { return false; }
+#endif
+uint64_t metricsNow(); // steady clock, nanoseconds
+
+// Start of an instrumented call: the clock, or 0 while metrics are off
+inline uint64_t metricsStart() { return metricsEnabled() ? metricsNow() : 0; }
+
+struct DecodeSample {
+  size_t bytes;
+  size_t unknownFields;
+  size_t depth;
+  DecodeErrc code;
+};
+void recordEncode(const ProtoDesc *desc, size_t bytes, bool ok,
+                  uint64_t start);
+void recordDecode(const ProtoDesc *desc, const DecodeSample &sample,
+                  uint64_t start);
+} // namespace detail
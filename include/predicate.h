@@ -0,0 +1,104 @@
+#pragma once
+#include "proto_desc.h"
+#include "wire_scanner.h"
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Record filters evaluated directly on encoded bytes, without decoding:
+//
+//   status == STATUS_OPEN && (wallet.token != "" || !has(card))
+//
+// Fields are named by dotted paths through singular message fields and
+// compared against literals: integers, floats, "strings" with C escapes,
+// true and false, and enum value names. Operators are == != < <= > >=,
+// && and || (short-circuiting), ! and parentheses; has(path) tests
+// presence and a bool field on its own tests that it is true.
+//
+// Fields read as decodeMessage would leave them: the last occurrence of a
+// singular field wins, setting a oneof member unsets the others, and an
+// unset field compares as its default (0, false, ""). A repeated scalar
+// field compares true when any element does, and has() when it has any
+// elements. Strings and bytes compare bytewise.
+struct PredicateError {
+  std::string message; // empty on success
+  size_t offset = 0;   // into the expression
+};
+
+class Predicate {
+public:
+  // Whether the record matches. Each message level the predicate reaches
+  // is scanned once, skipping the fields it does not name; nested messages
+  // are only scanned when the evaluation gets to them. A record that is
+  // malformed where it is read (framing, a named field with the wrong wire
+  // type, a bool other than 0 or 1) never matches; problems elsewhere go
+  // unnoticed.
+  bool matches(const uint8_t *data, size_t size) const;
+  bool matches(const std::vector<uint8_t> &record) const {
+    return matches(record.data(), record.size());
+  }
+
+  // Bit i (LSB-first, as Column::validity) is set when records[i] matches
+  std::vector<uint8_t>
+  select(const std::vector<std::vector<uint8_t>> &records) const;
+
+private:
+  Predicate() = default;
+  friend std::pair<std::optional<Predicate>, PredicateError>
+  compilePredicate(std::string_view, std::shared_ptr<const ProtoDesc>);
+  struct Compiler; // the expression parser, in predicate.cpp
+
+  // A message level the predicate reads: the root, or the last occurrence
+  // of a singular message field of another scope
+  struct Scope {
+    const ProtoDesc *desc;
+    uint32_t parentSlot; // UINT32_MAX for the root
+    std::vector<int32_t> slotOf; // per field of desc: its slot, or -1
+  };
+  // A field some scope reads, identified by a slot across all scopes
+  struct Slot {
+    const FieldDesc *field;
+    uint32_t scope;
+  };
+  enum class Op : uint8_t { Eq, Ne, Lt, Le, Gt, Ge };
+  struct Node {
+    enum { And, Or, Not, Compare, Has } type;
+    uint32_t lhs = 0, rhs = 0; // operands of And, Or, Not
+    uint32_t slot = 0;         // Compare, Has
+    Op op = Op::Eq;
+    // The literal: i for signed integer and enum fields, u for unsigned and
+    // bool ones, d for floating point, s for strings and bytes
+    int64_t i = 0;
+    uint64_t u = 0;
+    double d = 0;
+    std::string s;
+  };
+  // Per record: what has been scanned so far
+  struct State {
+    const uint8_t *data;
+    size_t size;
+    std::vector<uint8_t> scanned; // per scope
+    std::vector<WireField> last;  // per slot; number 0 when absent
+    bool malformed;
+  };
+
+  void reset(State &st, const uint8_t *data, size_t size) const;
+  bool eval(State &st, uint32_t node) const;
+  void scan(State &st, uint32_t scope) const;
+  bool compare(State &st, const Node &n) const;
+
+  std::shared_ptr<const ProtoDesc> desc;
+  std::vector<Scope> scopes;
+  std::vector<Slot> slots;
+  std::vector<Node> nodes; // the root is last
+};
+
+// Compiles expr against desc. Fails on syntax errors, unknown fields or
+// enum values, paths through repeated or map fields, message or map
+// fields compared as values, and literals of the wrong type or range.
+std::pair<std::optional<Predicate>, PredicateError>
+compilePredicate(std::string_view expr, std::shared_ptr<const ProtoDesc> desc);
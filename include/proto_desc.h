@@ -8,17 +8,155 @@
 #include <variant>
 #include <vector>
 
+// Copy accounting for the composite Value alternatives (Message and
+// RepeatedVal), on by default in builds without NDEBUG. Tests use it to
+// check that decoding and encoding move values instead of deep-copying them.
+#ifndef PROTO_COPY_COUNTERS
+#ifdef NDEBUG
+#define PROTO_COPY_COUNTERS 0
+#else
+#define PROTO_COPY_COUNTERS 1
+#endif
+#endif
+
+struct CopyStats {
+  uint64_t messages = 0; // Message copy-constructions and copy-assignments
+  uint64_t repeated = 0; // RepeatedVal copy-constructions and copy-assignments
+};
+// Counts for the calling thread since the last reset (zero if compiled out)
+CopyStats copyStats();
+void resetCopyStats();
+
+namespace detail {
+void countCopy(uint64_t CopyStats::*counter);
+
+// Empty member whose copy operations bump one CopyStats counter
+template <uint64_t CopyStats::*Counter> struct CopyCounter {
+  CopyCounter() = default;
+  CopyCounter(const CopyCounter &) noexcept { countCopy(Counter); }
+  CopyCounter(CopyCounter &&) noexcept = default;
+  CopyCounter &operator=(const CopyCounter &) noexcept {
+    countCopy(Counter);
+    return *this;
+  }
+  CopyCounter &operator=(CopyCounter &&) noexcept = default;
+};
+} // namespace detail
+
 struct RepeatedVal;
+class MapVal;
 class ProtoDesc;
 class Message;
-enum class FieldType { Int, Double, String, UInt, Bool, Message, Float, Bytes };
+enum class FieldType {
+  Int,
+  Double,
+  String,
+  UInt,
+  Bool,
+  Message,
+  Float,
+  Bytes,
+  Map,
+  Enum,
+  // Int and UInt above are sint64 (zigzag) and uint64; these follow the
+  // remaining protobuf scalar types
+  Int32,    // int32_t, varint (negative values take ten bytes)
+  Int64,    // int64_t, varint without zigzag
+  UInt32,   // uint32_t, varint
+  SInt32,   // int32_t, zigzag varint
+  Fixed32,  // uint32_t, I32
+  Fixed64,  // uint64_t, I64
+  SFixed32, // int32_t, I32
+  SFixed64  // int64_t, I64
+};
 using Value =
     std::variant<int64_t, double, std::string, uint64_t, bool, RepeatedVal,
-                 Message, float, std::vector<uint8_t>>;
+                 Message, float, std::vector<uint8_t>, MapVal, int32_t,
+                 uint32_t>;
 
 struct RepeatedVal {
   FieldType elemType;
   std::vector<Value> values;
+#if PROTO_COPY_COUNTERS
+  [[no_unique_address]] detail::CopyCounter<&CopyStats::repeated> copies{};
+#endif
+};
+
+// Value of a map<K, V> field: entries stored densely in insertion order,
+// indexed by an open-addressing (linear probing) hash table of entry indices.
+// Keys are integer, Bool or String values; inserts are type-checked.
+class MapVal {
+public:
+  FieldType keyType;
+  FieldType valueType;
+
+  MapVal(FieldType keyType, FieldType valueType);
+
+  size_t size() const;
+  bool empty() const;
+  const Value *find(const Value &key) const;
+  Value *find(const Value &key);
+  // Slot for key, inserted (holding a default Value) if absent; nullptr if
+  // the key has the wrong type. The value slot is not type-checked.
+  Value *tryEmplace(Value key);
+  bool insertOrAssign(Value key, Value value);
+  bool erase(const Value &key); // moves the last entry into the hole
+  void clear();                 // keeps capacity
+  void reserve(size_t n);
+
+  // Entries by position, in insertion order (modulo erase)
+  const Value &keyAt(size_t i) const;
+  const Value &valueAt(size_t i) const;
+  Value &valueAt(size_t i);
+  size_t capacityBytes() const; // table and entry storage, for spaceUsed
+
+private:
+  std::vector<Value> keys;
+  std::vector<Value> vals;
+  std::vector<uint64_t> hashes; // per entry
+  std::vector<uint32_t> slots;  // 0 = empty, else entry index + 1
+
+  size_t findSlot(const Value &key, uint64_t hash) const;
+  void rehash(size_t slotCount);
+};
+
+struct EnumValueDesc {
+  std::string name;
+  int32_t number;
+};
+
+// Enum type. Enums are open: fields hold any int32, and numbers without a
+// name are preserved. Lookups by number use a dense array plus a bitset of
+// known numbers when the range is compact (span <= max(64, 4 * count)), and
+// hash tables otherwise.
+class EnumDesc {
+public:
+  EnumDesc(std::string name, std::vector<EnumValueDesc> values);
+
+  const std::string &name() const { return enumName; }
+  const std::vector<EnumValueDesc> &values() const { return enumValues; }
+  bool isDense() const { return !knownBits.empty(); }
+
+  bool isKnown(int32_t number) const {
+    if (isDense()) {
+      uint64_t off = uint64_t(int64_t(number) - minNumber);
+      return off < span && ((knownBits[off / 64] >> (off % 64)) & 1);
+    }
+    return sparseNames.count(number) != 0;
+  }
+  // First name declared for number (aliases share a number), or nullptr
+  const std::string *nameOf(int32_t number) const;
+  std::optional<int32_t> numberOf(const std::string &name) const;
+
+private:
+  std::string enumName;
+  std::vector<EnumValueDesc> enumValues;
+  int64_t minNumber = 0;
+  uint64_t span = 0;
+  std::vector<uint64_t> knownBits;    // dense: bit (number - minNumber)
+  std::vector<uint32_t> denseNames;   // dense: index into enumValues
+  std::unordered_map<int32_t, uint32_t> sparseNames;
+  std::unordered_map<std::string, int32_t> numbersByName;
 };
 
 struct FieldDesc {
@@ -27,40 +165,213 @@ struct FieldDesc {
   FieldType type;
 
   bool isRepeated;
-  bool isPacked; // for repeated fields with packed encoding
+  bool isPacked; // encode repeated scalars packed; decode accepts either
+
+  // for nested messages; for maps, the entry message {key = 1, value = 2}
+  std::shared_ptr<const ProtoDesc> nestedDesc;
+
+  std::string oneof;       // oneof group name, empty if none
+  int32_t oneofIndex = -1; // index into ProtoDesc::oneofs(), set by ProtoDesc
+  std::string jsonName;    // lowerCamelCase name, set by ProtoDesc
 
-  std::shared_ptr<const ProtoDesc> nestedDesc; // for nested messages
+  std::shared_ptr<const EnumDesc> enumDesc; // names for Enum fields, optional
+
+  // Fully-qualified message or enum type for a DescriptorPool to link into
+  // nestedDesc/enumDesc, see ofType
+  std::string typeName;
 
   FieldDesc(std::string n, uint32_t num, FieldType t, bool repeated = false,
             bool packed = true,
             std::shared_ptr<const ProtoDesc> nested = nullptr)
       : name(std::move(n)), number(num), type(t), isRepeated(repeated),
         isPacked(packed), nestedDesc(std::move(nested)) {}
+
+  // map<keyType, valueType> field; message values need valueDesc (or a type
+  // name, see ofType) and valueEnum optionally names enum values. Throws
+  // std::runtime_error for key types protobuf does not allow.
+  static FieldDesc map(std::string n, uint32_t num, FieldType keyType,
+                       FieldType valueType,
+                       std::shared_ptr<const ProtoDesc> valueDesc = nullptr,
+                       std::shared_ptr<const EnumDesc> valueEnum = nullptr);
+  const FieldDesc &mapKey() const;   // requires type == Map
+  const FieldDesc &mapValue() const; // requires type == Map
+
+  // Makes this field a member of the named oneof group
+  FieldDesc inOneof(std::string group) && {
+    oneof = std::move(group);
+    return std::move(*this);
+  }
+  // Attaches the enum type of an Enum field
+  FieldDesc withEnum(std::shared_ptr<const EnumDesc> e) && {
+    enumDesc = std::move(e);
+    return std::move(*this);
+  }
+  // Names the message or enum type (of the value, for maps) instead of
+  // linking it, for descriptors registered in a DescriptorPool
+  FieldDesc ofType(std::string name) &&;
+};
+
+struct OneofDesc {
+  std::string name;
+  std::vector<size_t> fields; // member field indices
+};
+
+// Storage plan for Message, computed once per descriptor. A message is one
+// heap block of 64-bit words: a presence bitmap (one bit per field), then the
+// scalar fields packed inline at fixed byte offsets (widest first, so every
+// slot is naturally aligned), then one pointer per out-of-line field
+// (strings, bytes, nested messages and every repeated field).
+//
+// The members of a oneof share storage: one inline area as wide as the
+// widest scalar member, one pointer if any member is out-of-line, and a
+// uint32 case discriminator (member field index + 1, 0 if none is set).
+struct MessageLayout {
+  struct Slot {
+    bool isInline;
+    uint32_t offset; // byte offset into the scalar area, or pointer index
+  };
+  std::vector<Slot> slots; // per field, in declaration order
+  std::vector<uint32_t> caseOffsets; // per oneof, into the scalar area
+  uint32_t presenceWords = 0;
+  uint32_t scalarWords = 0;
+  uint32_t boxedCount = 0;
+
+  size_t blockWords() const {
+    return size_t(presenceWords) + scalarWords + boxedCount;
+  }
 };
 
 class ProtoDesc {
   std::unordered_map<std::string, size_t> nameToIndex;
+  std::unordered_map<std::string, size_t> jsonNameToIndex;
   std::unordered_map<uint32_t, size_t> numberToIndex;
+  std::vector<size_t> numberOrder; // field indices sorted by field number
+  std::vector<OneofDesc> oneofDescs;
+  MessageLayout msgLayout;
 
 public:
   std::vector<FieldDesc> fields;
   explicit ProtoDesc(std::vector<FieldDesc> flds);
   const FieldDesc *findByName(const std::string &name) const;
   std::optional<size_t> indexByName(const std::string &name) const;
+  std::optional<size_t> indexByJsonName(const std::string &name) const;
   std::optional<size_t> indexByNumber(uint32_t number) const;
+  // Field indices in ascending field-number order (canonical wire order)
+  const std::vector<size_t> &indicesByNumber() const { return numberOrder; }
+  const MessageLayout &layout() const { return msgLayout; }
+  const std::vector<OneofDesc> &oneofs() const { return oneofDescs; }
+  std::optional<size_t> oneofByName(const std::string &name) const;
 };
 
+// Non-owning handle to a descriptor that outlives all its users, such as one
+// owned by a DescriptorPool. It has no control block, so copying it does no
+// reference counting.
+template <typename T> std::shared_ptr<const T> borrowed(const T *p) {
+  return std::shared_ptr<const T>(std::shared_ptr<const T>(), p);
+}
+
+class ValueRef;
+
+// Out-of-line values (strings, bytes, nested messages, repeated fields) live
+// in reference-counted boxes that are shared between copies, so copying a
+// Message costs O(top-level fields). A shared box is cloned on the first
+// write through a mutating accessor, which clones only the path written.
+//
+// Thread safety: distinct Message objects may be read, copied and modified
+// from different threads even when they share boxes; reference counts are
+// atomic and a writer never modifies a box it does not own exclusively. A
+// single Message object is not safe for a write concurrent with any other
+// access. References and pointers returned by mutating accessors must not be
+// used to write after the message has been copied.
 class Message {
 public:
   std::shared_ptr<const ProtoDesc> desc;
-  std::vector<std::optional<Value>> vals; // per-field slot
 
   explicit Message(std::shared_ptr<const ProtoDesc> d);
-  std::optional<std::reference_wrapper<const Value>>
-  get(const std::string &fieldName) const;
+  // Borrows d, which must outlive the message (e.g. from a DescriptorPool)
+  explicit Message(const ProtoDesc *d) : Message(borrowed(d)) {}
+  Message(const Message &other);
+  Message(Message &&other) noexcept = default;
+  Message &operator=(const Message &other);
+  Message &operator=(Message &&other) noexcept;
+  ~Message();
+
+  std::optional<ValueRef> get(const std::string &fieldName) const;
   bool set(const std::string &fieldName, Value v);
   std::optional<std::reference_wrapper<const Value>>
   getByIndex(const std::string &fieldName, size_t idx) const;
   bool setByIndex(const std::string &fieldName, size_t idx, Value v);
   bool push(const std::string &fieldName, Value v);
+
+  // In-place construction of nested messages, so trees can be built without
+  // copying subtrees into set()/push(). Both return nullptr if the field is
+  // not a message field of the right cardinality.
+  Message *mutableMessage(const std::string &fieldName); // creates if unset
+  Message *addMessage(const std::string &fieldName);     // appends
+  MapVal *mutableMap(const std::string &fieldName);      // creates if unset
+
+  // Setting a oneof member clears whichever member was set before
+  const FieldDesc *whichOneof(const std::string &oneofName) const;
+  bool clearOneof(const std::string &oneofName);
+
+  // Access by field index, for the codec and other paths that already
+  // resolved the field. valueAt requires has(fieldIdx).
+  bool has(size_t fieldIdx) const;
+  ValueRef valueAt(size_t fieldIdx) const;
+  bool setAt(size_t fieldIdx, Value v); // type-checked like set()
+  // Out-of-line slot of a non-inline field, created and marked present if
+  // unset, and unshared before it is returned. Not type-checked; throws
+  // std::logic_error for inline fields.
+  Value &boxedAt(size_t fieldIdx);
+  // Appends an element to a repeated field, creating the field if unset.
+  // Reuses an element kept by clear() when there is one, so the slot may
+  // hold an emptied string, bytes or message. Not type-checked; throws
+  // std::logic_error for singular fields.
+  Value &appendAt(size_t fieldIdx);
+
+  // Unsets every field but keeps what the fields allocated (string and bytes
+  // buffers, repeated storage and elements, nested messages) for the next
+  // fill, e.g. by decodeInto. Storage shared with copies is released.
+  void clear();
+
+  // Approximate heap plus inline footprint of this message and its subtree;
+  // shared boxes are counted in full by every message that references them
+  size_t spaceUsed() const;
+
+private:
+  struct Box;
+  std::unique_ptr<uint64_t[]> storage; // see MessageLayout; null if no fields
+
+  const MessageLayout &layout() const { return desc->layout(); }
+  const unsigned char *scalarArea() const;
+  unsigned char *scalarArea();
+  Box *box(uint32_t boxIdx) const;
+  void setBox(uint32_t boxIdx, Box *b);
+  static void unref(Box *b);
+  void markPresent(size_t fieldIdx);
+  uint32_t oneofCase(int32_t group) const;
+  void clearOneofMember(int32_t group, bool keepBox);
+  void release();
 };
+
+// Read-only view of a field value. Out-of-line values are referenced in
+// place; inline scalars are materialized into the view, so the view must
+// outlive any reference obtained from get().
+class ValueRef {
+public:
+  explicit ValueRef(const Value *ref) : ref(ref) {}
+  explicit ValueRef(Value scalar) : ref(nullptr), scalar(std::move(scalar)) {}
+
+  const Value &get() const { return ref ? *ref : scalar; }
+  operator const Value &() const { return get(); }
+
+private:
+  const Value *ref;
+  Value scalar;
+};
+
+inline size_t MapVal::size() const { return keys.size(); }
+inline bool MapVal::empty() const { return keys.empty(); }
+inline const Value &MapVal::keyAt(size_t i) const { return keys[i]; }
+inline const Value &MapVal::valueAt(size_t i) const { return vals[i]; }
+inline Value &MapVal::valueAt(size_t i) { return vals[i]; }
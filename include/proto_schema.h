@@ -0,0 +1,63 @@
+#pragma once
+#include "proto_desc.h"
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Message and enum types of one .proto file, linked into ProtoDescs and keyed
+// by fully-qualified name without the leading dot ("pkg.Outer.Inner").
+struct ProtoSchema {
+  std::string package;
+  std::unordered_map<std::string, std::shared_ptr<const ProtoDesc>> messages;
+  std::unordered_map<std::string, std::shared_ptr<const EnumDesc>> enums;
+
+  // nullptr if the schema has no type of that name
+  std::shared_ptr<const ProtoDesc> message(const std::string &name) const;
+  std::shared_ptr<const EnumDesc> enumType(const std::string &name) const;
+};
+
+struct SchemaError {
+  std::string message; // empty on success
+  size_t line = 0;     // parseProto: 1-based position of the failure
+  size_t column = 0;
+  size_t offset = 0; // byte offset into the source or cache
+};
+
+class DescriptorPool;
+
+// Parses the .proto subset this library models: syntax, package and options,
+// messages (nested to any depth), enums, oneofs, maps, every scalar type and
+// the packed option. Repeated scalars are packed by default in proto3 and
+// unpacked in proto2, as in protoc. Service blocks, reserved ranges and
+// extension ranges are skipped; imports, groups and extend blocks are
+// rejected. Message types may not refer to themselves, directly or through
+// other messages; parse into a DescriptorPool for recursive types.
+std::pair<std::optional<ProtoSchema>, SchemaError>
+parseProto(std::string_view source);
+
+// Registers the file's types in pool, linked by name, so messages may be
+// recursive. Names the file does not define resolve against types already
+// in the pool, which stands in for imports. Nothing is registered if the
+// file has an error.
+SchemaError parseProto(std::string_view source, DescriptorPool &pool);
+
+// Binary descriptor cache: the linked schema in a compact form that loads
+// without tokenizing or resolving names, so services can parse their .proto
+// files once at build time and load the cache at startup. Descriptors
+// reachable from the schema but not named in it (hand-built nested types) are
+// stored anonymously. Throws std::runtime_error for recursive or unlinked
+// descriptors, which the cache cannot represent.
+std::vector<uint8_t> serializeSchema(const ProtoSchema &schema);
+
+// Loads a cache written by serializeSchema, reading the bytes in place (they
+// may be a read-only mapping of the cache file). Malformed or truncated input
+// fails with the offset of the bad record.
+std::pair<std::optional<ProtoSchema>, SchemaError>
+loadSchema(const uint8_t *data, size_t size);
+std::pair<std::optional<ProtoSchema>, SchemaError>
+loadSchema(const std::vector<uint8_t> &cache);
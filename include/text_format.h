@@ -0,0 +1,68 @@
+#pragma once
+#include "proto_desc.h"
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Protobuf text format, for debugging output, test fixtures and golden
+// files:
+//
+//   id: 1234
+//   lines {
+//     sku: "a\"b"
+//   }
+//   status: STATUS_OPEN
+//   by_sku {
+//     key: "x"
+//     value {
+//     }
+//   }
+//
+// Fields use their declared names, one line per repeated element and map
+// entry. Strings and bytes are quoted with C escapes (octal for bytes that
+// are not printable ASCII), enums print their value name (the number if it
+// has none), floats print the shortest text that parses back exactly, or
+// inf, -inf and nan.
+struct TextOptions {
+  bool singleLine = false; // one line, fields separated by spaces
+  size_t maxDepth = 100;   // nested messages, as DecodeOptions::maxDepth
+};
+
+struct TextError {
+  std::string message; // empty on success
+  size_t line = 0;     // parseText: 1-based position of the failure
+  size_t column = 0;
+  // parseText: offset into the text. Binary printText: offset into the
+  // input.
+  size_t offset = 0;
+};
+
+// Prints the set fields of msg in declaration order, streaming to os. Fails
+// if a value does not hold its field's type; os then has partial output.
+TextError printText(const Message &msg, std::ostream &os,
+                    const TextOptions &opts = {});
+
+// Prints protobuf binary in wire order without decoding it into a Message.
+// Fields the descriptor does not know, or that arrive with a wire type
+// their type cannot use, print by number: varints in decimal, fixed-width
+// values in hex and length-delimited ones as quoted bytes. Only malformed
+// framing (truncation, bad tags, groups) is an error.
+TextError printText(const std::vector<uint8_t> &data, const ProtoDesc &desc,
+                    std::ostream &os, const TextOptions &opts = {});
+
+// Parses text format. Besides what printText writes it accepts # comments,
+// ',' or ';' after a field, '<' '>' around messages, an optional ':' before
+// them, lists ("deltas: [1, 2]"), adjacent string literals, hex and octal
+// integers and a trailing 'f' on floats. A singular field may be given only
+// once, and so may one member of each oneof.
+std::pair<std::optional<Message>, TextError>
+parseText(std::string_view text, std::shared_ptr<const ProtoDesc> desc,
+          const TextOptions &opts = {});
+
+// Single-line text format, for logging
+std::ostream &operator<<(std::ostream &os, const Message &msg);
@@ -0,0 +1,100 @@
+#pragma once
+#include "message_encoder.h"
+#include "proto_desc.h"
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+// One field as it sits on the wire; data points into the scanned buffer
+struct WireField {
+  uint32_t number = 0;
+  WireType wire = VARINT;
+  // VARINT: the value. I64, I32: the little-endian value, zero-extended.
+  // LEN: the payload length.
+  uint64_t value = 0;
+  // The value's bytes: the varint, the fixed-width value or the payload
+  const uint8_t *data = nullptr;
+  size_t size = 0;
+  size_t offset = 0; // of the tag, from the start of the outermost buffer
+  // With a descriptor: the field it declares under this number, if any (the
+  // wire type is not checked against it)
+  const FieldDesc *desc = nullptr;
+
+  int64_t asSInt64() const { // sint64 (FieldType::Int), zigzag
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+  }
+  int32_t asInt32() const { return static_cast<int32_t>(value); }
+  double asDouble() const {
+    double d;
+    std::memcpy(&d, &value, sizeof d);
+    return d;
+  }
+  float asFloat() const {
+    auto bits = static_cast<uint32_t>(value);
+    float f;
+    std::memcpy(&f, &bits, sizeof f);
+    return f;
+  }
+  std::string_view asBytes() const {
+    return {reinterpret_cast<const char *>(data), size};
+  }
+};
+
+// One varint from [p, end) under decodeVarint's rules, advancing p past it.
+// False if it is truncated or longer than ten bytes; p is then unchanged.
+bool scanVarint(const uint8_t *&p, const uint8_t *end, uint64_t &out);
+
+// Pull iterator over the fields of an encoded message, in wire order, for
+// tools that only walk tags and values: counting fields, pulling out one
+// number, checking structure. Nothing is allocated or copied, and unknown
+// fields need no descriptor.
+//
+//   WireScanner scan(bytes, order.get());
+//   for (WireField f; scan.next(f);)
+//     if (f.number == 2) {
+//       WireScanner line = scan.descend(f);
+//       for (WireField g; line.next(g);) ...
+//     }
+//   if (scan.error() != DecodeErrc::None) ...
+//
+// Framing is checked as decodeMessage checks it: truncated varints and
+// values are Malformed, field number 0 or above 2^29 - 1 and wire types
+// other than VARINT, I64, LEN and I32 (groups) are InvalidTag. Values are
+// not interpreted, so a LEN field is not required to hold a message until
+// it is descended into.
+class WireScanner {
+public:
+  WireScanner(const uint8_t *data, size_t size,
+              const ProtoDesc *desc = nullptr)
+      : begin(data), pos(data), end(data + size), desc(desc) {}
+  explicit WireScanner(const std::vector<uint8_t> &data,
+                       const ProtoDesc *desc = nullptr)
+      : WireScanner(data.data(), data.size(), desc) {}
+
+  // Reads the next field into f. False at the end of the buffer, or at
+  // malformed input, which sets error() and stops the scan.
+  bool next(WireField &f);
+
+  // The fields of LEN field f, which this scanner returned, as a message,
+  // with f.desc's message type (the entry type for map fields) as the
+  // descriptor when there is one. Offsets stay relative to the outermost
+  // buffer.
+  WireScanner descend(const WireField &f) const;
+
+  DecodeErrc error() const { return err; }
+  // Bytes consumed, from the start of the outermost buffer; on error, the
+  // offset of the failure
+  size_t offset() const { return base + size_t(pos - begin); }
+  bool done() const { return pos == end && err == DecodeErrc::None; }
+
+private:
+  bool fail(DecodeErrc code, const uint8_t *at);
+
+  const uint8_t *begin;
+  const uint8_t *pos;
+  const uint8_t *end;
+  const ProtoDesc *desc;
+  size_t base = 0; // offset of begin in the outermost buffer
+  DecodeErrc err = DecodeErrc::None;
+};
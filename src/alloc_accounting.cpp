@@ -0,0 +1,109 @@
+#include "alloc_accounting.h"
+#include <ostream>
+
+constinit thread_local detail::AllocTraceState detail::allocTrace;
+
+const char *allocStageName(AllocStage stage) {
+  switch (stage) {
+  case AllocStage::Other:
+    return "other";
+  case AllocStage::Encode:
+    return "encode";
+  case AllocStage::Decode:
+    return "decode";
+  case AllocStage::Mutate:
+    return "mutate";
+  }
+  return "unknown";
+}
+
+uint64_t AllocationReport::allocations() const {
+  uint64_t n = 0;
+  for (const AllocationSite &s : sites)
+    n += s.allocations;
+  return n;
+}
+
+uint64_t AllocationReport::bytes() const {
+  uint64_t n = 0;
+  for (const AllocationSite &s : sites)
+    n += s.bytes;
+  return n;
+}
+
+uint64_t AllocationReport::copies() const {
+  uint64_t n = 0;
+  for (const AllocationSite &s : sites)
+    n += s.messageCopies + s.repeatedCopies;
+  return n;
+}
+
+const AllocationSite *AllocationReport::find(AllocStage stage,
+                                             std::string_view path) const {
+  for (const AllocationSite &s : sites)
+    if (s.stage == stage && s.fieldPath == path)
+      return &s;
+  return nullptr;
+}
+
+std::ostream &operator<<(std::ostream &out, const AllocationReport &report) {
+  for (const AllocationSite &s : report.sites)
+    out << allocStageName(s.stage) << '\t'
+        << (s.fieldPath.empty() ? "-" : s.fieldPath) << '\t' << s.allocations
+        << '\t' << s.bytes << '\t' << s.messageCopies << '\t'
+        << s.repeatedCopies << '\n';
+  return out;
+}
+
+AllocationTrace::AllocationTrace() : outer(detail::allocTrace.trace) {
+  detail::allocTrace.trace = this;
+}
+
+AllocationTrace::~AllocationTrace() { detail::allocTrace.trace = outer; }
+
+AllocationReport AllocationTrace::report() const {
+  detail::allocTrace.charging = true; // copying the report allocates
+  AllocationReport out = charged;
+  detail::allocTrace.charging = false;
+  return out;
+}
+
+// The site of the calling thread's innermost frame. Only called while
+// charging, so the path and index allocations are not charged themselves.
+AllocationSite &AllocationTrace::siteHere() {
+  const detail::AllocFrame *frame = detail::allocTrace.frame;
+  AllocStage stage = frame != nullptr ? frame->stage : AllocStage::Other;
+  std::vector<const FieldDesc *> fields;
+  for (const detail::AllocFrame *f = frame; f != nullptr; f = f->parent)
+    if (f->field != nullptr)
+      fields.push_back(f->field);
+  std::string path;
+  for (auto it = fields.rbegin(); it != fields.rend(); ++it) {
+    if (!path.empty())
+      path += '.';
+    path += (*it)->name;
+  }
+
+  auto [entry, added] =
+      siteIndex.try_emplace({stage, path}, charged.sites.size());
+  if (added) {
+    AllocationSite site;
+    site.stage = stage;
+    site.fieldPath = std::move(path);
+    charged.sites.push_back(std::move(site));
+  }
+  return charged.sites[entry->second];
+}
+
+void accountAllocation([[maybe_unused]] size_t bytes) {
+#if PROTO_ALLOC_ACCOUNTING
+  detail::AllocTraceState &st = detail::allocTrace;
+  if (st.trace == nullptr || st.charging)
+    return;
+  st.charging = true;
+  AllocationSite &site = st.trace->siteHere();
+  ++site.allocations;
+  site.bytes += bytes;
+  st.charging = false;
+#endif
+}
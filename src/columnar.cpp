@@ -0,0 +1,971 @@
+#include "columnar.h"
+#include "encoder.h"
+#include "wire_util.h"
+#include <bit>
+#include <cstring>
+#include <stdexcept>
+
+const Column *ColumnBatch::column(const std::string &name) const {
+  auto idx = desc->indexByName(name);
+  return idx.has_value() ? &columns[*idx] : nullptr;
+}
+
+// ---------------------------------------------------------------------------
+// Layout
+
+// Bytes per value in Column::values; 0 for bools (bits) and for types
+// without a values buffer
+static size_t valueWidth(FieldType type) {
+  switch (type) {
+  case FieldType::Int:
+  case FieldType::UInt:
+  case FieldType::Double:
+  case FieldType::Int64:
+  case FieldType::Fixed64:
+  case FieldType::SFixed64:
+    return 8;
+  case FieldType::Float:
+  case FieldType::Enum:
+  case FieldType::Int32:
+  case FieldType::UInt32:
+  case FieldType::SInt32:
+  case FieldType::Fixed32:
+  case FieldType::SFixed32:
+    return 4;
+  default:
+    return 0;
+  }
+}
+
+static void structChildren(Column &c, const ProtoDesc &desc,
+                           std::vector<const ProtoDesc *> &open);
+
+// Column for one field, or (element) for the elements of a repeated one
+static Column makeColumn(const FieldDesc &fd, bool element,
+                         std::vector<const ProtoDesc *> &open) {
+  Column c;
+  c.name = element ? "item" : fd.name;
+  c.type = fd.type;
+  if (!knownType(fd.type))
+    throw std::runtime_error("unknown field type: " + fd.name);
+  if ((fd.type == FieldType::Message || fd.type == FieldType::Map) &&
+      fd.nestedDesc == nullptr)
+    throw std::runtime_error("unlinked message type: " + fd.name);
+
+  if (fd.type == FieldType::Map) {
+    c.isList = true;
+    c.offsets.push_back(0);
+    Column entries;
+    entries.name = "entries";
+    entries.type = FieldType::Message;
+    structChildren(entries, *fd.nestedDesc, open);
+    c.children.push_back(std::move(entries));
+  } else if (fd.isRepeated && !element) {
+    c.isList = true;
+    c.offsets.push_back(0);
+    c.children.push_back(makeColumn(fd, true, open));
+  } else if (fd.type == FieldType::Message) {
+    structChildren(c, *fd.nestedDesc, open);
+  } else if (fd.type == FieldType::String || fd.type == FieldType::Bytes) {
+    c.offsets.push_back(0);
+  }
+  return c;
+}
+
+static void structChildren(Column &c, const ProtoDesc &desc,
+                           std::vector<const ProtoDesc *> &open) {
+  for (const ProtoDesc *d : open)
+    if (d == &desc)
+      throw std::runtime_error("recursive message type in column layout");
+  open.push_back(&desc);
+  for (const FieldDesc &fd : desc.fields)
+    c.children.push_back(makeColumn(fd, false, open));
+  open.pop_back();
+}
+
+static void pushBit(std::vector<uint8_t> &bits, size_t i, bool v) {
+  if (i % 8 == 0)
+    bits.push_back(0);
+  if (v)
+    bits[i / 8] |= uint8_t(1u << (i % 8));
+}
+
+static void truncateBits(std::vector<uint8_t> &bits, size_t n) {
+  bits.resize((n + 7) / 8);
+  if (n % 8 != 0)
+    bits.back() &= uint8_t((1u << (n % 8)) - 1);
+}
+
+// Closes slot c.length, valid or null
+static void finishSlot(Column &c, bool valid) {
+  pushBit(c.validity, c.length, valid);
+  c.nullCount += !valid;
+  ++c.length;
+}
+
+// Appends a slot for a field that did not occur: null, or with default
+// set (map keys and values) the field's default. Lists are empty either
+// way.
+static void appendMissing(Column &c, bool asDefault) {
+  if (c.isList) {
+    c.offsets.push_back(c.offsets.back());
+    finishSlot(c, true);
+    return;
+  }
+  if (c.type == FieldType::Message) {
+    for (Column &child : c.children)
+      appendMissing(child, false);
+  } else if (c.type == FieldType::String || c.type == FieldType::Bytes) {
+    c.offsets.push_back(c.offsets.back());
+  } else if (c.type == FieldType::Bool) {
+    pushBit(c.values, c.length, false);
+  } else {
+    c.values.resize(c.values.size() + valueWidth(c.type));
+  }
+  finishSlot(c, asDefault);
+}
+
+// Drops slots from n on. A failed or replaced struct slot can leave its
+// children one slot longer than itself, so children are cut regardless.
+static void truncateColumn(Column &c, size_t n) {
+  for (size_t i = n; i < c.length; ++i)
+    c.nullCount -= !c.isValid(i);
+  if (n < c.length) {
+    truncateBits(c.validity, n);
+    c.length = n;
+  }
+  if (c.isList) {
+    if (c.offsets.size() > n + 1)
+      c.offsets.resize(n + 1);
+    truncateColumn(c.children[0], size_t(c.offsets[n]));
+  } else if (c.type == FieldType::Message) {
+    for (Column &child : c.children)
+      truncateColumn(child, n);
+  } else if (c.type == FieldType::String || c.type == FieldType::Bytes) {
+    if (c.offsets.size() > n + 1)
+      c.offsets.resize(n + 1);
+    c.data.resize(size_t(c.offsets[n]));
+  } else if (c.type == FieldType::Bool) {
+    truncateBits(c.values, n);
+  } else {
+    c.values.resize(n * valueWidth(c.type));
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Decoding
+
+namespace {
+struct ColumnCtx {
+  const std::vector<uint8_t> &data;
+  const DecodeOptions &opts;
+  size_t depth = 0;
+  DecodeError err;
+};
+} // namespace
+
+static bool failAt(ColumnCtx &ctx, DecodeErrc code, size_t offset) {
+  if (ctx.err.code == DecodeErrc::None) {
+    ctx.err.code = code;
+    ctx.err.offset = offset;
+  }
+  return false;
+}
+
+// Unwinding out of a failed field: prefixes the path, as decodeMessage does
+static bool failField(ColumnCtx &ctx, DecodeErrc code, size_t offset,
+                      const FieldDesc &fd, const Column &c, size_t row) {
+  failAt(ctx, code, offset);
+  std::string here = fd.name;
+  if (c.isList)
+    here += "[" + std::to_string(c.children[0].length - c.offsets[row]) + "]";
+  if (ctx.err.fieldPath.empty())
+    ctx.err.fieldPath = std::move(here);
+  else
+    ctx.err.fieldPath = here + "." + ctx.err.fieldPath;
+  return false;
+}
+
+static bool readLength(ColumnCtx &ctx, size_t &idx, size_t end, size_t &len) {
+  auto [lenOpt, afterLen] = decodeVarint(ctx.data, idx);
+  if (!lenOpt.has_value() || afterLen > end)
+    return false;
+  if (lenOpt.value() > end - afterLen)
+    return failAt(ctx, DecodeErrc::Malformed, afterLen);
+  if (lenOpt.value() > ctx.opts.maxFieldSize)
+    return failAt(ctx, DecodeErrc::FieldTooLarge, afterLen);
+  len = static_cast<size_t>(lenOpt.value());
+  idx = afterLen;
+  return true;
+}
+
+static bool skipUnknown(const std::vector<uint8_t> &data, size_t &idx,
+                        size_t end, uint32_t wire) {
+  switch (wire) {
+  case VARINT: {
+    auto [v, next] = decodeVarint(data, idx);
+    if (!v.has_value() || next > end)
+      return false;
+    idx = next;
+    return true;
+  }
+  case I64:
+  case I32: {
+    size_t n = wire == I64 ? 8 : 4;
+    if (end - idx < n)
+      return false;
+    idx += n;
+    return true;
+  }
+  case LEN: {
+    auto [len, next] = decodeVarint(data, idx);
+    if (!len.has_value() || next > end || *len > end - next)
+      return false;
+    idx = next + static_cast<size_t>(*len);
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+template <typename T> static void pushValue(Column &c, T x) {
+  size_t at = c.values.size();
+  c.values.resize(at + sizeof x);
+  std::memcpy(c.values.data() + at, &x, sizeof x);
+}
+
+// Decodes one scalar, string or bytes value at idx into the next slot of c
+static bool appendScalar(ColumnCtx &ctx, Column &c, const FieldDesc &fd,
+                         size_t &idx, size_t end) {
+  const std::vector<uint8_t> &d = ctx.data;
+  switch (fd.type) {
+  case FieldType::String:
+  case FieldType::Bytes: {
+    size_t len;
+    if (!readLength(ctx, idx, end, len))
+      return false;
+    if (c.data.size() + len > size_t(INT32_MAX))
+      return failAt(ctx, DecodeErrc::FieldTooLarge, idx);
+    c.data.insert(c.data.end(), d.begin() + idx, d.begin() + idx + len);
+    c.offsets.push_back(int32_t(c.data.size()));
+    idx += len;
+    break;
+  }
+  case FieldType::Double:
+  case FieldType::Fixed64:
+  case FieldType::SFixed64:
+    if (end - idx < 8)
+      return false;
+    pushValue(c, decodeFixed64(d, idx).value());
+    idx += 8;
+    break;
+  case FieldType::Float:
+  case FieldType::Fixed32:
+  case FieldType::SFixed32:
+    if (end - idx < 4)
+      return false;
+    pushValue(c, decodeFixed32(d, idx).value());
+    idx += 4;
+    break;
+  case FieldType::Int: {
+    auto [x, next] = decodeSignedVarint(d, idx);
+    if (!x.has_value() || next > end)
+      return false;
+    pushValue(c, *x);
+    idx = next;
+    break;
+  }
+  case FieldType::UInt:
+  case FieldType::Int64:
+  case FieldType::Bool: {
+    auto [x, next] = decodeVarint(d, idx);
+    if (!x.has_value() || next > end)
+      return false;
+    if (fd.type == FieldType::Bool) {
+      if (*x > 1)
+        return failAt(ctx, DecodeErrc::InvalidValue, idx);
+      pushBit(c.values, c.length, *x == 1);
+    } else {
+      pushValue(c, *x);
+    }
+    idx = next;
+    break;
+  }
+  default: { // 32-bit varints
+    auto [x, next] = decodeVarint32(d, idx);
+    if (!x.has_value() || next > end)
+      return false;
+    uint32_t raw = *x;
+    if (fd.type == FieldType::SInt32)
+      raw = static_cast<uint32_t>(unzigzag32(raw));
+    if (fd.type == FieldType::Enum && ctx.opts.closedEnums && fd.enumDesc &&
+        !fd.enumDesc->isKnown(static_cast<int32_t>(raw)))
+      return failAt(ctx, DecodeErrc::InvalidValue, idx);
+    pushValue(c, raw);
+    idx = next;
+  }
+  }
+  finishSlot(c, true);
+  return true;
+}
+
+// A packed run of a fixed-width type: on little-endian hosts the wire bytes
+// already are the column's values
+static bool appendFixedRun(Column &c, const uint8_t *p, size_t len,
+                           size_t width) {
+  if constexpr (std::endian::native != std::endian::little)
+    return false;
+  if (len % width != 0)
+    return false;
+  size_t n = len / width;
+  c.values.insert(c.values.end(), p, p + len);
+  for (size_t i = 0; i < n; ++i)
+    pushBit(c.validity, c.length + i, true);
+  c.length += n;
+  return true;
+}
+
+static bool decodeStruct(ColumnCtx &ctx, const ProtoDesc &desc, Column &s,
+                         size_t begin, size_t end);
+
+// The elements of one occurrence of a repeated field, appended to the
+// list's current row
+static bool appendElements(ColumnCtx &ctx, const FieldDesc &fd, Column &list,
+                           size_t row, uint32_t wire, size_t &idx,
+                           size_t end) {
+  Column &elems = list.children[0];
+  WireType expected = wireOf(fd.type);
+  bool packed = expected != LEN && wire == LEN;
+  if (wire != expected && !packed)
+    return failField(ctx, DecodeErrc::WireTypeMismatch, idx, fd, list, row);
+
+  size_t stop = end;
+  if (packed) {
+    size_t lengthStart = idx;
+    size_t len;
+    if (!readLength(ctx, idx, end, len))
+      return failField(ctx, DecodeErrc::Malformed, lengthStart, fd, list,
+                       row);
+    stop = idx + len;
+    size_t width = expected == I64 ? 8 : 4;
+    if (expected != VARINT &&
+        elems.length - list.offsets[row] + len / width <=
+            ctx.opts.maxRepeated &&
+        appendFixedRun(elems, ctx.data.data() + idx, len, width)) {
+      idx = stop;
+      return true;
+    }
+  }
+  for (bool first = true; packed ? idx < stop : first; first = false) {
+    size_t elemStart = idx;
+    if (elems.length - list.offsets[row] >= ctx.opts.maxRepeated)
+      return failField(ctx, DecodeErrc::TooManyElements, elemStart, fd, list,
+                       row);
+    bool ok;
+    if (fd.type == FieldType::Message) {
+      size_t len;
+      ok = readLength(ctx, idx, end, len) &&
+           decodeStruct(ctx, *fd.nestedDesc, elems, idx, idx + len);
+      idx += ok ? len : 0;
+    } else {
+      ok = appendScalar(ctx, elems, fd, idx, stop);
+    }
+    if (!ok)
+      return failField(ctx, DecodeErrc::Malformed, elemStart, fd, list, row);
+  }
+  return true;
+}
+
+// One map entry, read as decodeMessage reads it: only the key and value
+// fields count, every key occurrence is decoded but only the last value is,
+// and a missing key or value takes its default
+static bool appendMapEntry(ColumnCtx &ctx, const FieldDesc &fd, Column &map,
+                           size_t row, uint32_t wire, size_t &idx,
+                           size_t end) {
+  Column &entries = map.children[0];
+  Column &keys = entries.children[0];
+  Column &values = entries.children[1];
+  const FieldDesc &kf = fd.mapKey();
+  const FieldDesc &vf = fd.mapValue();
+  if (wire != LEN)
+    return failField(ctx, DecodeErrc::WireTypeMismatch, idx, fd, map, row);
+  size_t lengthStart = idx;
+  size_t len;
+  if (!readLength(ctx, idx, end, len))
+    return failField(ctx, DecodeErrc::Malformed, lengthStart, fd, map, row);
+  size_t entryEnd = idx + len;
+
+  size_t slot = entries.length;
+  size_t valueStart = entryEnd; // entryEnd: no value in the entry
+  while (idx < entryEnd) {
+    size_t tagStart = idx;
+    auto [tag, afterTag] = decodeVarint(ctx.data, idx);
+    if (!tag.has_value() || afterTag > entryEnd)
+      return failField(ctx, DecodeErrc::Malformed, tagStart, fd, map, row);
+    idx = afterTag;
+    uint64_t number = *tag >> 3;
+    uint32_t fieldWire = *tag & 0x7;
+    if (number == 0)
+      return failField(ctx, DecodeErrc::InvalidTag, idx, fd, map, row);
+    if (number == 1) {
+      if (fieldWire != static_cast<uint32_t>(wireOf(kf.type)))
+        return failField(ctx, DecodeErrc::WireTypeMismatch, idx, fd, map,
+                         row);
+      size_t keyStart = idx;
+      truncateColumn(keys, slot);
+      if (!appendScalar(ctx, keys, kf, idx, entryEnd))
+        return failField(ctx, DecodeErrc::Malformed, keyStart, fd, map, row);
+      continue;
+    }
+    if (number == 2) {
+      if (fieldWire != static_cast<uint32_t>(wireOf(vf.type)))
+        return failField(ctx, DecodeErrc::WireTypeMismatch, idx, fd, map,
+                         row);
+      valueStart = idx;
+    }
+    size_t before = idx;
+    if (!skipUnknown(ctx.data, idx, entryEnd, fieldWire))
+      return failField(ctx, DecodeErrc::Malformed, before, fd, map, row);
+  }
+
+  if (slot - size_t(map.offsets[row]) >= ctx.opts.maxRepeated)
+    return failField(ctx, DecodeErrc::TooManyElements, lengthStart, fd, map,
+                     row);
+  if (keys.length == slot)
+    appendMissing(keys, true);
+  if (valueStart == entryEnd) {
+    appendMissing(values, true);
+  } else {
+    size_t valueIdx = valueStart;
+    bool ok;
+    if (vf.type == FieldType::Message) {
+      size_t valueLen;
+      ok = readLength(ctx, valueIdx, entryEnd, valueLen) &&
+           decodeStruct(ctx, *vf.nestedDesc, values, valueIdx,
+                        valueIdx + valueLen);
+    } else {
+      ok = appendScalar(ctx, values, vf, valueIdx, entryEnd);
+    }
+    if (!ok)
+      return failField(ctx, DecodeErrc::Malformed, valueStart, fd, map, row);
+  }
+  finishSlot(entries, true);
+  return true;
+}
+
+// Decodes the fields in [idx, end) as slot `row` of cols, which all have
+// `row` slots; fields that do not occur are null
+static bool decodeRow(ColumnCtx &ctx, const ProtoDesc &desc,
+                      std::vector<Column> &cols, size_t row, size_t idx,
+                      size_t end) {
+  while (idx < end) {
+    auto [tag, afterTag] = decodeVarint(ctx.data, idx);
+    if (!tag.has_value() || afterTag > end)
+      return failAt(ctx, DecodeErrc::Malformed, idx);
+    idx = afterTag;
+    uint64_t number = *tag >> 3;
+    uint32_t wire = *tag & 0x7;
+    if (number == 0 || number > kMaxFieldNumber)
+      return failAt(ctx, DecodeErrc::InvalidTag, idx);
+
+    auto field = desc.indexByNumber(static_cast<uint32_t>(number));
+    if (!field.has_value()) {
+      size_t before = idx;
+      if (!skipUnknown(ctx.data, idx, end, wire))
+        return failAt(ctx,
+                      wire == VARINT || wire == I64 || wire == LEN ||
+                              wire == I32
+                          ? DecodeErrc::Malformed
+                          : DecodeErrc::InvalidTag,
+                      before);
+      continue;
+    }
+    const FieldDesc &fd = desc.fields[*field];
+    Column &c = cols[*field];
+
+    if (c.isList) {
+      if (c.length == row) { // first occurrence: open the row's list
+        c.offsets.push_back(c.offsets.back());
+        finishSlot(c, true);
+      }
+      bool ok = fd.type == FieldType::Map
+                    ? appendMapEntry(ctx, fd, c, row, wire, idx, end)
+                    : appendElements(ctx, fd, c, row, wire, idx, end);
+      if (!ok)
+        return false;
+      c.offsets.back() = int32_t(c.children[0].length);
+      continue;
+    }
+
+    if (wire != static_cast<uint32_t>(wireOf(fd.type)))
+      return failField(ctx, DecodeErrc::WireTypeMismatch, idx, fd, c, row);
+    // Last occurrence wins, and so does the last member of a oneof
+    if (fd.oneofIndex >= 0)
+      for (size_t member : desc.oneofs()[fd.oneofIndex].fields)
+        truncateColumn(cols[member], row);
+    truncateColumn(c, row);
+    size_t valueStart = idx;
+    bool ok;
+    if (fd.type == FieldType::Message) {
+      size_t len;
+      ok = readLength(ctx, idx, end, len) &&
+           decodeStruct(ctx, *fd.nestedDesc, c, idx, idx + len);
+      idx += ok ? len : 0;
+    } else {
+      ok = appendScalar(ctx, c, fd, idx, end);
+    }
+    if (!ok)
+      return failField(ctx, DecodeErrc::Malformed, valueStart, fd, c, row);
+  }
+
+  for (Column &c : cols)
+    if (c.length == row)
+      appendMissing(c, false);
+  return true;
+}
+
+// One message as the next slot of struct column s
+static bool decodeStruct(ColumnCtx &ctx, const ProtoDesc &desc, Column &s,
+                         size_t begin, size_t end) {
+  if (ctx.depth >= ctx.opts.maxDepth)
+    return failAt(ctx, DecodeErrc::DepthExceeded, begin);
+  ++ctx.depth;
+  bool ok = decodeRow(ctx, desc, s.children, s.length, begin, end);
+  --ctx.depth;
+  if (ok)
+    finishSlot(s, true);
+  return ok;
+}
+
+// Empty columns for every field of desc
+static std::vector<Column> layoutColumns(const ProtoDesc &desc) {
+  Column root;
+  root.type = FieldType::Message;
+  std::vector<const ProtoDesc *> open;
+  structChildren(root, desc, open);
+  return std::move(root.children);
+}
+
+ColumnarDecoder::ColumnarDecoder(std::shared_ptr<const ProtoDesc> desc,
+                                 DecodeOptions opts)
+    : opts(opts) {
+  batch.columns = layoutColumns(*desc);
+  batch.desc = std::move(desc);
+}
+
+DecodeError ColumnarDecoder::append(const std::vector<uint8_t> &msg) {
+  ColumnCtx ctx{msg, opts, 0, {}};
+  if (msg.size() > opts.maxTotalBytes) {
+    failAt(ctx, DecodeErrc::TotalSizeExceeded, 0);
+    return std::move(ctx.err);
+  }
+  if (!decodeRow(ctx, *batch.desc, batch.columns, batch.rows, 0, msg.size())) {
+    for (Column &c : batch.columns)
+      truncateColumn(c, batch.rows);
+    return std::move(ctx.err);
+  }
+  ++batch.rows;
+  return {};
+}
+
+ColumnBatch ColumnarDecoder::finish() {
+  ColumnBatch done = std::move(batch);
+  batch.desc = done.desc;
+  batch.rows = 0;
+  batch.columns = layoutColumns(*batch.desc);
+  return done;
+}
+
+std::pair<std::optional<ColumnBatch>, DecodeError>
+decodeColumns(const std::vector<std::vector<uint8_t>> &messages,
+              std::shared_ptr<const ProtoDesc> desc,
+              const DecodeOptions &opts) {
+  ColumnarDecoder decoder(std::move(desc), opts);
+  for (size_t i = 0; i < messages.size(); ++i) {
+    DecodeError err = decoder.append(messages[i]);
+    if (err.code != DecodeErrc::None) {
+      std::string row = "[" + std::to_string(i) + "]";
+      err.fieldPath = err.fieldPath.empty() ? row : row + "." + err.fieldPath;
+      return {std::nullopt, std::move(err)};
+    }
+  }
+  return {decoder.finish(), DecodeError{}};
+}
+
+ColumnBatch makeColumnBatch(std::shared_ptr<const ProtoDesc> desc) {
+  ColumnBatch batch;
+  batch.columns = layoutColumns(*desc);
+  batch.desc = std::move(desc);
+  return batch;
+}
+
+// ---------------------------------------------------------------------------
+// Encoding
+
+namespace {
+// Encoded sizes of one column's slots, worked out for the whole batch
+// before anything is written
+struct ColumnPlan {
+  // Per slot: bytes added to the enclosing message or packed run, tags
+  // included; 0 for null slots and empty lists
+  std::vector<size_t> bytes;
+  // Per slot: the length prefix of a message or packed run
+  std::vector<size_t> payload;
+  std::vector<ColumnPlan> children;
+};
+} // namespace
+
+static bool failColumn(EncodeError &err, const FieldDesc &fd) {
+  err.code = EncodeErrc::MalformedColumn;
+  err.fieldPath =
+      err.fieldPath.empty() ? fd.name : fd.name + "." + err.fieldPath;
+  return false;
+}
+
+static uint64_t makeTag(uint32_t number, WireType wire) {
+  return (uint64_t(number) << 3) | uint64_t(wire);
+}
+
+static void putVarint(uint8_t *&p, uint64_t v) {
+  while (v >= 0x80) {
+    *p++ = static_cast<uint8_t>(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = static_cast<uint8_t>(v);
+}
+
+static void putFixed(uint8_t *&p, uint64_t v, size_t width) {
+  for (size_t k = 0; k < width; ++k)
+    *p++ = static_cast<uint8_t>(v >> (8 * k));
+}
+
+template <typename T> static T load(const Column &c, size_t i) {
+  T x;
+  std::memcpy(&x, c.values.data() + i * sizeof x, sizeof x);
+  return x;
+}
+
+// The varint slot i of an integer column goes on the wire as
+template <FieldType type> static uint64_t varintOf(const Column &c, size_t i) {
+  if constexpr (type == FieldType::Int)
+    return zigzag(load<int64_t>(c, i));
+  else if constexpr (type == FieldType::UInt || type == FieldType::Int64)
+    return load<uint64_t>(c, i);
+  else if constexpr (type == FieldType::Int32 || type == FieldType::Enum)
+    return static_cast<uint64_t>(int64_t(load<int32_t>(c, i)));
+  else if constexpr (type == FieldType::SInt32)
+    return zigzag32(load<int32_t>(c, i));
+  else if constexpr (type == FieldType::Bool)
+    return c.boolAt(i);
+  else
+    return load<uint32_t>(c, i);
+}
+
+// Calls visit with the varint type as a compile-time constant, so the
+// per-slot loops are specialized for it; false for other types
+template <typename Visit>
+static bool withVarintType(FieldType type, Visit &&visit) {
+  using T = FieldType;
+  switch (type) {
+  case T::Int:
+    return visit(std::integral_constant<T, T::Int>{}), true;
+  case T::UInt:
+    return visit(std::integral_constant<T, T::UInt>{}), true;
+  case T::Int64:
+    return visit(std::integral_constant<T, T::Int64>{}), true;
+  case T::Int32:
+    return visit(std::integral_constant<T, T::Int32>{}), true;
+  case T::Enum:
+    return visit(std::integral_constant<T, T::Enum>{}), true;
+  case T::SInt32:
+    return visit(std::integral_constant<T, T::SInt32>{}), true;
+  case T::UInt32:
+    return visit(std::integral_constant<T, T::UInt32>{}), true;
+  case T::Bool:
+    return visit(std::integral_constant<T, T::Bool>{}), true;
+  default:
+    return false;
+  }
+}
+
+// Offsets for n slots: non-negative, non-decreasing and within limit
+static bool validOffsets(const std::vector<int32_t> &offsets, size_t n,
+                         size_t limit) {
+  if (offsets.size() < n + 1 || offsets[0] < 0)
+    return false;
+  for (size_t i = 0; i < n; ++i)
+    if (offsets[i + 1] < offsets[i])
+      return false;
+  return size_t(offsets[n]) <= limit;
+}
+
+static bool planColumn(const Column &c, const FieldDesc &fd, size_t n,
+                       bool element, bool tagged, ColumnPlan &p,
+                       EncodeError &err);
+
+static bool planList(const Column &c, const FieldDesc &fd, size_t n,
+                     ColumnPlan &p, EncodeError &err) {
+  if (c.children.size() != 1 ||
+      !validOffsets(c.offsets, n, c.children[0].length))
+    return failColumn(err, fd);
+  bool packed = fd.isPacked && fd.type != FieldType::Map &&
+                wireOf(fd.type) != LEN;
+  p.children.resize(1);
+  if (!planColumn(c.children[0], fd, size_t(c.offsets[n]), true, !packed,
+                  p.children[0], err))
+    return false; // the elements' path already names the field
+
+  const std::vector<size_t> &elems = p.children[0].bytes;
+  if (packed)
+    p.payload.assign(n, 0);
+  size_t tag = varintSize(makeTag(fd.number, LEN));
+  for (size_t i = 0; i < n; ++i) {
+    size_t sum = 0;
+    for (int32_t j = c.offsets[i]; j < c.offsets[i + 1]; ++j)
+      sum += elems[j];
+    if (!packed) {
+      p.bytes[i] = sum;
+    } else if (sum != 0) {
+      p.payload[i] = sum;
+      p.bytes[i] = tag + varintSize(sum) + sum;
+    }
+  }
+  return true;
+}
+
+static bool planStruct(const Column &c, const FieldDesc &fd, size_t n,
+                       ColumnPlan &p, EncodeError &err) {
+  if (fd.nestedDesc == nullptr ||
+      c.children.size() != fd.nestedDesc->fields.size())
+    return failColumn(err, fd);
+  const ProtoDesc &nested = *fd.nestedDesc;
+  p.children.resize(c.children.size());
+  p.payload.assign(n, 0);
+  for (size_t f = 0; f < c.children.size(); ++f) {
+    if (!planColumn(c.children[f], nested.fields[f], n, false, true,
+                    p.children[f], err))
+      return failColumn(err, fd);
+    const std::vector<size_t> &bytes = p.children[f].bytes;
+    for (size_t i = 0; i < n; ++i)
+      p.payload[i] += bytes[i];
+  }
+  size_t tag = varintSize(makeTag(fd.number, LEN));
+  for (size_t i = 0; i < n; ++i)
+    if (c.isValid(i))
+      p.bytes[i] = tag + varintSize(p.payload[i]) + p.payload[i];
+  return true;
+}
+
+// Checks that n slots of c fit fd and sizes them. element: c holds the
+// elements of a repeated field (or a map's entries), which cannot be null;
+// tagged: each slot carries its own tag (all but packed elements).
+static bool planColumn(const Column &c, const FieldDesc &fd, size_t n,
+                       bool element, bool tagged, ColumnPlan &p,
+                       EncodeError &err) {
+  bool list = !element && (fd.isRepeated || fd.type == FieldType::Map);
+  FieldType type = element && fd.type == FieldType::Map ? FieldType::Message
+                                                        : fd.type;
+  if (c.type != type || c.isList != list || c.length < n ||
+      c.validity.size() < (n + 7) / 8)
+    return failColumn(err, fd);
+  if (element)
+    for (size_t i = 0; i < n; ++i)
+      if (!c.isValid(i))
+        return failColumn(err, fd);
+  p.bytes.assign(n, 0);
+  if (list)
+    return planList(c, fd, n, p, err);
+  if (type == FieldType::Message)
+    return planStruct(c, fd, n, p, err);
+
+  size_t tag = tagged ? varintSize(makeTag(fd.number, wireOf(type))) : 0;
+  if (type == FieldType::String || type == FieldType::Bytes) {
+    if (!validOffsets(c.offsets, n, c.data.size()))
+      return failColumn(err, fd);
+    for (size_t i = 0; i < n; ++i) {
+      size_t len = size_t(c.offsets[i + 1] - c.offsets[i]);
+      if (c.isValid(i))
+        p.bytes[i] = tag + varintSize(len) + len;
+    }
+    return true;
+  }
+  size_t width = valueWidth(type);
+  if (type == FieldType::Bool ? c.values.size() < (n + 7) / 8
+                              : c.values.size() < n * width)
+    return failColumn(err, fd);
+  if (wireOf(type) != VARINT) {
+    for (size_t i = 0; i < n; ++i)
+      if (c.isValid(i))
+        p.bytes[i] = tag + width;
+    return true;
+  }
+  if (!withVarintType(type, [&](auto t) {
+        for (size_t i = 0; i < n; ++i)
+          if (c.isValid(i))
+            p.bytes[i] = tag + varintSize(varintOf<t()>(c, i));
+      }))
+    return failColumn(err, fd);
+  return true;
+}
+
+// Writes the slots of c whose cursor is set, advancing each cursor past
+// what it wrote. Mirrors planColumn, which has validated c.
+static void writeColumn(const Column &c, const FieldDesc &fd, bool element,
+                        bool tagged, const ColumnPlan &p,
+                        std::vector<uint8_t *> &cur) {
+  size_t n = cur.size();
+  if (!element && (fd.isRepeated || fd.type == FieldType::Map)) {
+    const Column &elems = c.children[0];
+    const ColumnPlan &elemPlan = p.children[0];
+    bool packed = !p.payload.empty();
+    // Packed fixed-width runs are the column's values, byte for byte
+    bool copy = packed && wireOf(fd.type) != VARINT &&
+                std::endian::native == std::endian::little;
+    size_t width = valueWidth(fd.type);
+    std::vector<uint8_t *> at(copy ? 0 : size_t(c.offsets[n]), nullptr);
+    for (size_t i = 0; i < n; ++i) {
+      if (cur[i] == nullptr || p.bytes[i] == 0)
+        continue;
+      uint8_t *&q = cur[i];
+      if (packed) {
+        putVarint(q, makeTag(fd.number, LEN));
+        putVarint(q, p.payload[i]);
+      }
+      if (copy) {
+        std::memcpy(q, elems.values.data() + c.offsets[i] * width,
+                    p.payload[i]);
+        q += p.payload[i];
+        continue;
+      }
+      for (int32_t j = c.offsets[i]; j < c.offsets[i + 1]; ++j) {
+        at[j] = q;
+        q += elemPlan.bytes[j];
+      }
+    }
+    if (!copy)
+      writeColumn(elems, fd, true, !packed, elemPlan, at);
+    return;
+  }
+
+  FieldType type = element && fd.type == FieldType::Map ? FieldType::Message
+                                                        : fd.type;
+  if (type == FieldType::Message) {
+    std::vector<uint8_t *> inner(n, nullptr);
+    uint64_t tag = makeTag(fd.number, LEN);
+    for (size_t i = 0; i < n; ++i) {
+      if (cur[i] == nullptr || !c.isValid(i))
+        continue;
+      putVarint(cur[i], tag);
+      putVarint(cur[i], p.payload[i]);
+      inner[i] = cur[i];
+    }
+    const ProtoDesc &nested = *fd.nestedDesc;
+    for (size_t f = 0; f < c.children.size(); ++f)
+      writeColumn(c.children[f], nested.fields[f], false, true,
+                  p.children[f], inner);
+    for (size_t i = 0; i < n; ++i)
+      if (inner[i] != nullptr)
+        cur[i] = inner[i];
+    return;
+  }
+
+  uint64_t tag = makeTag(fd.number, wireOf(type));
+  auto each = [&](auto &&put) {
+    for (size_t i = 0; i < n; ++i) {
+      if (cur[i] == nullptr || !c.isValid(i))
+        continue;
+      if (tagged)
+        putVarint(cur[i], tag);
+      put(cur[i], i);
+    }
+  };
+  if (type == FieldType::String || type == FieldType::Bytes) {
+    each([&](uint8_t *&q, size_t i) {
+      size_t len = size_t(c.offsets[i + 1] - c.offsets[i]);
+      putVarint(q, len);
+      if (len != 0)
+        std::memcpy(q, c.data.data() + c.offsets[i], len);
+      q += len;
+    });
+  } else if (wireOf(type) == I64) {
+    each([&](uint8_t *&q, size_t i) { putFixed(q, load<uint64_t>(c, i), 8); });
+  } else if (wireOf(type) == I32) {
+    each([&](uint8_t *&q, size_t i) { putFixed(q, load<uint32_t>(c, i), 4); });
+  } else {
+    withVarintType(type, [&](auto t) {
+      each([&](uint8_t *&q, size_t i) { putVarint(q, varintOf<t()>(c, i)); });
+    });
+  }
+}
+
+// Sizes every row of batch; rowBytes gets the encoded length of each
+static bool planBatch(const ColumnBatch &batch, std::vector<ColumnPlan> &plans,
+                      std::vector<size_t> &rowBytes, EncodeError &err) {
+  const ProtoDesc &desc = *batch.desc;
+  if (batch.columns.size() != desc.fields.size()) {
+    err.code = EncodeErrc::MalformedColumn;
+    return false;
+  }
+  plans.resize(desc.fields.size());
+  rowBytes.assign(batch.rows, 0);
+  for (size_t f = 0; f < desc.fields.size(); ++f) {
+    if (!planColumn(batch.columns[f], desc.fields[f], batch.rows, false, true,
+                    plans[f], err))
+      return false;
+    for (size_t r = 0; r < batch.rows; ++r)
+      rowBytes[r] += plans[f].bytes[r];
+  }
+  return true;
+}
+
+// Fills each row at its cursor, one column at a time in declaration order
+static void writeBatch(const ColumnBatch &batch,
+                       const std::vector<ColumnPlan> &plans,
+                       std::vector<uint8_t *> &cur) {
+  for (size_t f = 0; f < plans.size(); ++f)
+    writeColumn(batch.columns[f], batch.desc->fields[f], false, true,
+                plans[f], cur);
+}
+
+std::pair<std::optional<std::vector<std::vector<uint8_t>>>, EncodeError>
+encodeColumns(const ColumnBatch &batch) {
+  EncodeError err;
+  std::vector<ColumnPlan> plans;
+  std::vector<size_t> rowBytes;
+  if (!planBatch(batch, plans, rowBytes, err))
+    return {std::nullopt, std::move(err)};
+
+  std::vector<std::vector<uint8_t>> rows(batch.rows);
+  std::vector<uint8_t *> cur(batch.rows);
+  for (size_t r = 0; r < batch.rows; ++r) {
+    rows[r].resize(rowBytes[r]);
+    cur[r] = rows[r].data();
+  }
+  writeBatch(batch, plans, cur);
+  return {std::move(rows), EncodeError{}};
+}
+
+EncodeError encodeColumnsDelimited(const ColumnBatch &batch,
+                                   std::vector<uint8_t> &out) {
+  EncodeError err;
+  std::vector<ColumnPlan> plans;
+  std::vector<size_t> rowBytes;
+  if (!planBatch(batch, plans, rowBytes, err))
+    return err;
+
+  size_t total = 0;
+  for (size_t bytes : rowBytes)
+    total += varintSize(bytes) + bytes;
+  size_t start = out.size();
+  out.resize(start + total);
+  std::vector<uint8_t *> cur(batch.rows);
+  uint8_t *q = out.data() + start;
+  for (size_t r = 0; r < batch.rows; ++r) {
+    putVarint(q, rowBytes[r]);
+    cur[r] = q;
+    q += rowBytes[r];
+  }
+  writeBatch(batch, plans, cur);
+  return err;
+}
@@ -0,0 +1,184 @@
+#include "descriptor_pool.h"
+#include <functional>
+#include <stdexcept>
+#include <unordered_set>
+
+DescriptorPool::DescriptorPool() = default;
+DescriptorPool::~DescriptorPool() = default;
+
+static std::string withoutDot(const std::string &name) {
+  return !name.empty() && name[0] == '.' ? name.substr(1) : name;
+}
+
+const ProtoDesc *DescriptorPool::adopt(std::unique_ptr<ProtoDesc> desc,
+                                       bool linked) {
+  const ProtoDesc *p = desc.get();
+  owned.emplace(p, Owned{std::move(desc), linked});
+  return p;
+}
+
+void DescriptorPool::add(const std::string &name,
+                         std::vector<FieldDesc> fields) {
+  std::string key = withoutDot(name);
+  std::lock_guard<std::mutex> lock(mu);
+  if (named.count(key) || enums.count(key))
+    throw std::runtime_error("duplicate type name: " + key);
+
+  // Map entries naming their value type are linked in place, so the pool
+  // takes its own copy of each
+  std::vector<std::unique_ptr<ProtoDesc>> entries;
+  for (FieldDesc &fd : fields) {
+    if (fd.type != FieldType::Map || !fd.nestedDesc ||
+        fd.mapValue().typeName.empty())
+      continue;
+    entries.push_back(std::make_unique<ProtoDesc>(fd.nestedDesc->fields));
+    fd.nestedDesc = borrowed<ProtoDesc>(entries.back().get());
+  }
+  auto desc = std::make_unique<ProtoDesc>(std::move(fields));
+  for (auto &entry : entries)
+    adopt(std::move(entry), /*linked=*/false);
+  named.emplace(std::move(key), adopt(std::move(desc), /*linked=*/false));
+}
+
+void DescriptorPool::addEnum(const std::string &name,
+                             std::vector<EnumValueDesc> values) {
+  std::string key = withoutDot(name);
+  std::lock_guard<std::mutex> lock(mu);
+  if (named.count(key) || enums.count(key))
+    throw std::runtime_error("duplicate type name: " + key);
+  auto e = std::make_unique<EnumDesc>(key, std::move(values));
+  enums.emplace(std::move(key), std::move(e));
+}
+
+// Resolves every type name reachable from root. All names are looked up
+// before any field is written, so a missing type leaves the pool as it was.
+void DescriptorPool::link(const ProtoDesc *root) {
+  struct Patch {
+    FieldDesc *field;
+    const ProtoDesc *msg;
+    const EnumDesc *enm;
+  };
+  std::vector<Patch> patches;
+  std::vector<ProtoDesc *> work;
+  std::unordered_set<const ProtoDesc *> seen;
+
+  auto visit = [&](const ProtoDesc *d) {
+    auto it = owned.find(d);
+    if (it != owned.end() && !it->second.linked && seen.insert(d).second)
+      work.push_back(it->second.desc.get());
+  };
+  visit(root);
+  while (!work.empty()) {
+    ProtoDesc *d = work.back();
+    work.pop_back();
+    for (FieldDesc &fd : d->fields) {
+      if (fd.typeName.empty() || fd.nestedDesc || fd.enumDesc) {
+        visit(fd.nestedDesc.get()); // map entries and direct links
+        continue;
+      }
+      std::string key = withoutDot(fd.typeName);
+      if (fd.type == FieldType::Enum) {
+        auto it = enums.find(key);
+        if (it == enums.end())
+          throw std::runtime_error("unknown enum type " + key + " for field " +
+                                   fd.name);
+        patches.push_back({&fd, nullptr, it->second.get()});
+      } else if (fd.type == FieldType::Message) {
+        auto it = named.find(key);
+        if (it == named.end())
+          throw std::runtime_error("unknown message type " + key +
+                                   " for field " + fd.name);
+        patches.push_back({&fd, it->second, nullptr});
+        visit(it->second);
+      }
+    }
+  }
+
+  for (const Patch &p : patches) {
+    if (p.msg != nullptr)
+      p.field->nestedDesc = borrowed(p.msg);
+    else
+      p.field->enumDesc = borrowed(p.enm);
+  }
+  for (const ProtoDesc *d : seen)
+    owned.at(d).linked = true;
+}
+
+const ProtoDesc *DescriptorPool::find(const std::string &name) {
+  std::lock_guard<std::mutex> lock(mu);
+  auto it = named.find(withoutDot(name));
+  if (it == named.end())
+    return nullptr;
+  link(it->second);
+  return it->second;
+}
+
+const EnumDesc *DescriptorPool::findEnum(const std::string &name) const {
+  std::lock_guard<std::mutex> lock(mu);
+  auto it = enums.find(withoutDot(name));
+  return it == enums.end() ? nullptr : it->second.get();
+}
+
+bool DescriptorPool::contains(const std::string &name) const {
+  std::lock_guard<std::mutex> lock(mu);
+  return named.count(withoutDot(name)) != 0;
+}
+
+size_t DescriptorPool::size() const {
+  std::lock_guard<std::mutex> lock(mu);
+  return owned.size();
+}
+
+// What identifies a field for interning. Map fields compare by key and value
+// rather than by their (per-field) entry descriptor.
+static bool sameField(const FieldDesc &a, const FieldDesc &b) {
+  if (a.name != b.name || a.number != b.number || a.type != b.type ||
+      a.isRepeated != b.isRepeated || a.isPacked != b.isPacked ||
+      a.oneof != b.oneof || a.enumDesc != b.enumDesc)
+    return false;
+  if (a.type != FieldType::Map)
+    return a.nestedDesc == b.nestedDesc;
+  const FieldDesc &av = a.mapValue(), &bv = b.mapValue();
+  return a.mapKey().type == b.mapKey().type && av.type == bv.type &&
+         av.nestedDesc == bv.nestedDesc && av.enumDesc == bv.enumDesc;
+}
+
+static uint64_t fieldsHash(const std::vector<FieldDesc> &fields) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  auto mix = [&h](uint64_t v) { h = (h ^ v) * 0x100000001b3ull; };
+  for (const FieldDesc &fd : fields) {
+    mix(std::hash<std::string>{}(fd.name));
+    mix(fd.number);
+    mix(uint64_t(fd.type) << 2 | uint64_t(fd.isRepeated) << 1 | fd.isPacked);
+    const FieldDesc &target = fd.type == FieldType::Map ? fd.mapValue() : fd;
+    mix(std::hash<const void *>{}(target.nestedDesc.get()));
+  }
+  return h;
+}
+
+const ProtoDesc *DescriptorPool::intern(std::vector<FieldDesc> fields) {
+  for (const FieldDesc &fd : fields) {
+    bool isMap = fd.type == FieldType::Map;
+    if (isMap && !fd.nestedDesc)
+      throw std::runtime_error("map field needs an entry descriptor: " +
+                               fd.name);
+    if (!fd.typeName.empty() || (isMap && !fd.mapValue().typeName.empty()))
+      throw std::runtime_error("interned field cannot name a type: " +
+                               fd.name);
+  }
+  uint64_t h = fieldsHash(fields);
+  std::lock_guard<std::mutex> lock(mu);
+  auto [lo, hi] = interned.equal_range(h);
+  for (auto it = lo; it != hi; ++it) {
+    const std::vector<FieldDesc> &other = it->second->fields;
+    bool same = other.size() == fields.size();
+    for (size_t i = 0; same && i < fields.size(); ++i)
+      same = sameField(other[i], fields[i]);
+    if (same)
+      return it->second;
+  }
+  const ProtoDesc *p =
+      adopt(std::make_unique<ProtoDesc>(std::move(fields)), /*linked=*/true);
+  interned.emplace(h, p);
+  return p;
+}
@@ -18,39 +18,60 @@ std::ostream &operator<<(std::ostream &os, const std::vector<uint8_t> &vec) {
   return os;
 }
 
+void appendVarint(std::vector<uint8_t> &out, uint64_t num) {
+  while (num >= 0x80) {
+    out.push_back(static_cast<uint8_t>(num | 0x80));
+    num >>= 7;
+  }
+  out.push_back(static_cast<uint8_t>(num));
+}
+
+void appendVarint32(std::vector<uint8_t> &out, uint32_t num) {
+  while (num >= 0x80) {
+    out.push_back(static_cast<uint8_t>(num | 0x80));
+    num >>= 7;
+  }
+  out.push_back(static_cast<uint8_t>(num));
+}
+
+void appendSignedVarint(std::vector<uint8_t> &out, int64_t num) {
+  appendVarint(out, zigzag(num));
+}
+
+void appendFixed64(std::vector<uint8_t> &out, uint64_t num) {
+  for (int i = 0; i < 8; i++) {
+    out.push_back((num >> (8 * i)) & 0xFF);
+  }
+}
+
+void appendFixed32(std::vector<uint8_t> &out, uint32_t num) {
+  for (int i = 0; i < 4; i++) {
+    out.push_back((num >> (8 * i)) & 0xFF);
+  }
+}
+
 std::vector<uint8_t> encodeVarint(uint64_t num) {
   std::vector<uint8_t> enc;
-  do {
-    uint8_t rem = num & 0x7F;
-    if (num > rem) {
-      enc.push_back(rem | (1 << 7));
-    } else {
-      enc.push_back(rem);
-    }
-    num >>= 7;
-  } while (num > 0);
+  enc.reserve(varintSize(num));
+  appendVarint(enc, num);
   return enc;
 }
 
 std::vector<uint8_t> encodeSignedVarint(int64_t num) {
-  uint64_t u = static_cast<uint64_t>(num);
-  uint64_t sign = static_cast<uint64_t>(-(num < 0));
-  return encodeVarint((u << 1) ^ sign);
+  return encodeVarint(zigzag(num));
 }
 
 std::vector<uint8_t> encodeFixed64(uint64_t num) {
   std::vector<uint8_t> enc;
-  for (int i = 0; i < 8; i++) {
-    enc.push_back((num >> (8 * i)) & 0xFF);
-  }
+  enc.reserve(8);
+  appendFixed64(enc, num);
   return enc;
 }
 
 std::vector<uint8_t> encodeFixed32(uint32_t num) {
   std::vector<uint8_t> enc;
-  for (int i = 0; i < 4; i++) {
-    enc.push_back((num >> (8 * i)) & 0xFF);
-  }
+  enc.reserve(4);
+  appendFixed32(enc, num);
   return enc;
 }
 
@@ -85,13 +106,13 @@ std::vector<uint8_t> encodeBytes(const std::vector<uint8_t> &bytes) {
   return enc;
 }
 
-std::pair<std::optional<uint64_t>, int>
-decodeVarint(const std::vector<uint8_t> &str, int index = 0) {
+std::pair<std::optional<uint64_t>, size_t>
+decodeVarint(const std::vector<uint8_t> &str, size_t index = 0) {
   uint64_t out = 0;
   int shift = 0;
-  int sz = str.size();
+  size_t sz = str.size();
 
-  for (int i = index, count = 0; i < sz && count < 10; ++i, ++count) {
+  for (size_t i = index, count = 0; i < sz && count < 10; ++i, ++count) {
     uint8_t b = str[i];
     if (count == 9 && (b & 0xFE) != 0) {
       return {std::nullopt, index};
@@ -106,8 +127,34 @@ decodeVarint(const std::vector<uint8_t> &str, int index = 0) {
   return {std::nullopt, index};
 }
 
-std::pair<std::optional<int64_t>, int>
-decodeSignedVarint(const std::vector<uint8_t> &str, int index = 0) {
+std::pair<std::optional<uint32_t>, size_t>
+decodeVarint32(const std::vector<uint8_t> &str, size_t index = 0) {
+  size_t sz = str.size();
+  size_t i = index;
+  uint32_t out = 0;
+  for (int shift = 0; shift < 35; shift += 7, ++i) {
+    if (i >= sz)
+      return {std::nullopt, index};
+    uint8_t b = str[i];
+    out |= uint32_t(b & 0x7F) << shift;
+    if ((b & 0x80) == 0)
+      return {out, i + 1};
+  }
+  // Bytes 6-10 only carry bits above 32; the tenth may carry one bit
+  for (int count = 5; count < 10; ++count, ++i) {
+    if (i >= sz)
+      return {std::nullopt, index};
+    uint8_t b = str[i];
+    if (count == 9 && (b & 0xFE) != 0)
+      return {std::nullopt, index};
+    if ((b & 0x80) == 0)
+      return {out, i + 1};
+  }
+  return {std::nullopt, index};
+}
+
+std::pair<std::optional<int64_t>, size_t>
+decodeSignedVarint(const std::vector<uint8_t> &str, size_t index = 0) {
   auto [unsignedValOpt, nextIndex] = decodeVarint(str, index);
   if (!unsignedValOpt.has_value()) {
     return {std::nullopt, index};
@@ -119,33 +166,33 @@ decodeSignedVarint(const std::vector<uint8_t> &str, int index = 0) {
 }
 
 std::optional<uint64_t> decodeFixed64(const std::vector<uint8_t> &str,
-                                      int index = 0) {
-  int sz = str.size();
-  if (index + 8 > sz) {
+                                      size_t index = 0) {
+  size_t sz = str.size();
+  if (index > sz || sz - index < 8) {
     return std::nullopt;
   }
   uint64_t out = 0;
-  for (int i = index; i < index + 8; i++) {
-    out |= static_cast<uint64_t>(str[i]) << (8 * (i - index));
+  for (size_t i = 0; i < 8; i++) {
+    out |= static_cast<uint64_t>(str[index + i]) << (8 * i);
   }
   return out;
 }
 
 std::optional<uint32_t> decodeFixed32(const std::vector<uint8_t> &str,
-                                      int index = 0) {
-  int sz = str.size();
-  if (index + 4 > sz) {
+                                      size_t index = 0) {
+  size_t sz = str.size();
+  if (index > sz || sz - index < 4) {
     return std::nullopt;
   }
   uint32_t out = 0;
-  for (int i = index; i < index + 4; i++) {
-    out |= static_cast<uint32_t>(str[i]) << (8 * (i - index));
+  for (size_t i = 0; i < 4; i++) {
+    out |= static_cast<uint32_t>(str[index + i]) << (8 * i);
   }
   return out;
 }
 
 std::optional<double> decodeDouble(const std::vector<uint8_t> &str,
-                                   int index = 0) {
+                                   size_t index = 0) {
   auto fixedOpt = decodeFixed64(str, index);
   if (!fixedOpt.has_value()) {
     return std::nullopt;
@@ -157,7 +204,7 @@ std::optional<double> decodeDouble(const std::vector<uint8_t> &str,
 }
 
 std::optional<float> decodeFloat(const std::vector<uint8_t> &str,
-                                 int index = 0) {
+                                 size_t index = 0) {
   auto fixedOpt = decodeFixed32(str, index);
   if (!fixedOpt.has_value()) {
     return std::nullopt;
@@ -168,36 +215,34 @@ std::optional<float> decodeFloat(const std::vector<uint8_t> &str,
   return out;
 }
 
-std::pair<std::optional<std::string>, int>
-decodeStr(const std::vector<uint8_t> &str, int index = 0) {
-  int sz = str.size();
-  std::string res;
+std::pair<std::optional<std::string>, size_t>
+decodeStr(const std::vector<uint8_t> &str, size_t index = 0) {
+  size_t sz = str.size();
   auto [lengthOpt, newIndex] = decodeVarint(str, index);
   if (!lengthOpt.has_value()) {
     return {std::nullopt, index};
   }
-  int length = lengthOpt.value();
-  if (newIndex + length > sz) {
+  // Compare against the remaining bytes so a huge length cannot wrap around
+  uint64_t length = lengthOpt.value();
+  if (length > sz - newIndex) {
     return {std::nullopt, index};
   }
-  for (int i = newIndex; i < newIndex + length; i++) {
-    res += static_cast<char>(str[i]);
-  }
-  return {res, static_cast<int>(newIndex + length)};
+  std::string res(str.begin() + newIndex, str.begin() + newIndex + length);
+  return {std::move(res), newIndex + length};
 }
 
-std::pair<std::optional<std::vector<uint8_t>>, int>
-decodeBytes(const std::vector<uint8_t> &str, int index = 0) {
-  int sz = str.size();
+std::pair<std::optional<std::vector<uint8_t>>, size_t>
+decodeBytes(const std::vector<uint8_t> &str, size_t index = 0) {
+  size_t sz = str.size();
   auto [lengthOpt, newIndex] = decodeVarint(str, index);
   if (!lengthOpt.has_value()) {
     return {std::nullopt, index};
   }
-  int length = lengthOpt.value();
-  if (newIndex + length > sz) {
+  uint64_t length = lengthOpt.value();
+  if (length > sz - newIndex) {
     return {std::nullopt, index};
   }
   std::vector<uint8_t> res(str.begin() + newIndex,
                            str.begin() + newIndex + length);
-  return {res, static_cast<int>(newIndex + length)};
+  return {std::move(res), newIndex + length};
 }
@@ -0,0 +1,1426 @@
+#include "json_format.h"
+#include "encoder.h"
+#include "message_encoder.h"
+#include "wire_util.h"
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <unordered_map>
+
+// JSON strings are scanned a machine word at a time (SWAR): specialBytes
+// flags every byte that cannot be copied through verbatim, so plain ASCII
+// runs cost one load and a few ALU ops per eight bytes on any target.
+
+static inline bool isSpecial(unsigned char c) {
+  return c < 0x20 || c == '"' || c == '\\' || c >= 0x80;
+}
+
+// High bit set in each byte of w that isSpecial. Borrows only run towards
+// more significant bytes, so the least significant flag is exact; flags
+// above it may be spurious.
+static inline uint64_t specialBytes(uint64_t w) {
+  constexpr uint64_t ones = 0x0101010101010101ULL;
+  constexpr uint64_t high = 0x8080808080808080ULL;
+  uint64_t quote = w ^ (ones * '"');
+  uint64_t slash = w ^ (ones * '\\');
+  uint64_t found = ((quote - ones) & ~quote) | ((slash - ones) & ~slash) |
+                   ((w - ones * 0x20) & ~w) | w;
+  return found & high;
+}
+
+// Length of the leading run of p[0, n) with no isSpecial byte
+static size_t plainPrefix(const char *p, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t w;
+    std::memcpy(&w, p + i, 8);
+    uint64_t flags = specialBytes(w);
+    if (flags == 0)
+      continue;
+    if constexpr (std::endian::native == std::endian::little)
+      return i + std::countr_zero(flags) / 8;
+    break; // flags are in the wrong order here: finish bytewise
+  }
+  while (i < n && !isSpecial(static_cast<unsigned char>(p[i])))
+    ++i;
+  return i;
+}
+
+// Length of the well-formed UTF-8 sequence at p (lead byte >= 0x80), or 0
+// for overlong forms, surrogates, code points past U+10FFFF and truncation
+static size_t utf8Sequence(const unsigned char *p, size_t n) {
+  unsigned char c = p[0];
+  size_t len;
+  uint32_t cp;
+  if (c >= 0xC2 && c <= 0xDF) {
+    len = 2;
+    cp = c & 0x1F;
+  } else if (c >= 0xE0 && c <= 0xEF) {
+    len = 3;
+    cp = c & 0x0F;
+  } else if (c >= 0xF0 && c <= 0xF4) {
+    len = 4;
+    cp = c & 0x07;
+  } else {
+    return 0;
+  }
+  if (n < len)
+    return 0;
+  for (size_t k = 1; k < len; ++k) {
+    if ((p[k] & 0xC0) != 0x80)
+      return 0;
+    cp = cp << 6 | (p[k] & 0x3F);
+  }
+  if (len == 3 && (cp < 0x800 || (cp >= 0xD800 && cp <= 0xDFFF)))
+    return 0;
+  if (len == 4 && (cp < 0x10000 || cp > 0x10FFFF))
+    return 0;
+  return len;
+}
+
+// ---------------------------------------------------------------------------
+// Writing
+
+// Appends s as a string literal; false if s is not valid UTF-8
+static bool writeString(std::string &out, std::string_view s) {
+  static const char hex[] = "0123456789abcdef";
+  out += '"';
+  const char *p = s.data();
+  size_t n = s.size(), i = 0;
+  while (true) {
+    size_t run = plainPrefix(p + i, n - i);
+    out.append(p + i, run);
+    i += run;
+    if (i == n)
+      break;
+    auto c = static_cast<unsigned char>(p[i]);
+    if (c >= 0x80) {
+      size_t len = utf8Sequence(reinterpret_cast<const unsigned char *>(p) + i,
+                                n - i);
+      if (len == 0)
+        return false;
+      out.append(p + i, len);
+      i += len;
+      continue;
+    }
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\b':
+      out += "\\b";
+      break;
+    case '\f':
+      out += "\\f";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\r':
+      out += "\\r";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default:
+      out += "\\u00";
+      out += hex[c >> 4];
+      out += hex[c & 0xF];
+    }
+    ++i;
+  }
+  out += '"';
+  return true;
+}
+
+static void writeBase64(std::string &out, const uint8_t *p, size_t n) {
+  static const char digits[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  out += '"';
+  size_t i = 0;
+  for (; i + 3 <= n; i += 3) {
+    uint32_t v = uint32_t(p[i]) << 16 | uint32_t(p[i + 1]) << 8 | p[i + 2];
+    out += digits[v >> 18];
+    out += digits[v >> 12 & 63];
+    out += digits[v >> 6 & 63];
+    out += digits[v & 63];
+  }
+  if (i < n) {
+    uint32_t v = uint32_t(p[i]) << 16;
+    if (i + 1 < n)
+      v |= uint32_t(p[i + 1]) << 8;
+    out += digits[v >> 18];
+    out += digits[v >> 12 & 63];
+    out += i + 1 < n ? digits[v >> 6 & 63] : '=';
+    out += '=';
+  }
+  out += '"';
+}
+
+// Shortest form that parses back to the same value (std::to_chars)
+template <typename T> static void writeNumber(std::string &out, T x) {
+  char buf[32];
+  auto res = std::to_chars(buf, buf + sizeof buf, x);
+  out.append(buf, res.ptr);
+}
+
+template <typename T> static void writeQuoted(std::string &out, T x) {
+  out += '"';
+  writeNumber(out, x);
+  out += '"';
+}
+
+template <typename T> static void writeFloating(std::string &out, T x) {
+  if (std::isnan(x))
+    out += "\"NaN\"";
+  else if (std::isinf(x))
+    out += x > 0 ? "\"Infinity\"" : "\"-Infinity\"";
+  else
+    writeNumber(out, x);
+}
+
+static bool writeEnum(std::string &out, const FieldDesc &fd, int32_t number,
+                      const JsonOptions &opts) {
+  if (!opts.enumsAsInts && fd.enumDesc)
+    if (const std::string *name = fd.enumDesc->nameOf(number))
+      return writeString(out, *name);
+  writeNumber(out, number);
+  return true;
+}
+
+namespace {
+struct WriteCtx {
+  std::string &out;
+  const JsonOptions &opts;
+  size_t depth = 0;
+  JsonError err;
+};
+} // namespace
+
+static bool failWrite(WriteCtx &ctx, const char *what, const FieldDesc &fd) {
+  if (ctx.err.message.empty()) {
+    ctx.err.message = std::string(what) + ": " + fd.name;
+    ctx.err.offset = ctx.out.size();
+  }
+  return false;
+}
+
+static bool writeMessage(WriteCtx &ctx, const Message &m);
+
+// Numeric, bool and enum values; also the string, bytes and message values
+// of a Message. fd supplies the enum names (the map value field for maps).
+static bool writeScalar(WriteCtx &ctx, const FieldDesc &fd, FieldType type,
+                        const Value &v) {
+  std::string &out = ctx.out;
+  switch (type) {
+  case FieldType::Int:
+  case FieldType::Int64:
+  case FieldType::SFixed64:
+    if (const auto *x = std::get_if<int64_t>(&v))
+      return writeQuoted(out, *x), true;
+    break;
+  case FieldType::UInt:
+  case FieldType::Fixed64:
+    if (const auto *x = std::get_if<uint64_t>(&v))
+      return writeQuoted(out, *x), true;
+    break;
+  case FieldType::Int32:
+  case FieldType::SInt32:
+  case FieldType::SFixed32:
+    if (const auto *x = std::get_if<int32_t>(&v))
+      return writeNumber(out, *x), true;
+    break;
+  case FieldType::UInt32:
+  case FieldType::Fixed32:
+    if (const auto *x = std::get_if<uint32_t>(&v))
+      return writeNumber(out, *x), true;
+    break;
+  case FieldType::Enum:
+    if (const auto *x = std::get_if<int32_t>(&v))
+      return writeEnum(out, fd, *x, ctx.opts);
+    break;
+  case FieldType::Double:
+    if (const auto *x = std::get_if<double>(&v))
+      return writeFloating(out, *x), true;
+    break;
+  case FieldType::Float:
+    if (const auto *x = std::get_if<float>(&v))
+      return writeFloating(out, *x), true;
+    break;
+  case FieldType::Bool:
+    if (const auto *x = std::get_if<bool>(&v))
+      return out += *x ? "true" : "false", true;
+    break;
+  case FieldType::String:
+    if (const auto *x = std::get_if<std::string>(&v))
+      return writeString(out, *x) || failWrite(ctx, "invalid UTF-8", fd);
+    break;
+  case FieldType::Bytes:
+    if (const auto *x = std::get_if<std::vector<uint8_t>>(&v))
+      return writeBase64(out, x->data(), x->size()), true;
+    break;
+  case FieldType::Message:
+    if (const auto *x = std::get_if<Message>(&v)) {
+      if (ctx.depth >= ctx.opts.maxDepth)
+        return failWrite(ctx, "nesting too deep", fd);
+      ++ctx.depth;
+      bool ok = writeMessage(ctx, *x);
+      --ctx.depth;
+      return ok;
+    }
+    break;
+  default:
+    return failWrite(ctx, "unknown field type", fd);
+  }
+  return failWrite(ctx, "type mismatch", fd);
+}
+
+// Map keys are always strings in JSON
+static bool writeMapKey(WriteCtx &ctx, const FieldDesc &fd, const Value &k) {
+  if (const auto *s = std::get_if<std::string>(&k))
+    return writeString(ctx.out, *s) || failWrite(ctx, "invalid UTF-8", fd);
+  if (const auto *b = std::get_if<bool>(&k))
+    ctx.out += *b ? "\"true\"" : "\"false\"";
+  else if (const auto *i = std::get_if<int64_t>(&k))
+    writeQuoted(ctx.out, *i);
+  else if (const auto *u = std::get_if<uint64_t>(&k))
+    writeQuoted(ctx.out, *u);
+  else if (const auto *i32 = std::get_if<int32_t>(&k))
+    writeQuoted(ctx.out, *i32);
+  else if (const auto *u32 = std::get_if<uint32_t>(&k))
+    writeQuoted(ctx.out, *u32);
+  else
+    return failWrite(ctx, "type mismatch", fd);
+  return true;
+}
+
+static void writeKey(WriteCtx &ctx, const FieldDesc &fd, bool &first) {
+  if (!first)
+    ctx.out += ',';
+  first = false;
+  writeString(ctx.out, ctx.opts.useProtoNames ? fd.name : fd.jsonName);
+  ctx.out += ':';
+}
+
+static bool writeMessage(WriteCtx &ctx, const Message &m) {
+  std::string &out = ctx.out;
+  out += '{';
+  bool first = true;
+  for (size_t i = 0; i < m.desc->fields.size(); ++i) {
+    if (!m.has(i))
+      continue;
+    const FieldDesc &fd = m.desc->fields[i];
+    ValueRef ref = m.valueAt(i);
+    const Value &v = ref.get();
+
+    if (fd.type == FieldType::Map) {
+      const auto *mv = std::get_if<MapVal>(&v);
+      if (mv == nullptr)
+        return failWrite(ctx, "type mismatch", fd);
+      if (mv->empty())
+        continue;
+      writeKey(ctx, fd, first);
+      out += '{';
+      const FieldDesc &vf = fd.mapValue();
+      for (size_t e = 0; e < mv->size(); ++e) {
+        if (e != 0)
+          out += ',';
+        if (!writeMapKey(ctx, fd, mv->keyAt(e)))
+          return false;
+        out += ':';
+        if (!writeScalar(ctx, vf, vf.type, mv->valueAt(e)))
+          return failWrite(ctx, "bad map value", fd);
+      }
+      out += '}';
+    } else if (fd.isRepeated) {
+      const auto *rv = std::get_if<RepeatedVal>(&v);
+      if (rv == nullptr)
+        return failWrite(ctx, "type mismatch", fd);
+      if (rv->values.empty())
+        continue;
+      writeKey(ctx, fd, first);
+      out += '[';
+      for (size_t e = 0; e < rv->values.size(); ++e) {
+        if (e != 0)
+          out += ',';
+        if (!writeScalar(ctx, fd, fd.type, rv->values[e]))
+          return false;
+      }
+      out += ']';
+    } else {
+      writeKey(ctx, fd, first);
+      if (!writeScalar(ctx, fd, fd.type, v))
+        return false;
+    }
+  }
+  out += '}';
+  return true;
+}
+
+JsonError messageToJson(const Message &msg, std::string &out,
+                        const JsonOptions &opts) {
+  WriteCtx ctx{out, opts, 0, {}};
+  writeMessage(ctx, msg);
+  return std::move(ctx.err);
+}
+
+// ---------------------------------------------------------------------------
+// Parsing
+
+namespace {
+struct ParseCtx {
+  std::string_view in;
+  const JsonOptions &opts;
+  size_t pos = 0;
+  size_t depth = 0;
+  JsonError err;
+  std::string text; // member names and other transient strings
+};
+} // namespace
+
+static bool failParse(ParseCtx &ctx, std::string what, size_t at) {
+  if (ctx.err.message.empty()) {
+    ctx.err.message = std::move(what);
+    ctx.err.offset = at;
+  }
+  return false;
+}
+
+static void skipSpace(ParseCtx &ctx) {
+  while (ctx.pos < ctx.in.size()) {
+    char c = ctx.in[ctx.pos];
+    if (c != ' ' && c != '\t' && c != '\n' && c != '\r')
+      return;
+    ++ctx.pos;
+  }
+}
+
+// Skips whitespace, then consumes c if it is next
+static bool consume(ParseCtx &ctx, char c) {
+  skipSpace(ctx);
+  if (ctx.pos < ctx.in.size() && ctx.in[ctx.pos] == c) {
+    ++ctx.pos;
+    return true;
+  }
+  return false;
+}
+
+static bool expect(ParseCtx &ctx, char c) {
+  if (consume(ctx, c))
+    return true;
+  return failParse(ctx, std::string("expected '") + c + "'", ctx.pos);
+}
+
+static bool consumeWord(ParseCtx &ctx, std::string_view word) {
+  skipSpace(ctx);
+  if (ctx.in.substr(ctx.pos, word.size()) != word)
+    return false;
+  ctx.pos += word.size();
+  return true;
+}
+
+static int hexDigit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+static bool readHex4(ParseCtx &ctx, uint32_t &cp) {
+  if (ctx.in.size() - ctx.pos < 4)
+    return failParse(ctx, "truncated \\u escape", ctx.pos);
+  cp = 0;
+  for (int k = 0; k < 4; ++k) {
+    int d = hexDigit(ctx.in[ctx.pos + k]);
+    if (d < 0)
+      return failParse(ctx, "bad \\u escape", ctx.pos);
+    cp = cp << 4 | uint32_t(d);
+  }
+  ctx.pos += 4;
+  return true;
+}
+
+// Parses a string literal into out (replacing its contents)
+static bool parseString(ParseCtx &ctx, std::string &out) {
+  skipSpace(ctx);
+  if (ctx.pos >= ctx.in.size() || ctx.in[ctx.pos] != '"')
+    return failParse(ctx, "expected string", ctx.pos);
+  ++ctx.pos;
+  out.clear();
+  const char *p = ctx.in.data();
+  size_t n = ctx.in.size();
+  while (true) {
+    size_t run = plainPrefix(p + ctx.pos, n - ctx.pos);
+    out.append(p + ctx.pos, run);
+    ctx.pos += run;
+    if (ctx.pos == n)
+      return failParse(ctx, "unterminated string", n);
+    auto c = static_cast<unsigned char>(p[ctx.pos]);
+    if (c == '"') {
+      ++ctx.pos;
+      return true;
+    }
+    if (c >= 0x80) {
+      size_t len = utf8Sequence(
+          reinterpret_cast<const unsigned char *>(p) + ctx.pos, n - ctx.pos);
+      if (len == 0)
+        return failParse(ctx, "invalid UTF-8", ctx.pos);
+      out.append(p + ctx.pos, len);
+      ctx.pos += len;
+      continue;
+    }
+    if (c != '\\')
+      return failParse(ctx, "control character in string", ctx.pos);
+    size_t escStart = ctx.pos++;
+    if (ctx.pos == n)
+      return failParse(ctx, "unterminated string", n);
+    char e = p[ctx.pos++];
+    switch (e) {
+    case '"':
+    case '\\':
+    case '/':
+      out += e;
+      break;
+    case 'b':
+      out += '\b';
+      break;
+    case 'f':
+      out += '\f';
+      break;
+    case 'n':
+      out += '\n';
+      break;
+    case 'r':
+      out += '\r';
+      break;
+    case 't':
+      out += '\t';
+      break;
+    case 'u': {
+      uint32_t cp;
+      if (!readHex4(ctx, cp))
+        return false;
+      if (cp >= 0xDC00 && cp <= 0xDFFF)
+        return failParse(ctx, "unpaired surrogate", escStart);
+      if (cp >= 0xD800 && cp <= 0xDBFF) {
+        uint32_t lo;
+        if (ctx.in.substr(ctx.pos, 2) != "\\u")
+          return failParse(ctx, "unpaired surrogate", escStart);
+        ctx.pos += 2;
+        if (!readHex4(ctx, lo))
+          return false;
+        if (lo < 0xDC00 || lo > 0xDFFF)
+          return failParse(ctx, "unpaired surrogate", escStart);
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+      }
+      appendUtf8(out, cp);
+      break;
+    }
+    default:
+      return failParse(ctx, "bad escape", escStart);
+    }
+  }
+}
+
+// A JSON number token: -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+// Returns its length at the start of s, or 0 if there is none.
+static size_t numberLength(std::string_view s, bool &integral) {
+  size_t i = 0;
+  auto digits = [&] {
+    size_t start = i;
+    while (i < s.size() && s[i] >= '0' && s[i] <= '9')
+      ++i;
+    return i - start;
+  };
+  integral = true;
+  if (i < s.size() && s[i] == '-')
+    ++i;
+  size_t intStart = i;
+  size_t intDigits = digits();
+  if (intDigits == 0 || (intDigits > 1 && s[intStart] == '0'))
+    return 0;
+  if (i < s.size() && s[i] == '.') {
+    ++i;
+    integral = false;
+    if (digits() == 0)
+      return 0;
+  }
+  if (i < s.size() && (s[i] == 'e' || s[i] == 'E')) {
+    ++i;
+    integral = false;
+    if (i < s.size() && (s[i] == '+' || s[i] == '-'))
+      ++i;
+    if (digits() == 0)
+      return 0;
+  }
+  return i;
+}
+
+// The number at the cursor, bare or (for quotable types) in a string. A
+// quoted number must fill its string.
+static bool numberToken(ParseCtx &ctx, bool allowQuoted, std::string_view &tok,
+                        bool &integral, bool &quoted) {
+  skipSpace(ctx);
+  size_t start = ctx.pos;
+  quoted = allowQuoted && start < ctx.in.size() && ctx.in[start] == '"';
+  if (quoted) {
+    if (!parseString(ctx, ctx.text))
+      return false;
+    tok = ctx.text;
+    if (tok.empty() || numberLength(tok, integral) != tok.size())
+      return failParse(ctx, "expected number", start);
+    return true;
+  }
+  size_t len = numberLength(ctx.in.substr(start), integral);
+  if (len == 0)
+    return failParse(ctx, "expected number", start);
+  tok = ctx.in.substr(start, len);
+  ctx.pos += len;
+  return true;
+}
+
+// Integer field values: exact integer tokens, or any number whose value is
+// integral and in range ("1e3")
+template <typename T>
+static bool parseInteger(ParseCtx &ctx, bool allowQuoted, T &out) {
+  size_t start = (skipSpace(ctx), ctx.pos);
+  std::string_view tok;
+  bool integral, quoted;
+  if (!numberToken(ctx, allowQuoted, tok, integral, quoted))
+    return false;
+  const char *first = tok.data(), *last = tok.data() + tok.size();
+  if (integral) {
+    auto res = std::from_chars(first, last, out);
+    if (res.ec == std::errc() && res.ptr == last)
+      return true;
+    return failParse(ctx, "integer out of range", start);
+  }
+  double d;
+  auto res = std::from_chars(first, last, d);
+  // Both bounds are exact doubles: min is -2^(n-1) or 0, limit 2^(n-1) or 2^n
+  constexpr double lowest = double(std::numeric_limits<T>::min());
+  constexpr double limit = std::is_signed_v<T>
+                               ? -lowest
+                               : double(std::numeric_limits<T>::max()) + 1.0;
+  if (res.ec != std::errc() || d != std::trunc(d) || d < lowest ||
+      d >= limit)
+    return failParse(ctx, "not an integer in range", start);
+  out = static_cast<T>(d);
+  return true;
+}
+
+template <typename T> static bool parseFloating(ParseCtx &ctx, T &out) {
+  skipSpace(ctx);
+  size_t start = ctx.pos;
+  if (start < ctx.in.size() && ctx.in[start] == '"') {
+    size_t save = ctx.pos;
+    if (!parseString(ctx, ctx.text))
+      return false;
+    if (ctx.text == "NaN") {
+      out = std::numeric_limits<T>::quiet_NaN();
+      return true;
+    }
+    if (ctx.text == "Infinity" || ctx.text == "-Infinity") {
+      out = std::numeric_limits<T>::infinity();
+      if (ctx.text[0] == '-')
+        out = -out;
+      return true;
+    }
+    ctx.pos = save; // a quoted number
+  }
+  std::string_view tok;
+  bool integral, quoted;
+  if (!numberToken(ctx, true, tok, integral, quoted))
+    return false;
+  auto res = std::from_chars(tok.data(), tok.data() + tok.size(), out);
+  if (res.ec != std::errc())
+    return failParse(ctx, "number out of range", start);
+  return true;
+}
+
+static bool parseBase64(ParseCtx &ctx, std::vector<uint8_t> &out) {
+  size_t start = (skipSpace(ctx), ctx.pos);
+  if (!parseString(ctx, ctx.text))
+    return false;
+  std::string_view s = ctx.text;
+  while (!s.empty() && s.back() == '=' && s.size() % 4 != 1)
+    s.remove_suffix(1);
+  if (s.size() % 4 == 1 || ctx.text.size() - s.size() > 2)
+    return failParse(ctx, "bad base64", start);
+  out.clear();
+  out.reserve(s.size() * 3 / 4);
+  uint32_t acc = 0;
+  int bits = 0;
+  for (char c : s) {
+    int d;
+    if (c >= 'A' && c <= 'Z')
+      d = c - 'A';
+    else if (c >= 'a' && c <= 'z')
+      d = c - 'a' + 26;
+    else if (c >= '0' && c <= '9')
+      d = c - '0' + 52;
+    else if (c == '+' || c == '-')
+      d = 62;
+    else if (c == '/' || c == '_')
+      d = 63;
+    else
+      return failParse(ctx, "bad base64", start);
+    acc = acc << 6 | uint32_t(d);
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      out.push_back(uint8_t(acc >> bits));
+    }
+  }
+  return true;
+}
+
+// Skips a value of any shape, for unknown members
+static bool skipJsonValue(ParseCtx &ctx) {
+  skipSpace(ctx);
+  if (ctx.pos >= ctx.in.size())
+    return failParse(ctx, "expected value", ctx.pos);
+  char c = ctx.in[ctx.pos];
+  if (c == '"')
+    return parseString(ctx, ctx.text);
+  if (c == '{' || c == '[') {
+    if (ctx.depth >= ctx.opts.maxDepth)
+      return failParse(ctx, "nesting too deep", ctx.pos);
+    char close = c == '{' ? '}' : ']';
+    ++ctx.pos;
+    ++ctx.depth;
+    if (!consume(ctx, close)) {
+      do {
+        if (c == '{' && (!parseString(ctx, ctx.text) || !expect(ctx, ':')))
+          return false;
+        if (!skipJsonValue(ctx))
+          return false;
+      } while (consume(ctx, ','));
+      if (!expect(ctx, close))
+        return false;
+    }
+    --ctx.depth;
+    return true;
+  }
+  if (consumeWord(ctx, "true") || consumeWord(ctx, "false") ||
+      consumeWord(ctx, "null"))
+    return true;
+  std::string_view tok;
+  bool integral, quoted;
+  return numberToken(ctx, false, tok, integral, quoted);
+}
+
+static bool parseObject(ParseCtx &ctx, Message &msg);
+
+// One value of type into out, which may hold storage to reuse
+static bool parseValue(ParseCtx &ctx, const FieldDesc &fd, FieldType type,
+                       Value &out) {
+  skipSpace(ctx);
+  size_t start = ctx.pos;
+  switch (type) {
+  case FieldType::Int:
+  case FieldType::Int64:
+  case FieldType::SFixed64: {
+    int64_t x;
+    return parseInteger(ctx, true, x) && (out = x, true);
+  }
+  case FieldType::UInt:
+  case FieldType::Fixed64: {
+    uint64_t x;
+    return parseInteger(ctx, true, x) && (out = x, true);
+  }
+  case FieldType::Int32:
+  case FieldType::SInt32:
+  case FieldType::SFixed32: {
+    int32_t x;
+    return parseInteger(ctx, true, x) && (out = x, true);
+  }
+  case FieldType::UInt32:
+  case FieldType::Fixed32: {
+    uint32_t x;
+    return parseInteger(ctx, true, x) && (out = x, true);
+  }
+  case FieldType::Enum: {
+    if (start < ctx.in.size() && ctx.in[start] == '"') {
+      if (!parseString(ctx, ctx.text))
+        return false;
+      std::optional<int32_t> number;
+      if (fd.enumDesc)
+        number = fd.enumDesc->numberOf(ctx.text);
+      if (!number.has_value())
+        return failParse(ctx, "unknown enum value " + ctx.text, start);
+      out = *number;
+      return true;
+    }
+    int32_t x;
+    return parseInteger(ctx, false, x) && (out = x, true);
+  }
+  case FieldType::Double: {
+    double x;
+    return parseFloating(ctx, x) && (out = x, true);
+  }
+  case FieldType::Float: {
+    float x;
+    return parseFloating(ctx, x) && (out = x, true);
+  }
+  case FieldType::Bool:
+    if (consumeWord(ctx, "true"))
+      return out = true, true;
+    if (consumeWord(ctx, "false"))
+      return out = false, true;
+    return failParse(ctx, "expected true or false", start);
+  case FieldType::String: {
+    auto *s = std::get_if<std::string>(&out);
+    if (s == nullptr)
+      s = &out.emplace<std::string>();
+    return parseString(ctx, *s);
+  }
+  case FieldType::Bytes: {
+    auto *b = std::get_if<std::vector<uint8_t>>(&out);
+    if (b == nullptr)
+      b = &out.emplace<std::vector<uint8_t>>();
+    return parseBase64(ctx, *b);
+  }
+  case FieldType::Message: {
+    if (ctx.depth >= ctx.opts.maxDepth)
+      return failParse(ctx, "nesting too deep", start);
+    Message *nested = std::get_if<Message>(&out);
+    if (nested != nullptr && nested->desc == fd.nestedDesc)
+      nested->clear();
+    else
+      nested = &out.emplace<Message>(fd.nestedDesc);
+    ++ctx.depth;
+    bool ok = parseObject(ctx, *nested);
+    --ctx.depth;
+    return ok;
+  }
+  default:
+    return failParse(ctx, "unknown field type for " + fd.name, start);
+  }
+}
+
+// Map keys arrive as strings; integer and bool keys are parsed from them
+static bool parseMapKey(ParseCtx &ctx, FieldType type, Value &key) {
+  size_t start = (skipSpace(ctx), ctx.pos);
+  std::string k;
+  if (!parseString(ctx, k))
+    return false;
+  auto integer = [&](auto x) {
+    auto res = std::from_chars(k.data(), k.data() + k.size(), x);
+    if (k.empty() || res.ec != std::errc() || res.ptr != k.data() + k.size())
+      return failParse(ctx, "bad map key", start);
+    key = x;
+    return true;
+  };
+  switch (type) {
+  case FieldType::String:
+    key = std::move(k);
+    return true;
+  case FieldType::Bool:
+    if (k != "true" && k != "false")
+      return failParse(ctx, "bad map key", start);
+    key = k == "true";
+    return true;
+  case FieldType::Int:
+  case FieldType::Int64:
+  case FieldType::SFixed64:
+    return integer(int64_t(0));
+  case FieldType::UInt:
+  case FieldType::Fixed64:
+    return integer(uint64_t(0));
+  case FieldType::Int32:
+  case FieldType::SInt32:
+  case FieldType::SFixed32:
+    return integer(int32_t(0));
+  case FieldType::UInt32:
+  case FieldType::Fixed32:
+    return integer(uint32_t(0));
+  default:
+    return failParse(ctx, "bad map key type", start);
+  }
+}
+
+// The value of field fieldIdx. A member given twice replaces the first.
+static bool parseField(ParseCtx &ctx, Message &msg, size_t fieldIdx) {
+  const FieldDesc &fd = msg.desc->fields[fieldIdx];
+  if (fd.type == FieldType::Map) {
+    const FieldDesc &kf = fd.mapKey();
+    const FieldDesc &vf = fd.mapValue();
+    if (!expect(ctx, '{'))
+      return false;
+    bool fresh = !msg.has(fieldIdx);
+    Value &slot = msg.boxedAt(fieldIdx);
+    if (fresh && !std::holds_alternative<MapVal>(slot))
+      slot.emplace<MapVal>(kf.type, vf.type);
+    MapVal &map = std::get<MapVal>(slot);
+    map.clear();
+    if (consume(ctx, '}'))
+      return true;
+    do {
+      Value key;
+      if (!parseMapKey(ctx, kf.type, key) || !expect(ctx, ':'))
+        return false;
+      Value *out = map.tryEmplace(std::move(key));
+      if (!parseValue(ctx, vf, vf.type, *out))
+        return false;
+    } while (consume(ctx, ','));
+    return expect(ctx, '}');
+  }
+
+  if (fd.isRepeated) {
+    if (!expect(ctx, '['))
+      return false;
+    if (msg.has(fieldIdx))
+      std::get<RepeatedVal>(msg.boxedAt(fieldIdx)).values.clear();
+    if (consume(ctx, ']'))
+      return true;
+    do {
+      skipSpace(ctx);
+      if (consumeWord(ctx, "null"))
+        return failParse(ctx, "null in array: " + fd.name, ctx.pos - 4);
+      if (!parseValue(ctx, fd, fd.type, msg.appendAt(fieldIdx)))
+        return false;
+    } while (consume(ctx, ','));
+    return expect(ctx, ']');
+  }
+
+  if (msg.desc->layout().slots[fieldIdx].isInline) {
+    Value scalar;
+    return parseValue(ctx, fd, fd.type, scalar) &&
+           msg.setAt(fieldIdx, std::move(scalar));
+  }
+  return parseValue(ctx, fd, fd.type, msg.boxedAt(fieldIdx));
+}
+
+static bool parseObject(ParseCtx &ctx, Message &msg) {
+  const ProtoDesc &desc = *msg.desc;
+  if (!expect(ctx, '{'))
+    return false;
+  if (consume(ctx, '}'))
+    return true;
+  do {
+    size_t nameStart = (skipSpace(ctx), ctx.pos);
+    if (!parseString(ctx, ctx.text) || !expect(ctx, ':'))
+      return false;
+    std::optional<size_t> idx = desc.indexByJsonName(ctx.text);
+    if (!idx.has_value())
+      idx = desc.indexByName(ctx.text);
+    if (!idx.has_value()) {
+      if (!ctx.opts.ignoreUnknownFields)
+        return failParse(ctx, "unknown field " + ctx.text, nameStart);
+      if (!skipJsonValue(ctx))
+        return false;
+      continue;
+    }
+    if (consumeWord(ctx, "null"))
+      continue; // unset
+    if (!parseField(ctx, msg, *idx))
+      return false;
+  } while (consume(ctx, ','));
+  return expect(ctx, '}');
+}
+
+std::pair<std::optional<Message>, JsonError>
+jsonToMessage(std::string_view json, std::shared_ptr<const ProtoDesc> desc,
+              const JsonOptions &opts) {
+  ParseCtx ctx{json, opts, 0, 0, {}, {}};
+  Message msg(std::move(desc));
+  if (!parseObject(ctx, msg))
+    return {std::nullopt, std::move(ctx.err)};
+  skipSpace(ctx);
+  if (ctx.pos != json.size()) {
+    failParse(ctx, "trailing characters", ctx.pos);
+    return {std::nullopt, std::move(ctx.err)};
+  }
+  return {std::move(msg), JsonError{}};
+}
+
+// ---------------------------------------------------------------------------
+// Binary to JSON
+//
+// Each message is scanned once to validate its tags and wire types and to
+// record where every known field occurs; the occurrences are then ordered
+// by field (declaration order, then wire order) and written. Repeated
+// occurrences are concatenated, a singular field takes its last occurrence
+// and so does a oneof, as decodeMessage does. Superseded occurrences are
+// still checked, without writing, so the same inputs are rejected.
+
+namespace {
+struct Occurrence {
+  uint32_t field; // index into ProtoDesc::fields
+  uint32_t wire;
+  size_t start; // offset of the value, after the tag
+};
+} // namespace
+
+namespace {
+struct TranscodeCtx {
+  const std::vector<uint8_t> &data;
+  WriteCtx w;
+  std::vector<Occurrence> occs; // per-message runs, stacked by depth
+  std::vector<size_t> oneofLast; // per oneof, its last member's start; ditto
+  JsonError err;
+};
+} // namespace
+
+static bool failInput(TranscodeCtx &ctx, std::string what, size_t at) {
+  if (ctx.err.message.empty()) {
+    ctx.err.message = std::move(what);
+    ctx.err.offset = at;
+  }
+  return false;
+}
+
+// Reads a LEN prefix whose payload lies within [idx, end)
+static bool readLen(TranscodeCtx &ctx, size_t &idx, size_t end, size_t &len) {
+  return readLenPrefix(ctx.data, idx, end, len) ||
+         failInput(ctx, "malformed length", idx);
+}
+
+static bool skipWire(TranscodeCtx &ctx, size_t &idx, size_t end,
+                     uint32_t wire) {
+  switch (wire) {
+  case VARINT: {
+    auto [v, next] = decodeVarint(ctx.data, idx);
+    if (!v.has_value() || next > end)
+      return failInput(ctx, "malformed varint", idx);
+    idx = next;
+    return true;
+  }
+  case I64:
+  case I32: {
+    size_t n = wire == I64 ? 8 : 4;
+    if (end - idx < n)
+      return failInput(ctx, "truncated fixed-width value", idx);
+    idx += n;
+    return true;
+  }
+  case LEN: {
+    size_t len;
+    if (!readLen(ctx, idx, end, len))
+      return false;
+    idx += len;
+    return true;
+  }
+  default:
+    return failInput(ctx, "invalid wire type", idx);
+  }
+}
+
+static bool transcodeMessage(TranscodeCtx &ctx, const ProtoDesc &desc,
+                             size_t begin, size_t end, bool emit);
+
+// One element of a non-map field at idx (the wire type already checked).
+// Numeric values are decoded into a Value so they share writeScalar.
+static bool transcodeElement(TranscodeCtx &ctx, const FieldDesc &fd,
+                             FieldType type, size_t &idx, size_t end,
+                             bool emit) {
+  const std::vector<uint8_t> &d = ctx.data;
+  size_t start = idx;
+  Value v;
+  switch (type) {
+  case FieldType::String:
+  case FieldType::Bytes:
+  case FieldType::Message: {
+    size_t len;
+    if (!readLen(ctx, idx, end, len))
+      return false;
+    size_t payload = idx;
+    idx += len;
+    if (type == FieldType::Message) {
+      if (ctx.w.depth >= ctx.w.opts.maxDepth)
+        return failInput(ctx, "nesting too deep", payload);
+      ++ctx.w.depth;
+      bool ok = transcodeMessage(ctx, *fd.nestedDesc, payload, idx, emit);
+      --ctx.w.depth;
+      return ok;
+    }
+    if (!emit)
+      return true;
+    const uint8_t *p = d.data() + payload;
+    if (type == FieldType::Bytes) {
+      writeBase64(ctx.w.out, p, len);
+      return true;
+    }
+    if (!writeString(ctx.w.out, {reinterpret_cast<const char *>(p), len}))
+      return failInput(ctx, "invalid UTF-8 in " + fd.name, payload);
+    return true;
+  }
+  case FieldType::Int: {
+    auto [x, next] = decodeSignedVarint(d, idx);
+    if (!x.has_value() || next > end)
+      return failInput(ctx, "malformed varint", start);
+    v = *x;
+    idx = next;
+    break;
+  }
+  case FieldType::UInt:
+  case FieldType::Int64:
+  case FieldType::Bool: {
+    auto [x, next] = decodeVarint(d, idx);
+    if (!x.has_value() || next > end)
+      return failInput(ctx, "malformed varint", start);
+    if (type == FieldType::UInt)
+      v = *x;
+    else if (type == FieldType::Int64)
+      v = static_cast<int64_t>(*x);
+    else if (*x > 1)
+      return failInput(ctx, "invalid bool", start);
+    else
+      v = *x == 1;
+    idx = next;
+    break;
+  }
+  case FieldType::Int32:
+  case FieldType::Enum:
+  case FieldType::UInt32:
+  case FieldType::SInt32: {
+    auto [x, next] = decodeVarint32(d, idx);
+    if (!x.has_value() || next > end)
+      return failInput(ctx, "malformed varint", start);
+    if (type == FieldType::UInt32)
+      v = *x;
+    else if (type == FieldType::SInt32)
+      v = unzigzag32(*x);
+    else
+      v = static_cast<int32_t>(*x);
+    idx = next;
+    break;
+  }
+  case FieldType::Double:
+  case FieldType::Fixed64:
+  case FieldType::SFixed64: {
+    if (end - idx < 8)
+      return failInput(ctx, "truncated fixed64", start);
+    uint64_t raw = decodeFixed64(d, idx).value();
+    if (type == FieldType::Double)
+      v = std::bit_cast<double>(raw);
+    else if (type == FieldType::Fixed64)
+      v = raw;
+    else
+      v = static_cast<int64_t>(raw);
+    idx += 8;
+    break;
+  }
+  case FieldType::Float:
+  case FieldType::Fixed32:
+  case FieldType::SFixed32: {
+    if (end - idx < 4)
+      return failInput(ctx, "truncated fixed32", start);
+    uint32_t raw = decodeFixed32(d, idx).value();
+    if (type == FieldType::Float)
+      v = std::bit_cast<float>(raw);
+    else if (type == FieldType::Fixed32)
+      v = raw;
+    else
+      v = static_cast<int32_t>(raw);
+    idx += 4;
+    break;
+  }
+  default:
+    return failInput(ctx, "unknown field type for " + fd.name, start);
+  }
+  return !emit || writeScalar(ctx.w, fd, type, v);
+}
+
+// The JSON text of a field's default value, for map entries without one
+static bool writeDefault(TranscodeCtx &ctx, const FieldDesc &fd) {
+  switch (fd.type) {
+  case FieldType::Message:
+    ctx.w.out += "{}";
+    return true;
+  case FieldType::String:
+  case FieldType::Bytes:
+    ctx.w.out += "\"\"";
+    return true;
+  case FieldType::Int:
+  case FieldType::Int64:
+  case FieldType::SFixed64:
+    return writeScalar(ctx.w, fd, fd.type, int64_t(0));
+  case FieldType::UInt:
+  case FieldType::Fixed64:
+    return writeScalar(ctx.w, fd, fd.type, uint64_t(0));
+  case FieldType::UInt32:
+  case FieldType::Fixed32:
+    return writeScalar(ctx.w, fd, fd.type, uint32_t(0));
+  case FieldType::Double:
+    return writeScalar(ctx.w, fd, fd.type, 0.0);
+  case FieldType::Float:
+    return writeScalar(ctx.w, fd, fd.type, 0.0f);
+  case FieldType::Bool:
+    return writeScalar(ctx.w, fd, fd.type, false);
+  default:
+    return writeScalar(ctx.w, fd, fd.type, int32_t(0));
+  }
+}
+
+namespace {
+struct MapEntry {
+  std::string key;   // raw bytes of a string key, else the key as JSON
+  size_t valueStart; // SIZE_MAX: no value in the entry
+  size_t entryEnd;
+  size_t last; // for the first entry with a key: the last one with it
+};
+} // namespace
+
+// Parses one map entry at idx as decodeMessage does: key and value may
+// come in any order and repeat (the last counts), other members are
+// skipped, and a missing key or value is the default.
+static bool readMapEntry(TranscodeCtx &ctx, const FieldDesc &fd, size_t &idx,
+                         size_t end, MapEntry &entry) {
+  const FieldDesc &kf = fd.mapKey();
+  const FieldDesc &vf = fd.mapValue();
+  size_t len;
+  if (!readLen(ctx, idx, end, len))
+    return false;
+  entry.entryEnd = idx + len;
+  entry.valueStart = SIZE_MAX;
+  size_t keyStart = SIZE_MAX;
+  while (idx < entry.entryEnd) {
+    size_t tagStart = idx;
+    auto [tag, afterTag] = decodeVarint(ctx.data, idx);
+    if (!tag.has_value() || afterTag > entry.entryEnd)
+      return failInput(ctx, "malformed map entry", tagStart);
+    idx = afterTag;
+    uint64_t number = *tag >> 3;
+    uint32_t wire = *tag & 0x7;
+    if (number == 0)
+      return failInput(ctx, "invalid tag in map entry", idx);
+    if (number == 1) {
+      if (wire != wireOf(kf.type))
+        return failInput(ctx, "wire type mismatch for map key", idx);
+      keyStart = idx;
+      if (!transcodeElement(ctx, kf, kf.type, idx, entry.entryEnd, false))
+        return false;
+      continue;
+    }
+    if (number == 2) {
+      if (wire != wireOf(vf.type))
+        return failInput(ctx, "wire type mismatch for map value", idx);
+      entry.valueStart = idx;
+    }
+    if (!skipWire(ctx, idx, entry.entryEnd, wire))
+      return false;
+  }
+
+  entry.key.clear();
+  if (kf.type == FieldType::String) {
+    if (keyStart != SIZE_MAX) {
+      size_t at = keyStart, klen;
+      readLen(ctx, at, entry.entryEnd, klen); // validated above
+      entry.key.assign(reinterpret_cast<const char *>(ctx.data.data()) + at,
+                       klen);
+    }
+    return true;
+  }
+  // Integer and bool keys always write; their text is their identity, so
+  // a missing key is written as the zero an explicit one would be
+  std::swap(entry.key, ctx.w.out);
+  if (keyStart == SIZE_MAX)
+    writeDefault(ctx, kf);
+  else
+    transcodeElement(ctx, kf, kf.type, keyStart, entry.entryEnd, true);
+  std::swap(entry.key, ctx.w.out);
+  return true;
+}
+
+// Entries are written in the order keys first appear, each with the value
+// of the last entry for its key, as MapVal keeps them
+static bool transcodeMap(TranscodeCtx &ctx, const FieldDesc &fd, size_t first,
+                         size_t last, bool emit, bool &wrote) {
+  const FieldDesc &kf = fd.mapKey();
+  const FieldDesc &vf = fd.mapValue();
+  std::vector<MapEntry> entries(last - first);
+  for (size_t i = first; i < last; ++i) {
+    size_t idx = ctx.occs[i].start;
+    if (!readMapEntry(ctx, fd, idx, ctx.data.size(), entries[i - first]))
+      return false;
+  }
+  std::unordered_map<std::string_view, size_t> firstByKey;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    size_t firstIdx = firstByKey.emplace(entries[i].key, i).first->second;
+    entries[firstIdx].last = i;
+  }
+
+  std::string &out = ctx.w.out;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    size_t firstIdx = firstByKey.at(entries[i].key);
+    if (firstIdx != i && entries[firstIdx].last != i) {
+      // Superseded: still checked, since decodeMessage decodes it
+      size_t at = entries[i].valueStart;
+      if (at != SIZE_MAX &&
+          !transcodeElement(ctx, vf, vf.type, at, entries[i].entryEnd, false))
+        return false;
+      continue;
+    }
+    if (firstIdx != i)
+      continue; // the value of an earlier key, done there
+    if (emit) {
+      if (wrote)
+        out += ',';
+      if (kf.type == FieldType::String) {
+        if (!writeString(out, entries[i].key))
+          return failInput(ctx, "invalid UTF-8 in map key of " + fd.name,
+                           ctx.occs[first + i].start);
+      } else if (entries[i].key.front() == '"') {
+        out += entries[i].key; // 64-bit keys are quoted already
+      } else {
+        out += '"';
+        out += entries[i].key;
+        out += '"';
+      }
+      out += ':';
+    }
+    wrote = true;
+    const MapEntry &src = entries[entries[i].last];
+    size_t at = src.valueStart;
+    if (at == SIZE_MAX) {
+      if (emit && !writeDefault(ctx, vf))
+        return false;
+    } else if (!transcodeElement(ctx, vf, vf.type, at, src.entryEnd, emit)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool transcodeMessage(TranscodeCtx &ctx, const ProtoDesc &desc,
+                             size_t begin, size_t end, bool emit) {
+  const std::vector<uint8_t> &d = ctx.data;
+  size_t base = ctx.occs.size();
+  size_t oneofBase = ctx.oneofLast.size();
+  ctx.oneofLast.resize(oneofBase + desc.oneofs().size(), SIZE_MAX);
+
+  // Pass 1: validate tags and wire types, and record known fields
+  size_t idx = begin;
+  while (idx < end) {
+    size_t tagStart = idx;
+    auto [tag, afterTag] = decodeVarint(d, idx);
+    if (!tag.has_value() || afterTag > end)
+      return failInput(ctx, "malformed tag", tagStart);
+    idx = afterTag;
+    uint64_t number = *tag >> 3;
+    uint32_t wire = *tag & 0x7;
+    if (number == 0 || number > kMaxFieldNumber)
+      return failInput(ctx, "invalid tag", idx);
+    std::optional<size_t> field =
+        desc.indexByNumber(static_cast<uint32_t>(number));
+    if (field.has_value()) {
+      const FieldDesc &fd = desc.fields[*field];
+      if (!knownType(fd.type))
+        return failInput(ctx, "unknown field type for " + fd.name, idx);
+      WireType expected = wireOf(fd.type);
+      bool packed = fd.isRepeated && expected != LEN && wire == LEN;
+      if (wire != expected && !packed)
+        return failInput(ctx, "wire type mismatch for " + fd.name, idx);
+      ctx.occs.push_back({static_cast<uint32_t>(*field), wire, idx});
+      if (fd.oneofIndex >= 0)
+        ctx.oneofLast[oneofBase + fd.oneofIndex] = idx;
+    }
+    if (!skipWire(ctx, idx, end, wire))
+      return false;
+  }
+
+  auto byField = [](const Occurrence &a, const Occurrence &b) {
+    return a.field != b.field ? a.field < b.field : a.start < b.start;
+  };
+  auto first = ctx.occs.begin() + base;
+  if (!std::is_sorted(first, ctx.occs.end(), byField))
+    std::sort(first, ctx.occs.end(), byField);
+
+  // Pass 2: one member per field
+  std::string &out = ctx.w.out;
+  if (emit)
+    out += '{';
+  bool firstMember = true;
+  for (size_t i = base; i < ctx.occs.size();) {
+    size_t field = ctx.occs[i].field;
+    size_t groupEnd = i;
+    while (groupEnd < ctx.occs.size() && ctx.occs[groupEnd].field == field)
+      ++groupEnd;
+    const FieldDesc &fd = desc.fields[field];
+    size_t mark = out.size();
+    bool wasFirst = firstMember;
+    if (emit)
+      writeKey(ctx.w, fd, firstMember);
+
+    if (fd.type == FieldType::Map || fd.isRepeated) {
+      bool wrote = false;
+      if (emit)
+        out += fd.type == FieldType::Map ? '{' : '[';
+      if (fd.type == FieldType::Map) {
+        if (!transcodeMap(ctx, fd, i, groupEnd, emit, wrote))
+          return false;
+      } else {
+        for (size_t k = i; k < groupEnd; ++k) {
+          Occurrence occ = ctx.occs[k];
+          size_t at = occ.start, stop = end;
+          if (occ.wire == LEN && wireOf(fd.type) != LEN) {
+            size_t len;
+            readLen(ctx, at, end, len); // validated in pass 1
+            stop = at + len;
+            while (at < stop) {
+              if (emit && wrote)
+                out += ',';
+              wrote = true;
+              if (!transcodeElement(ctx, fd, fd.type, at, stop, emit))
+                return false;
+            }
+            continue;
+          }
+          if (emit && wrote)
+            out += ',';
+          wrote = true;
+          if (!transcodeElement(ctx, fd, fd.type, at, stop, emit))
+            return false;
+        }
+      }
+      if (emit) {
+        out += fd.type == FieldType::Map ? '}' : ']';
+        if (!wrote) { // empty: leave the field out
+          out.resize(mark);
+          firstMember = wasFirst;
+        }
+      }
+    } else {
+      // A oneof member counts only if it was the last member set
+      bool live = fd.oneofIndex < 0 ||
+                  ctx.oneofLast[oneofBase + fd.oneofIndex] ==
+                      ctx.occs[groupEnd - 1].start;
+      if (emit && !live) {
+        out.resize(mark);
+        firstMember = wasFirst;
+      }
+      for (size_t k = i; k < groupEnd; ++k) {
+        size_t at = ctx.occs[k].start;
+        bool write = emit && live && k + 1 == groupEnd;
+        if (!transcodeElement(ctx, fd, fd.type, at, end, write))
+          return false;
+      }
+    }
+    i = groupEnd;
+  }
+  if (emit)
+    out += '}';
+  ctx.occs.resize(base);
+  ctx.oneofLast.resize(oneofBase);
+  return true;
+}
+
+JsonError binaryToJson(const std::vector<uint8_t> &data, const ProtoDesc &desc,
+                       std::string &out, const JsonOptions &opts) {
+  TranscodeCtx ctx{data, WriteCtx{out, opts, 0, {}}, {}, {}, {}};
+  if (!transcodeMessage(ctx, desc, 0, data.size(), true) &&
+      ctx.err.message.empty())
+    return std::move(ctx.w.err);
+  return std::move(ctx.err);
+}
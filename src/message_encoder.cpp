@@ -1,7 +1,10 @@
 #include "message_encoder.h"
+#include "alloc_accounting.h"
 #include "encoder.h"
 #include "log.h"
-#include <cstdlib>
+#include "metrics.h"
+#include "wire_util.h"
+#include <algorithm>
 #include <iostream>
 #include <variant>
 
@@ -10,42 +13,46 @@ static inline void appendBytes(std::vector<uint8_t> &out,
   out.insert(out.end(), bytes.begin(), bytes.end());
 }
 
+static inline uint64_t makeTag(uint32_t fieldNumber, WireType wire) {
+  return (uint64_t(fieldNumber) << 3) | uint64_t(wire);
+}
+
 static inline void appendTag(std::vector<uint8_t> &out, uint32_t fieldNumber,
                              WireType wire) {
-  uint64_t tag = (uint64_t(fieldNumber) << 3) | uint64_t(wire);
-  appendBytes(out, encodeVarint(tag));
+  appendVarint(out, makeTag(fieldNumber, wire));
 }
 
-static inline bool skipUnknown(const std::vector<uint8_t> &data, int &idx,
-                               uint32_t wireRaw) {
-  const int sz = static_cast<int>(data.size());
+static inline size_t tagSize(uint32_t fieldNumber, WireType wire) {
+  return varintSize(makeTag(fieldNumber, wire));
+}
 
+static inline bool skipUnknown(const std::vector<uint8_t> &data, size_t &idx,
+                               size_t end, uint32_t wireRaw) {
   switch (wireRaw) {
   case WireType::VARINT: {
     auto [tmp, next] = decodeVarint(data, idx);
-    if (!tmp.has_value())
+    if (!tmp.has_value() || next > end)
       return false;
     idx = next;
     return true;
   }
   case WireType::I64: {
-    if (idx + 8 > sz)
+    if (end - idx < 8)
       return false;
     idx += 8;
     return true;
   }
   case WireType::LEN: {
     auto [lenOpt, afterLen] = decodeVarint(data, idx);
-    if (!lenOpt.has_value())
+    if (!lenOpt.has_value() || afterLen > end)
       return false;
-    int len = static_cast<int>(lenOpt.value());
-    if (afterLen + len > sz)
+    if (lenOpt.value() > end - afterLen)
       return false;
-    idx = afterLen + len;
+    idx = afterLen + lenOpt.value();
     return true;
   }
   case WireType::I32: {
-    if (idx + 4 > sz)
+    if (end - idx < 4)
       return false;
     idx += 4;
     return true;
@@ -55,31 +62,121 @@ static inline bool skipUnknown(const std::vector<uint8_t> &data, int &idx,
   }
 }
 
+// Encoding runs in two passes. The sizing pass records the payload size of
+// every length-delimited composite (nested message or packed run) in visit
+// order; the writing pass consumes them in the same order, so each nested
+// message is sized once and written straight into the output buffer.
+// The sizing pass tolerates malformed values (they size as 0); the writing
+// pass validates and stops at the first error, recording it in err.
+// encodeChain sets chain: the writing pass then still writes into the
+// chain's inlineBytes, but cuts the run there to reference each payload of
+// at least minReferenced bytes, which the sizing pass totals in referenced.
+struct EncodeCtx {
+  const EncodeOptions &opts;
+  std::vector<size_t> sizes;
+  size_t next = 0;
+  EncodeError err;
+  EncodedChain *chain = nullptr;
+  size_t minReferenced = SIZE_MAX;
+  size_t referenced = 0;
+  size_t runStart = 0; // start of the inline run not yet in chain->pieces
+};
+
+// Ends the current inline run and appends a reference to the payload, when
+// encoding a chain and the payload is large enough
+static bool referencePayload(EncodeCtx &ctx, const std::vector<uint8_t> &out,
+                             const void *data, size_t len) {
+  if (ctx.chain == nullptr || len < ctx.minReferenced)
+    return false;
+  auto &pieces = ctx.chain->pieces;
+  if (out.size() > ctx.runStart)
+    pieces.push_back({nullptr, ctx.runStart, out.size() - ctx.runStart});
+  pieces.push_back({static_cast<const uint8_t *>(data), out.size(), len});
+  ctx.runStart = out.size();
+  return true;
+}
+
+// Decoding works on [idx, end) windows of the caller's buffer, so nested
+// messages are parsed in place rather than copied out first. Every limit in
+// DecodeOptions is checked before the allocation it guards.
+struct DecodeCtx {
+  const std::vector<uint8_t> &data;
+  const DecodeOptions &opts;
+  size_t depth = 0;
+  size_t allocations = 0;
+  DecodeError err;
+  size_t unknownFields = 0; // for metrics
+  size_t deepest = 0;
+};
+
+// Records the innermost failure; outer frames keep the first code/offset
+static bool failAt(DecodeCtx &ctx, DecodeErrc code, size_t offset) {
+  if (ctx.err.code == DecodeErrc::None) {
+    ctx.err.code = code;
+    ctx.err.offset = offset;
+  }
+  return false;
+}
+
+static bool countAllocation(DecodeCtx &ctx, size_t offset) {
+  if (++ctx.allocations > ctx.opts.maxAllocations)
+    return failAt(ctx, DecodeErrc::TooManyAllocations, offset);
+  return true;
+}
+
+// Reads a LEN prefix and validates it against the enclosing window and
+// maxFieldSize. On success idx points at the payload.
+static bool readLength(DecodeCtx &ctx, size_t &idx, size_t end, size_t &len) {
+  auto [lenOpt, afterLen] = decodeVarint(ctx.data, idx);
+  if (!lenOpt.has_value() || afterLen > end)
+    return false;
+  if (lenOpt.value() > end - afterLen)
+    return failAt(ctx, DecodeErrc::Malformed, afterLen);
+  if (lenOpt.value() > ctx.opts.maxFieldSize)
+    return failAt(ctx, DecodeErrc::FieldTooLarge, afterLen);
+  len = static_cast<size_t>(lenOpt.value());
+  idx = afterLen;
+  return true;
+}
+
 struct Codec {
   WireType scalarWire; // wire type used for ONE scalar element
   bool packable;       // true for varint/fixed64 types, false for LEN types
-  bool (*encodeOne)(const FieldDesc &, const Value &, std::vector<uint8_t> &);
-  bool (*decodeOne)(const FieldDesc &, const std::vector<uint8_t> &, int &,
+  bool (*encodeOne)(const FieldDesc &, const Value &, EncodeCtx &,
+                    std::vector<uint8_t> &);
+  bool (*decodeOne)(const FieldDesc &, DecodeCtx &, size_t &idx, size_t end,
                     Value &);
+  size_t (*sizeOne)(const FieldDesc &, const Value &, EncodeCtx &);
 };
 
+static size_t messageSize(const Message &m, EncodeCtx &ctx);
+static bool writeMessage(const Message &m, EncodeCtx &ctx,
+                         std::vector<uint8_t> &out);
+static bool decodeFields(DecodeCtx &ctx, Message &msg, size_t index,
+                         size_t end);
+
 // Int (sint64 zigzag -> VARINT)
-static bool encInt(const FieldDesc &fd, const Value &v,
+static bool encInt(const FieldDesc &fd, const Value &v, EncodeCtx &,
                    std::vector<uint8_t> &out) {
   if (fd.type != FieldType::Int)
     return false;
   if (!std::holds_alternative<int64_t>(v))
     return false;
-  appendBytes(out, encodeSignedVarint(std::get<int64_t>(v)));
+  appendSignedVarint(out, std::get<int64_t>(v));
   return true;
 }
 
-static bool decInt(const FieldDesc &fd, const std::vector<uint8_t> &in,
-                   int &idx, Value &out) {
+static size_t sizeInt(const FieldDesc &, const Value &v, EncodeCtx &) {
+  const auto *x = std::get_if<int64_t>(&v);
+  return x ? signedVarintSize(*x) : 0;
+}
+
+static bool decInt(const FieldDesc &fd, DecodeCtx &ctx, size_t &idx,
+                   size_t end, Value &out) {
   if (fd.type != FieldType::Int)
     return false;
-  auto [opt, next] = decodeSignedVarint(in, idx);
-  if (!opt.has_value())
+  auto [opt, next] = decodeSignedVarint(ctx.data, idx);
+  if (!opt.has_value() || next > end)
     return false;
   out = opt.value();
   idx = next;
@@ -87,7 +184,7 @@ static bool decInt(const FieldDesc &fd, const std::vector<uint8_t> &in,
 }
 
 // Double (fixed64 -> I64)
-static bool encDouble(const FieldDesc &fd, const Value &v,
+static bool encDouble(const FieldDesc &fd, const Value &v, EncodeCtx &,
                       std::vector<uint8_t> &out) {
   if (fd.type != FieldType::Double)
     return false;
@@ -97,11 +194,17 @@ static bool encDouble(const FieldDesc &fd, const Value &v,
   return true;
 }
 
-static bool decDouble(const FieldDesc &fd, const std::vector<uint8_t> &in,
-                      int &idx, Value &out) {
+static size_t sizeDouble(const FieldDesc &, const Value &, EncodeCtx &) {
+  return 8;
+}
+
+static bool decDouble(const FieldDesc &fd, DecodeCtx &ctx, size_t &idx,
+                      size_t end, Value &out) {
   if (fd.type != FieldType::Double)
     return false;
-  auto opt = decodeDouble(in, idx);
+  if (end - idx < 8)
+    return false;
+  auto opt = decodeDouble(ctx.data, idx);
   if (!opt.has_value())
     return false;
   out = opt.value();
@@ -110,45 +213,68 @@ static bool decDouble(const FieldDesc &fd, const std::vector<uint8_t> &in,
 }
 
 // String (len-delimited -> LEN)
-static bool encString(const FieldDesc &fd, const Value &v,
+static bool encString(const FieldDesc &fd, const Value &v, EncodeCtx &ctx,
                       std::vector<uint8_t> &out) {
   if (fd.type != FieldType::String)
     return false;
   if (!std::holds_alternative<std::string>(v))
     return false;
-  appendBytes(out, encodeStr(std::get<std::string>(v)));
+  const std::string &str = std::get<std::string>(v);
+  appendVarint(out, str.size());
+  if (!referencePayload(ctx, out, str.data(), str.size()))
+    out.insert(out.end(), str.begin(), str.end());
   return true;
 }
 
-static bool decString(const FieldDesc &fd, const std::vector<uint8_t> &in,
-                      int &idx, Value &out) {
+static size_t sizeString(const FieldDesc &, const Value &v, EncodeCtx &ctx) {
+  const auto *x = std::get_if<std::string>(&v);
+  if (!x)
+    return 0;
+  if (x->size() >= ctx.minReferenced)
+    ctx.referenced += x->size();
+  return varintSize(x->size()) + x->size();
+}
+
+static bool decString(const FieldDesc &fd, DecodeCtx &ctx, size_t &idx,
+                      size_t end, Value &out) {
   if (fd.type != FieldType::String)
     return false;
-  auto [opt, next] = decodeStr(in, idx);
-  if (!opt.has_value())
+  size_t len;
+  if (!readLength(ctx, idx, end, len) || !countAllocation(ctx, idx))
     return false;
-  out = opt.value();
-  idx = next;
+  auto first = ctx.data.begin() + idx;
+  // Reuses the buffer of a string already there (see decodeInto); assign()
+  // from unsigned char iterators would build a temporary
+  if (auto *s = std::get_if<std::string>(&out))
+    s->assign(reinterpret_cast<const char *>(ctx.data.data() + idx), len);
+  else
+    out.emplace<std::string>(first, first + len);
+  idx += len;
   return true;
 }
 
 // UInt (uint64 -> VARINT)
-static bool encUInt(const FieldDesc &fd, const Value &v,
+static bool encUInt(const FieldDesc &fd, const Value &v, EncodeCtx &,
                     std::vector<uint8_t> &out) {
   if (fd.type != FieldType::UInt)
     return false;
   if (!std::holds_alternative<uint64_t>(v))
     return false;
-  appendBytes(out, encodeVarint(std::get<uint64_t>(v)));
+  appendVarint(out, std::get<uint64_t>(v));
   return true;
 }
 
-static bool decUInt(const FieldDesc &fd, const std::vector<uint8_t> &in,
-                    int &idx, Value &out) {
+static size_t sizeUInt(const FieldDesc &, const Value &v, EncodeCtx &) {
+  const auto *x = std::get_if<uint64_t>(&v);
+  return x ? varintSize(*x) : 0;
+}
+
+static bool decUInt(const FieldDesc &fd, DecodeCtx &ctx, size_t &idx,
+                    size_t end, Value &out) {
   if (fd.type != FieldType::UInt)
     return false;
-  auto [opt, next] = decodeVarint(in, idx);
-  if (!opt.has_value())
+  auto [opt, next] = decodeVarint(ctx.data, idx);
+  if (!opt.has_value() || next > end)
     return false;
   out = opt.value();
   idx = next;
@@ -156,67 +282,89 @@ static bool decUInt(const FieldDesc &fd, const std::vector<uint8_t> &in,
 }
 
 // Bool (bool -> VARINT with 0/1)
-static bool encBool(const FieldDesc &fd, const Value &v,
+static bool encBool(const FieldDesc &fd, const Value &v, EncodeCtx &,
                     std::vector<uint8_t> &out) {
   if (fd.type != FieldType::Bool)
     return false;
   if (!std::holds_alternative<bool>(v))
     return false;
-  uint64_t b = std::get<bool>(v) ? 1 : 0;
-  appendBytes(out, encodeVarint(b));
+  out.push_back(std::get<bool>(v) ? 1 : 0);
   return true;
 }
 
-static bool decBool(const FieldDesc &fd, const std::vector<uint8_t> &in,
-                    int &idx, Value &out) {
+static size_t sizeBool(const FieldDesc &, const Value &, EncodeCtx &) {
+  return 1;
+}
+
+static bool decBool(const FieldDesc &fd, DecodeCtx &ctx, size_t &idx,
+                    size_t end, Value &out) {
   if (fd.type != FieldType::Bool)
     return false;
-  auto [opt, next] = decodeVarint(in, idx);
-  if (!opt.has_value())
+  auto [opt, next] = decodeVarint(ctx.data, idx);
+  if (!opt.has_value() || next > end)
     return false;
   uint64_t raw = opt.value();
   if (raw != 0 && raw != 1)
-    return false;
+    return failAt(ctx, DecodeErrc::InvalidValue, idx);
   out = (raw == 1);
   idx = next;
   return true;
 }
 
-static bool encMessage(const FieldDesc &fd, const Value &v,
+// Message (len-delimited -> LEN)
+static bool encMessage(const FieldDesc &fd, const Value &v, EncodeCtx &ctx,
                        std::vector<uint8_t> &out) {
   if (fd.type != FieldType::Message)
     return false;
   if (!std::holds_alternative<Message>(v))
     return false;
-  const Message &m = std::get<Message>(v);
-  std::vector<uint8_t> encoded = encodeMessage(m);
-  appendBytes(out, encodeVarint(encoded.size()));
-  appendBytes(out, encoded);
-  return true;
+  size_t len = ctx.sizes[ctx.next++];
+  appendVarint(out, len);
+  return writeMessage(std::get<Message>(v), ctx, out);
 }
 
-static bool decMessage(const FieldDesc &fd, const std::vector<uint8_t> &in,
-                       int &idx, Value &out) {
+static size_t sizeMessage(const FieldDesc &, const Value &v, EncodeCtx &ctx) {
+  const auto *x = std::get_if<Message>(&v);
+  if (!x)
+    return 0;
+  size_t slot = ctx.sizes.size();
+  ctx.sizes.push_back(0);
+  size_t len = messageSize(*x, ctx);
+  ctx.sizes[slot] = len;
+  return varintSize(len) + len;
+}
+
+static bool decMessage(const FieldDesc &fd, DecodeCtx &ctx, size_t &idx,
+                       size_t end, Value &out) {
   if (fd.type != FieldType::Message)
     return false;
-  auto [lenOpt, afterLen] = decodeVarint(in, idx);
-  if (!lenOpt.has_value())
+  size_t len;
+  if (!readLength(ctx, idx, end, len))
     return false;
-  int len = static_cast<int>(lenOpt.value());
-  idx = afterLen;
-  if (idx + len > static_cast<int>(in.size()))
+  if (ctx.depth >= ctx.opts.maxDepth)
+    return failAt(ctx, DecodeErrc::DepthExceeded, idx);
+  if (!countAllocation(ctx, idx))
     return false;
-  std::vector<uint8_t> msgBytes(in.begin() + idx, in.begin() + idx + len);
-  auto [msgOpt, next] = decodeMessage(msgBytes, fd.nestedDesc);
-  if (!msgOpt.has_value())
+
+  // Decode straight into the destination slot; nothing is moved afterwards.
+  // A message of the same type already there (kept by clear(), or an
+  // earlier occurrence that this one replaces) is emptied and reused.
+  Message *nested = std::get_if<Message>(&out);
+  if (nested != nullptr && nested->desc == fd.nestedDesc)
+    nested->clear();
+  else
+    nested = &out.emplace<Message>(fd.nestedDesc);
+  ctx.deepest = std::max(ctx.deepest, ++ctx.depth);
+  bool ok = decodeFields(ctx, *nested, idx, idx + len);
+  --ctx.depth;
+  if (!ok)
     return false;
-  out = msgOpt.value();
   idx += len;
   return true;
 }
 
 // Float (fixed32 -> I32)
-static bool encFloat(const FieldDesc &fd, const Value &v,
+static bool encFloat(const FieldDesc &fd, const Value &v, EncodeCtx &,
                      std::vector<uint8_t> &out) {
   if (fd.type != FieldType::Float)
     return false;
@@ -226,11 +374,17 @@ static bool encFloat(const FieldDesc &fd, const Value &v,
   return true;
 }
 
-static bool decFloat(const FieldDesc &fd, const std::vector<uint8_t> &in,
-                     int &idx, Value &out) {
+static size_t sizeFloat(const FieldDesc &, const Value &, EncodeCtx &) {
+  return 4;
+}
+
+static bool decFloat(const FieldDesc &fd, DecodeCtx &ctx, size_t &idx,
+                     size_t end, Value &out) {
   if (fd.type != FieldType::Float)
     return false;
-  auto opt = decodeFloat(in, idx);
+  if (end - idx < 4)
+    return false;
+  auto opt = decodeFloat(ctx.data, idx);
   if (!opt.has_value())
     return false;
   out = opt.value();
@@ -239,242 +393,984 @@ static bool decFloat(const FieldDesc &fd, const std::vector<uint8_t> &in,
 }
 
 // Bytes (len-delimited -> LEN)
-static bool encBytes(const FieldDesc &fd, const Value &v,
+static bool encBytes(const FieldDesc &fd, const Value &v, EncodeCtx &ctx,
                      std::vector<uint8_t> &out) {
   if (fd.type != FieldType::Bytes)
     return false;
   if (!std::holds_alternative<std::vector<uint8_t>>(v))
     return false;
-  appendBytes(out, encodeBytes(std::get<std::vector<uint8_t>>(v)));
+  const auto &bytes = std::get<std::vector<uint8_t>>(v);
+  appendVarint(out, bytes.size());
+  if (!referencePayload(ctx, out, bytes.data(), bytes.size()))
+    appendBytes(out, bytes);
   return true;
 }
 
-static bool decBytes(const FieldDesc &fd, const std::vector<uint8_t> &in,
-                     int &idx, Value &out) {
+static size_t sizeBytes(const FieldDesc &, const Value &v, EncodeCtx &ctx) {
+  const auto *x = std::get_if<std::vector<uint8_t>>(&v);
+  if (!x)
+    return 0;
+  if (x->size() >= ctx.minReferenced)
+    ctx.referenced += x->size();
+  return varintSize(x->size()) + x->size();
+}
+
+static bool decBytes(const FieldDesc &fd, DecodeCtx &ctx, size_t &idx,
+                     size_t end, Value &out) {
   if (fd.type != FieldType::Bytes)
     return false;
-  auto [opt, next] = decodeBytes(in, idx);
-  if (!opt.has_value())
+  size_t len;
+  if (!readLength(ctx, idx, end, len) || !countAllocation(ctx, idx))
     return false;
-  out = opt.value();
+  auto first = ctx.data.begin() + idx;
+  if (auto *b = std::get_if<std::vector<uint8_t>>(&out))
+    b->assign(first, first + len);
+  else
+    out.emplace<std::vector<uint8_t>>(first, first + len);
+  idx += len;
+  return true;
+}
+
+// Enum (int32 -> VARINT; negative numbers sign-extend to ten bytes)
+static bool encEnum(const FieldDesc &fd, const Value &v, EncodeCtx &,
+                    std::vector<uint8_t> &out) {
+  if (fd.type != FieldType::Enum)
+    return false;
+  if (!std::holds_alternative<int32_t>(v))
+    return false;
+  appendVarint(out, static_cast<uint64_t>(int64_t(std::get<int32_t>(v))));
+  return true;
+}
+
+static size_t sizeEnum(const FieldDesc &, const Value &v, EncodeCtx &) {
+  const auto *x = std::get_if<int32_t>(&v);
+  return x ? varintSize(static_cast<uint64_t>(int64_t(*x))) : 0;
+}
+
+static bool decEnum(const FieldDesc &fd, DecodeCtx &ctx, size_t &idx,
+                    size_t end, Value &out) {
+  if (fd.type != FieldType::Enum)
+    return false;
+  auto [opt, next] = decodeVarint32(ctx.data, idx);
+  if (!opt.has_value() || next > end)
+    return false;
+  auto number = static_cast<int32_t>(opt.value());
+  if (ctx.opts.closedEnums && fd.enumDesc && !fd.enumDesc->isKnown(number))
+    return failAt(ctx, DecodeErrc::InvalidValue, idx);
+  out = number;
   idx = next;
   return true;
 }
 
-static const Codec &codecFor(FieldType t) {
-  static const Codec INT{VARINT, true, encInt, decInt};
-  static const Codec DBL{I64, true, encDouble, decDouble};
-  static const Codec STR{LEN, false, encString, decString};
-  static const Codec UINT{VARINT, true, encUInt, decUInt};
-  static const Codec BOOL{VARINT, true, encBool, decBool};
-  static const Codec MSG{LEN, false, encMessage, decMessage};
-  static const Codec FLT{I32, true, encFloat, decFloat};
-  static const Codec BYTES{LEN, false, encBytes, decBytes};
+// Remaining integer kinds. Each traits type fixes the Value alternative, the
+// wire type and a width-specialized read/write/size; 32-bit varints go
+// through the five-byte decodeVarint32/appendVarint32 loops.
+static bool readVarint32(const std::vector<uint8_t> &data, size_t &idx,
+                         size_t end, uint32_t &raw) {
+  auto [opt, next] = decodeVarint32(data, idx);
+  if (!opt.has_value() || next > end)
+    return false;
+  raw = opt.value();
+  idx = next;
+  return true;
+}
+
+static bool readVarint64(const std::vector<uint8_t> &data, size_t &idx,
+                         size_t end, uint64_t &raw) {
+  auto [opt, next] = decodeVarint(data, idx);
+  if (!opt.has_value() || next > end)
+    return false;
+  raw = opt.value();
+  idx = next;
+  return true;
+}
+
+static bool readFixed32(const std::vector<uint8_t> &data, size_t &idx,
+                        size_t end, uint32_t &raw) {
+  if (end - idx < 4)
+    return false;
+  raw = decodeFixed32(data, idx).value();
+  idx += 4;
+  return true;
+}
+
+static bool readFixed64(const std::vector<uint8_t> &data, size_t &idx,
+                        size_t end, uint64_t &raw) {
+  if (end - idx < 8)
+    return false;
+  raw = decodeFixed64(data, idx).value();
+  idx += 8;
+  return true;
+}
+
+struct Int32Kind {
+  using T = int32_t;
+  static constexpr FieldType type = FieldType::Int32;
+  static constexpr WireType wire = VARINT;
+  static void write(std::vector<uint8_t> &out, T x) {
+    appendVarint(out, static_cast<uint64_t>(int64_t(x))); // sign-extended
+  }
+  static size_t size(T x) {
+    return varintSize(static_cast<uint64_t>(int64_t(x)));
+  }
+  static bool read(const std::vector<uint8_t> &d, size_t &idx, size_t end,
+                   T &x) {
+    uint32_t raw;
+    if (!readVarint32(d, idx, end, raw))
+      return false;
+    x = static_cast<int32_t>(raw);
+    return true;
+  }
+};
+
+struct Int64Kind {
+  using T = int64_t;
+  static constexpr FieldType type = FieldType::Int64;
+  static constexpr WireType wire = VARINT;
+  static void write(std::vector<uint8_t> &out, T x) {
+    appendVarint(out, static_cast<uint64_t>(x));
+  }
+  static size_t size(T x) { return varintSize(static_cast<uint64_t>(x)); }
+  static bool read(const std::vector<uint8_t> &d, size_t &idx, size_t end,
+                   T &x) {
+    uint64_t raw;
+    if (!readVarint64(d, idx, end, raw))
+      return false;
+    x = static_cast<int64_t>(raw);
+    return true;
+  }
+};
+
+struct UInt32Kind {
+  using T = uint32_t;
+  static constexpr FieldType type = FieldType::UInt32;
+  static constexpr WireType wire = VARINT;
+  static void write(std::vector<uint8_t> &out, T x) { appendVarint32(out, x); }
+  static size_t size(T x) { return varintSize(x); }
+  static bool read(const std::vector<uint8_t> &d, size_t &idx, size_t end,
+                   T &x) {
+    return readVarint32(d, idx, end, x);
+  }
+};
+
+struct SInt32Kind {
+  using T = int32_t;
+  static constexpr FieldType type = FieldType::SInt32;
+  static constexpr WireType wire = VARINT;
+  static void write(std::vector<uint8_t> &out, T x) {
+    appendVarint32(out, zigzag32(x));
+  }
+  static size_t size(T x) { return varintSize(zigzag32(x)); }
+  static bool read(const std::vector<uint8_t> &d, size_t &idx, size_t end,
+                   T &x) {
+    uint32_t raw;
+    if (!readVarint32(d, idx, end, raw))
+      return false;
+    x = unzigzag32(raw);
+    return true;
+  }
+};
+
+template <FieldType Type, typename Int> struct Fixed32Kind {
+  using T = Int;
+  static constexpr FieldType type = Type;
+  static constexpr WireType wire = I32;
+  static void write(std::vector<uint8_t> &out, T x) {
+    appendFixed32(out, static_cast<uint32_t>(x));
+  }
+  static size_t size(T) { return 4; }
+  static bool read(const std::vector<uint8_t> &d, size_t &idx, size_t end,
+                   T &x) {
+    uint32_t raw;
+    if (!readFixed32(d, idx, end, raw))
+      return false;
+    x = static_cast<T>(raw);
+    return true;
+  }
+};
+
+template <FieldType Type, typename Int> struct Fixed64Kind {
+  using T = Int;
+  static constexpr FieldType type = Type;
+  static constexpr WireType wire = I64;
+  static void write(std::vector<uint8_t> &out, T x) {
+    appendFixed64(out, static_cast<uint64_t>(x));
+  }
+  static size_t size(T) { return 8; }
+  static bool read(const std::vector<uint8_t> &d, size_t &idx, size_t end,
+                   T &x) {
+    uint64_t raw;
+    if (!readFixed64(d, idx, end, raw))
+      return false;
+    x = static_cast<T>(raw);
+    return true;
+  }
+};
+
+template <typename K>
+static bool encKind(const FieldDesc &fd, const Value &v, EncodeCtx &,
+                    std::vector<uint8_t> &out) {
+  if (fd.type != K::type)
+    return false;
+  const auto *x = std::get_if<typename K::T>(&v);
+  if (x == nullptr)
+    return false;
+  K::write(out, *x);
+  return true;
+}
+
+template <typename K>
+static size_t sizeKind(const FieldDesc &, const Value &v, EncodeCtx &) {
+  const auto *x = std::get_if<typename K::T>(&v);
+  return x ? K::size(*x) : 0;
+}
+
+template <typename K>
+static bool decKind(const FieldDesc &fd, DecodeCtx &ctx, size_t &idx,
+                    size_t end, Value &out) {
+  if (fd.type != K::type)
+    return false;
+  typename K::T x;
+  if (!K::read(ctx.data, idx, end, x))
+    return false;
+  out = x;
+  return true;
+}
+
+template <typename K> static constexpr Codec kindCodec() {
+  return Codec{K::wire, true, encKind<K>, decKind<K>, sizeKind<K>};
+}
+
+// Codec for a field type, or nullptr for an unknown FieldType
+static const Codec *codecFor(FieldType t) {
+  static const Codec INT{VARINT, true, encInt, decInt, sizeInt};
+  static const Codec DBL{I64, true, encDouble, decDouble, sizeDouble};
+  static const Codec STR{LEN, false, encString, decString, sizeString};
+  static const Codec UINT{VARINT, true, encUInt, decUInt, sizeUInt};
+  static const Codec BOOL{VARINT, true, encBool, decBool, sizeBool};
+  static const Codec MSG{LEN, false, encMessage, decMessage, sizeMessage};
+  static const Codec FLT{I32, true, encFloat, decFloat, sizeFloat};
+  static const Codec BYTES{LEN, false, encBytes, decBytes, sizeBytes};
+  static const Codec ENUM{VARINT, true, encEnum, decEnum, sizeEnum};
+  static const Codec INT32 = kindCodec<Int32Kind>();
+  static const Codec INT64 = kindCodec<Int64Kind>();
+  static const Codec UINT32 = kindCodec<UInt32Kind>();
+  static const Codec SINT32 = kindCodec<SInt32Kind>();
+  static const Codec FIXED32 =
+      kindCodec<Fixed32Kind<FieldType::Fixed32, uint32_t>>();
+  static const Codec FIXED64 =
+      kindCodec<Fixed64Kind<FieldType::Fixed64, uint64_t>>();
+  static const Codec SFIXED32 =
+      kindCodec<Fixed32Kind<FieldType::SFixed32, int32_t>>();
+  static const Codec SFIXED64 =
+      kindCodec<Fixed64Kind<FieldType::SFixed64, int64_t>>();
 
   switch (t) {
   case FieldType::Int:
-    return INT;
+    return &INT;
   case FieldType::Double:
-    return DBL;
+    return &DBL;
   case FieldType::String:
-    return STR;
+    return &STR;
   case FieldType::UInt:
-    return UINT;
+    return &UINT;
   case FieldType::Bool:
-    return BOOL;
+    return &BOOL;
   case FieldType::Message:
-    return MSG;
+    return &MSG;
   case FieldType::Float:
-    return FLT;
+    return &FLT;
   case FieldType::Bytes:
-    return BYTES;
+    return &BYTES;
+  case FieldType::Enum:
+    return &ENUM;
+  case FieldType::Int32:
+    return &INT32;
+  case FieldType::Int64:
+    return &INT64;
+  case FieldType::UInt32:
+    return &UINT32;
+  case FieldType::SInt32:
+    return &SINT32;
+  case FieldType::Fixed32:
+    return &FIXED32;
+  case FieldType::Fixed64:
+    return &FIXED64;
+  case FieldType::SFixed32:
+    return &SFIXED32;
+  case FieldType::SFixed64:
+    return &SFIXED64;
   default:
-    std::abort();
+    return nullptr;
   }
 }
 
-std::vector<uint8_t> encodeMessage(const Message &m) {
-  std::vector<uint8_t> enc;
+// Index of the i-th field in emission order
+static inline size_t fieldAt(const Message &m, const EncodeOptions &opts,
+                             size_t i) {
+  return opts.canonical ? m.desc->indicesByNumber()[i] : i;
+}
+
+static bool fail(EncodeCtx &ctx, EncodeErrc code, const FieldDesc &field,
+                 size_t offset) {
+  ctx.err.code = code;
+  ctx.err.fieldPath = field.name;
+  ctx.err.offset = offset;
+  return false;
+}
+
+// Called while unwinding out of a failed element: prefixes the path with the
+// enclosing field (and element index for repeated fields).
+static bool failElement(EncodeCtx &ctx, EncodeErrc leafCode,
+                        const FieldDesc &field, size_t elem, size_t offset) {
+  std::string here = field.name;
+  if (field.isRepeated || field.type == FieldType::Map)
+    here += "[" + std::to_string(elem) + "]";
+
+  if (ctx.err.code == EncodeErrc::None) {
+    ctx.err.code = leafCode;
+    ctx.err.fieldPath = std::move(here);
+    ctx.err.offset = offset;
+  } else {
+    ctx.err.fieldPath = here + "." + ctx.err.fieldPath;
+  }
+  return false;
+}
+
+static bool keyLess(const Value &a, const Value &b) {
+  if (const auto *s = std::get_if<std::string>(&a))
+    return *s < std::get<std::string>(b);
+  if (const auto *i = std::get_if<int64_t>(&a))
+    return *i < std::get<int64_t>(b);
+  if (const auto *u = std::get_if<uint64_t>(&a))
+    return *u < std::get<uint64_t>(b);
+  if (const auto *i = std::get_if<int32_t>(&a))
+    return *i < std::get<int32_t>(b);
+  if (const auto *u = std::get_if<uint32_t>(&a))
+    return *u < std::get<uint32_t>(b);
+  return std::get<bool>(a) < std::get<bool>(b);
+}
+
+// Visits map entry indices in emission order: insertion order, or by key
+// when the output must be deterministic. Both encode passes see the same
+// order. Stops at the first visit returning false.
+template <typename Visit>
+static bool forEachEntry(const MapVal &mv, const EncodeOptions &opts,
+                         Visit &&visit) {
+  if (!opts.canonical && !opts.deterministic) {
+    for (size_t i = 0; i < mv.size(); ++i)
+      if (!visit(i))
+        return false;
+    return true;
+  }
+  std::vector<size_t> order(mv.size());
+  for (size_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+  std::sort(order.begin(), order.end(), [&mv](size_t a, size_t b) {
+    return keyLess(mv.keyAt(a), mv.keyAt(b));
+  });
+  for (size_t i : order)
+    if (!visit(i))
+      return false;
+  return true;
+}
+
+// Map fields go on the wire as repeated entry messages {key = 1, value = 2}
+static size_t mapFieldSize(const FieldDesc &field, const Value &v,
+                           EncodeCtx &ctx) {
+  const auto *mv = std::get_if<MapVal>(&v);
+  const FieldDesc &kf = field.mapKey();
+  const FieldDesc &vf = field.mapValue();
+  const Codec *kc = codecFor(kf.type);
+  const Codec *vc = codecFor(vf.type);
+  if (mv == nullptr || kc == nullptr || vc == nullptr)
+    return 0;
+
+  size_t total = 0;
+  forEachEntry(*mv, ctx.opts, [&](size_t i) {
+    size_t slot = ctx.sizes.size();
+    ctx.sizes.push_back(0);
+    size_t len = tagSize(1, kc->scalarWire) +
+                 kc->sizeOne(kf, mv->keyAt(i), ctx) +
+                 tagSize(2, vc->scalarWire) +
+                 vc->sizeOne(vf, mv->valueAt(i), ctx);
+    ctx.sizes[slot] = len;
+    total += tagSize(field.number, LEN) + varintSize(len) + len;
+    return true;
+  });
+  return total;
+}
+
+static bool writeMapField(const FieldDesc &field, const Value &v,
+                          EncodeCtx &ctx, std::vector<uint8_t> &enc) {
+  const auto *mv = std::get_if<MapVal>(&v);
+  if (mv == nullptr)
+    return fail(ctx, EncodeErrc::TypeMismatch, field, enc.size());
+  const FieldDesc &kf = field.mapKey();
+  const FieldDesc &vf = field.mapValue();
+  const Codec *kc = codecFor(kf.type);
+  const Codec *vc = codecFor(vf.type);
+  if (kc == nullptr || vc == nullptr)
+    return fail(ctx, EncodeErrc::UnknownFieldType, field, enc.size());
+
+  size_t n = 0;
+  return forEachEntry(*mv, ctx.opts, [&](size_t i) {
+    size_t start = enc.size();
+    appendTag(enc, field.number, LEN);
+    appendVarint(enc, ctx.sizes[ctx.next++]);
+    appendTag(enc, 1, kc->scalarWire);
+    if (!kc->encodeOne(kf, mv->keyAt(i), ctx, enc))
+      return failElement(ctx, EncodeErrc::TypeMismatch, field, n, start);
+    appendTag(enc, 2, vc->scalarWire);
+    if (!vc->encodeOne(vf, mv->valueAt(i), ctx, enc))
+      return failElement(ctx, EncodeErrc::TypeMismatch, field, n, start);
+    ++n;
+    return true;
+  });
+}
+
+static size_t fieldSize(const FieldDesc &field, const Value &v,
+                        EncodeCtx &ctx) {
+  if (field.type == FieldType::Map)
+    return mapFieldSize(field, v, ctx);
+  const Codec *c = codecFor(field.type);
+  if (c == nullptr)
+    return 0;
+
+  if (!field.isRepeated)
+    return tagSize(field.number, c->scalarWire) + c->sizeOne(field, v, ctx);
+
+  const auto *rv = std::get_if<RepeatedVal>(&v);
+  if (rv == nullptr || (ctx.opts.canonical && rv->values.empty()))
+    return 0;
+
+  if (field.isPacked) {
+    size_t slot = ctx.sizes.size();
+    ctx.sizes.push_back(0);
+    size_t payload = 0;
+    for (const auto &elem : rv->values)
+      payload += c->sizeOne(field, elem, ctx);
+    ctx.sizes[slot] = payload;
+    return tagSize(field.number, LEN) + varintSize(payload) + payload;
+  }
+
+  size_t total = tagSize(field.number, c->scalarWire) * rv->values.size();
+  for (const auto &elem : rv->values)
+    total += c->sizeOne(field, elem, ctx);
+  return total;
+}
+
+static size_t messageSize(const Message &m, EncodeCtx &ctx) {
+  size_t total = 0;
+  for (size_t i = 0; i < m.desc->fields.size(); ++i) {
+    size_t fieldIdx = fieldAt(m, ctx.opts, i);
+    if (m.has(fieldIdx)) {
+      ValueRef v = m.valueAt(fieldIdx);
+      total += fieldSize(m.desc->fields[fieldIdx], v, ctx);
+    }
+  }
+  return total;
+}
 
-  for (const auto &field : m.desc->fields) {
-    auto maybeValue = m.get(field.name);
-    if (!maybeValue)
+static bool writeField(const FieldDesc &field, const Value &v, EncodeCtx &ctx,
+                       std::vector<uint8_t> &enc) {
+  detail::AllocFrame frame(AllocStage::Encode, &field);
+  if (field.type == FieldType::Map)
+    return writeMapField(field, v, ctx, enc);
+  const Codec *c = codecFor(field.type);
+  if (c == nullptr)
+    return fail(ctx, EncodeErrc::UnknownFieldType, field, enc.size());
+
+  if (!field.isRepeated) {
+    size_t start = enc.size();
+    appendTag(enc, field.number, c->scalarWire);
+    if (!c->encodeOne(field, v, ctx, enc))
+      return failElement(ctx, EncodeErrc::TypeMismatch, field, 0, start);
+    return true;
+  }
+
+  if (!std::holds_alternative<RepeatedVal>(v))
+    return fail(ctx, EncodeErrc::NotRepeated, field, enc.size());
+  const RepeatedVal &rv = std::get<RepeatedVal>(v);
+  if (rv.elemType != field.type)
+    return fail(ctx, EncodeErrc::TypeMismatch, field, enc.size());
+  if (ctx.opts.canonical && rv.values.empty())
+    return true;
+
+  if (field.isPacked) {
+    if (!c->packable)
+      return fail(ctx, EncodeErrc::NotPackable, field, enc.size());
+
+    appendTag(enc, field.number, LEN);
+    appendVarint(enc, ctx.sizes[ctx.next++]);
+    for (size_t i = 0; i < rv.values.size(); ++i) {
+      size_t start = enc.size();
+      if (!c->encodeOne(field, rv.values[i], ctx, enc))
+        return failElement(ctx, EncodeErrc::TypeMismatch, field, i, start);
+    }
+  } else {
+    for (size_t i = 0; i < rv.values.size(); ++i) {
+      size_t start = enc.size();
+      appendTag(enc, field.number, c->scalarWire);
+      if (!c->encodeOne(field, rv.values[i], ctx, enc))
+        return failElement(ctx, EncodeErrc::TypeMismatch, field, i, start);
+    }
+  }
+  return true;
+}
+
+static bool writeMessage(const Message &m, EncodeCtx &ctx,
+                         std::vector<uint8_t> &out) {
+  for (size_t i = 0; i < m.desc->fields.size(); ++i) {
+    size_t fieldIdx = fieldAt(m, ctx.opts, i);
+    if (!m.has(fieldIdx))
       continue;
+    ValueRef v = m.valueAt(fieldIdx);
+    if (!writeField(m.desc->fields[fieldIdx], v, ctx, out))
+      return false;
+  }
+  return true;
+}
 
-    const Codec &c = codecFor(field.type);
+std::pair<std::optional<std::vector<uint8_t>>, EncodeError>
+encodeMessage(const Message &m, const EncodeOptions &opts) {
+  uint64_t start = detail::metricsStart();
+  detail::AllocFrame frame(AllocStage::Encode, nullptr);
+  EncodeCtx ctx{opts, {}, 0, {}};
+  size_t total = messageSize(m, ctx);
+
+  std::vector<uint8_t> enc;
+  enc.reserve(total);
+  bool ok = writeMessage(m, ctx, enc);
+  if (start != 0)
+    detail::recordEncode(m.desc.get(), enc.size(), ok, start);
+  if (!ok) {
+    PB_LOG("Encode failed at " << ctx.err.fieldPath);
+    return {std::nullopt, std::move(ctx.err)};
+  }
+  return {std::move(enc), EncodeError{}};
+}
+
+std::pair<std::optional<EncodedChain>, EncodeError>
+encodeChain(const Message &m, const EncodeOptions &opts,
+            size_t minReferenced) {
+  uint64_t start = detail::metricsStart();
+  detail::AllocFrame frame(AllocStage::Encode, nullptr);
+  EncodedChain chain;
+  EncodeCtx ctx{opts, {}, 0, {}};
+  ctx.chain = &chain;
+  ctx.minReferenced = std::max<size_t>(minReferenced, 1);
+  size_t total = messageSize(m, ctx);
+
+  std::vector<uint8_t> &enc = chain.inlineBytes;
+  enc.reserve(total - ctx.referenced);
+  bool ok = writeMessage(m, ctx, enc);
+  if (start != 0)
+    detail::recordEncode(m.desc.get(), total, ok, start);
+  if (!ok) {
+    // Report the offset in the flat output: add the payloads referenced
+    // before the failing field started
+    size_t shift = 0;
+    for (const EncodedChain::Piece &p : chain.pieces)
+      if (p.external != nullptr && p.offset <= ctx.err.offset)
+        shift += p.len;
+    ctx.err.offset += shift;
+    return {std::nullopt, std::move(ctx.err)};
+  }
+  if (enc.size() > ctx.runStart)
+    chain.pieces.push_back({nullptr, ctx.runStart, enc.size() - ctx.runStart});
+  return {std::move(chain), EncodeError{}};
+}
+
+size_t EncodedChain::size() const {
+  size_t total = 0;
+  for (const Piece &p : pieces)
+    total += p.len;
+  return total;
+}
+
+std::vector<OutputSegment> EncodedChain::segments() const {
+  std::vector<OutputSegment> out;
+  out.reserve(pieces.size());
+  for (const Piece &p : pieces)
+    out.push_back({p.external ? p.external : inlineBytes.data() + p.offset,
+                   p.len});
+  return out;
+}
+
+std::vector<uint8_t> EncodedChain::flatten() const {
+  std::vector<uint8_t> out;
+  out.reserve(size());
+  for (const OutputSegment &seg : segments()) {
+    const auto *first = static_cast<const uint8_t *>(seg.base);
+    out.insert(out.end(), first, first + seg.len);
+  }
+  return out;
+}
+
+size_t byteSize(const Message &m, const EncodeOptions &opts) {
+  EncodeCtx ctx{opts, {}, 0, {}};
+  return messageSize(m, ctx);
+}
 
-    if (!field.isRepeated) {
-      appendTag(enc, field.number, c.scalarWire);
-      if (!c.encodeOne(field, maybeValue->get(), enc))
-        std::abort();
+std::vector<FieldByteSize> byteSizeByField(const Message &m,
+                                           const EncodeOptions &opts) {
+  EncodeCtx ctx{opts, {}, 0, {}};
+  std::vector<FieldByteSize> out;
+  for (size_t i = 0; i < m.desc->fields.size(); ++i) {
+    size_t fieldIdx = fieldAt(m, opts, i);
+    if (!m.has(fieldIdx))
       continue;
-    }
+    const FieldDesc &field = m.desc->fields[fieldIdx];
+    ValueRef v = m.valueAt(fieldIdx);
+    size_t bytes = fieldSize(field, v, ctx);
+    if (bytes != 0)
+      out.push_back({fieldIdx, field.number, bytes});
+  }
+  return out;
+}
 
-    const Value &v = maybeValue->get();
-    if (!std::holds_alternative<RepeatedVal>(v))
-      std::abort();
-    const RepeatedVal &rv = std::get<RepeatedVal>(v);
+// Unwinding out of a failed field: prefixes the path with that field (and the
+// element index for repeated fields).
+static bool failField(DecodeCtx &ctx, DecodeErrc leafCode, size_t offset,
+                      const FieldDesc &fd, size_t elem) {
+  failAt(ctx, leafCode, offset);
+  std::string here = fd.name;
+  if (fd.isRepeated || fd.type == FieldType::Map)
+    here += "[" + std::to_string(elem) + "]";
+  if (ctx.err.fieldPath.empty())
+    ctx.err.fieldPath = std::move(here);
+  else
+    ctx.err.fieldPath = here + "." + ctx.err.fieldPath;
+  return false;
+}
 
-    if (rv.elemType != field.type)
-      std::abort();
+// Elements in a packed payload, so the run is reserved once: every varint
+// ends at exactly one byte without the continuation bit
+static size_t packedCount(const std::vector<uint8_t> &data, size_t idx,
+                          size_t end, WireType wire) {
+  switch (wire) {
+  case WireType::VARINT: {
+    size_t count = 0;
+    for (; idx < end; ++idx)
+      count += data[idx] < 0x80;
+    return count;
+  }
+  case WireType::I64:
+    return (end - idx) / 8;
+  case WireType::I32:
+    return (end - idx) / 4;
+  default:
+    return 0;
+  }
+}
 
-    if (field.isPacked) {
-      if (!c.packable) {
-        std::abort();
-      }
+static RepeatedVal &repeatedSlot(Message &msg, size_t fieldIdx,
+                                 const FieldDesc &fd) {
+  bool fresh = !msg.has(fieldIdx);
+  Value &slot = msg.boxedAt(fieldIdx);
+  // An unset field may still hold the empty storage clear() kept
+  if (fresh && !std::holds_alternative<RepeatedVal>(slot))
+    slot.emplace<RepeatedVal>(RepeatedVal{fd.type, {}});
+  return std::get<RepeatedVal>(slot);
+}
+
+// Value a map entry takes for a missing key or value
+static Value defaultValue(const FieldDesc &fd) {
+  switch (fd.type) {
+  case FieldType::Int:
+    return int64_t(0);
+  case FieldType::Double:
+    return 0.0;
+  case FieldType::String:
+    return std::string();
+  case FieldType::UInt:
+    return uint64_t(0);
+  case FieldType::Bool:
+    return false;
+  case FieldType::Message:
+    return Message(fd.nestedDesc);
+  case FieldType::Float:
+    return 0.0f;
+  case FieldType::Bytes:
+    return std::vector<uint8_t>();
+  case FieldType::Enum:
+  case FieldType::Int32:
+  case FieldType::SInt32:
+  case FieldType::SFixed32:
+    return int32_t(0);
+  case FieldType::Int64:
+  case FieldType::SFixed64:
+    return int64_t(0);
+  case FieldType::UInt32:
+  case FieldType::Fixed32:
+    return uint32_t(0);
+  case FieldType::Fixed64:
+    return uint64_t(0);
+  default:
+    return Value{};
+  }
+}
 
-      appendTag(enc, field.number, LEN);
+// One map entry. The key is decoded first (wherever it appears in the entry),
+// then the value is decoded straight into the table slot for that key. A
+// repeated key keeps the last value, as protobuf requires.
+static bool decodeMapEntry(DecodeCtx &ctx, Message &msg, size_t fieldIdx,
+                           uint32_t wireRaw, size_t &index, size_t end) {
+  const FieldDesc &fd = msg.desc->fields[fieldIdx];
+  const FieldDesc &kf = fd.mapKey();
+  const FieldDesc &vf = fd.mapValue();
+  const Codec *kc = codecFor(kf.type);
+  const Codec *vc = codecFor(vf.type);
+  if (kc == nullptr || vc == nullptr)
+    return failField(ctx, DecodeErrc::UnknownFieldType, index, fd, 0);
 
-      std::vector<uint8_t> payload;
-      for (const auto &elem : rv.values) {
-        if (!c.encodeOne(field, elem, payload))
-          std::abort();
-      }
+  bool fresh = !msg.has(fieldIdx);
+  Value &slot = msg.boxedAt(fieldIdx);
+  if (fresh) {
+    if (!std::holds_alternative<MapVal>(slot)) // else emptied by clear()
+      slot.emplace<MapVal>(kf.type, vf.type);
+    if (!countAllocation(ctx, index))
+      return failField(ctx, DecodeErrc::TooManyAllocations, index, fd, 0);
+  }
+  MapVal &map = std::get<MapVal>(slot);
+  size_t elem = map.size();
 
-      appendBytes(enc, encodeVarint(payload.size()));
-      appendBytes(enc, payload);
-    } else {
-      for (const auto &elem : rv.values) {
-        appendTag(enc, field.number, c.scalarWire);
-        if (!c.encodeOne(field, elem, enc))
-          std::abort();
-      }
+  if (wireRaw != static_cast<uint32_t>(WireType::LEN))
+    return failField(ctx, DecodeErrc::WireTypeMismatch, index, fd, elem);
+  size_t lengthStart = index;
+  size_t len;
+  if (!readLength(ctx, index, end, len))
+    return failField(ctx, DecodeErrc::Malformed, lengthStart, fd, elem);
+  size_t entryEnd = index + len;
+
+  Value key = defaultValue(kf);
+  size_t valueStart = entryEnd; // entryEnd: no value in the entry
+  while (index < entryEnd) {
+    size_t tagStart = index;
+    auto [tag, afterTag] = decodeVarint(ctx.data, index);
+    if (!tag.has_value() || afterTag > entryEnd)
+      return failField(ctx, DecodeErrc::Malformed, tagStart, fd, elem);
+    index = afterTag;
+    uint64_t number = *tag >> 3;
+    uint32_t wire = *tag & 0x7;
+    if (number == 0)
+      return failField(ctx, DecodeErrc::InvalidTag, index, fd, elem);
+    if (number == 1) {
+      if (wire != static_cast<uint32_t>(kc->scalarWire))
+        return failField(ctx, DecodeErrc::WireTypeMismatch, index, fd, elem);
+      size_t keyStart = index;
+      if (!kc->decodeOne(kf, ctx, index, entryEnd, key))
+        return failField(ctx, DecodeErrc::Malformed, keyStart, fd, elem);
+      continue;
+    }
+    if (number == 2) {
+      if (wire != static_cast<uint32_t>(vc->scalarWire))
+        return failField(ctx, DecodeErrc::WireTypeMismatch, index, fd, elem);
+      valueStart = index;
     }
+    size_t before = index;
+    if (!skipUnknown(ctx.data, index, entryEnd, wire))
+      return failField(ctx, DecodeErrc::Malformed, before, fd, elem);
+    if (number != 2) // the value is skipped here and decoded below
+      ++ctx.unknownFields;
   }
 
-  return enc;
+  if (elem >= ctx.opts.maxRepeated && map.find(key) == nullptr)
+    return failField(ctx, DecodeErrc::TooManyElements, lengthStart, fd, elem);
+  Value *out = map.tryEmplace(std::move(key));
+  if (valueStart == entryEnd) {
+    *out = defaultValue(vf);
+    return true;
+  }
+  size_t valueIdx = valueStart;
+  if (!vc->decodeOne(vf, ctx, valueIdx, entryEnd, *out))
+    return failField(ctx, DecodeErrc::Malformed, valueStart, fd, elem);
+  return true;
 }
 
-std::pair<std::optional<Message>, int>
-decodeMessage(const std::vector<uint8_t> &data,
-              std::shared_ptr<const ProtoDesc> desc) {
-  int index = 0;
-  const int sz = static_cast<int>(data.size());
-  Message msg(desc);
+static bool decodeFields(DecodeCtx &ctx, Message &msg, size_t index,
+                         size_t end) {
+  const ProtoDesc &desc = *msg.desc;
 
-  while (index < sz) {
-    auto [maybeFieldTag, afterTag] = decodeVarint(data, index);
-    if (!maybeFieldTag.has_value()) {
+  while (index < end) {
+    auto [maybeFieldTag, afterTag] = decodeVarint(ctx.data, index);
+    if (!maybeFieldTag.has_value() || afterTag > end) {
       PB_LOG("No Tag for input field");
-      return {std::nullopt, index};
+      return failAt(ctx, DecodeErrc::Malformed, index);
     }
 
     index = afterTag;
-    uint32_t fieldTag = static_cast<uint32_t>(maybeFieldTag.value());
-    uint32_t fieldNumber = fieldTag >> 3;
+    uint64_t fieldTag = maybeFieldTag.value();
+    uint64_t fieldNumber = fieldTag >> 3;
     uint32_t wireRaw = fieldTag & 0x7;
-    if (fieldNumber == 0) {
-      return {std::nullopt, index};
+    if (fieldNumber == 0 || fieldNumber > kMaxFieldNumber) {
+      return failAt(ctx, DecodeErrc::InvalidTag, index);
     }
 
     // Unknown field: skip it
-    auto maybeFieldIndex = desc->indexByNumber(fieldNumber);
+    auto maybeFieldIndex =
+        desc.indexByNumber(static_cast<uint32_t>(fieldNumber));
     if (!maybeFieldIndex.has_value()) {
       PB_LOG("Field Information not found skipping...");
-      int before = index;
-      if (!skipUnknown(data, index, wireRaw))
-        return {std::nullopt, before};
+      size_t before = index;
+      if (!skipUnknown(ctx.data, index, end, wireRaw))
+        return failAt(ctx,
+                      wireRaw == VARINT || wireRaw == I64 || wireRaw == LEN ||
+                              wireRaw == I32
+                          ? DecodeErrc::Malformed
+                          : DecodeErrc::InvalidTag,
+                      before);
+      ++ctx.unknownFields;
       continue;
     }
 
-    const FieldDesc &fd = desc->fields[*maybeFieldIndex];
-    const Codec &c = codecFor(fd.type);
+    size_t fieldIdx = *maybeFieldIndex;
+    const FieldDesc &fd = desc.fields[fieldIdx];
+    detail::AllocFrame frame(AllocStage::Decode, &fd);
+    if (fd.type == FieldType::Map) {
+      if (!decodeMapEntry(ctx, msg, fieldIdx, wireRaw, index, end))
+        return false;
+      continue;
+    }
+    const Codec *codec = codecFor(fd.type);
+    if (codec == nullptr) {
+      PB_LOG("Unknown field type in descriptor");
+      return failField(ctx, DecodeErrc::UnknownFieldType, index, fd, 0);
+    }
+    const Codec &c = *codec;
 
     if (!fd.isRepeated) {
       if (wireRaw != static_cast<uint32_t>(c.scalarWire)) {
         PB_LOG("Mismatch in wire type");
-        return {std::nullopt, index}; // index is start of value (matches tests)
+        // index is start of value (matches tests)
+        return failField(ctx, DecodeErrc::WireTypeMismatch, index, fd, 0);
       }
 
-      int valueStart = index;
-      Value out;
-      if (!c.decodeOne(fd, data, index, out)) {
+      // Out-of-line values are decoded in place and inline scalars through
+      // a temporary; a failed decode discards the message
+      size_t valueStart = index;
+      bool ok;
+      if (desc.layout().slots[fieldIdx].isInline) {
+        Value scalar;
+        ok = c.decodeOne(fd, ctx, index, end, scalar) &&
+             msg.setAt(fieldIdx, std::move(scalar));
+      } else {
+        ok = c.decodeOne(fd, ctx, index, end, msg.boxedAt(fieldIdx));
+      }
+      if (!ok) {
         PB_LOG("Scalar value incorrectly encoded");
-        return {std::nullopt, valueStart};
+        return failField(ctx, DecodeErrc::Malformed, valueStart, fd, 0);
       }
-
-      if (!msg.set(fd.name, std::move(out)))
-        return {std::nullopt, valueStart};
-
       continue;
     }
 
-    if (fd.isPacked) {
-      if (wireRaw != static_cast<uint32_t>(WireType::LEN)) {
-        PB_LOG("Mismatch in wire type for packed repeated field");
-        return {std::nullopt, index};
-      }
-      if (!c.packable) {
-        PB_LOG("Packed encoding not allowed for this field type");
-        return {std::nullopt, index};
-      }
+    bool fresh = !msg.has(fieldIdx);
+    RepeatedVal &rv = repeatedSlot(msg, fieldIdx, fd);
+    if (fresh && !countAllocation(ctx, index))
+      return failField(ctx, DecodeErrc::TooManyAllocations, index, fd, 0);
 
-      int lengthStart = index;
-      auto [lenOpt, afterLen] = decodeVarint(data, index);
-      if (!lenOpt.has_value()) {
+    // Parsers must accept both encodings of a packable field whatever
+    // isPacked says, so the wire type picks the form. Packed runs and
+    // single elements may interleave and all append to the same values.
+    if (c.packable && wireRaw == static_cast<uint32_t>(WireType::LEN)) {
+      size_t lengthStart = index;
+      size_t payloadLen;
+      if (!readLength(ctx, index, end, payloadLen)) {
         PB_LOG("Length not properly encoded for packed repeated field");
-        return {std::nullopt, lengthStart};
-      }
-
-      int payloadLen = static_cast<int>(lenOpt.value());
-      index = afterLen;
-      int end = index + payloadLen;
-      if (end > sz) {
-        PB_LOG("Packed repeated field length exceeds data size");
-        return {std::nullopt, index};
+        return failField(ctx, DecodeErrc::Malformed, lengthStart, fd,
+                         rv.values.size());
       }
+      size_t payloadEnd = index + payloadLen;
+      size_t count = packedCount(ctx.data, index, payloadEnd, c.scalarWire);
+      rv.values.reserve(rv.values.size() +
+                        std::min(count, ctx.opts.maxRepeated));
 
-      while (index < end) {
-        if (fd.type == FieldType::Double) {
-          if (index + 8 > end) {
-            PB_LOG("Double overruns packed payload");
-            return {std::nullopt, index};
-          }
-        }
-        if (fd.type == FieldType::Float) {
-          if (index + 4 > end) {
-            PB_LOG("Float overruns packed payload");
-            return {std::nullopt, index};
-          }
-        }
+      while (index < payloadEnd) {
+        size_t elemStart = index;
+        if (rv.values.size() >= ctx.opts.maxRepeated)
+          return failField(ctx, DecodeErrc::TooManyElements, elemStart, fd,
+                           rv.values.size());
 
-        int elemStart = index;
-        Value out;
-        if (!c.decodeOne(fd, data, index, out)) {
+        Value &out = rv.values.emplace_back();
+        if (!c.decodeOne(fd, ctx, index, payloadEnd, out)) {
           PB_LOG("Element incorrectly encoded in packed repeated field");
-          return {std::nullopt, elemStart};
+          return failField(ctx, DecodeErrc::Malformed, elemStart, fd,
+                           rv.values.size() - 1);
         }
-        if (index > end) {
-          PB_LOG("Element overruns packed payload");
-          return {std::nullopt, elemStart};
-        }
-
-        if (!msg.push(fd.name, std::move(out)))
-          return {std::nullopt, elemStart};
-      }
-
-      if (index != end) {
-        PB_LOG("Packed payload did not end on element boundary");
-        return {std::nullopt, index};
       }
 
     } else {
       if (wireRaw != static_cast<uint32_t>(c.scalarWire)) {
         PB_LOG("Mismatch in wire type for repeated field");
-        return {std::nullopt, index};
+        return failField(ctx, DecodeErrc::WireTypeMismatch, index, fd,
+                         rv.values.size());
       }
 
-      int elemStart = index;
-      Value out;
-      if (!c.decodeOne(fd, data, index, out)) {
+      size_t elemStart = index;
+      if (rv.values.size() >= ctx.opts.maxRepeated)
+        return failField(ctx, DecodeErrc::TooManyElements, elemStart, fd,
+                         rv.values.size());
+
+      // LEN-typed elements may reuse one kept by Message::clear()
+      Value &out =
+          c.packable ? rv.values.emplace_back() : msg.appendAt(fieldIdx);
+      if (!c.decodeOne(fd, ctx, index, end, out)) {
         PB_LOG("Element incorrectly encoded in repeated field");
-        return {std::nullopt, elemStart};
+        return failField(ctx, DecodeErrc::Malformed, elemStart, fd,
+                         rv.values.size() - 1);
       }
-
-      if (!msg.push(fd.name, std::move(out)))
-        return {std::nullopt, elemStart};
     }
   }
 
-  return {msg, index};
+  return true;
+}
+
+static void recordDecode(const DecodeCtx &ctx, const Message &msg,
+                         uint64_t start) {
+  detail::recordDecode(
+      msg.desc.get(),
+      {ctx.data.size(), ctx.unknownFields, ctx.deepest, ctx.err.code}, start);
+}
+
+std::pair<std::optional<Message>, DecodeError>
+decodeMessage(const std::vector<uint8_t> &data,
+              std::shared_ptr<const ProtoDesc> desc,
+              const DecodeOptions &opts) {
+  uint64_t start = detail::metricsStart();
+  detail::AllocFrame frame(AllocStage::Decode, nullptr);
+  DecodeCtx ctx{data, opts, 0, 0, {}};
+  Message msg(std::move(desc));
+  bool ok = data.size() > opts.maxTotalBytes
+                ? failAt(ctx, DecodeErrc::TotalSizeExceeded, 0)
+                : decodeFields(ctx, msg, 0, data.size());
+  if (start != 0)
+    recordDecode(ctx, msg, start);
+  if (!ok)
+    return {std::nullopt, std::move(ctx.err)};
+  return {std::move(msg), DecodeError{}};
+}
+
+DecodeError decodeInto(Message &msg, const std::vector<uint8_t> &data,
+                       const DecodeOptions &opts) {
+  uint64_t start = detail::metricsStart();
+  detail::AllocFrame frame(AllocStage::Decode, nullptr);
+  DecodeCtx ctx{data, opts, 0, 0, {}};
+  msg.clear();
+  if (data.size() > opts.maxTotalBytes)
+    failAt(ctx, DecodeErrc::TotalSizeExceeded, 0);
+  else
+    decodeFields(ctx, msg, 0, data.size());
+  if (start != 0)
+    recordDecode(ctx, msg, start);
+  return std::move(ctx.err);
+}
+
+std::pair<std::optional<Message>, size_t>
+decodeMessage(const std::vector<uint8_t> &data,
+              std::shared_ptr<const ProtoDesc> desc) {
+  auto [msg, err] = decodeMessage(data, std::move(desc), DecodeOptions{});
+  if (!msg.has_value())
+    return {std::nullopt, err.offset};
+  return {std::move(msg), data.size()};
 }
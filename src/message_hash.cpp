@@ -0,0 +1,161 @@
+#include "message_hash.h"
+#include <cstring>
+#include <variant>
+
+namespace {
+
+constexpr uint64_t kSeed = 0x9E3779B97F4A7C15ULL;
+
+inline uint64_t mix(uint64_t h, uint64_t v) {
+  h ^= v + kSeed + (h << 6) + (h >> 2);
+  h *= 0xBF58476D1CE4E5B9ULL;
+  return h ^ (h >> 31);
+}
+
+// Hashes raw bytes eight at a time, then the tail and the length.
+uint64_t mixBytes(uint64_t h, const uint8_t *p, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t w;
+    std::memcpy(&w, p + i, 8);
+    h = mix(h, w);
+  }
+  if (i < n) {
+    uint64_t tail = 0;
+    std::memcpy(&tail, p + i, n - i);
+    h = mix(h, tail);
+  }
+  return mix(h, n);
+}
+
+template <typename T> uint64_t bitsOf(T v) {
+  static_assert(sizeof(T) <= sizeof(uint64_t));
+  uint64_t out = 0;
+  std::memcpy(&out, &v, sizeof(T));
+  return out;
+}
+
+bool isPresent(const Message &m, size_t idx) {
+  if (!m.has(idx))
+    return false;
+  const FieldDesc &fd = m.desc->fields[idx];
+  if (!fd.isRepeated && fd.type != FieldType::Map)
+    return true;
+  // Empty repeated fields and maps encode to nothing
+  ValueRef v = m.valueAt(idx);
+  if (const auto *rv = std::get_if<RepeatedVal>(&v.get()))
+    return !rv->values.empty();
+  if (const auto *mv = std::get_if<MapVal>(&v.get()))
+    return !mv->empty();
+  return true;
+}
+
+uint64_t hashValue(uint64_t h, const Value &v) {
+  return std::visit(
+      [h](const auto &x) -> uint64_t {
+        using T = std::decay_t<decltype(x)>;
+        if constexpr (std::is_same_v<T, std::string>) {
+          return mixBytes(h, reinterpret_cast<const uint8_t *>(x.data()),
+                          x.size());
+        } else if constexpr (std::is_same_v<T, std::vector<uint8_t>>) {
+          return mixBytes(h, x.data(), x.size());
+        } else if constexpr (std::is_same_v<T, RepeatedVal>) {
+          uint64_t out = mix(h, x.values.size());
+          for (const auto &elem : x.values)
+            out = hashValue(out, elem);
+          return out;
+        } else if constexpr (std::is_same_v<T, Message>) {
+          return mix(h, hashMessage(x));
+        } else if constexpr (std::is_same_v<T, MapVal>) {
+          // Entry order is not part of a map's identity: sum entry hashes
+          uint64_t sum = 0;
+          for (size_t i = 0; i < x.size(); ++i)
+            sum += hashValue(hashValue(kSeed, x.keyAt(i)), x.valueAt(i));
+          return mix(mix(h, x.size()), sum);
+        } else {
+          return mix(h, bitsOf(x));
+        }
+      },
+      v);
+}
+
+bool valuesEqual(const Value &a, const Value &b) {
+  if (&a == &b) // shared copy-on-write box
+    return true;
+  if (a.index() != b.index())
+    return false;
+  return std::visit(
+      [&b](const auto &x) -> bool {
+        using T = std::decay_t<decltype(x)>;
+        const T &y = std::get<T>(b);
+        if constexpr (std::is_same_v<T, RepeatedVal>) {
+          if (x.values.size() != y.values.size())
+            return false;
+          for (size_t i = 0; i < x.values.size(); ++i)
+            if (!valuesEqual(x.values[i], y.values[i]))
+              return false;
+          return true;
+        } else if constexpr (std::is_same_v<T, Message>) {
+          return messagesEqual(x, y);
+        } else if constexpr (std::is_same_v<T, MapVal>) {
+          if (x.size() != y.size())
+            return false;
+          for (size_t i = 0; i < x.size(); ++i) {
+            const Value *other = y.find(x.keyAt(i));
+            if (other == nullptr || !valuesEqual(x.valueAt(i), *other))
+              return false;
+          }
+          return true;
+        } else if constexpr (std::is_same_v<T, double> ||
+                             std::is_same_v<T, float>) {
+          return bitsOf(x) == bitsOf(y);
+        } else {
+          return x == y;
+        }
+      },
+      a);
+}
+
+} // namespace
+
+uint64_t hashMessage(const Message &m) {
+  uint64_t h = kSeed;
+  for (size_t idx : m.desc->indicesByNumber()) {
+    if (!isPresent(m, idx))
+      continue;
+    h = mix(h, m.desc->fields[idx].number);
+    h = hashValue(h, m.valueAt(idx));
+  }
+  return h;
+}
+
+bool messagesEqual(const Message &a, const Message &b) {
+  if (&a == &b)
+    return true;
+
+  // Walk both messages in canonical order, comparing only present fields.
+  const auto &orderA = a.desc->indicesByNumber();
+  const auto &orderB = b.desc->indicesByNumber();
+  size_t i = 0, j = 0;
+  while (true) {
+    while (i < orderA.size() && !isPresent(a, orderA[i]))
+      ++i;
+    while (j < orderB.size() && !isPresent(b, orderB[j]))
+      ++j;
+    if (i == orderA.size() || j == orderB.size())
+      return i == orderA.size() && j == orderB.size();
+
+    const FieldDesc &fa = a.desc->fields[orderA[i]];
+    const FieldDesc &fb = b.desc->fields[orderB[j]];
+    if (fa.number != fb.number)
+      return false;
+    if (a.desc != b.desc &&
+        (fa.type != fb.type || fa.isRepeated != fb.isRepeated ||
+         fa.isPacked != fb.isPacked))
+      return false;
+    if (!valuesEqual(a.valueAt(orderA[i]), b.valueAt(orderB[j])))
+      return false;
+    ++i;
+    ++j;
+  }
+}
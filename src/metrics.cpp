@@ -0,0 +1,361 @@
+#include "metrics.h"
+#include "proto_schema.h"
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <unordered_map>
+
+size_t LatencyHistogram::bucketOf(uint64_t ns) {
+  if (ns <= upperBoundNs(0))
+    return 0;
+  return std::min<size_t>(std::bit_width((ns - 1) >> 8), kBuckets - 1);
+}
+
+uint64_t LatencyHistogram::count() const {
+  uint64_t n = 0;
+  for (uint64_t b : buckets)
+    n += b;
+  return n;
+}
+
+const char *decodeErrcName(DecodeErrc code) {
+  switch (code) {
+  case DecodeErrc::None:
+    return "none";
+  case DecodeErrc::Malformed:
+    return "malformed";
+  case DecodeErrc::InvalidTag:
+    return "invalid_tag";
+  case DecodeErrc::WireTypeMismatch:
+    return "wire_type_mismatch";
+  case DecodeErrc::InvalidValue:
+    return "invalid_value";
+  case DecodeErrc::UnknownFieldType:
+    return "unknown_field_type";
+  case DecodeErrc::DepthExceeded:
+    return "depth_exceeded";
+  case DecodeErrc::TotalSizeExceeded:
+    return "total_size_exceeded";
+  case DecodeErrc::FieldTooLarge:
+    return "field_too_large";
+  case DecodeErrc::TooManyElements:
+    return "too_many_elements";
+  case DecodeErrc::TooManyAllocations:
+    return "too_many_allocations";
+  }
+  return "unknown";
+}
+
+#if PROTO_METRICS
+std::atomic<bool> detail::metricsOn{false};
+#endif
+
+void enableMetrics([[maybe_unused]] bool on) {
+#if PROTO_METRICS
+  detail::metricsOn.store(on, std::memory_order_relaxed);
+#endif
+}
+
+uint64_t detail::metricsNow() {
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch());
+  return std::max<uint64_t>(static_cast<uint64_t>(ns.count()), 1);
+}
+
+namespace {
+// One thread's counters for one descriptor. Only the owning thread writes
+// them, with plain load/store pairs; the atomics let readers on other
+// threads load them while it does.
+struct Shard {
+  using Counter = std::atomic<uint64_t>;
+  struct Histogram {
+    std::array<Counter, LatencyHistogram::kBuckets> buckets{};
+    Counter sumNs{0};
+  };
+  Counter encoded{0}, encodedBytes{0}, encodeFailures{0};
+  Counter decoded{0}, decodedBytes{0}, unknownFields{0}, maxDepth{0};
+  std::array<Counter, kDecodeErrcCount> decodeFailures{};
+  Histogram encodeLatency, decodeLatency;
+};
+
+void bump(std::atomic<uint64_t> &c, uint64_t n) {
+  c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+void observe(Shard::Histogram &h, uint64_t ns) {
+  bump(h.buckets[LatencyHistogram::bucketOf(ns)], 1);
+  bump(h.sumNs, ns);
+}
+
+uint64_t load(const std::atomic<uint64_t> &c) {
+  return c.load(std::memory_order_relaxed);
+}
+
+void addTo(LatencyHistogram &out, const Shard::Histogram &h) {
+  for (size_t i = 0; i < LatencyHistogram::kBuckets; ++i)
+    out.buckets[i] += load(h.buckets[i]);
+  out.sumNs += load(h.sumNs);
+}
+
+void addTo(DescMetrics &out, const Shard &s) {
+  out.encoded += load(s.encoded);
+  out.encodedBytes += load(s.encodedBytes);
+  out.encodeFailures += load(s.encodeFailures);
+  out.decoded += load(s.decoded);
+  out.decodedBytes += load(s.decodedBytes);
+  out.unknownFields += load(s.unknownFields);
+  out.maxDepth = std::max(out.maxDepth, load(s.maxDepth));
+  for (size_t i = 0; i < kDecodeErrcCount; ++i)
+    out.decodeFailures[i] += load(s.decodeFailures[i]);
+  addTo(out.encodeLatency, s.encodeLatency);
+  addTo(out.decodeLatency, s.decodeLatency);
+}
+
+void zero(Shard &s) {
+  for (auto *c : {&s.encoded, &s.encodedBytes, &s.encodeFailures, &s.decoded,
+                  &s.decodedBytes, &s.unknownFields, &s.maxDepth,
+                  &s.encodeLatency.sumNs, &s.decodeLatency.sumNs})
+    c->store(0, std::memory_order_relaxed);
+  for (auto &c : s.decodeFailures)
+    c.store(0, std::memory_order_relaxed);
+  for (auto &c : s.encodeLatency.buckets)
+    c.store(0, std::memory_order_relaxed);
+  for (auto &c : s.decodeLatency.buckets)
+    c.store(0, std::memory_order_relaxed);
+}
+
+struct ThreadShards;
+
+// Every live thread's shards, the totals of exited threads and the names.
+// Shards are added under mu, so readers holding it see stable maps.
+struct Registry {
+  std::mutex mu;
+  std::vector<ThreadShards *> threads;
+  std::unordered_map<const ProtoDesc *, DescMetrics> retired;
+  std::unordered_map<const ProtoDesc *, std::string> names;
+};
+
+// Never destroyed: threads may exit after static destructors have run
+Registry &registry() {
+  static Registry *r = new Registry;
+  return *r;
+}
+
+struct ThreadShards {
+  std::unordered_map<const ProtoDesc *, std::unique_ptr<Shard>> byDesc;
+  const ProtoDesc *lastDesc = nullptr; // most calls repeat the last type
+  Shard *last = nullptr;
+
+  ThreadShards() {
+    Registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mu);
+    r.threads.push_back(this);
+  }
+  ~ThreadShards() {
+    Registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mu);
+    for (const auto &[desc, shard] : byDesc)
+      addTo(r.retired[desc], *shard);
+    std::erase(r.threads, this);
+  }
+
+  Shard &of(const ProtoDesc *desc) {
+    if (desc == lastDesc)
+      return *last;
+    auto it = byDesc.find(desc);
+    if (it == byDesc.end()) {
+      std::lock_guard<std::mutex> lock(registry().mu);
+      it = byDesc.emplace(desc, std::make_unique<Shard>()).first;
+    }
+    lastDesc = desc;
+    last = it->second.get();
+    return *last;
+  }
+};
+
+Shard &shardOf(const ProtoDesc *desc) {
+  static thread_local ThreadShards shards;
+  return shards.of(desc);
+}
+} // namespace
+
+void detail::recordEncode(const ProtoDesc *desc, size_t bytes, bool ok,
+                          uint64_t start) {
+  uint64_t ns = metricsNow() - start;
+  Shard &s = shardOf(desc);
+  if (ok) {
+    bump(s.encoded, 1);
+    bump(s.encodedBytes, bytes);
+  } else {
+    bump(s.encodeFailures, 1);
+  }
+  observe(s.encodeLatency, ns);
+}
+
+void detail::recordDecode(const ProtoDesc *desc, const DecodeSample &sample,
+                          uint64_t start) {
+  uint64_t ns = metricsNow() - start;
+  Shard &s = shardOf(desc);
+  if (sample.code == DecodeErrc::None) {
+    bump(s.decoded, 1);
+    bump(s.decodedBytes, sample.bytes);
+    bump(s.unknownFields, sample.unknownFields);
+    if (sample.depth > load(s.maxDepth))
+      s.maxDepth.store(sample.depth, std::memory_order_relaxed);
+  } else {
+    bump(s.decodeFailures[static_cast<size_t>(sample.code)], 1);
+  }
+  observe(s.decodeLatency, ns);
+}
+
+void nameMetrics(const ProtoDesc &desc, std::string name) {
+  Registry &r = registry();
+  std::lock_guard<std::mutex> lock(r.mu);
+  r.names[&desc] = std::move(name);
+}
+
+void nameMetrics(const ProtoSchema &schema) {
+  for (const auto &[name, desc] : schema.messages)
+    nameMetrics(*desc, name);
+}
+
+std::vector<DescMetrics> metricsSnapshot() {
+  Registry &r = registry();
+  std::unordered_map<const ProtoDesc *, DescMetrics> totals;
+  {
+    std::lock_guard<std::mutex> lock(r.mu);
+    totals = r.retired;
+    for (const ThreadShards *t : r.threads)
+      for (const auto &[desc, shard] : t->byDesc)
+        addTo(totals[desc], *shard);
+    for (auto &[desc, m] : totals) {
+      m.desc = desc;
+      auto name = r.names.find(desc);
+      if (name != r.names.end())
+        m.name = name->second;
+    }
+  }
+
+  std::vector<DescMetrics> out;
+  out.reserve(totals.size());
+  for (auto &[desc, m] : totals)
+    out.push_back(std::move(m));
+  std::sort(out.begin(), out.end(),
+            [](const DescMetrics &a, const DescMetrics &b) {
+              if (a.name.empty() != b.name.empty())
+                return b.name.empty();
+              if (a.name != b.name)
+                return a.name < b.name;
+              return std::less<const ProtoDesc *>()(a.desc, b.desc);
+            });
+  return out;
+}
+
+void resetMetrics() {
+  Registry &r = registry();
+  std::lock_guard<std::mutex> lock(r.mu);
+  r.retired.clear();
+  for (ThreadShards *t : r.threads)
+    for (auto &[desc, shard] : t->byDesc)
+      zero(*shard);
+}
+
+// Label values escape backslash, double quote and newline
+static void writeLabel(std::ostream &out, const std::string &value) {
+  for (char c : value) {
+    if (c == '\\' || c == '"')
+      out << '\\' << c;
+    else if (c == '\n')
+      out << "\\n";
+    else
+      out << c;
+  }
+}
+
+static void writeHeader(std::ostream &out, const char *name, const char *type,
+                        const char *help) {
+  out << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' '
+      << type << '\n';
+}
+
+void writePrometheus(std::ostream &out) {
+  std::vector<DescMetrics> all = metricsSnapshot();
+  auto precision = out.precision(12); // bucket bounds need 8 digits
+  std::vector<std::string> labels;
+  labels.reserve(all.size());
+  for (const DescMetrics &m : all) {
+    std::ostringstream label;
+    label << "desc=\"";
+    if (m.name.empty())
+      label << static_cast<const void *>(m.desc);
+    else
+      writeLabel(label, m.name);
+    label << '"';
+    labels.push_back(label.str());
+  }
+
+  struct Scalar {
+    const char *name, *type, *help;
+    uint64_t DescMetrics::*field;
+  };
+  static constexpr Scalar kScalars[] = {
+      {"protoenc_encoded_messages_total", "counter", "Messages encoded.",
+       &DescMetrics::encoded},
+      {"protoenc_encoded_bytes_total", "counter", "Bytes of encoded output.",
+       &DescMetrics::encodedBytes},
+      {"protoenc_encode_failures_total", "counter", "Encodes that failed.",
+       &DescMetrics::encodeFailures},
+      {"protoenc_decoded_messages_total", "counter", "Messages decoded.",
+       &DescMetrics::decoded},
+      {"protoenc_decoded_bytes_total", "counter",
+       "Bytes of successfully decoded input.", &DescMetrics::decodedBytes},
+      {"protoenc_unknown_fields_total", "counter",
+       "Unknown fields skipped while decoding.", &DescMetrics::unknownFields},
+      {"protoenc_decode_max_depth", "gauge",
+       "Deepest message nesting decoded.", &DescMetrics::maxDepth},
+  };
+  for (const Scalar &s : kScalars) {
+    writeHeader(out, s.name, s.type, s.help);
+    for (size_t i = 0; i < all.size(); ++i)
+      out << s.name << '{' << labels[i] << "} " << all[i].*s.field << '\n';
+  }
+
+  writeHeader(out, "protoenc_decode_failures_total", "counter",
+              "Decodes that failed, by reason.");
+  for (size_t i = 0; i < all.size(); ++i)
+    for (size_t code = 1; code < kDecodeErrcCount; ++code)
+      if (all[i].decodeFailures[code] != 0)
+        out << "protoenc_decode_failures_total{" << labels[i] << ",reason=\""
+            << decodeErrcName(static_cast<DecodeErrc>(code)) << "\"} "
+            << all[i].decodeFailures[code] << '\n';
+
+  auto histogram = [&](const char *name, const char *help,
+                       LatencyHistogram DescMetrics::*field) {
+    writeHeader(out, name, "histogram", help);
+    for (size_t i = 0; i < all.size(); ++i) {
+      const LatencyHistogram &h = all[i].*field;
+      uint64_t cumulative = 0;
+      for (size_t b = 0; b < LatencyHistogram::kBuckets; ++b) {
+        cumulative += h.buckets[b];
+        out << name << "_bucket{" << labels[i] << ",le=\"";
+        if (b + 1 == LatencyHistogram::kBuckets)
+          out << "+Inf";
+        else
+          out << double(LatencyHistogram::upperBoundNs(b)) / 1e9;
+        out << "\"} " << cumulative << '\n';
+      }
+      out << name << "_sum{" << labels[i] << "} " << double(h.sumNs) / 1e9
+          << '\n'
+          << name << "_count{" << labels[i] << "} " << cumulative << '\n';
+    }
+  };
+  histogram("protoenc_encode_duration_seconds", "Time spent encoding.",
+            &DescMetrics::encodeLatency);
+  histogram("protoenc_decode_duration_seconds", "Time spent decoding.",
+            &DescMetrics::decodeLatency);
+  out.precision(precision);
+}
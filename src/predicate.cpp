@@ -0,0 +1,612 @@
+#include "predicate.h"
+#include "encoder.h"
+#include "wire_util.h"
+#include <charconv>
+#include <cstring>
+#include <limits>
+
+static constexpr uint32_t kNoParent = UINT32_MAX;
+static constexpr size_t kMaxNesting = 100; // parentheses and '!'
+
+static bool isRepeated(const FieldDesc &fd) {
+  return fd.isRepeated || fd.type == FieldType::Map;
+}
+
+// ---------------------------------------------------------------------------
+// Compiling
+
+struct Predicate::Compiler {
+  std::string_view src;
+  Predicate &p;
+  size_t pos = 0;
+  size_t nesting = 0;
+  PredicateError err;
+
+  bool fail(std::string message, size_t at) {
+    if (err.message.empty()) {
+      err.message = std::move(message);
+      err.offset = at;
+    }
+    return false;
+  }
+
+  void skipSpace() {
+    while (pos < src.size() && (src[pos] == ' ' || src[pos] == '\t' ||
+                                src[pos] == '\n' || src[pos] == '\r'))
+      ++pos;
+  }
+  bool peek(std::string_view tok) {
+    skipSpace();
+    return src.substr(pos, tok.size()) == tok;
+  }
+  bool eat(std::string_view tok) {
+    if (!peek(tok))
+      return false;
+    pos += tok.size();
+    return true;
+  }
+  static bool identStart(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+  }
+  static bool identChar(char c) {
+    return identStart(c) || (c >= '0' && c <= '9');
+  }
+  bool ident(std::string_view &out) {
+    skipSpace();
+    if (pos >= src.size() || !identStart(src[pos]))
+      return false;
+    size_t start = pos;
+    while (pos < src.size() && identChar(src[pos]))
+      ++pos;
+    out = src.substr(start, pos - start);
+    return true;
+  }
+
+  uint32_t add(Node n) {
+    p.nodes.push_back(std::move(n));
+    return static_cast<uint32_t>(p.nodes.size() - 1);
+  }
+
+  // The slot for field `field` of scope, created on first use
+  uint32_t slotFor(uint32_t scope, size_t field) {
+    int32_t &slot = p.scopes[scope].slotOf[field];
+    if (slot < 0) {
+      slot = static_cast<int32_t>(p.slots.size());
+      p.slots.push_back({&p.scopes[scope].desc->fields[field], scope});
+    }
+    return static_cast<uint32_t>(slot);
+  }
+
+  // The scope reading the message in slot, created on first use
+  uint32_t scopeFor(uint32_t slot) {
+    for (uint32_t s = 0; s < p.scopes.size(); ++s)
+      if (p.scopes[s].parentSlot == slot)
+        return s;
+    const ProtoDesc *nested = p.slots[slot].field->nestedDesc.get();
+    p.scopes.push_back(
+        {nested, slot, std::vector<int32_t>(nested->fields.size(), -1)});
+    return static_cast<uint32_t>(p.scopes.size() - 1);
+  }
+
+  bool parsePath(uint32_t &slot) {
+    uint32_t scope = 0;
+    while (true) {
+      std::string_view name;
+      size_t at = (skipSpace(), pos);
+      if (!ident(name))
+        return fail("expected a field name", at);
+      const ProtoDesc &desc = *p.scopes[scope].desc;
+      auto field = desc.indexByName(std::string(name));
+      if (!field.has_value())
+        return fail("unknown field '" + std::string(name) + "'", at);
+      slot = slotFor(scope, *field);
+      if (!eat("."))
+        return true;
+      const FieldDesc &fd = desc.fields[*field];
+      if (fd.type != FieldType::Message || isRepeated(fd) ||
+          fd.nestedDesc == nullptr)
+        return fail("'" + fd.name + "' is not a singular message field", at);
+      scope = scopeFor(slot);
+    }
+  }
+
+  bool parseString(std::string &out) {
+    size_t at = (skipSpace(), pos);
+    if (!eat("\""))
+      return fail("expected a string", at);
+    while (pos < src.size() && src[pos] != '"') {
+      char c = src[pos++];
+      if (c != '\\') {
+        out += c;
+        continue;
+      }
+      if (pos >= src.size())
+        break;
+      char e = src[pos++];
+      switch (e) {
+      case 'n':
+        out += '\n';
+        break;
+      case 'r':
+        out += '\r';
+        break;
+      case 't':
+        out += '\t';
+        break;
+      case '0':
+        out += '\0';
+        break;
+      case '\\':
+      case '"':
+      case '\'':
+        out += e;
+        break;
+      case 'x': {
+        unsigned v = 0;
+        auto [end, ec] = std::from_chars(src.data() + pos,
+                                         src.data() + std::min(pos + 2,
+                                                               src.size()),
+                                         v, 16);
+        if (ec != std::errc() || end != src.data() + pos + 2)
+          return fail("expected two hex digits", pos);
+        out += static_cast<char>(v);
+        pos += 2;
+        break;
+      }
+      default:
+        return fail("unknown escape", pos - 2);
+      }
+    }
+    if (!eat("\""))
+      return fail("unterminated string", at);
+    return true;
+  }
+
+  // An integer or float literal; integer is set when it has no fraction or
+  // exponent, with its magnitude in mag
+  bool parseNumber(bool &integer, bool &negative, uint64_t &mag, double &d) {
+    size_t at = (skipSpace(), pos);
+    negative = eat("-");
+    skipSpace();
+    size_t start = pos;
+    if (src.substr(pos, 2) == "0x" || src.substr(pos, 2) == "0X") {
+      auto [end, ec] = std::from_chars(src.data() + pos + 2,
+                                       src.data() + src.size(), mag, 16);
+      if (ec == std::errc::result_out_of_range)
+        return fail("number out of range", at);
+      if (ec != std::errc() || end == src.data() + pos + 2)
+        return fail("expected a number", at);
+      pos = size_t(end - src.data());
+      integer = true;
+      d = negative ? -double(mag) : double(mag);
+      return true;
+    }
+    auto [end, ec] =
+        std::from_chars(src.data() + start, src.data() + src.size(), d);
+    if (ec != std::errc() || !(src[start] >= '0' && src[start] <= '9'))
+      return fail("expected a number", at);
+    pos = size_t(end - src.data());
+    std::string_view text = src.substr(start, pos - start);
+    integer = text.find_first_of(".eE") == std::string_view::npos;
+    if (integer) {
+      auto [iend, iec] =
+          std::from_chars(text.data(), text.data() + text.size(), mag);
+      if (iec != std::errc())
+        return fail("number out of range", at);
+    }
+    if (negative)
+      d = -d;
+    return true;
+  }
+
+  // The literal compared with fd, converted to how fd's values compare
+  bool parseLiteral(Node &n, const FieldDesc &fd) {
+    size_t at = (skipSpace(), pos);
+    switch (fd.type) {
+    case FieldType::String:
+    case FieldType::Bytes:
+      return parseString(n.s);
+    case FieldType::Bool: {
+      std::string_view word;
+      if (ident(word) && (word == "true" || word == "false")) {
+        n.u = word == "true";
+        return true;
+      }
+      return fail("expected true or false", at);
+    }
+    case FieldType::Double:
+    case FieldType::Float: {
+      bool integer, negative;
+      uint64_t mag;
+      if (!parseNumber(integer, negative, mag, n.d))
+        return false;
+      if (fd.type == FieldType::Float)
+        n.d = double(float(n.d)); // compare as the float it would be stored as
+      return true;
+    }
+    default:
+      break;
+    }
+
+    bool isSigned = fd.type != FieldType::UInt &&
+                    fd.type != FieldType::UInt32 &&
+                    fd.type != FieldType::Fixed32 &&
+                    fd.type != FieldType::Fixed64;
+    std::string_view word;
+    if (fd.type == FieldType::Enum && ident(word)) {
+      std::optional<int32_t> number;
+      if (fd.enumDesc != nullptr)
+        number = fd.enumDesc->numberOf(std::string(word));
+      if (!number.has_value())
+        return fail("unknown enum value '" + std::string(word) + "'", at);
+      n.i = *number;
+      return true;
+    }
+    bool integer, negative;
+    uint64_t mag;
+    double d;
+    if (!parseNumber(integer, negative, mag, d))
+      return false;
+    if (!integer)
+      return fail("expected an integer", at);
+    if (!isSigned) {
+      if (negative && mag != 0)
+        return fail("number out of range", at);
+      n.u = mag;
+    } else if (negative) {
+      if (mag > uint64_t(1) << 63)
+        return fail("number out of range", at);
+      n.i = static_cast<int64_t>(0 - mag);
+    } else {
+      if (mag > uint64_t(std::numeric_limits<int64_t>::max()))
+        return fail("number out of range", at);
+      n.i = static_cast<int64_t>(mag);
+    }
+    return true;
+  }
+
+  bool parseComparison(uint32_t &out) {
+    size_t at = (skipSpace(), pos);
+    Node n;
+    n.type = Node::Compare;
+    if (!parsePath(n.slot))
+      return false;
+    const FieldDesc &fd = *p.slots[n.slot].field;
+    if (fd.type == FieldType::Message || fd.type == FieldType::Map)
+      return fail("'" + fd.name + "' is a message; compare its fields", at);
+
+    static constexpr std::pair<std::string_view, Op> ops[] = {
+        {"==", Op::Eq}, {"!=", Op::Ne}, {"<=", Op::Le},
+        {">=", Op::Ge}, {"<", Op::Lt},  {">", Op::Gt},
+    };
+    bool found = false;
+    for (auto [tok, op] : ops)
+      if (!found && eat(tok)) {
+        n.op = op;
+        found = true;
+      }
+    if (!found) {
+      if (fd.type != FieldType::Bool)
+        return fail("expected a comparison", (skipSpace(), pos));
+      n.u = 1; // a bool on its own: == true
+    } else if (!parseLiteral(n, fd)) {
+      return false;
+    }
+    out = add(std::move(n));
+    return true;
+  }
+
+  bool parseUnary(uint32_t &out) {
+    if (nesting >= kMaxNesting)
+      return fail("expression nests too deeply", (skipSpace(), pos));
+    ++nesting;
+    bool ok = parseUnaryNested(out);
+    --nesting;
+    return ok;
+  }
+
+  bool parseUnaryNested(uint32_t &out) {
+    if (peek("!") && !peek("!=")) {
+      eat("!");
+      Node n;
+      n.type = Node::Not;
+      if (!parseUnary(n.lhs))
+        return false;
+      out = add(std::move(n));
+      return true;
+    }
+    if (eat("(")) {
+      if (!parseOr(out))
+        return false;
+      if (!eat(")"))
+        return fail("expected ')'", pos);
+      return true;
+    }
+    size_t save = (skipSpace(), pos);
+    std::string_view word;
+    if (ident(word) && word == "has" && eat("(")) {
+      Node n;
+      n.type = Node::Has;
+      if (!parsePath(n.slot))
+        return false;
+      if (!eat(")"))
+        return fail("expected ')'", pos);
+      out = add(std::move(n));
+      return true;
+    }
+    pos = save;
+    return parseComparison(out);
+  }
+
+  // A run of terms joined by one operator, as a balanced tree so that long
+  // chains do not nest deeply; evaluation order is unchanged
+  uint32_t balance(decltype(Node::type) type,
+                   const std::vector<uint32_t> &terms, size_t lo,
+                   size_t hi) {
+    if (hi - lo == 1)
+      return terms[lo];
+    size_t mid = lo + (hi - lo) / 2;
+    Node n;
+    n.type = type;
+    n.lhs = balance(type, terms, lo, mid);
+    n.rhs = balance(type, terms, mid, hi);
+    return add(std::move(n));
+  }
+
+  bool parseAnd(uint32_t &out) {
+    std::vector<uint32_t> terms(1);
+    if (!parseUnary(terms[0]))
+      return false;
+    while (eat("&&"))
+      if (!parseUnary(terms.emplace_back()))
+        return false;
+    out = balance(Node::And, terms, 0, terms.size());
+    return true;
+  }
+
+  bool parseOr(uint32_t &out) {
+    std::vector<uint32_t> terms(1);
+    if (!parseAnd(terms[0]))
+      return false;
+    while (eat("||"))
+      if (!parseAnd(terms.emplace_back()))
+        return false;
+    out = balance(Node::Or, terms, 0, terms.size());
+    return true;
+  }
+};
+
+std::pair<std::optional<Predicate>, PredicateError>
+compilePredicate(std::string_view expr, std::shared_ptr<const ProtoDesc> desc) {
+  Predicate p;
+  p.scopes.push_back(
+      {desc.get(), kNoParent, std::vector<int32_t>(desc->fields.size(), -1)});
+  p.desc = std::move(desc);
+  Predicate::Compiler c{expr, p, 0, 0, {}};
+  uint32_t root;
+  if (!c.parseOr(root))
+    return {std::nullopt, std::move(c.err)};
+  if (c.skipSpace(), c.pos != expr.size()) {
+    c.fail("unexpected text after the expression", c.pos);
+    return {std::nullopt, std::move(c.err)};
+  }
+  // Keep the root last
+  if (root != p.nodes.size() - 1)
+    p.nodes.push_back(p.nodes[root]);
+  return {std::move(p), PredicateError{}};
+}
+
+// ---------------------------------------------------------------------------
+// Evaluating
+
+void Predicate::reset(State &st, const uint8_t *data, size_t size) const {
+  st.data = data;
+  st.size = size;
+  st.scanned.assign(scopes.size(), 0);
+  st.last.resize(slots.size());
+  for (WireField &f : st.last)
+    f.number = 0;
+  st.malformed = false;
+}
+
+// Scans a scope's bytes once, keeping the last occurrence of each field it
+// reads; reaching it scans the enclosing scopes first
+void Predicate::scan(State &st, uint32_t s) const {
+  st.scanned[s] = 1;
+  const Scope &sc = scopes[s];
+  const uint8_t *data = st.data;
+  size_t size = st.size;
+  if (sc.parentSlot != kNoParent) {
+    uint32_t parent = slots[sc.parentSlot].scope;
+    if (!st.scanned[parent])
+      scan(st, parent);
+    const WireField &msg = st.last[sc.parentSlot];
+    data = msg.data;
+    size = msg.number != 0 ? msg.size : 0;
+  }
+
+  const ProtoDesc &desc = *sc.desc;
+  WireScanner scanner(data, size);
+  for (WireField f; scanner.next(f);) {
+    auto field = desc.indexByNumber(f.number);
+    if (!field.has_value())
+      continue;
+    const FieldDesc &fd = desc.fields[*field];
+    if (fd.oneofIndex >= 0) // a member unsets the others
+      for (size_t member : desc.oneofs()[fd.oneofIndex].fields)
+        if (sc.slotOf[member] >= 0)
+          st.last[sc.slotOf[member]].number = 0;
+    int32_t slot = sc.slotOf[*field];
+    if (slot < 0)
+      continue;
+    WireType want = wireOf(fd.type);
+    bool repeated = isRepeated(fd);
+    if (f.wire != want && !(repeated && want != LEN && f.wire == LEN)) {
+      st.malformed = true;
+      return;
+    }
+    // Repeated fields only record that they have elements
+    if (!repeated || want == LEN || f.wire != LEN || f.size != 0)
+      st.last[slot] = f;
+  }
+  if (scanner.error() != DecodeErrc::None)
+    st.malformed = true;
+}
+
+template <typename T> static bool holds(uint8_t op, const T &a, const T &b) {
+  switch (op) {
+  case 0:
+    return a == b;
+  case 1:
+    return a != b;
+  case 2:
+    return a < b;
+  case 3:
+    return a <= b;
+  case 4:
+    return a > b;
+  default:
+    return a >= b;
+  }
+}
+
+// Compares one value of fd, as it came off the wire, with the literal;
+// bad is set for bools other than 0 or 1
+static bool test(uint8_t op, const FieldDesc &fd, uint64_t raw,
+                 std::string_view bytes, int64_t i, uint64_t u, double d,
+                 std::string_view s, bool &bad) {
+  switch (fd.type) {
+  case FieldType::String:
+  case FieldType::Bytes:
+    return holds(op, bytes, s);
+  case FieldType::Double: {
+    double x;
+    std::memcpy(&x, &raw, sizeof x);
+    return holds(op, x, d);
+  }
+  case FieldType::Float: {
+    auto bits = static_cast<uint32_t>(raw);
+    float x;
+    std::memcpy(&x, &bits, sizeof x);
+    return holds(op, double(x), d);
+  }
+  case FieldType::Bool:
+    if (raw > 1)
+      bad = true;
+    return holds(op, raw, u);
+  case FieldType::UInt:
+  case FieldType::Fixed64:
+    return holds(op, raw, u);
+  case FieldType::UInt32:
+  case FieldType::Fixed32:
+    return holds(op, uint64_t(uint32_t(raw)), u);
+  case FieldType::Int:
+    return holds(op, static_cast<int64_t>(raw >> 1) ^
+                         -static_cast<int64_t>(raw & 1),
+                 i);
+  case FieldType::Int64:
+  case FieldType::SFixed64:
+    return holds(op, static_cast<int64_t>(raw), i);
+  case FieldType::SInt32:
+    return holds(op, int64_t(unzigzag32(uint32_t(raw))), i);
+  default: // Int32, Enum, SFixed32
+    return holds(op, int64_t(static_cast<int32_t>(raw)), i);
+  }
+}
+
+bool Predicate::compare(State &st, const Node &n) const {
+  const Slot &slot = slots[n.slot];
+  if (!st.scanned[slot.scope])
+    scan(st, slot.scope);
+  if (st.malformed)
+    return false;
+  const WireField &last = st.last[n.slot];
+  if (n.type == Node::Has)
+    return last.number != 0;
+
+  const FieldDesc &fd = *slot.field;
+  auto op = static_cast<uint8_t>(n.op);
+  bool bad = false;
+  if (!isRepeated(fd)) {
+    bool r = last.number != 0
+                 ? test(op, fd, last.value, last.asBytes(), n.i, n.u, n.d,
+                        n.s, bad)
+                 : test(op, fd, 0, {}, n.i, n.u, n.d, n.s, bad);
+    st.malformed |= bad;
+    return r && !bad;
+  }
+  if (last.number == 0) // no elements: no element matches
+    return false;
+
+  // Any element: walk every occurrence again, expanding packed runs
+  const uint8_t *data = st.data;
+  size_t size = st.size;
+  if (scopes[slot.scope].parentSlot != kNoParent) {
+    const WireField &msg = st.last[scopes[slot.scope].parentSlot];
+    data = msg.data;
+    size = msg.size;
+  }
+  WireType want = wireOf(fd.type);
+  WireScanner scanner(data, size);
+  for (WireField f; scanner.next(f);) {
+    if (f.number != fd.number)
+      continue;
+    if (f.wire == want) {
+      if (test(op, fd, f.value, f.asBytes(), n.i, n.u, n.d, n.s, bad))
+        return !(st.malformed |= bad);
+      continue;
+    }
+    const uint8_t *q = f.data;
+    const uint8_t *end = f.data + f.size;
+    size_t width = want == I64 ? 8 : 4;
+    while (q < end) {
+      uint64_t raw = 0;
+      if (want != VARINT) {
+        if (size_t(end - q) < width)
+          return !(st.malformed = true);
+        for (size_t k = 0; k < width; ++k)
+          raw |= uint64_t(*q++) << (8 * k);
+      } else if (!scanVarint(q, end, raw)) {
+        return !(st.malformed = true);
+      }
+      if (test(op, fd, raw, {}, n.i, n.u, n.d, n.s, bad))
+        return !(st.malformed |= bad);
+    }
+  }
+  st.malformed |= bad;
+  return false;
+}
+
+bool Predicate::eval(State &st, uint32_t node) const {
+  const Node &n = nodes[node];
+  switch (n.type) {
+  case Node::And:
+    return eval(st, n.lhs) && eval(st, n.rhs);
+  case Node::Or:
+    return eval(st, n.lhs) || eval(st, n.rhs);
+  case Node::Not:
+    return !eval(st, n.lhs);
+  default:
+    return compare(st, n);
+  }
+}
+
+bool Predicate::matches(const uint8_t *data, size_t size) const {
+  State st;
+  reset(st, data, size);
+  bool r = eval(st, static_cast<uint32_t>(nodes.size() - 1));
+  return r && !st.malformed;
+}
+
+std::vector<uint8_t>
+Predicate::select(const std::vector<std::vector<uint8_t>> &records) const {
+  std::vector<uint8_t> bits((records.size() + 7) / 8, 0);
+  State st;
+  auto root = static_cast<uint32_t>(nodes.size() - 1);
+  for (size_t r = 0; r < records.size(); ++r) {
+    reset(st, records[r].data(), records[r].size());
+    if (eval(st, root) && !st.malformed)
+      bits[r / 8] |= uint8_t(1u << (r % 8));
+  }
+  return bits;
+}
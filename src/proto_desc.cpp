@@ -1,7 +1,238 @@
 #include "proto_desc.h"
+#include "alloc_accounting.h"
 #include "log.h"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <string_view>
+#include <utility>
+#include <cstring>
 #include <stdexcept>
 
+static thread_local CopyStats tlsCopyStats;
+
+CopyStats copyStats() { return tlsCopyStats; }
+
+void resetCopyStats() { tlsCopyStats = CopyStats{}; }
+
+void detail::countCopy(uint64_t CopyStats::*counter) {
+  ++(tlsCopyStats.*counter);
+#if PROTO_ALLOC_ACCOUNTING
+  AllocTraceState &st = allocTrace;
+  if (st.trace == nullptr || st.charging)
+    return;
+  st.charging = true;
+  AllocationSite &site = st.trace->siteHere();
+  ++(counter == &CopyStats::messages ? site.messageCopies
+                                     : site.repeatedCopies);
+  st.charging = false;
+#endif
+}
+
+EnumDesc::EnumDesc(std::string name, std::vector<EnumValueDesc> values)
+    : enumName(std::move(name)), enumValues(std::move(values)) {
+  if (enumValues.empty())
+    return;
+  int64_t lo = enumValues[0].number, hi = lo;
+  for (uint32_t i = 0; i < enumValues.size(); ++i) {
+    const EnumValueDesc &v = enumValues[i];
+    if (!numbersByName.emplace(v.name, v.number).second)
+      throw std::runtime_error("duplicate enum value name: " + v.name);
+    lo = std::min<int64_t>(lo, v.number);
+    hi = std::max<int64_t>(hi, v.number);
+  }
+
+  uint64_t range = uint64_t(hi - lo) + 1;
+  if (range > std::max<uint64_t>(64, 4 * enumValues.size())) {
+    for (uint32_t i = 0; i < enumValues.size(); ++i)
+      sparseNames.emplace(enumValues[i].number, i); // first alias wins
+    return;
+  }
+  minNumber = lo;
+  span = range;
+  knownBits.assign((range + 63) / 64, 0);
+  denseNames.assign(range, 0);
+  for (uint32_t i = enumValues.size(); i-- > 0;) { // first alias wins
+    uint64_t off = uint64_t(enumValues[i].number - lo);
+    knownBits[off / 64] |= uint64_t(1) << (off % 64);
+    denseNames[off] = i;
+  }
+}
+
+const std::string *EnumDesc::nameOf(int32_t number) const {
+  if (!isKnown(number))
+    return nullptr;
+  if (isDense())
+    return &enumValues[denseNames[uint64_t(int64_t(number) - minNumber)]].name;
+  return &enumValues[sparseNames.at(number)].name;
+}
+
+std::optional<int32_t> EnumDesc::numberOf(const std::string &name) const {
+  auto it = numbersByName.find(name);
+  if (it == numbersByName.end())
+    return std::nullopt;
+  return it->second;
+}
+
+FieldDesc FieldDesc::map(std::string n, uint32_t num, FieldType keyType,
+                         FieldType valueType,
+                         std::shared_ptr<const ProtoDesc> valueDesc,
+                         std::shared_ptr<const EnumDesc> valueEnum) {
+  switch (keyType) {
+  case FieldType::Int:
+  case FieldType::UInt:
+  case FieldType::Bool:
+  case FieldType::String:
+  case FieldType::Int32:
+  case FieldType::Int64:
+  case FieldType::UInt32:
+  case FieldType::SInt32:
+  case FieldType::Fixed32:
+  case FieldType::Fixed64:
+  case FieldType::SFixed32:
+  case FieldType::SFixed64:
+    break;
+  default:
+    throw std::runtime_error("invalid map key type: " + n);
+  }
+  if (valueType == FieldType::Map)
+    throw std::runtime_error("map value cannot be a map: " + n);
+
+  auto entry = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"key", 1, keyType},
+      FieldDesc("value", 2, valueType, /*repeated=*/false, /*packed=*/false,
+                std::move(valueDesc))
+          .withEnum(std::move(valueEnum)),
+  });
+  return FieldDesc(std::move(n), num, FieldType::Map, /*repeated=*/false,
+                   /*packed=*/false, std::move(entry));
+}
+
+FieldDesc FieldDesc::ofType(std::string name) && {
+  if (type != FieldType::Map) {
+    typeName = std::move(name);
+    return std::move(*this);
+  }
+  // The entry descriptor is shared and immutable: build one naming the value
+  const FieldDesc &v = mapValue();
+  nestedDesc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      mapKey(),
+      FieldDesc("value", 2, v.type, /*repeated=*/false, /*packed=*/false)
+          .withEnum(v.enumDesc)
+          .ofType(std::move(name)),
+  });
+  return std::move(*this);
+}
+
+const FieldDesc &FieldDesc::mapKey() const { return nestedDesc->fields[0]; }
+
+const FieldDesc &FieldDesc::mapValue() const { return nestedDesc->fields[1]; }
+
+// Width of a field stored inline in the scalar area, or 0 if out-of-line
+static uint32_t inlineWidth(const FieldDesc &fd) {
+  if (fd.isRepeated)
+    return 0;
+  switch (fd.type) {
+  case FieldType::Int:
+  case FieldType::UInt:
+  case FieldType::Double:
+  case FieldType::Int64:
+  case FieldType::Fixed64:
+  case FieldType::SFixed64:
+    return 8;
+  case FieldType::Float:
+  case FieldType::Enum:
+  case FieldType::Int32:
+  case FieldType::UInt32:
+  case FieldType::SInt32:
+  case FieldType::Fixed32:
+  case FieldType::SFixed32:
+    return 4;
+  case FieldType::Bool:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static MessageLayout layoutFor(const std::vector<FieldDesc> &fields,
+                               const std::vector<OneofDesc> &oneofs) {
+  MessageLayout layout;
+  layout.slots.resize(fields.size());
+  layout.caseOffsets.resize(oneofs.size());
+  layout.presenceWords = static_cast<uint32_t>((fields.size() + 63) / 64);
+
+  // Inline items: each plain scalar field, and per oneof its shared value
+  // area and case discriminator
+  struct Item {
+    uint32_t width;
+    size_t field; // plain field index, or oneof index for the others
+    enum { Field, OneofValue, OneofCase } kind;
+  };
+  std::vector<Item> items;
+  std::vector<uint32_t> oneofWidth(oneofs.size(), 0);
+  std::vector<bool> oneofBoxed(oneofs.size(), false);
+  for (size_t i = 0; i < fields.size(); ++i) {
+    uint32_t width = inlineWidth(fields[i]);
+    if (fields[i].oneofIndex >= 0) {
+      size_t g = static_cast<size_t>(fields[i].oneofIndex);
+      oneofWidth[g] = std::max(oneofWidth[g], width);
+      oneofBoxed[g] = oneofBoxed[g] || width == 0;
+    } else if (width != 0) {
+      items.push_back({width, i, Item::Field});
+    } else {
+      layout.slots[i] = {false, layout.boxedCount++};
+    }
+  }
+  for (size_t g = 0; g < oneofs.size(); ++g) {
+    if (oneofWidth[g] != 0)
+      items.push_back({oneofWidth[g], g, Item::OneofValue});
+    items.push_back({uint32_t(sizeof(uint32_t)), g, Item::OneofCase});
+  }
+
+  // Widest first keeps every inline slot naturally aligned
+  std::stable_sort(items.begin(), items.end(),
+                   [](const Item &a, const Item &b) { return a.width > b.width; });
+
+  uint32_t scalarBytes = 0;
+  std::vector<uint32_t> oneofValue(oneofs.size(), 0);
+  for (const Item &item : items) {
+    if (item.kind == Item::Field)
+      layout.slots[item.field] = {true, scalarBytes};
+    else if (item.kind == Item::OneofValue)
+      oneofValue[item.field] = scalarBytes;
+    else
+      layout.caseOffsets[item.field] = scalarBytes;
+    scalarBytes += item.width;
+  }
+  layout.scalarWords = (scalarBytes + 7) / 8;
+
+  for (size_t g = 0; g < oneofs.size(); ++g) {
+    uint32_t box = oneofBoxed[g] ? layout.boxedCount++ : 0;
+    for (size_t i : oneofs[g].fields)
+      layout.slots[i] = inlineWidth(fields[i]) != 0
+                            ? MessageLayout::Slot{true, oneofValue[g]}
+                            : MessageLayout::Slot{false, box};
+  }
+  return layout;
+}
+
+// protoc's default json_name: underscores dropped, the letter after each
+// one upper-cased ("user_id" -> "userId")
+static std::string jsonNameOf(const std::string &name) {
+  std::string out;
+  bool upper = false;
+  for (char c : name) {
+    if (c == '_') {
+      upper = true;
+    } else {
+      out += upper && c >= 'a' && c <= 'z' ? char(c - 'a' + 'A') : c;
+      upper = false;
+    }
+  }
+  return out;
+}
+
 ProtoDesc::ProtoDesc(std::vector<FieldDesc> flds) : fields(std::move(flds)) {
   nameToIndex.reserve(fields.size());
   numberToIndex.reserve(fields.size());
@@ -12,10 +243,42 @@ ProtoDesc::ProtoDesc(std::vector<FieldDesc> flds) : fields(std::move(flds)) {
       throw std::runtime_error("field number cannot be 0");
     if (!nameToIndex.emplace(fd.name, i).second)
       throw std::runtime_error("duplicate field name: " + fd.name);
+    fields[i].jsonName = jsonNameOf(fd.name);
+    jsonNameToIndex.emplace(fd.jsonName, i); // first wins on a clash
     if (!numberToIndex.emplace(fd.number, i).second)
       throw std::runtime_error("duplicate field number: " +
                                std::to_string(fd.number));
+    if (fd.type == FieldType::Map) {
+      if (!fd.nestedDesc)
+        throw std::runtime_error("map field needs an entry descriptor: " +
+                                 fd.name);
+      const FieldDesc &v = fd.mapValue();
+      if (v.type == FieldType::Message && !v.nestedDesc && v.typeName.empty())
+        throw std::runtime_error("map of messages needs a value descriptor: " +
+                                 fd.name);
+    }
+    if (!fd.oneof.empty()) {
+      if (fd.isRepeated || fd.type == FieldType::Map)
+        throw std::runtime_error("oneof member cannot be repeated: " +
+                                 fd.name);
+      std::optional<size_t> group = oneofByName(fd.oneof);
+      if (!group.has_value()) {
+        group = oneofDescs.size();
+        oneofDescs.push_back({fd.oneof, {}});
+      }
+      oneofDescs[*group].fields.push_back(i);
+      fields[i].oneofIndex = static_cast<int32_t>(*group);
+    }
   }
+
+  numberOrder.resize(fields.size());
+  for (size_t i = 0; i < fields.size(); ++i)
+    numberOrder[i] = i;
+  std::sort(numberOrder.begin(), numberOrder.end(), [this](size_t a, size_t b) {
+    return fields[a].number < fields[b].number;
+  });
+
+  msgLayout = layoutFor(fields, oneofDescs);
 }
 
 const FieldDesc *ProtoDesc::findByName(const std::string &name) const {
@@ -32,6 +295,21 @@ std::optional<size_t> ProtoDesc::indexByName(const std::string &name) const {
   return it->second;
 }
 
+std::optional<size_t>
+ProtoDesc::indexByJsonName(const std::string &name) const {
+  auto it = jsonNameToIndex.find(name);
+  if (it == jsonNameToIndex.end())
+    return std::nullopt;
+  return it->second;
+}
+
+std::optional<size_t> ProtoDesc::oneofByName(const std::string &name) const {
+  for (size_t g = 0; g < oneofDescs.size(); ++g)
+    if (oneofDescs[g].name == name)
+      return g;
+  return std::nullopt;
+}
+
 std::optional<size_t> ProtoDesc::indexByNumber(uint32_t number) const {
   auto it = numberToIndex.find(number);
   if (it == numberToIndex.end()) {
@@ -41,9 +319,6 @@ std::optional<size_t> ProtoDesc::indexByNumber(uint32_t number) const {
   return it->second;
 }
 
-Message::Message(std::shared_ptr<const ProtoDesc> d)
-    : desc(std::move(d)), vals(desc->fields.size()) {}
-
 static bool valueMatchesFieldType(FieldType type, const Value &v) {
   switch (type) {
   case FieldType::Int:
@@ -62,20 +337,355 @@ static bool valueMatchesFieldType(FieldType type, const Value &v) {
     return std::holds_alternative<float>(v);
   case FieldType::Bytes:
     return std::holds_alternative<std::vector<uint8_t>>(v);
+  case FieldType::Map:
+    return std::holds_alternative<MapVal>(v);
+  case FieldType::Enum:
+  case FieldType::Int32:
+  case FieldType::SInt32:
+  case FieldType::SFixed32:
+    return std::holds_alternative<int32_t>(v);
+  case FieldType::Int64:
+  case FieldType::SFixed64:
+    return std::holds_alternative<int64_t>(v);
+  case FieldType::UInt32:
+  case FieldType::Fixed32:
+    return std::holds_alternative<uint32_t>(v);
+  case FieldType::Fixed64:
+    return std::holds_alternative<uint64_t>(v);
   default:
     return false;
   }
 }
 
-std::optional<std::reference_wrapper<const Value>>
-Message::get(const std::string &fieldName) const {
+template <typename T> static T loadScalar(const unsigned char *p) {
+  T x;
+  std::memcpy(&x, p, sizeof(T));
+  return x;
+}
+
+template <typename T> static void storeScalar(unsigned char *p, T x) {
+  std::memcpy(p, &x, sizeof(T));
+}
+
+static Value loadInline(FieldType type, const unsigned char *p) {
+  switch (type) {
+  case FieldType::Int:
+  case FieldType::Int64:
+  case FieldType::SFixed64:
+    return loadScalar<int64_t>(p);
+  case FieldType::UInt:
+  case FieldType::Fixed64:
+    return loadScalar<uint64_t>(p);
+  case FieldType::Double:
+    return loadScalar<double>(p);
+  case FieldType::Float:
+    return loadScalar<float>(p);
+  case FieldType::Enum:
+  case FieldType::Int32:
+  case FieldType::SInt32:
+  case FieldType::SFixed32:
+    return loadScalar<int32_t>(p);
+  case FieldType::UInt32:
+  case FieldType::Fixed32:
+    return loadScalar<uint32_t>(p);
+  case FieldType::Bool:
+    return *p != 0;
+  default:
+    return Value{};
+  }
+}
+
+// v must already match type (see valueMatchesFieldType)
+static void storeInline(FieldType type, unsigned char *p, const Value &v) {
+  switch (type) {
+  case FieldType::Int:
+  case FieldType::Int64:
+  case FieldType::SFixed64:
+    storeScalar(p, std::get<int64_t>(v));
+    break;
+  case FieldType::UInt:
+  case FieldType::Fixed64:
+    storeScalar(p, std::get<uint64_t>(v));
+    break;
+  case FieldType::Double:
+    storeScalar(p, std::get<double>(v));
+    break;
+  case FieldType::Float:
+    storeScalar(p, std::get<float>(v));
+    break;
+  case FieldType::Enum:
+  case FieldType::Int32:
+  case FieldType::SInt32:
+  case FieldType::SFixed32:
+    storeScalar(p, std::get<int32_t>(v));
+    break;
+  case FieldType::UInt32:
+  case FieldType::Fixed32:
+    storeScalar(p, std::get<uint32_t>(v));
+    break;
+  case FieldType::Bool:
+    *p = std::get<bool>(v) ? 1 : 0;
+    break;
+  default:
+    break;
+  }
+}
+
+// Shared, reference-counted out-of-line value. The acquire/release pairs on
+// refs order a box's last reads by other owners before its deletion or its
+// in-place modification by the final owner.
+struct Message::Box {
+  std::atomic<uint32_t> refs{1};
+  Value value;
+  // Elements of a repeated value emptied by clear(), handed out again by
+  // appendAt. Not part of the value: clones start without them.
+  std::vector<Value> spare;
+
+  void recycle();
+};
+
+Message::Message(std::shared_ptr<const ProtoDesc> d) : desc(std::move(d)) {
+  size_t words = layout().blockWords();
+  if (words != 0)
+    storage = std::make_unique<uint64_t[]>(words); // zeroed: nothing present
+}
+
+Message::Message(const Message &other) : desc(other.desc) {
+#if PROTO_COPY_COUNTERS
+  detail::countCopy(&CopyStats::messages);
+#endif
+  if (!other.storage)
+    return;
+  const MessageLayout &lay = layout();
+  size_t words = lay.blockWords();
+  storage = std::make_unique_for_overwrite<uint64_t[]>(words);
+  std::memcpy(storage.get(), other.storage.get(), words * sizeof(uint64_t));
+  for (uint32_t b = 0; b < lay.boxedCount; ++b)
+    if (Box *bx = box(b))
+      bx->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+Message &Message::operator=(const Message &other) {
+  if (this != &other)
+    *this = Message(other);
+  return *this;
+}
+
+Message &Message::operator=(Message &&other) noexcept {
+  if (this != &other) {
+    release();
+    desc = std::move(other.desc);
+    storage = std::move(other.storage);
+  }
+  return *this;
+}
+
+Message::~Message() { release(); }
+
+void Message::unref(Box *b) {
+  if (b != nullptr && b->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    delete b;
+}
+
+void Message::release() {
+  if (!storage)
+    return;
+  for (uint32_t b = 0; b < layout().boxedCount; ++b)
+    unref(box(b));
+  storage.reset();
+}
+
+const unsigned char *Message::scalarArea() const {
+  return reinterpret_cast<const unsigned char *>(storage.get() +
+                                                 layout().presenceWords);
+}
+
+unsigned char *Message::scalarArea() {
+  return reinterpret_cast<unsigned char *>(storage.get() +
+                                           layout().presenceWords);
+}
+
+Message::Box *Message::box(uint32_t boxIdx) const {
+  const MessageLayout &lay = layout();
+  uint64_t word = storage[size_t(lay.presenceWords) + lay.scalarWords + boxIdx];
+  return reinterpret_cast<Box *>(static_cast<uintptr_t>(word));
+}
+
+void Message::setBox(uint32_t boxIdx, Box *b) {
+  const MessageLayout &lay = layout();
+  storage[size_t(lay.presenceWords) + lay.scalarWords + boxIdx] =
+      reinterpret_cast<uintptr_t>(b);
+}
+
+void Message::markPresent(size_t fieldIdx) {
+  int32_t group = desc->fields[fieldIdx].oneofIndex;
+  if (group >= 0 && oneofCase(group) != fieldIdx + 1) {
+    // Switching members: drop the previous one and record the new case. The
+    // shared box is kept when the new member is out-of-line too.
+    clearOneofMember(group, !layout().slots[fieldIdx].isInline);
+    storeScalar(scalarArea() + layout().caseOffsets[group],
+                static_cast<uint32_t>(fieldIdx + 1));
+  }
+  storage[fieldIdx / 64] |= uint64_t(1) << (fieldIdx % 64);
+}
+
+uint32_t Message::oneofCase(int32_t group) const {
+  return loadScalar<uint32_t>(scalarArea() + layout().caseOffsets[group]);
+}
+
+// Clears the member set in group, if any. An out-of-line member's box is
+// released unless keepBox (the caller is about to reuse it for another
+// out-of-line member).
+void Message::clearOneofMember(int32_t group, bool keepBox) {
+  uint32_t current = oneofCase(group);
+  if (current == 0)
+    return;
+  size_t member = current - 1;
+  storage[member / 64] &= ~(uint64_t(1) << (member % 64));
+  storeScalar(scalarArea() + layout().caseOffsets[group], uint32_t(0));
+
+  const MessageLayout::Slot &slot = layout().slots[member];
+  if (!slot.isInline && !keepBox) {
+    unref(box(slot.offset));
+    setBox(slot.offset, nullptr);
+  }
+}
+
+bool Message::has(size_t fieldIdx) const {
+  return (storage[fieldIdx / 64] >> (fieldIdx % 64)) & 1;
+}
+
+ValueRef Message::valueAt(size_t fieldIdx) const {
+  const MessageLayout::Slot &slot = layout().slots[fieldIdx];
+  if (slot.isInline)
+    return ValueRef(loadInline(desc->fields[fieldIdx].type,
+                               scalarArea() + slot.offset));
+  return ValueRef(&box(slot.offset)->value);
+}
+
+Value &Message::boxedAt(size_t fieldIdx) {
+  const MessageLayout::Slot &slot = layout().slots[fieldIdx];
+  if (slot.isInline)
+    throw std::logic_error("field is stored inline: " +
+                           desc->fields[fieldIdx].name);
+  Box *b = box(slot.offset);
+  if (b == nullptr) {
+    b = new Box();
+    setBox(slot.offset, b);
+  } else if (b->refs.load(std::memory_order_acquire) != 1) {
+    // Shared with another message: clone this level only (nested boxes
+    // inside the copy stay shared), or start empty if the field is unset
+    Box *own = has(fieldIdx) ? new Box{{1}, b->value, {}} : new Box();
+    setBox(slot.offset, own);
+    unref(b);
+    b = own;
+  }
+  markPresent(fieldIdx);
+  return b->value;
+}
+
+Value &Message::appendAt(size_t fieldIdx) {
+  const FieldDesc &fd = desc->fields[fieldIdx];
+  if (!fd.isRepeated)
+    throw std::logic_error("field is not repeated: " + fd.name);
+  bool fresh = !has(fieldIdx);
+  Value &slot = boxedAt(fieldIdx);
+  if (fresh && !std::holds_alternative<RepeatedVal>(slot))
+    slot.emplace<RepeatedVal>(RepeatedVal{fd.type, {}});
+  RepeatedVal &rv = std::get<RepeatedVal>(slot);
+
+  std::vector<Value> &spare = box(layout().slots[fieldIdx].offset)->spare;
+  if (spare.empty())
+    return rv.values.emplace_back();
+  rv.values.push_back(std::move(spare.back()));
+  spare.pop_back();
+  return rv.values.back();
+}
+
+// Empties v in place, keeping its buffers
+static void clearValue(Value &v) {
+  if (auto *s = std::get_if<std::string>(&v))
+    s->clear();
+  else if (auto *b = std::get_if<std::vector<uint8_t>>(&v))
+    b->clear();
+  else if (auto *m = std::get_if<Message>(&v))
+    m->clear();
+  else if (auto *mv = std::get_if<MapVal>(&v))
+    mv->clear();
+}
+
+void Message::Box::recycle() {
+  auto *rv = std::get_if<RepeatedVal>(&value);
+  if (rv == nullptr) {
+    clearValue(value);
+    return;
+  }
+  // Scalar elements own nothing worth keeping beyond the vector itself.
+  // Pushed last-first so element i is handed out again as element i, whose
+  // buffers already fit the same position in a message of the same shape.
+  if (rv->elemType == FieldType::String || rv->elemType == FieldType::Bytes ||
+      rv->elemType == FieldType::Message) {
+    for (auto it = rv->values.rbegin(); it != rv->values.rend(); ++it) {
+      clearValue(*it);
+      spare.push_back(std::move(*it));
+    }
+  }
+  rv->values.clear();
+}
+
+void Message::clear() {
+  if (!storage)
+    return;
+  const MessageLayout &lay = layout();
+  // Presence bits, inline scalars and oneof cases
+  std::memset(storage.get(), 0,
+              (size_t(lay.presenceWords) + lay.scalarWords) * sizeof(uint64_t));
+  for (uint32_t b = 0; b < lay.boxedCount; ++b) {
+    Box *bx = box(b);
+    if (bx == nullptr)
+      continue;
+    if (bx->refs.load(std::memory_order_acquire) == 1) {
+      bx->recycle();
+    } else {
+      unref(bx);
+      setBox(b, nullptr);
+    }
+  }
+}
+
+bool Message::setAt(size_t fieldIdx, Value v) {
+  const FieldDesc &fd = desc->fields[fieldIdx];
+  if (fd.isRepeated) {
+    // Expecting a RepeatedVal
+    const RepeatedVal *rv = std::get_if<RepeatedVal>(&v);
+    if (rv == nullptr || rv->elemType != fd.type)
+      return false;
+  } else if (!valueMatchesFieldType(fd.type, v)) {
+    return false;
+  } else if (const MapVal *mv = std::get_if<MapVal>(&v)) {
+    if (mv->keyType != fd.mapKey().type ||
+        mv->valueType != fd.mapValue().type)
+      return false;
+  }
+
+  const MessageLayout::Slot &slot = layout().slots[fieldIdx];
+  if (slot.isInline) {
+    storeInline(fd.type, scalarArea() + slot.offset, v);
+    markPresent(fieldIdx);
+  } else {
+    boxedAt(fieldIdx) = std::move(v);
+  }
+  return true;
+}
+
+std::optional<ValueRef> Message::get(const std::string &fieldName) const {
   std::optional<size_t> maybeIdx = desc->indexByName(fieldName);
   if (!maybeIdx.has_value())
     return std::nullopt;
   size_t idx = *maybeIdx;
-  if (!vals[idx].has_value())
+  if (!has(idx))
     return std::nullopt;
-  return std::cref(*vals[idx]);
+  return valueAt(idx);
 }
 
 std::optional<std::reference_wrapper<const Value>>
@@ -91,11 +701,11 @@ Message::getByIndex(const std::string &fieldName, size_t idx) const {
     PB_LOG("Field is not repeated: " << fieldName);
     return std::nullopt;
   }
-  if (!vals[fieldIdx].has_value()) {
+  if (!has(fieldIdx)) {
     PB_LOG("No value set for field: " << fieldName);
     return std::nullopt;
   }
-  const Value &v = *vals[fieldIdx];
+  const Value &v = box(layout().slots[fieldIdx].offset)->value;
   if (!std::holds_alternative<RepeatedVal>(v)) {
     PB_LOG("Value is not repeated for field: " << fieldName);
     return std::nullopt;
@@ -113,56 +723,8 @@ bool Message::set(const std::string &fieldName, Value v) {
   if (!maybeIdx.has_value()) {
     return false;
   }
-  size_t idx = *maybeIdx;
-  const FieldDesc &fd = desc->fields[idx];
-  if (fd.isRepeated) {
-    // Expecting a RepeatedVal
-    if (!std::holds_alternative<RepeatedVal>(v))
-      return false;
-    const RepeatedVal &rv = std::get<RepeatedVal>(v);
-    if (rv.elemType != fd.type)
-      return false;
-  } else {
-    // Type check
-    switch (fd.type) {
-    case FieldType::Int:
-      if (!std::holds_alternative<std::int64_t>(v))
-        return false;
-      break;
-    case FieldType::Double:
-      if (!std::holds_alternative<double>(v))
-        return false;
-      break;
-    case FieldType::String:
-      if (!std::holds_alternative<std::string>(v))
-        return false;
-      break;
-    case FieldType::UInt:
-      if (!std::holds_alternative<std::uint64_t>(v))
-        return false;
-      break;
-    case FieldType::Bool:
-      if (!std::holds_alternative<bool>(v))
-        return false;
-      break;
-    case FieldType::Message:
-      if (!std::holds_alternative<Message>(v))
-        return false;
-      break;
-    case FieldType::Float:
-      if (!std::holds_alternative<float>(v))
-        return false;
-      break;
-    case FieldType::Bytes:
-      if (!std::holds_alternative<std::vector<uint8_t>>(v))
-        return false;
-      break;
-    default:
-      return false;
-    }
-  }
-  vals[idx] = std::move(v);
-  return true;
+  detail::AllocFrame frame(AllocStage::Mutate, &desc->fields[*maybeIdx]);
+  return setAt(*maybeIdx, std::move(v));
 }
 
 bool Message::setByIndex(const std::string &fieldName, size_t idx, Value v) {
@@ -173,15 +735,16 @@ bool Message::setByIndex(const std::string &fieldName, size_t idx, Value v) {
   }
   size_t fieldIdx = *maybeIdx;
   const FieldDesc &fd = desc->fields[fieldIdx];
+  detail::AllocFrame frame(AllocStage::Mutate, &fd);
   if (!fd.isRepeated) {
     PB_LOG("Field is not repeated: " << fieldName);
     return false;
   }
-  if (!vals[fieldIdx].has_value()) {
+  if (!has(fieldIdx)) {
     PB_LOG("No value set for field: " << fieldName);
     return false;
   }
-  Value &fieldValue = *vals[fieldIdx];
+  Value &fieldValue = boxedAt(fieldIdx);
   if (!std::holds_alternative<RepeatedVal>(fieldValue)) {
     PB_LOG("Value is not repeated for field: " << fieldName);
     return false;
@@ -211,21 +774,20 @@ bool Message::push(const std::string &fieldName, Value v) {
   }
   size_t fieldIdx = *maybeIdx;
   const FieldDesc &fd = desc->fields[fieldIdx];
+  detail::AllocFrame frame(AllocStage::Mutate, &fd);
   if (!fd.isRepeated) {
     PB_LOG("Field is not repeated: " << fieldName);
     return false;
   }
-  if (!vals[fieldIdx].has_value()) {
+  if (!has(fieldIdx)) {
     if (!valueMatchesFieldType(fd.type, v)) {
       PB_LOG("Element value type mismatch for field: " << fieldName);
       return false;
     }
     // Initialize RepeatedVal if not present
-    RepeatedVal rv;
-    rv.elemType = fd.type;
-    vals[fieldIdx] = rv;
+    boxedAt(fieldIdx).emplace<RepeatedVal>(RepeatedVal{fd.type, {}});
   }
-  Value &fieldValue = *vals[fieldIdx];
+  Value &fieldValue = boxedAt(fieldIdx);
   if (!std::holds_alternative<RepeatedVal>(fieldValue)) {
     PB_LOG("Value is not repeated for field: " << fieldName);
     return false;
@@ -242,3 +804,291 @@ bool Message::push(const std::string &fieldName, Value v) {
   rv.values.push_back(std::move(v));
   return true;
 }
+
+Message *Message::mutableMessage(const std::string &fieldName) {
+  auto maybeIdx = desc->indexByName(fieldName);
+  if (!maybeIdx.has_value()) {
+    PB_LOG("Field name not found: " << fieldName);
+    return nullptr;
+  }
+  size_t fieldIdx = *maybeIdx;
+  const FieldDesc &fd = desc->fields[fieldIdx];
+  detail::AllocFrame frame(AllocStage::Mutate, &fd);
+  if (fd.type != FieldType::Message || fd.isRepeated || !fd.nestedDesc) {
+    PB_LOG("Field is not a singular message: " << fieldName);
+    return nullptr;
+  }
+  bool fresh = !has(fieldIdx);
+  Value &slot = boxedAt(fieldIdx);
+  if (!fresh)
+    return std::get_if<Message>(&slot);
+  // Reuse a message kept by clear(), or left by another oneof member
+  Message *kept = std::get_if<Message>(&slot);
+  if (kept == nullptr || kept->desc != fd.nestedDesc)
+    return &slot.emplace<Message>(fd.nestedDesc);
+  kept->clear();
+  return kept;
+}
+
+Message *Message::addMessage(const std::string &fieldName) {
+  auto maybeIdx = desc->indexByName(fieldName);
+  if (!maybeIdx.has_value()) {
+    PB_LOG("Field name not found: " << fieldName);
+    return nullptr;
+  }
+  size_t fieldIdx = *maybeIdx;
+  const FieldDesc &fd = desc->fields[fieldIdx];
+  detail::AllocFrame frame(AllocStage::Mutate, &fd);
+  if (fd.type != FieldType::Message || !fd.isRepeated || !fd.nestedDesc) {
+    PB_LOG("Field is not a repeated message: " << fieldName);
+    return nullptr;
+  }
+  if (has(fieldIdx) &&
+      !std::holds_alternative<RepeatedVal>(valueAt(fieldIdx).get()))
+    return nullptr;
+  Value &elem = appendAt(fieldIdx);
+  Message *kept = std::get_if<Message>(&elem);
+  if (kept == nullptr || kept->desc != fd.nestedDesc)
+    return &elem.emplace<Message>(fd.nestedDesc);
+  return kept; // emptied by clear()
+}
+
+MapVal *Message::mutableMap(const std::string &fieldName) {
+  auto maybeIdx = desc->indexByName(fieldName);
+  if (!maybeIdx.has_value()) {
+    PB_LOG("Field name not found: " << fieldName);
+    return nullptr;
+  }
+  size_t fieldIdx = *maybeIdx;
+  const FieldDesc &fd = desc->fields[fieldIdx];
+  detail::AllocFrame frame(AllocStage::Mutate, &fd);
+  if (fd.type != FieldType::Map) {
+    PB_LOG("Field is not a map: " << fieldName);
+    return nullptr;
+  }
+  bool fresh = !has(fieldIdx);
+  Value &slot = boxedAt(fieldIdx);
+  if (fresh)
+    slot.emplace<MapVal>(fd.mapKey().type, fd.mapValue().type);
+  return std::get_if<MapVal>(&slot);
+}
+
+const FieldDesc *Message::whichOneof(const std::string &oneofName) const {
+  std::optional<size_t> group = desc->oneofByName(oneofName);
+  if (!group.has_value())
+    return nullptr;
+  uint32_t current = oneofCase(static_cast<int32_t>(*group));
+  return current == 0 ? nullptr : &desc->fields[current - 1];
+}
+
+bool Message::clearOneof(const std::string &oneofName) {
+  std::optional<size_t> group = desc->oneofByName(oneofName);
+  if (!group.has_value()) {
+    PB_LOG("Oneof not found: " << oneofName);
+    return false;
+  }
+  clearOneofMember(static_cast<int32_t>(*group), false);
+  return true;
+}
+
+static uint64_t finalizeHash(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  return h ^ (h >> 33);
+}
+
+static uint64_t hashKey(const Value &key) {
+  if (const auto *s = std::get_if<std::string>(&key))
+    return finalizeHash(std::hash<std::string_view>{}(*s));
+  if (const auto *i = std::get_if<int64_t>(&key))
+    return finalizeHash(static_cast<uint64_t>(*i));
+  if (const auto *u = std::get_if<uint64_t>(&key))
+    return finalizeHash(*u);
+  if (const auto *i = std::get_if<int32_t>(&key))
+    return finalizeHash(static_cast<uint64_t>(int64_t(*i)));
+  if (const auto *u = std::get_if<uint32_t>(&key))
+    return finalizeHash(*u);
+  if (const auto *b = std::get_if<bool>(&key))
+    return finalizeHash(*b ? 1 : 0);
+  return 0;
+}
+
+static bool keysEqual(const Value &a, const Value &b) {
+  if (a.index() != b.index())
+    return false;
+  if (const auto *s = std::get_if<std::string>(&a))
+    return *s == std::get<std::string>(b);
+  if (const auto *i = std::get_if<int64_t>(&a))
+    return *i == std::get<int64_t>(b);
+  if (const auto *u = std::get_if<uint64_t>(&a))
+    return *u == std::get<uint64_t>(b);
+  if (const auto *i = std::get_if<int32_t>(&a))
+    return *i == std::get<int32_t>(b);
+  if (const auto *u = std::get_if<uint32_t>(&a))
+    return *u == std::get<uint32_t>(b);
+  if (const auto *x = std::get_if<bool>(&a))
+    return *x == std::get<bool>(b);
+  return false;
+}
+
+MapVal::MapVal(FieldType keyType, FieldType valueType)
+    : keyType(keyType), valueType(valueType) {}
+
+// Slot holding key, or the empty slot where it would go. The table is never
+// full, so the probe always terminates.
+size_t MapVal::findSlot(const Value &key, uint64_t hash) const {
+  size_t mask = slots.size() - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    uint32_t e = slots[i];
+    if (e == 0 || (hashes[e - 1] == hash && keysEqual(keys[e - 1], key)))
+      return i;
+  }
+}
+
+void MapVal::rehash(size_t slotCount) {
+  slots.assign(slotCount, 0);
+  size_t mask = slotCount - 1;
+  for (size_t e = 0; e < keys.size(); ++e) {
+    size_t i = hashes[e] & mask;
+    while (slots[i] != 0)
+      i = (i + 1) & mask;
+    slots[i] = static_cast<uint32_t>(e + 1);
+  }
+}
+
+const Value *MapVal::find(const Value &key) const {
+  if (keys.empty())
+    return nullptr;
+  uint32_t e = slots[findSlot(key, hashKey(key))];
+  return e == 0 ? nullptr : &vals[e - 1];
+}
+
+Value *MapVal::find(const Value &key) {
+  return const_cast<Value *>(std::as_const(*this).find(key));
+}
+
+Value *MapVal::tryEmplace(Value key) {
+  if (!valueMatchesFieldType(keyType, key))
+    return nullptr;
+  uint64_t hash = hashKey(key);
+  if (!slots.empty()) {
+    uint32_t e = slots[findSlot(key, hash)];
+    if (e != 0)
+      return &vals[e - 1];
+  }
+  // Load factor stays at or below 3/4
+  if ((keys.size() + 1) * 4 > slots.size() * 3)
+    rehash(std::max<size_t>(8, slots.size() * 2));
+
+  size_t slot = findSlot(key, hash);
+  keys.push_back(std::move(key));
+  vals.emplace_back();
+  hashes.push_back(hash);
+  slots[slot] = static_cast<uint32_t>(keys.size());
+  return &vals.back();
+}
+
+bool MapVal::insertOrAssign(Value key, Value value) {
+  if (!valueMatchesFieldType(valueType, value))
+    return false;
+  Value *slot = tryEmplace(std::move(key));
+  if (slot == nullptr)
+    return false;
+  *slot = std::move(value);
+  return true;
+}
+
+bool MapVal::erase(const Value &key) {
+  if (keys.empty())
+    return false;
+  size_t hole = findSlot(key, hashKey(key));
+  if (slots[hole] == 0)
+    return false;
+  size_t e = slots[hole] - 1;
+
+  // Backward-shift deletion: pull later members of the probe run into the
+  // hole unless that would move them before their home slot
+  size_t mask = slots.size() - 1;
+  for (size_t i = (hole + 1) & mask; slots[i] != 0; i = (i + 1) & mask) {
+    size_t home = hashes[slots[i] - 1] & mask;
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      slots[hole] = slots[i];
+      hole = i;
+    }
+  }
+  slots[hole] = 0;
+
+  size_t last = keys.size() - 1;
+  if (e != last) {
+    slots[findSlot(keys[last], hashes[last])] = static_cast<uint32_t>(e + 1);
+    keys[e] = std::move(keys[last]);
+    vals[e] = std::move(vals[last]);
+    hashes[e] = hashes[last];
+  }
+  keys.pop_back();
+  vals.pop_back();
+  hashes.pop_back();
+  return true;
+}
+
+void MapVal::clear() {
+  keys.clear();
+  vals.clear();
+  hashes.clear();
+  std::fill(slots.begin(), slots.end(), 0);
+}
+
+void MapVal::reserve(size_t n) {
+  keys.reserve(n);
+  vals.reserve(n);
+  hashes.reserve(n);
+  if (n * 4 > slots.size() * 3)
+    rehash(std::bit_ceil(std::max<size_t>(8, (n * 4 + 2) / 3)));
+}
+
+size_t MapVal::capacityBytes() const {
+  return (keys.capacity() + vals.capacity()) * sizeof(Value) +
+         hashes.capacity() * sizeof(uint64_t) +
+         slots.capacity() * sizeof(uint32_t);
+}
+
+// Heap bytes owned by a value beyond sizeof(Value)
+static size_t heapBytes(const Value &v) {
+  if (const auto *s = std::get_if<std::string>(&v))
+    return s->capacity() > std::string().capacity() ? s->capacity() + 1 : 0;
+  if (const auto *b = std::get_if<std::vector<uint8_t>>(&v))
+    return b->capacity();
+  if (const auto *m = std::get_if<Message>(&v))
+    return m->spaceUsed() - sizeof(Message);
+  if (const auto *rv = std::get_if<RepeatedVal>(&v)) {
+    size_t bytes = rv->values.capacity() * sizeof(Value);
+    for (const auto &elem : rv->values)
+      bytes += heapBytes(elem);
+    return bytes;
+  }
+  if (const auto *mv = std::get_if<MapVal>(&v)) {
+    size_t bytes = mv->capacityBytes();
+    for (size_t i = 0; i < mv->size(); ++i)
+      bytes += heapBytes(mv->keyAt(i)) + heapBytes(mv->valueAt(i));
+    return bytes;
+  }
+  return 0;
+}
+
+size_t Message::spaceUsed() const {
+  size_t bytes = sizeof(Message);
+  if (!storage)
+    return bytes;
+  const MessageLayout &lay = layout();
+  bytes += lay.blockWords() * sizeof(uint64_t);
+  for (uint32_t b = 0; b < lay.boxedCount; ++b)
+    if (const Box *bx = box(b)) {
+      bytes += sizeof(Box) + heapBytes(bx->value) +
+               bx->spare.capacity() * sizeof(Value);
+      for (const Value &elem : bx->spare)
+        bytes += heapBytes(elem);
+    }
+  return bytes;
+}
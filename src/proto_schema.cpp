@@ -0,0 +1,857 @@
+#include "proto_schema.h"
+#include "descriptor_pool.h"
+#include "log.h"
+#include <stdexcept>
+
+std::shared_ptr<const ProtoDesc>
+ProtoSchema::message(const std::string &name) const {
+  auto it = messages.find(name);
+  return it == messages.end() ? nullptr : it->second;
+}
+
+std::shared_ptr<const EnumDesc>
+ProtoSchema::enumType(const std::string &name) const {
+  auto it = enums.find(name);
+  return it == enums.end() ? nullptr : it->second;
+}
+
+static constexpr uint64_t kMaxFieldNumber = (uint64_t(1) << 29) - 1;
+
+namespace {
+
+enum class Tok { End, Ident, Int, Float, String, Symbol };
+
+struct Pos {
+  size_t line = 1;
+  size_t column = 1;
+  size_t offset = 0;
+};
+
+struct Token {
+  Tok kind = Tok::End;
+  std::string_view text; // for strings, the raw text between the quotes
+  Pos pos;
+};
+
+struct ParsedField {
+  std::string name;
+  uint32_t number = 0;
+  bool repeated = false;
+  std::optional<bool> packed; // [packed = ...], if given
+  std::string oneof;
+  // Scalar type, or else the message/enum type reference as written. For
+  // maps these describe the value and mapKey holds the key type.
+  std::optional<FieldType> scalar;
+  std::string typeRef;
+  std::optional<FieldType> mapKey;
+  Pos pos;
+};
+
+struct ParsedMessage {
+  std::string fullName;
+  std::vector<ParsedField> fields;
+  Pos pos;
+};
+
+struct ParsedEnum {
+  std::string fullName;
+  std::vector<EnumValueDesc> values;
+  Pos pos;
+};
+
+std::optional<FieldType> scalarType(std::string_view name) {
+  static const std::pair<std::string_view, FieldType> kScalars[] = {
+      {"double", FieldType::Double},    {"float", FieldType::Float},
+      {"int32", FieldType::Int32},      {"int64", FieldType::Int64},
+      {"uint32", FieldType::UInt32},    {"uint64", FieldType::UInt},
+      {"sint32", FieldType::SInt32},    {"sint64", FieldType::Int},
+      {"fixed32", FieldType::Fixed32},  {"fixed64", FieldType::Fixed64},
+      {"sfixed32", FieldType::SFixed32}, {"sfixed64", FieldType::SFixed64},
+      {"bool", FieldType::Bool},        {"string", FieldType::String},
+      {"bytes", FieldType::Bytes},
+  };
+  for (const auto &[word, type] : kScalars)
+    if (word == name)
+      return type;
+  return std::nullopt;
+}
+
+bool isPackable(FieldType type) {
+  return type != FieldType::String && type != FieldType::Bytes &&
+         type != FieldType::Message && type != FieldType::Map;
+}
+
+// Decimal, hex (0x) or octal (leading 0) integer literal
+bool parseUInt(std::string_view s, uint64_t &out) {
+  uint64_t base = 10;
+  size_t i = 0;
+  if (s.size() > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+    base = 16;
+    i = 2;
+  } else if (s.size() > 1 && s[0] == '0') {
+    base = 8;
+    i = 1;
+  }
+  out = 0;
+  for (; i < s.size(); ++i) {
+    char c = s[i];
+    uint64_t d;
+    if (c >= '0' && c <= '9')
+      d = uint64_t(c - '0');
+    else if (c >= 'a' && c <= 'f')
+      d = uint64_t(c - 'a' + 10);
+    else if (c >= 'A' && c <= 'F')
+      d = uint64_t(c - 'A' + 10);
+    else
+      return false;
+    if (d >= base || out > (UINT64_MAX - d) / base)
+      return false;
+    out = out * base + d;
+  }
+  return true;
+}
+
+bool isIdentStart(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+bool isIdentChar(char c) { return isIdentStart(c) || (c >= '0' && c <= '9'); }
+
+// Recursive-descent parser over a one-token lookahead. Each parse function
+// returns false after recording the first error, like the wire decoder.
+class Parser {
+public:
+  explicit Parser(std::string_view src) : src(src) {}
+
+  bool parseFile();
+
+  SchemaError err;
+  std::string package;
+  std::vector<ParsedMessage> messages;
+  std::vector<ParsedEnum> enums;
+  bool proto3 = false;
+
+private:
+  std::string_view src;
+  Pos at; // lexer position
+  Token tok;
+
+  void bump() {
+    if (src[at.offset] == '\n') {
+      ++at.line;
+      at.column = 1;
+    } else {
+      ++at.column;
+    }
+    ++at.offset;
+  }
+  bool failAt(const Pos &pos, const std::string &what) {
+    if (err.message.empty())
+      err = SchemaError{what, pos.line, pos.column, pos.offset};
+    return false;
+  }
+  bool fail(const std::string &what) { return failAt(tok.pos, what); }
+
+  bool skipSpace();
+  bool advance();
+
+  bool isSymbol(char c) const {
+    return tok.kind == Tok::Symbol && tok.text[0] == c;
+  }
+  bool isWord(std::string_view word) const {
+    return tok.kind == Tok::Ident && tok.text == word;
+  }
+  bool expectSymbol(char c);
+  bool expectIdent(std::string &out, const char *what);
+  bool expectFieldNumber(uint32_t &out);
+
+  bool skipConstant();
+  bool skipUntilSemicolon();
+  bool skipBlock();
+  bool parseOption();
+  bool parseFieldOptions(ParsedField &f);
+  bool parseMessage(const std::string &scope);
+  bool parseEnum(const std::string &scope);
+  bool parseOneof(ParsedMessage &m);
+  bool parseField(ParsedMessage &m, const std::string &oneof);
+  bool parseMapField(ParsedMessage &m);
+  std::string qualify(const std::string &scope, std::string_view name) const {
+    return scope.empty() ? std::string(name)
+                         : scope + "." + std::string(name);
+  }
+};
+
+bool Parser::skipSpace() {
+  while (at.offset < src.size()) {
+    char c = src[at.offset];
+    if (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f' ||
+        c == '\v') {
+      bump();
+    } else if (src.compare(at.offset, 2, "//") == 0) {
+      while (at.offset < src.size() && src[at.offset] != '\n')
+        bump();
+    } else if (src.compare(at.offset, 2, "/*") == 0) {
+      Pos start = at;
+      bump();
+      bump();
+      while (at.offset < src.size() && src.compare(at.offset, 2, "*/") != 0)
+        bump();
+      if (at.offset >= src.size())
+        return failAt(start, "unterminated comment");
+      bump();
+      bump();
+    } else {
+      break;
+    }
+  }
+  return true;
+}
+
+bool Parser::advance() {
+  if (!skipSpace())
+    return false;
+  tok = Token{Tok::End, {}, at};
+  if (at.offset >= src.size())
+    return true;
+
+  size_t start = at.offset;
+  char c = src[start];
+  bool dotIdent = c == '.' && start + 1 < src.size() &&
+                  isIdentStart(src[start + 1]);
+  if (isIdentStart(c) || dotIdent) {
+    // Dotted names ("foo.Bar", ".pkg.Msg") are one token
+    bump();
+    while (at.offset < src.size()) {
+      char d = src[at.offset];
+      if (isIdentChar(d) || (d == '.' && at.offset + 1 < src.size() &&
+                             isIdentStart(src[at.offset + 1])))
+        bump();
+      else
+        break;
+    }
+    tok.kind = Tok::Ident;
+  } else if ((c >= '0' && c <= '9') ||
+             (c == '.' && start + 1 < src.size() && src[start + 1] >= '0' &&
+              src[start + 1] <= '9')) {
+    bool isFloat = false;
+    bool hex = src.compare(start, 2, "0x") == 0 ||
+               src.compare(start, 2, "0X") == 0;
+    while (at.offset < src.size()) {
+      char d = src[at.offset];
+      bool exponentSign =
+          !hex && at.offset > start && (d == '+' || d == '-') &&
+          (src[at.offset - 1] == 'e' || src[at.offset - 1] == 'E');
+      if (!hex && (d == '.' || d == 'e' || d == 'E'))
+        isFloat = true;
+      if (isIdentChar(d) || d == '.' || exponentSign)
+        bump();
+      else
+        break;
+    }
+    tok.kind = isFloat ? Tok::Float : Tok::Int;
+  } else if (c == '"' || c == '\'') {
+    bump();
+    while (at.offset < src.size() && src[at.offset] != c) {
+      if (src[at.offset] == '\n')
+        break;
+      if (src[at.offset] == '\\' && at.offset + 1 < src.size())
+        bump();
+      bump();
+    }
+    if (at.offset >= src.size() || src[at.offset] != c)
+      return failAt(tok.pos, "unterminated string");
+    bump();
+    tok.kind = Tok::String;
+    tok.text = src.substr(start + 1, at.offset - start - 2);
+    return true;
+  } else {
+    bump();
+    tok.kind = Tok::Symbol;
+  }
+  tok.text = src.substr(start, at.offset - start);
+  return true;
+}
+
+bool Parser::expectSymbol(char c) {
+  if (!isSymbol(c))
+    return fail(std::string("expected '") + c + "'");
+  return advance();
+}
+
+bool Parser::expectIdent(std::string &out, const char *what) {
+  if (tok.kind != Tok::Ident)
+    return fail(std::string("expected ") + what);
+  out = std::string(tok.text);
+  return advance();
+}
+
+bool Parser::expectFieldNumber(uint32_t &out) {
+  uint64_t n;
+  if (tok.kind != Tok::Int || !parseUInt(tok.text, n))
+    return fail("expected field number");
+  if (n == 0 || n > kMaxFieldNumber)
+    return fail("field number out of range: " + std::string(tok.text));
+  out = static_cast<uint32_t>(n);
+  return advance();
+}
+
+// Option value: a scalar constant or an aggregate in braces
+bool Parser::skipConstant() {
+  if (isSymbol('{'))
+    return skipBlock();
+  if (isSymbol('-') || isSymbol('+')) {
+    if (!advance())
+      return false;
+  }
+  if (tok.kind == Tok::End || tok.kind == Tok::Symbol)
+    return fail("expected constant");
+  if (!advance())
+    return false;
+  // Adjacent string literals concatenate
+  while (tok.kind == Tok::String) {
+    if (!advance())
+      return false;
+  }
+  return true;
+}
+
+bool Parser::skipUntilSemicolon() {
+  while (!isSymbol(';')) {
+    if (tok.kind == Tok::End)
+      return fail("expected ';'");
+    if (!advance())
+      return false;
+  }
+  return advance();
+}
+
+// Balanced { ... } starting at the opening brace
+bool Parser::skipBlock() {
+  size_t depth = 0;
+  do {
+    if (tok.kind == Tok::End)
+      return fail("expected '}'");
+    if (isSymbol('{'))
+      ++depth;
+    else if (isSymbol('}'))
+      --depth;
+    if (!advance())
+      return false;
+  } while (depth != 0);
+  return true;
+}
+
+// option name = constant; (the keyword already consumed). File, message and
+// enum options do not change descriptors.
+bool Parser::parseOption() {
+  while (!isSymbol('=')) {
+    if (tok.kind == Tok::End || isSymbol(';'))
+      return fail("expected '='");
+    if (!advance())
+      return false;
+  }
+  return advance() && skipConstant() && expectSymbol(';');
+}
+
+bool Parser::parseFieldOptions(ParsedField &f) {
+  if (!isSymbol('['))
+    return true;
+  if (!advance())
+    return false;
+  while (true) {
+    bool packed = isWord("packed");
+    Pos namePos = tok.pos;
+    while (!isSymbol('=')) {
+      if (tok.kind == Tok::End || isSymbol(']'))
+        return fail("expected '='");
+      if (!advance())
+        return false;
+    }
+    if (!advance())
+      return false;
+    if (packed) {
+      if (!isWord("true") && !isWord("false"))
+        return fail("packed must be true or false");
+      if (!f.repeated || (f.scalar.has_value() && !isPackable(*f.scalar)))
+        return failAt(namePos, "[packed] needs a repeated scalar field: " +
+                                   f.name);
+      f.packed = isWord("true");
+      if (!advance())
+        return false;
+    } else if (!skipConstant()) {
+      return false;
+    }
+    if (isSymbol(']'))
+      return advance();
+    if (!expectSymbol(','))
+      return false;
+  }
+}
+
+bool Parser::parseFile() {
+  if (!advance())
+    return false;
+  // proto2 is the default when no syntax statement is present
+  if (isWord("syntax")) {
+    if (!advance() || !expectSymbol('='))
+      return false;
+    if (tok.kind != Tok::String ||
+        (tok.text != "proto2" && tok.text != "proto3"))
+      return fail("syntax must be \"proto2\" or \"proto3\"");
+    proto3 = tok.text == "proto3";
+    if (!advance() || !expectSymbol(';'))
+      return false;
+  }
+
+  while (tok.kind != Tok::End) {
+    if (isSymbol(';')) {
+      if (!advance())
+        return false;
+    } else if (isWord("package")) {
+      if (!package.empty())
+        return fail("duplicate package statement");
+      if (!advance() || !expectIdent(package, "package name") ||
+          !expectSymbol(';'))
+        return false;
+      if (package[0] == '.')
+        return fail("package name cannot start with '.'");
+    } else if (isWord("option")) {
+      if (!advance() || !parseOption())
+        return false;
+    } else if (isWord("message")) {
+      if (!advance() || !parseMessage(package))
+        return false;
+    } else if (isWord("enum")) {
+      if (!advance() || !parseEnum(package))
+        return false;
+    } else if (isWord("service")) {
+      while (!isSymbol('{')) {
+        if (tok.kind == Tok::End)
+          return fail("expected '{'");
+        if (!advance())
+          return false;
+      }
+      if (!skipBlock())
+        return false;
+    } else if (isWord("import") || isWord("extend") || isWord("edition")) {
+      return fail("unsupported statement: " + std::string(tok.text));
+    } else {
+      return fail("unexpected token: " + std::string(tok.text));
+    }
+  }
+  return true;
+}
+
+bool Parser::parseMessage(const std::string &scope) {
+  Pos pos = tok.pos;
+  std::string name;
+  if (!expectIdent(name, "message name") || !expectSymbol('{'))
+    return false;
+
+  // Nested types are appended while the body is parsed, so fill the message
+  // in by index
+  size_t self = messages.size();
+  messages.push_back({qualify(scope, name), {}, pos});
+  ParsedMessage m{messages[self].fullName, {}, pos};
+
+  while (!isSymbol('}')) {
+    if (tok.kind == Tok::End)
+      return fail("expected '}'");
+    bool ok;
+    if (isSymbol(';')) {
+      ok = advance();
+    } else if (isWord("message")) {
+      ok = advance() && parseMessage(m.fullName);
+    } else if (isWord("enum")) {
+      ok = advance() && parseEnum(m.fullName);
+    } else if (isWord("oneof")) {
+      ok = advance() && parseOneof(m);
+    } else if (isWord("map")) {
+      ok = parseMapField(m);
+    } else if (isWord("option")) {
+      ok = advance() && parseOption();
+    } else if (isWord("reserved") || isWord("extensions")) {
+      ok = skipUntilSemicolon();
+    } else if (isWord("extend")) {
+      ok = fail("unsupported statement: extend");
+    } else {
+      ok = parseField(m, "");
+    }
+    if (!ok)
+      return false;
+  }
+  messages[self].fields = std::move(m.fields);
+  return advance();
+}
+
+bool Parser::parseEnum(const std::string &scope) {
+  Pos pos = tok.pos;
+  std::string name;
+  if (!expectIdent(name, "enum name") || !expectSymbol('{'))
+    return false;
+  ParsedEnum e{qualify(scope, name), {}, pos};
+
+  while (!isSymbol('}')) {
+    if (tok.kind == Tok::End)
+      return fail("expected '}'");
+    bool ok;
+    if (isSymbol(';')) {
+      ok = advance();
+    } else if (isWord("option")) {
+      ok = advance() && parseOption();
+    } else if (isWord("reserved")) {
+      ok = skipUntilSemicolon();
+    } else {
+      EnumValueDesc v;
+      if (!expectIdent(v.name, "enum value name") || !expectSymbol('='))
+        return false;
+      bool negative = isSymbol('-');
+      if (negative && !advance())
+        return false;
+      uint64_t n;
+      if (tok.kind != Tok::Int || !parseUInt(tok.text, n) ||
+          n > (negative ? uint64_t(INT32_MAX) + 1 : uint64_t(INT32_MAX)))
+        return fail("expected int32 enum value");
+      v.number = static_cast<int32_t>(negative ? -int64_t(n) : int64_t(n));
+      e.values.push_back(std::move(v));
+      ParsedField opts; // enum value options are parsed and ignored
+      ok = advance() && parseFieldOptions(opts) && expectSymbol(';');
+    }
+    if (!ok)
+      return false;
+  }
+  if (e.values.empty())
+    return fail("enum has no values: " + e.fullName);
+  enums.push_back(std::move(e));
+  return advance();
+}
+
+bool Parser::parseOneof(ParsedMessage &m) {
+  std::string name;
+  if (!expectIdent(name, "oneof name") || !expectSymbol('{'))
+    return false;
+  while (!isSymbol('}')) {
+    if (tok.kind == Tok::End)
+      return fail("expected '}'");
+    bool ok;
+    if (isSymbol(';'))
+      ok = advance();
+    else if (isWord("option"))
+      ok = advance() && parseOption();
+    else
+      ok = parseField(m, name);
+    if (!ok)
+      return false;
+  }
+  return advance();
+}
+
+bool Parser::parseField(ParsedMessage &m, const std::string &oneof) {
+  ParsedField f;
+  f.pos = tok.pos;
+  f.oneof = oneof;
+  if (isWord("repeated") || isWord("optional") || isWord("required")) {
+    if (!oneof.empty())
+      return fail("oneof fields cannot have a label");
+    f.repeated = isWord("repeated");
+    if (!advance())
+      return false;
+  }
+  if (isWord("map"))
+    return fail(oneof.empty() ? "map fields cannot have a label"
+                              : "map fields cannot be oneof members");
+  if (isWord("group"))
+    return fail("groups are not supported");
+
+  std::string type;
+  if (!expectIdent(type, "field type"))
+    return false;
+  f.scalar = scalarType(type);
+  if (!f.scalar.has_value())
+    f.typeRef = std::move(type);
+  if (!expectIdent(f.name, "field name") || !expectSymbol('=') ||
+      !expectFieldNumber(f.number) || !parseFieldOptions(f) ||
+      !expectSymbol(';'))
+    return false;
+  m.fields.push_back(std::move(f));
+  return true;
+}
+
+bool Parser::parseMapField(ParsedMessage &m) {
+  ParsedField f;
+  f.pos = tok.pos;
+  if (!advance() || !expectSymbol('<'))
+    return false;
+  std::string key;
+  Pos keyPos = tok.pos;
+  if (!expectIdent(key, "map key type"))
+    return false;
+  f.mapKey = scalarType(key);
+  if (!f.mapKey.has_value() || *f.mapKey == FieldType::Double ||
+      *f.mapKey == FieldType::Float || *f.mapKey == FieldType::Bytes)
+    return failAt(keyPos, "invalid map key type: " + key);
+  std::string value;
+  if (!expectSymbol(',') || !expectIdent(value, "map value type") ||
+      !expectSymbol('>'))
+    return false;
+  f.scalar = scalarType(value);
+  if (!f.scalar.has_value())
+    f.typeRef = std::move(value);
+  if (!expectIdent(f.name, "field name") || !expectSymbol('=') ||
+      !expectFieldNumber(f.number) || !parseFieldOptions(f) ||
+      !expectSymbol(';'))
+    return false;
+  m.fields.push_back(std::move(f));
+  return true;
+}
+
+// Resolves type references and builds the descriptors: linked directly,
+// dependencies first, or as named references registered in a pool
+class Linker {
+public:
+  Linker(Parser &parsed, SchemaError &err, DescriptorPool *pool = nullptr)
+      : p(parsed), err(err), pool(pool) {}
+
+  bool link(ProtoSchema &schema);
+  bool registerTypes();
+
+private:
+  struct Target {
+    FieldType type; // Message or Enum
+    std::string name;
+    std::optional<size_t> local; // index in this file, if defined here
+  };
+
+  Parser &p;
+  SchemaError &err;
+  DescriptorPool *pool;
+  std::unordered_map<std::string, size_t> messageIdx;
+  std::unordered_map<std::string, size_t> enumIdx;
+  std::vector<std::shared_ptr<const ProtoDesc>> built;
+  std::vector<std::shared_ptr<const EnumDesc>> builtEnums;
+  std::vector<char> visiting;
+
+  bool failAt(const Pos &pos, const std::string &what) {
+    if (err.message.empty())
+      err = SchemaError{what, pos.line, pos.column, pos.offset};
+    return false;
+  }
+  bool indexTypes();
+  // Innermost scope first, as protoc resolves relative names; types of this
+  // file win over types already in the pool
+  bool resolve(const std::string &scope, const ParsedField &f, Target &out);
+  bool build(size_t idx);
+  bool buildField(const ParsedMessage &m, const ParsedField &f,
+                  std::vector<FieldDesc> &out);
+  bool buildFields(const ParsedMessage &m, std::vector<FieldDesc> &out);
+};
+
+bool Linker::resolve(const std::string &scope, const ParsedField &f,
+                     Target &out) {
+  auto lookup = [&](const std::string &name) {
+    if (auto it = messageIdx.find(name); it != messageIdx.end())
+      out = {FieldType::Message, name, it->second};
+    else if (auto it = enumIdx.find(name); it != enumIdx.end())
+      out = {FieldType::Enum, name, it->second};
+    else if (pool != nullptr && pool->contains(name))
+      out = {FieldType::Message, name, std::nullopt};
+    else if (pool != nullptr && pool->findEnum(name) != nullptr)
+      out = {FieldType::Enum, name, std::nullopt};
+    else
+      return false;
+    return true;
+  };
+
+  if (f.typeRef[0] == '.') {
+    if (lookup(f.typeRef.substr(1)))
+      return true;
+  } else {
+    std::string_view s = scope;
+    while (true) {
+      std::string candidate =
+          s.empty() ? f.typeRef : std::string(s) + "." + f.typeRef;
+      if (lookup(candidate))
+        return true;
+      if (s.empty())
+        break;
+      size_t dot = s.rfind('.');
+      s = dot == std::string_view::npos ? std::string_view{} : s.substr(0, dot);
+    }
+  }
+  return failAt(f.pos, "unknown type: " + f.typeRef);
+}
+
+bool Linker::buildField(const ParsedMessage &m, const ParsedField &f,
+                        std::vector<FieldDesc> &out) {
+  FieldType type = f.scalar.value_or(FieldType::Message);
+  std::shared_ptr<const ProtoDesc> nested;
+  std::shared_ptr<const EnumDesc> enumType;
+  std::string typeName;
+  if (!f.scalar.has_value()) {
+    Target target;
+    if (!resolve(m.fullName, f, target))
+      return false;
+    type = target.type;
+    if (pool != nullptr) {
+      typeName = std::move(target.name);
+    } else if (type == FieldType::Enum) {
+      enumType = builtEnums[*target.local];
+    } else {
+      if (visiting[*target.local])
+        return failAt(f.pos, "recursive message types need a DescriptorPool: " +
+                                 m.fullName + "." + f.name);
+      if (!build(*target.local))
+        return false;
+      nested = built[*target.local];
+    }
+  }
+  if (f.packed.value_or(false) && !isPackable(type))
+    return failAt(f.pos, "[packed] needs a repeated scalar field: " + f.name);
+  // Repeated scalars are packed by default in proto3 only
+  bool packed = f.repeated && isPackable(type) && f.packed.value_or(p.proto3);
+
+  FieldDesc fd =
+      f.mapKey.has_value()
+          ? FieldDesc::map(f.name, f.number, *f.mapKey, type,
+                           std::move(nested), std::move(enumType))
+          : FieldDesc(f.name, f.number, type, f.repeated, packed,
+                      std::move(nested))
+                .withEnum(std::move(enumType));
+  fd.oneof = f.oneof;
+  if (!typeName.empty())
+    fd = std::move(fd).ofType(std::move(typeName));
+  out.push_back(std::move(fd));
+  return true;
+}
+
+bool Linker::buildFields(const ParsedMessage &m, std::vector<FieldDesc> &out) {
+  out.reserve(m.fields.size());
+  for (const ParsedField &f : m.fields) {
+    if (!buildField(m, f, out))
+      return false;
+  }
+  return true;
+}
+
+bool Linker::build(size_t idx) {
+  if (built[idx])
+    return true;
+  const ParsedMessage &m = p.messages[idx];
+  visiting[idx] = 1;
+  std::vector<FieldDesc> fields;
+  if (!buildFields(m, fields))
+    return false;
+  visiting[idx] = 0;
+
+  try {
+    built[idx] = std::make_shared<ProtoDesc>(std::move(fields));
+  } catch (const std::runtime_error &e) {
+    return failAt(m.pos, m.fullName + ": " + e.what());
+  }
+  return true;
+}
+
+bool Linker::indexTypes() {
+  auto taken = [this](const std::string &name) {
+    return pool != nullptr &&
+           (pool->contains(name) || pool->findEnum(name) != nullptr);
+  };
+  for (size_t i = 0; i < p.messages.size(); ++i) {
+    const ParsedMessage &m = p.messages[i];
+    if (taken(m.fullName) || !messageIdx.emplace(m.fullName, i).second)
+      return failAt(m.pos, "duplicate type name: " + m.fullName);
+  }
+  for (size_t i = 0; i < p.enums.size(); ++i) {
+    const ParsedEnum &e = p.enums[i];
+    if (taken(e.fullName) || messageIdx.count(e.fullName) ||
+        !enumIdx.emplace(e.fullName, i).second)
+      return failAt(e.pos, "duplicate type name: " + e.fullName);
+  }
+  return true;
+}
+
+bool Linker::link(ProtoSchema &schema) {
+  if (!indexTypes())
+    return false;
+  builtEnums.reserve(p.enums.size());
+  for (ParsedEnum &e : p.enums) {
+    try {
+      builtEnums.push_back(
+          std::make_shared<EnumDesc>(e.fullName, std::move(e.values)));
+    } catch (const std::runtime_error &ex) {
+      return failAt(e.pos, e.fullName + ": " + ex.what());
+    }
+  }
+
+  built.resize(p.messages.size());
+  visiting.assign(p.messages.size(), 0);
+  for (size_t i = 0; i < p.messages.size(); ++i) {
+    if (!build(i))
+      return false;
+  }
+
+  schema.package = p.package;
+  for (size_t i = 0; i < p.messages.size(); ++i)
+    schema.messages.emplace(p.messages[i].fullName, built[i]);
+  for (size_t i = 0; i < p.enums.size(); ++i)
+    schema.enums.emplace(p.enums[i].fullName, builtEnums[i]);
+  return true;
+}
+
+// Everything is built and checked before the first type is registered, so a
+// bad file leaves the pool untouched
+bool Linker::registerTypes() {
+  if (!indexTypes())
+    return false;
+  for (const ParsedEnum &e : p.enums) {
+    try {
+      EnumDesc probe(e.fullName, e.values);
+    } catch (const std::runtime_error &ex) {
+      return failAt(e.pos, e.fullName + ": " + ex.what());
+    }
+  }
+  std::vector<std::vector<FieldDesc>> fields(p.messages.size());
+  for (size_t i = 0; i < p.messages.size(); ++i) {
+    const ParsedMessage &m = p.messages[i];
+    if (!buildFields(m, fields[i]))
+      return false;
+    try {
+      ProtoDesc probe(fields[i]);
+    } catch (const std::runtime_error &ex) {
+      return failAt(m.pos, m.fullName + ": " + ex.what());
+    }
+  }
+
+  for (ParsedEnum &e : p.enums)
+    pool->addEnum(e.fullName, std::move(e.values));
+  for (size_t i = 0; i < p.messages.size(); ++i)
+    pool->add(p.messages[i].fullName, std::move(fields[i]));
+  return true;
+}
+
+} // namespace
+
+std::pair<std::optional<ProtoSchema>, SchemaError>
+parseProto(std::string_view source) {
+  Parser parser(source);
+  if (!parser.parseFile()) {
+    PB_LOG("proto parse failed: " << parser.err.message);
+    return {std::nullopt, std::move(parser.err)};
+  }
+  ProtoSchema schema;
+  SchemaError err;
+  if (!Linker(parser, err).link(schema))
+    return {std::nullopt, std::move(err)};
+  return {std::move(schema), SchemaError{}};
+}
+
+SchemaError parseProto(std::string_view source, DescriptorPool &pool) {
+  Parser parser(source);
+  if (!parser.parseFile()) {
+    PB_LOG("proto parse failed: " << parser.err.message);
+    return std::move(parser.err);
+  }
+  SchemaError err;
+  Linker(parser, err, &pool).registerTypes();
+  return err;
+}
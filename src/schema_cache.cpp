@@ -0,0 +1,387 @@
+#include "encoder.h"
+#include "log.h"
+#include "proto_schema.h"
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_set>
+
+// Cache layout (integers are varints, strings are varint length + bytes):
+//
+//   "PBSC" version:u8 package:str
+//   enumCount  { name:str valueCount { name:str zigzag(number) } }
+//   msgCount   { fieldCount { field } }
+//   enumNames  { key:str enumIndex }
+//   msgNames   { key:str msgIndex }
+//
+//   field: name:str number type:u8 flags:u8 [oneof:str] [key:u8 value:u8]
+//          [msgIndex] [enumIndex]
+//
+// Messages are stored dependencies first and refer to earlier messages only,
+// so the loader builds each ProtoDesc in one pass. A map field stores its key
+// and value types and its message/enum references describe the value; the
+// entry descriptor is rebuilt by FieldDesc::map.
+
+namespace {
+
+constexpr uint8_t kMagic[4] = {'P', 'B', 'S', 'C'};
+constexpr uint8_t kVersion = 1;
+
+enum FieldFlags : uint8_t {
+  kRepeated = 1,
+  kPacked = 2,
+  kInOneof = 4,
+  kHasMessage = 8,
+  kHasEnum = 16,
+};
+
+class Writer {
+public:
+  std::vector<uint8_t> out;
+
+  void write(const ProtoSchema &schema);
+
+private:
+  std::unordered_map<const ProtoDesc *, size_t> msgIndex;
+  std::unordered_map<const EnumDesc *, size_t> enumIndex;
+  std::vector<const ProtoDesc *> msgOrder;
+  std::vector<const EnumDesc *> enumOrder;
+  std::unordered_set<const ProtoDesc *> visiting;
+
+  void str(const std::string &s) {
+    appendVarint(out, s.size());
+    out.insert(out.end(), s.begin(), s.end());
+  }
+  void addEnum(const EnumDesc *e) {
+    if (e != nullptr && enumIndex.emplace(e, enumOrder.size()).second)
+      enumOrder.push_back(e);
+  }
+  void addMessage(const ProtoDesc *d);
+  void field(const FieldDesc &fd);
+};
+
+// Post-order, so every message follows the messages its fields refer to
+void Writer::addMessage(const ProtoDesc *d) {
+  if (msgIndex.count(d))
+    return;
+  if (!visiting.insert(d).second)
+    throw std::runtime_error("recursive descriptors cannot be cached");
+  for (const FieldDesc &fd : d->fields) {
+    const FieldDesc &target = fd.type == FieldType::Map ? fd.mapValue() : fd;
+    if (target.type == FieldType::Message && !target.nestedDesc)
+      throw std::runtime_error("unlinked message field: " + fd.name);
+    if (target.nestedDesc)
+      addMessage(target.nestedDesc.get());
+    addEnum(target.enumDesc.get());
+  }
+  visiting.erase(d);
+  msgIndex.emplace(d, msgOrder.size());
+  msgOrder.push_back(d);
+}
+
+void Writer::field(const FieldDesc &fd) {
+  const FieldDesc &target = fd.type == FieldType::Map ? fd.mapValue() : fd;
+  uint8_t flags = (fd.isRepeated ? kRepeated : 0) |
+                  (fd.isPacked ? kPacked : 0) |
+                  (fd.oneof.empty() ? 0 : kInOneof) |
+                  (target.nestedDesc ? kHasMessage : 0) |
+                  (target.enumDesc ? kHasEnum : 0);
+  str(fd.name);
+  appendVarint(out, fd.number);
+  out.push_back(static_cast<uint8_t>(fd.type));
+  out.push_back(flags);
+  if (flags & kInOneof)
+    str(fd.oneof);
+  if (fd.type == FieldType::Map) {
+    out.push_back(static_cast<uint8_t>(fd.mapKey().type));
+    out.push_back(static_cast<uint8_t>(target.type));
+  }
+  if (flags & kHasMessage)
+    appendVarint(out, msgIndex.at(target.nestedDesc.get()));
+  if (flags & kHasEnum)
+    appendVarint(out, enumIndex.at(target.enumDesc.get()));
+}
+
+template <typename Map>
+std::vector<typename Map::const_pointer> sortedByName(const Map &m) {
+  std::vector<typename Map::const_pointer> entries;
+  entries.reserve(m.size());
+  for (const auto &entry : m)
+    entries.push_back(&entry);
+  std::sort(entries.begin(), entries.end(),
+            [](auto a, auto b) { return a->first < b->first; });
+  return entries;
+}
+
+void Writer::write(const ProtoSchema &schema) {
+  // Sorted roots make the cache bytes a function of the schema alone
+  auto namedEnums = sortedByName(schema.enums);
+  auto namedMessages = sortedByName(schema.messages);
+  for (auto entry : namedEnums)
+    addEnum(entry->second.get());
+  for (auto entry : namedMessages)
+    addMessage(entry->second.get());
+
+  out.insert(out.end(), std::begin(kMagic), std::end(kMagic));
+  out.push_back(kVersion);
+  str(schema.package);
+
+  appendVarint(out, enumOrder.size());
+  for (const EnumDesc *e : enumOrder) {
+    str(e->name());
+    appendVarint(out, e->values().size());
+    for (const EnumValueDesc &v : e->values()) {
+      str(v.name);
+      appendVarint32(out, zigzag32(v.number));
+    }
+  }
+
+  appendVarint(out, msgOrder.size());
+  for (const ProtoDesc *d : msgOrder) {
+    appendVarint(out, d->fields.size());
+    for (const FieldDesc &fd : d->fields)
+      field(fd);
+  }
+
+  appendVarint(out, namedEnums.size());
+  for (auto entry : namedEnums) {
+    str(entry->first);
+    appendVarint(out, enumIndex.at(entry->second.get()));
+  }
+  appendVarint(out, namedMessages.size());
+  for (auto entry : namedMessages) {
+    str(entry->first);
+    appendVarint(out, msgIndex.at(entry->second.get()));
+  }
+}
+
+// Bounds-checked cursor over the cache bytes
+class Reader {
+public:
+  Reader(const uint8_t *data, size_t size) : data(data), size(size) {}
+
+  SchemaError err;
+  size_t pos = 0;
+
+  bool fail(const std::string &what, size_t at) {
+    if (err.message.empty())
+      err = SchemaError{what, 0, 0, at};
+    return false;
+  }
+  bool byte(uint8_t &out) {
+    if (pos >= size)
+      return fail("truncated descriptor cache", pos);
+    out = data[pos++];
+    return true;
+  }
+  bool varint(uint64_t &out) {
+    out = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+      uint8_t b;
+      if (!byte(b))
+        return false;
+      out |= uint64_t(b & 0x7F) << shift;
+      if (b < 0x80)
+        return true;
+    }
+    return fail("malformed varint", pos);
+  }
+  // An element count, bounded by the bytes left (each element takes at
+  // least minBytes) so a corrupt count cannot drive a huge reservation
+  bool count(uint64_t &out, size_t minBytes) {
+    size_t at = pos;
+    if (!varint(out))
+      return false;
+    if (out > (size - pos) / minBytes)
+      return fail("count exceeds descriptor cache size", at);
+    return true;
+  }
+  bool index(uint64_t &out, size_t limit, const char *what) {
+    size_t at = pos;
+    if (!varint(out))
+      return false;
+    if (out >= limit)
+      return fail(std::string("invalid ") + what + " index", at);
+    return true;
+  }
+  bool str(std::string &out) {
+    uint64_t len;
+    if (!count(len, 1))
+      return false;
+    out.assign(reinterpret_cast<const char *>(data + pos), len);
+    pos += len;
+    return true;
+  }
+  bool fieldType(FieldType &out) {
+    uint8_t b;
+    if (!byte(b))
+      return false;
+    if (b > static_cast<uint8_t>(FieldType::SFixed64))
+      return fail("invalid field type", pos - 1);
+    out = static_cast<FieldType>(b);
+    return true;
+  }
+
+private:
+  const uint8_t *data;
+  size_t size;
+};
+
+bool readField(Reader &r,
+               const std::vector<std::shared_ptr<const ProtoDesc>> &msgs,
+               const std::vector<std::shared_ptr<const EnumDesc>> &enums,
+               std::vector<FieldDesc> &out) {
+  size_t start = r.pos;
+  std::string name, oneof;
+  uint64_t number, msgIdx = 0, enumIdx = 0;
+  FieldType type, keyType = FieldType::Int, valueType = FieldType::Int;
+  uint8_t flags;
+  if (!r.str(name) || !r.varint(number) || !r.fieldType(type) ||
+      !r.byte(flags))
+    return false;
+  if (number > UINT32_MAX)
+    return r.fail("invalid field number", start);
+  if ((flags & kInOneof) && !r.str(oneof))
+    return false;
+  bool isMap = type == FieldType::Map;
+  if (isMap && (!r.fieldType(keyType) || !r.fieldType(valueType)))
+    return false;
+  if ((flags & kHasMessage) && !r.index(msgIdx, msgs.size(), "message"))
+    return false;
+  if ((flags & kHasEnum) && !r.index(enumIdx, enums.size(), "enum"))
+    return false;
+
+  FieldType target = isMap ? valueType : type;
+  if (bool(flags & kHasMessage) != (target == FieldType::Message) ||
+      ((flags & kHasEnum) && target != FieldType::Enum))
+    return r.fail("field references do not match its type: " + name, start);
+  auto nested = (flags & kHasMessage) ? msgs[msgIdx] : nullptr;
+  auto enumType = (flags & kHasEnum) ? enums[enumIdx] : nullptr;
+
+  if (isMap) {
+    out.push_back(FieldDesc::map(std::move(name), uint32_t(number), keyType,
+                                 valueType, std::move(nested),
+                                 std::move(enumType)));
+  } else {
+    FieldDesc fd(std::move(name), uint32_t(number), type, flags & kRepeated,
+                 flags & kPacked, std::move(nested));
+    fd.enumDesc = std::move(enumType);
+    fd.oneof = std::move(oneof);
+    out.push_back(std::move(fd));
+  }
+  return true;
+}
+
+bool readSchema(Reader &r, ProtoSchema &schema) {
+  uint8_t magic[4], version;
+  for (uint8_t &b : magic) {
+    if (!r.byte(b))
+      return false;
+  }
+  if (!std::equal(std::begin(magic), std::end(magic), std::begin(kMagic)))
+    return r.fail("not a descriptor cache", 0);
+  if (!r.byte(version))
+    return false;
+  if (version != kVersion)
+    return r.fail("unsupported descriptor cache version", 4);
+  if (!r.str(schema.package))
+    return false;
+
+  uint64_t n;
+  std::vector<std::shared_ptr<const EnumDesc>> enums;
+  if (!r.count(n, 2))
+    return false;
+  enums.reserve(n);
+  for (uint64_t i = 0; i < n; ++i) {
+    size_t start = r.pos;
+    std::string name;
+    uint64_t valueCount;
+    if (!r.str(name) || !r.count(valueCount, 2))
+      return false;
+    std::vector<EnumValueDesc> values(valueCount);
+    for (EnumValueDesc &v : values) {
+      uint64_t zz;
+      if (!r.str(v.name) || !r.varint(zz))
+        return false;
+      if (zz > UINT32_MAX)
+        return r.fail("invalid enum number", start);
+      v.number = unzigzag32(uint32_t(zz));
+    }
+    try {
+      enums.push_back(std::make_shared<EnumDesc>(std::move(name),
+                                                 std::move(values)));
+    } catch (const std::runtime_error &e) {
+      return r.fail(e.what(), start);
+    }
+  }
+
+  std::vector<std::shared_ptr<const ProtoDesc>> msgs;
+  if (!r.count(n, 1))
+    return false;
+  msgs.reserve(n);
+  for (uint64_t i = 0; i < n; ++i) {
+    size_t start = r.pos;
+    uint64_t fieldCount;
+    if (!r.count(fieldCount, 4))
+      return false;
+    std::vector<FieldDesc> fields;
+    fields.reserve(fieldCount);
+    try {
+      for (uint64_t f = 0; f < fieldCount; ++f) {
+        if (!readField(r, msgs, enums, fields))
+          return false;
+      }
+      msgs.push_back(std::make_shared<ProtoDesc>(std::move(fields)));
+    } catch (const std::runtime_error &e) {
+      return r.fail(e.what(), start);
+    }
+  }
+
+  if (!r.count(n, 2))
+    return false;
+  schema.enums.reserve(n);
+  for (uint64_t i = 0; i < n; ++i) {
+    std::string key;
+    uint64_t idx;
+    if (!r.str(key) || !r.index(idx, enums.size(), "enum"))
+      return false;
+    schema.enums.emplace(std::move(key), enums[idx]);
+  }
+  if (!r.count(n, 2))
+    return false;
+  schema.messages.reserve(n);
+  for (uint64_t i = 0; i < n; ++i) {
+    std::string key;
+    uint64_t idx;
+    if (!r.str(key) || !r.index(idx, msgs.size(), "message"))
+      return false;
+    schema.messages.emplace(std::move(key), msgs[idx]);
+  }
+  return true;
+}
+
+} // namespace
+
+std::vector<uint8_t> serializeSchema(const ProtoSchema &schema) {
+  Writer w;
+  w.write(schema);
+  return std::move(w.out);
+}
+
+std::pair<std::optional<ProtoSchema>, SchemaError>
+loadSchema(const uint8_t *data, size_t size) {
+  Reader r(data, size);
+  ProtoSchema schema;
+  if (!readSchema(r, schema)) {
+    PB_LOG("descriptor cache rejected: " << r.err.message);
+    return {std::nullopt, std::move(r.err)};
+  }
+  if (r.pos != size)
+    return {std::nullopt,
+            SchemaError{"trailing bytes after descriptor cache", 0, 0, r.pos}};
+  return {std::move(schema), SchemaError{}};
+}
+
+std::pair<std::optional<ProtoSchema>, SchemaError>
+loadSchema(const std::vector<uint8_t> &cache) {
+  return loadSchema(cache.data(), cache.size());
+}
@@ -0,0 +1,1007 @@
+#include "text_format.h"
+#include "encoder.h"
+#include "message_encoder.h"
+#include "wire_util.h"
+#include <bit>
+#include <charconv>
+#include <cmath>
+#include <limits>
+#include <ostream>
+
+// ---------------------------------------------------------------------------
+// Printing
+//
+// Everything is written straight to the stream: numbers through a stack
+// buffer, strings as runs between escapes.
+
+namespace {
+struct PrintCtx {
+  std::ostream &os;
+  const TextOptions &opts;
+  size_t depth = 0;
+  bool needSpace = false; // single line: a separator is due
+  TextError err;
+};
+} // namespace
+
+static void put(std::ostream &os, std::string_view s) {
+  os.write(s.data(), static_cast<std::streamsize>(s.size()));
+}
+
+template <typename T> static void putNumber(std::ostream &os, T x) {
+  char buf[32];
+  auto res = std::to_chars(buf, buf + sizeof buf, x);
+  os.write(buf, res.ptr - buf);
+}
+
+template <typename T> static void putFloating(std::ostream &os, T x) {
+  if (std::isnan(x))
+    put(os, "nan");
+  else if (std::isinf(x))
+    put(os, x > 0 ? "inf" : "-inf");
+  else
+    putNumber(os, x);
+}
+
+static void putHex(std::ostream &os, uint64_t x, int digits) {
+  static const char hex[] = "0123456789abcdef";
+  char buf[18] = {'0', 'x'};
+  for (int i = 0; i < digits; ++i)
+    buf[2 + i] = hex[x >> (4 * (digits - 1 - i)) & 0xF];
+  os.write(buf, 2 + digits);
+}
+
+static bool isPlain(unsigned char c) {
+  return c >= 0x20 && c < 0x7F && c != '"' && c != '\'' && c != '\\';
+}
+
+static void putQuoted(std::ostream &os, const char *p, size_t n) {
+  os.put('"');
+  size_t i = 0;
+  while (i < n) {
+    size_t run = i;
+    while (run < n && isPlain(static_cast<unsigned char>(p[run])))
+      ++run;
+    os.write(p + i, static_cast<std::streamsize>(run - i));
+    if (run == n)
+      break;
+    auto c = static_cast<unsigned char>(p[run]);
+    char esc[4] = {'\\'};
+    std::streamsize len = 2;
+    switch (c) {
+    case '\n':
+      esc[1] = 'n';
+      break;
+    case '\r':
+      esc[1] = 'r';
+      break;
+    case '\t':
+      esc[1] = 't';
+      break;
+    case '"':
+    case '\'':
+    case '\\':
+      esc[1] = char(c);
+      break;
+    default:
+      esc[1] = char('0' + (c >> 6));
+      esc[2] = char('0' + (c >> 3 & 7));
+      esc[3] = char('0' + (c & 7));
+      len = 4;
+    }
+    os.write(esc, len);
+    i = run + 1;
+  }
+  os.put('"');
+}
+
+// Indentation, or the space between fields on a single line
+static void beginLine(PrintCtx &ctx) {
+  if (ctx.opts.singleLine) {
+    if (ctx.needSpace)
+      ctx.os.put(' ');
+    return;
+  }
+  for (size_t i = 0; i < ctx.depth; ++i)
+    put(ctx.os, "  ");
+}
+
+static void endLine(PrintCtx &ctx) {
+  if (ctx.opts.singleLine)
+    ctx.needSpace = true;
+  else
+    ctx.os.put('\n');
+}
+
+static void beginScalar(PrintCtx &ctx, std::string_view name) {
+  beginLine(ctx);
+  put(ctx.os, name);
+  put(ctx.os, ": ");
+}
+
+// "name {"; false if that nests too deep
+static bool openMessage(PrintCtx &ctx, std::string_view name) {
+  if (ctx.depth >= ctx.opts.maxDepth)
+    return false;
+  beginLine(ctx);
+  put(ctx.os, name);
+  put(ctx.os, " {");
+  endLine(ctx);
+  ++ctx.depth;
+  return true;
+}
+
+static void closeMessage(PrintCtx &ctx) {
+  --ctx.depth;
+  beginLine(ctx);
+  ctx.os.put('}');
+  endLine(ctx);
+}
+
+static bool failPrint(PrintCtx &ctx, const char *what, const FieldDesc &fd) {
+  if (ctx.err.message.empty())
+    ctx.err.message = std::string(what) + ": " + fd.name;
+  return false;
+}
+
+// A scalar value of type (anything but Message and Map); fd supplies the
+// enum names
+static bool putScalar(PrintCtx &ctx, const FieldDesc &fd, FieldType type,
+                      const Value &v) {
+  std::ostream &os = ctx.os;
+  switch (type) {
+  case FieldType::Int:
+  case FieldType::Int64:
+  case FieldType::SFixed64:
+    if (const auto *x = std::get_if<int64_t>(&v))
+      return putNumber(os, *x), true;
+    break;
+  case FieldType::UInt:
+  case FieldType::Fixed64:
+    if (const auto *x = std::get_if<uint64_t>(&v))
+      return putNumber(os, *x), true;
+    break;
+  case FieldType::Int32:
+  case FieldType::SInt32:
+  case FieldType::SFixed32:
+    if (const auto *x = std::get_if<int32_t>(&v))
+      return putNumber(os, *x), true;
+    break;
+  case FieldType::UInt32:
+  case FieldType::Fixed32:
+    if (const auto *x = std::get_if<uint32_t>(&v))
+      return putNumber(os, *x), true;
+    break;
+  case FieldType::Enum:
+    if (const auto *x = std::get_if<int32_t>(&v)) {
+      const std::string *name = fd.enumDesc ? fd.enumDesc->nameOf(*x) : nullptr;
+      if (name != nullptr)
+        put(os, *name);
+      else
+        putNumber(os, *x);
+      return true;
+    }
+    break;
+  case FieldType::Double:
+    if (const auto *x = std::get_if<double>(&v))
+      return putFloating(os, *x), true;
+    break;
+  case FieldType::Float:
+    if (const auto *x = std::get_if<float>(&v))
+      return putFloating(os, *x), true;
+    break;
+  case FieldType::Bool:
+    if (const auto *x = std::get_if<bool>(&v))
+      return put(os, *x ? "true" : "false"), true;
+    break;
+  case FieldType::String:
+    if (const auto *x = std::get_if<std::string>(&v))
+      return putQuoted(os, x->data(), x->size()), true;
+    break;
+  case FieldType::Bytes:
+    if (const auto *x = std::get_if<std::vector<uint8_t>>(&v)) {
+      putQuoted(os, reinterpret_cast<const char *>(x->data()), x->size());
+      return true;
+    }
+    break;
+  default:
+    return failPrint(ctx, "unknown field type", fd);
+  }
+  return failPrint(ctx, "type mismatch", fd);
+}
+
+static bool printMessage(PrintCtx &ctx, const Message &m);
+
+// One "name: value" line, or a "name { ... }" block
+static bool printElement(PrintCtx &ctx, const FieldDesc &fd, const Value &v) {
+  if (fd.type == FieldType::Message) {
+    const auto *nested = std::get_if<Message>(&v);
+    if (nested == nullptr)
+      return failPrint(ctx, "type mismatch", fd);
+    if (!openMessage(ctx, fd.name))
+      return failPrint(ctx, "nesting too deep", fd);
+    if (!printMessage(ctx, *nested))
+      return false;
+    closeMessage(ctx);
+    return true;
+  }
+  beginScalar(ctx, fd.name);
+  if (!putScalar(ctx, fd, fd.type, v))
+    return false;
+  endLine(ctx);
+  return true;
+}
+
+static bool printMessage(PrintCtx &ctx, const Message &m) {
+  for (size_t i = 0; i < m.desc->fields.size(); ++i) {
+    if (!m.has(i))
+      continue;
+    const FieldDesc &fd = m.desc->fields[i];
+    ValueRef ref = m.valueAt(i);
+    const Value &v = ref.get();
+    if (fd.type == FieldType::Map) {
+      const auto *map = std::get_if<MapVal>(&v);
+      if (map == nullptr)
+        return failPrint(ctx, "type mismatch", fd);
+      // Entries print as messages of the entry type: key, then value
+      for (size_t e = 0; e < map->size(); ++e) {
+        if (!openMessage(ctx, fd.name))
+          return failPrint(ctx, "nesting too deep", fd);
+        if (!printElement(ctx, fd.mapKey(), map->keyAt(e)) ||
+            !printElement(ctx, fd.mapValue(), map->valueAt(e)))
+          return false;
+        closeMessage(ctx);
+      }
+    } else if (fd.isRepeated) {
+      const auto *rv = std::get_if<RepeatedVal>(&v);
+      if (rv == nullptr)
+        return failPrint(ctx, "type mismatch", fd);
+      for (const Value &elem : rv->values)
+        if (!printElement(ctx, fd, elem))
+          return false;
+    } else if (!printElement(ctx, fd, v)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+TextError printText(const Message &msg, std::ostream &os,
+                    const TextOptions &opts) {
+  PrintCtx ctx{os, opts, 0, false, {}};
+  printMessage(ctx, msg);
+  return std::move(ctx.err);
+}
+
+std::ostream &operator<<(std::ostream &os, const Message &msg) {
+  printText(msg, os, {.singleLine = true});
+  return os;
+}
+
+// ---------------------------------------------------------------------------
+// Printing binary input
+
+namespace {
+struct RawCtx {
+  const std::vector<uint8_t> &data;
+  PrintCtx p;
+};
+} // namespace
+
+static bool failRaw(RawCtx &ctx, const char *what, size_t at) {
+  if (ctx.p.err.message.empty()) {
+    ctx.p.err.message = what;
+    ctx.p.err.offset = at;
+  }
+  return false;
+}
+
+// Reads a LEN prefix whose payload lies within [idx, end)
+static bool readLen(RawCtx &ctx, size_t &idx, size_t end, size_t &len) {
+  return readLenPrefix(ctx.data, idx, end, len) ||
+         failRaw(ctx, "malformed length", idx);
+}
+
+static bool readVarint(RawCtx &ctx, size_t &idx, size_t end, uint64_t &v) {
+  auto [x, next] = decodeVarint(ctx.data, idx);
+  if (!x.has_value() || next > end)
+    return failRaw(ctx, "malformed varint", idx);
+  v = *x;
+  idx = next;
+  return true;
+}
+
+static bool readFixed(RawCtx &ctx, size_t &idx, size_t end, size_t width,
+                      uint64_t &v) {
+  if (end - idx < width)
+    return failRaw(ctx, "truncated fixed-width value", idx);
+  v = width == 8 ? decodeFixed64(ctx.data, idx).value()
+                 : decodeFixed32(ctx.data, idx).value();
+  idx += width;
+  return true;
+}
+
+// One element of a scalar field, decoded to a Value so it prints like the
+// Message path. Bools other than 0 and 1 print as numbers.
+static bool printRawScalar(RawCtx &ctx, const FieldDesc &fd, size_t &idx,
+                           size_t end) {
+  std::ostream &os = ctx.p.os;
+  beginScalar(ctx.p, fd.name);
+  uint64_t raw;
+  Value v;
+  switch (fd.type) {
+  case FieldType::String:
+  case FieldType::Bytes: {
+    size_t len;
+    if (!readLen(ctx, idx, end, len))
+      return false;
+    putQuoted(os, reinterpret_cast<const char *>(ctx.data.data()) + idx, len);
+    idx += len;
+    endLine(ctx.p);
+    return true;
+  }
+  case FieldType::Double:
+  case FieldType::Fixed64:
+  case FieldType::SFixed64:
+    if (!readFixed(ctx, idx, end, 8, raw))
+      return false;
+    if (fd.type == FieldType::Double)
+      v = std::bit_cast<double>(raw);
+    else if (fd.type == FieldType::Fixed64)
+      v = raw;
+    else
+      v = static_cast<int64_t>(raw);
+    break;
+  case FieldType::Float:
+  case FieldType::Fixed32:
+  case FieldType::SFixed32:
+    if (!readFixed(ctx, idx, end, 4, raw))
+      return false;
+    if (fd.type == FieldType::Float)
+      v = std::bit_cast<float>(static_cast<uint32_t>(raw));
+    else if (fd.type == FieldType::Fixed32)
+      v = static_cast<uint32_t>(raw);
+    else
+      v = static_cast<int32_t>(raw);
+    break;
+  default:
+    if (!readVarint(ctx, idx, end, raw))
+      return false;
+    switch (fd.type) {
+    case FieldType::Int:
+      v = static_cast<int64_t>(raw >> 1) ^ -static_cast<int64_t>(raw & 1);
+      break;
+    case FieldType::UInt:
+      v = raw;
+      break;
+    case FieldType::Int64:
+      v = static_cast<int64_t>(raw);
+      break;
+    case FieldType::Bool:
+      if (raw > 1)
+        return putNumber(os, raw), endLine(ctx.p), true;
+      v = raw == 1;
+      break;
+    case FieldType::UInt32:
+      v = static_cast<uint32_t>(raw);
+      break;
+    case FieldType::SInt32:
+      v = unzigzag32(static_cast<uint32_t>(raw));
+      break;
+    default: // Int32, Enum
+      v = static_cast<int32_t>(raw);
+    }
+  }
+  if (!putScalar(ctx.p, fd, fd.type, v))
+    return false;
+  endLine(ctx.p);
+  return true;
+}
+
+// A field the descriptor cannot interpret, by number
+static bool printUnknown(RawCtx &ctx, uint64_t number, uint32_t wire,
+                         size_t &idx, size_t end) {
+  std::ostream &os = ctx.p.os;
+  size_t start = idx;
+  beginLine(ctx.p);
+  putNumber(os, number);
+  put(os, ": ");
+  uint64_t v;
+  switch (wire) {
+  case VARINT:
+    if (!readVarint(ctx, idx, end, v))
+      return false;
+    putNumber(os, v);
+    break;
+  case I64:
+  case I32: {
+    size_t width = wire == I64 ? 8 : 4;
+    if (!readFixed(ctx, idx, end, width, v))
+      return false;
+    putHex(os, v, int(width * 2));
+    break;
+  }
+  case LEN: {
+    size_t len;
+    if (!readLen(ctx, idx, end, len))
+      return false;
+    putQuoted(os, reinterpret_cast<const char *>(ctx.data.data()) + idx, len);
+    idx += len;
+    break;
+  }
+  default:
+    return failRaw(ctx, "invalid wire type", start);
+  }
+  endLine(ctx.p);
+  return true;
+}
+
+static bool printWire(RawCtx &ctx, const ProtoDesc &desc, size_t begin,
+                      size_t end) {
+  size_t idx = begin;
+  while (idx < end) {
+    size_t tagStart = idx;
+    uint64_t tag;
+    if (!readVarint(ctx, idx, end, tag))
+      return false;
+    uint64_t number = tag >> 3;
+    uint32_t wire = tag & 0x7;
+    if (number == 0 || number > kMaxFieldNumber)
+      return failRaw(ctx, "invalid tag", tagStart);
+
+    auto field = desc.indexByNumber(static_cast<uint32_t>(number));
+    const FieldDesc *fd = field ? &desc.fields[*field] : nullptr;
+    if (fd == nullptr || !knownType(fd->type)) {
+      if (!printUnknown(ctx, number, wire, idx, end))
+        return false;
+      continue;
+    }
+    WireType expected = wireOf(fd->type);
+    bool packed = fd->isRepeated && expected != LEN && wire == LEN;
+    if (wire != expected && !packed) {
+      if (!printUnknown(ctx, number, wire, idx, end))
+        return false;
+      continue;
+    }
+
+    if (packed) {
+      size_t len;
+      if (!readLen(ctx, idx, end, len))
+        return false;
+      size_t stop = idx + len;
+      while (idx < stop)
+        if (!printRawScalar(ctx, *fd, idx, stop))
+          return false;
+    } else if (fd->type == FieldType::Message ||
+               fd->type == FieldType::Map) {
+      // Map entries print as messages of the entry type
+      size_t len;
+      if (!readLen(ctx, idx, end, len))
+        return false;
+      if (!openMessage(ctx.p, fd->name))
+        return failRaw(ctx, "nesting too deep", idx);
+      if (!printWire(ctx, *fd->nestedDesc, idx, idx + len))
+        return false;
+      closeMessage(ctx.p);
+      idx += len;
+    } else if (!printRawScalar(ctx, *fd, idx, end)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+TextError printText(const std::vector<uint8_t> &data, const ProtoDesc &desc,
+                    std::ostream &os, const TextOptions &opts) {
+  RawCtx ctx{data, PrintCtx{os, opts, 0, false, {}}};
+  printWire(ctx, desc, 0, data.size());
+  return std::move(ctx.p.err);
+}
+
+// ---------------------------------------------------------------------------
+// Parsing
+
+namespace {
+struct ParseCtx {
+  std::string_view in;
+  const TextOptions &opts;
+  size_t pos = 0;
+  size_t depth = 0;
+  TextError err;
+};
+} // namespace
+
+static bool failParse(ParseCtx &ctx, std::string what, size_t at) {
+  if (!ctx.err.message.empty())
+    return false;
+  ctx.err.message = std::move(what);
+  ctx.err.offset = at;
+  ctx.err.line = 1;
+  size_t lineStart = 0;
+  for (size_t i = 0; i < at && i < ctx.in.size(); ++i)
+    if (ctx.in[i] == '\n') {
+      ++ctx.err.line;
+      lineStart = i + 1;
+    }
+  ctx.err.column = at - lineStart + 1;
+  return false;
+}
+
+// Whitespace and # comments
+static void skipSpace(ParseCtx &ctx) {
+  while (ctx.pos < ctx.in.size()) {
+    char c = ctx.in[ctx.pos];
+    if (c == '#') {
+      while (ctx.pos < ctx.in.size() && ctx.in[ctx.pos] != '\n')
+        ++ctx.pos;
+    } else if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+      ++ctx.pos;
+    } else {
+      return;
+    }
+  }
+}
+
+static bool consume(ParseCtx &ctx, char c) {
+  skipSpace(ctx);
+  if (ctx.pos < ctx.in.size() && ctx.in[ctx.pos] == c) {
+    ++ctx.pos;
+    return true;
+  }
+  return false;
+}
+
+static bool expect(ParseCtx &ctx, char c) {
+  if (consume(ctx, c))
+    return true;
+  return failParse(ctx, std::string("expected '") + c + "'", ctx.pos);
+}
+
+static bool isIdentChar(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_';
+}
+
+static std::string_view identifier(ParseCtx &ctx) {
+  skipSpace(ctx);
+  size_t start = ctx.pos;
+  if (start < ctx.in.size() && (ctx.in[start] < '0' || ctx.in[start] > '9'))
+    while (ctx.pos < ctx.in.size() && isIdentChar(ctx.in[ctx.pos]))
+      ++ctx.pos;
+  return ctx.in.substr(start, ctx.pos - start);
+}
+
+// A number, bool or enum name: an optional '-', then identifier characters,
+// '.' and an exponent sign
+static std::string_view scalarToken(ParseCtx &ctx) {
+  skipSpace(ctx);
+  size_t start = ctx.pos;
+  if (ctx.pos < ctx.in.size() && ctx.in[ctx.pos] == '-')
+    ++ctx.pos;
+  bool hex = ctx.in.substr(ctx.pos, 2) == "0x" ||
+             ctx.in.substr(ctx.pos, 2) == "0X";
+  while (ctx.pos < ctx.in.size()) {
+    char c = ctx.in[ctx.pos];
+    bool exponentSign = (c == '+' || c == '-') && !hex &&
+                        ctx.pos > start &&
+                        (ctx.in[ctx.pos - 1] == 'e' ||
+                         ctx.in[ctx.pos - 1] == 'E');
+    if (!isIdentChar(c) && c != '.' && !exponentSign)
+      break;
+    ++ctx.pos;
+  }
+  return ctx.in.substr(start, ctx.pos - start);
+}
+
+// Decimal, 0x hex or 0-prefixed octal, range-checked for T
+template <typename T>
+static bool intFromToken(ParseCtx &ctx, std::string_view tok, size_t at,
+                         T &out) {
+  bool neg = !tok.empty() && tok[0] == '-';
+  std::string_view digits = tok.substr(neg ? 1 : 0);
+  int base = 10;
+  if (digits.size() > 2 && (digits.substr(0, 2) == "0x" ||
+                            digits.substr(0, 2) == "0X")) {
+    base = 16;
+    digits.remove_prefix(2);
+  } else if (digits.size() > 1 && digits[0] == '0') {
+    base = 8;
+    digits.remove_prefix(1);
+  }
+  uint64_t mag;
+  const char *last = digits.data() + digits.size();
+  auto res = std::from_chars(digits.data(), last, mag, base);
+  if (digits.empty() || res.ec != std::errc() || res.ptr != last)
+    return failParse(ctx, "expected integer", at);
+  constexpr uint64_t max = std::numeric_limits<T>::max();
+  // The most negative value has magnitude max + 1; unsigned types allow -0
+  uint64_t limit = neg ? (std::is_signed_v<T> ? max + 1 : 0) : max;
+  if (mag > limit)
+    return failParse(ctx, "integer out of range", at);
+  out = static_cast<T>(neg ? uint64_t(0) - mag : mag);
+  return true;
+}
+
+template <typename T> static bool parseInt(ParseCtx &ctx, T &out) {
+  size_t at = (skipSpace(ctx), ctx.pos);
+  return intFromToken(ctx, scalarToken(ctx), at, out);
+}
+
+static bool equalsLower(std::string_view s, std::string_view lower) {
+  if (s.size() != lower.size())
+    return false;
+  for (size_t i = 0; i < s.size(); ++i)
+    if ((s[i] | 0x20) != lower[i])
+      return false;
+  return true;
+}
+
+template <typename T> static bool parseFloat(ParseCtx &ctx, T &out) {
+  size_t at = (skipSpace(ctx), ctx.pos);
+  std::string_view tok = scalarToken(ctx);
+  bool neg = !tok.empty() && tok[0] == '-';
+  std::string_view body = tok.substr(neg ? 1 : 0);
+  if (equalsLower(body, "inf") || equalsLower(body, "infinity")) {
+    out = neg ? -std::numeric_limits<T>::infinity()
+              : std::numeric_limits<T>::infinity();
+    return true;
+  }
+  if (equalsLower(body, "nan")) {
+    out = std::numeric_limits<T>::quiet_NaN();
+    return true;
+  }
+  if (!tok.empty() && (tok.back() == 'f' || tok.back() == 'F'))
+    tok.remove_suffix(1);
+  const char *last = tok.data() + tok.size();
+  auto res = std::from_chars(tok.data(), last, out);
+  if (tok.empty() || res.ec != std::errc() || res.ptr != last)
+    return failParse(ctx, "expected number", at);
+  return true;
+}
+
+static bool parseBool(ParseCtx &ctx, bool &out) {
+  size_t at = (skipSpace(ctx), ctx.pos);
+  std::string_view tok = scalarToken(ctx);
+  if (tok == "true" || tok == "True" || tok == "t" || tok == "1")
+    return out = true, true;
+  if (tok == "false" || tok == "False" || tok == "f" || tok == "0")
+    return out = false, true;
+  return failParse(ctx, "expected true or false", at);
+}
+
+static bool parseEnum(ParseCtx &ctx, const FieldDesc &fd, int32_t &out) {
+  size_t at = (skipSpace(ctx), ctx.pos);
+  std::string_view tok = scalarToken(ctx);
+  bool isName = !tok.empty() && (tok[0] == '_' || (tok[0] | 0x20) >= 'a');
+  if (!isName)
+    return intFromToken(ctx, tok, at, out);
+  std::optional<int32_t> number;
+  if (fd.enumDesc)
+    number = fd.enumDesc->numberOf(std::string(tok));
+  if (!number.has_value())
+    return failParse(ctx, "unknown enum value " + std::string(tok), at);
+  out = *number;
+  return true;
+}
+
+// Up to maxDigits digits of base at the cursor
+static size_t readDigits(ParseCtx &ctx, int base, size_t maxDigits,
+                         uint32_t &v) {
+  v = 0;
+  size_t n = 0;
+  while (n < maxDigits && ctx.pos < ctx.in.size()) {
+    char c = ctx.in[ctx.pos];
+    int d = c >= '0' && c <= '9'   ? c - '0'
+            : c >= 'a' && c <= 'f' ? c - 'a' + 10
+            : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                                   : 99;
+    if (d >= base)
+      break;
+    v = v * uint32_t(base) + uint32_t(d);
+    ++ctx.pos;
+    ++n;
+  }
+  return n;
+}
+
+// One or more adjacent quoted literals with C escapes, into out (replacing
+// its contents)
+static bool parseString(ParseCtx &ctx, std::string &out) {
+  skipSpace(ctx);
+  out.clear();
+  if (ctx.pos >= ctx.in.size() ||
+      (ctx.in[ctx.pos] != '"' && ctx.in[ctx.pos] != '\''))
+    return failParse(ctx, "expected string", ctx.pos);
+  const std::string_view in = ctx.in;
+  while (ctx.pos < in.size() && (in[ctx.pos] == '"' || in[ctx.pos] == '\'')) {
+    char quote = in[ctx.pos++];
+    while (true) {
+      size_t run = ctx.pos;
+      while (run < in.size() && in[run] != quote && in[run] != '\\' &&
+             in[run] != '\n')
+        ++run;
+      out.append(in.data() + ctx.pos, run - ctx.pos);
+      ctx.pos = run;
+      if (run == in.size() || in[run] == '\n')
+        return failParse(ctx, "unterminated string", run);
+      ++ctx.pos;
+      if (in[run] == quote)
+        break;
+      if (ctx.pos == in.size())
+        return failParse(ctx, "unterminated string", ctx.pos);
+      char e = in[ctx.pos++];
+      uint32_t v;
+      switch (e) {
+      case 'n':
+        out += '\n';
+        break;
+      case 'r':
+        out += '\r';
+        break;
+      case 't':
+        out += '\t';
+        break;
+      case 'a':
+        out += '\a';
+        break;
+      case 'b':
+        out += '\b';
+        break;
+      case 'f':
+        out += '\f';
+        break;
+      case 'v':
+        out += '\v';
+        break;
+      case '\\':
+      case '\'':
+      case '"':
+      case '?':
+        out += e;
+        break;
+      case 'x':
+        if (readDigits(ctx, 16, 2, v) == 0)
+          return failParse(ctx, "bad \\x escape", run);
+        out += char(v);
+        break;
+      case 'u':
+      case 'U': {
+        size_t want = e == 'u' ? 4 : 8;
+        if (readDigits(ctx, 16, want, v) != want || v > 0x10FFFF ||
+            (v >= 0xD800 && v <= 0xDFFF))
+          return failParse(ctx, "bad unicode escape", run);
+        appendUtf8(out, v);
+        break;
+      }
+      default:
+        --ctx.pos;
+        if (readDigits(ctx, 8, 3, v) == 0 || v > 0xFF)
+          return failParse(ctx, "bad escape", run);
+        out += char(v);
+      }
+    }
+    skipSpace(ctx);
+  }
+  return true;
+}
+
+static Value defaultFor(const FieldDesc &fd) {
+  switch (fd.type) {
+  case FieldType::Int:
+  case FieldType::Int64:
+  case FieldType::SFixed64:
+    return int64_t(0);
+  case FieldType::UInt:
+  case FieldType::Fixed64:
+    return uint64_t(0);
+  case FieldType::UInt32:
+  case FieldType::Fixed32:
+    return uint32_t(0);
+  case FieldType::Double:
+    return 0.0;
+  case FieldType::Float:
+    return 0.0f;
+  case FieldType::Bool:
+    return false;
+  case FieldType::String:
+    return std::string();
+  case FieldType::Bytes:
+    return std::vector<uint8_t>();
+  case FieldType::Message:
+    return Message(fd.nestedDesc);
+  default:
+    return int32_t(0);
+  }
+}
+
+static bool parseFields(ParseCtx &ctx, Message &msg, char close);
+
+// "{ ... }" or "< ... >" into target
+static bool parseMessageBody(ParseCtx &ctx, Message &target) {
+  size_t at = (skipSpace(ctx), ctx.pos);
+  char close;
+  if (consume(ctx, '{'))
+    close = '}';
+  else if (consume(ctx, '<'))
+    close = '>';
+  else
+    return failParse(ctx, "expected '{'", at);
+  if (ctx.depth >= ctx.opts.maxDepth)
+    return failParse(ctx, "nesting too deep", at);
+  ++ctx.depth;
+  bool ok = parseFields(ctx, target, close);
+  --ctx.depth;
+  return ok;
+}
+
+// A value of a scalar type into out, which may hold storage to reuse
+static bool parseScalar(ParseCtx &ctx, const FieldDesc &fd, Value &out) {
+  switch (fd.type) {
+  case FieldType::Int:
+  case FieldType::Int64:
+  case FieldType::SFixed64: {
+    int64_t x;
+    return parseInt(ctx, x) && (out = x, true);
+  }
+  case FieldType::UInt:
+  case FieldType::Fixed64: {
+    uint64_t x;
+    return parseInt(ctx, x) && (out = x, true);
+  }
+  case FieldType::Int32:
+  case FieldType::SInt32:
+  case FieldType::SFixed32: {
+    int32_t x;
+    return parseInt(ctx, x) && (out = x, true);
+  }
+  case FieldType::UInt32:
+  case FieldType::Fixed32: {
+    uint32_t x;
+    return parseInt(ctx, x) && (out = x, true);
+  }
+  case FieldType::Enum: {
+    int32_t x;
+    return parseEnum(ctx, fd, x) && (out = x, true);
+  }
+  case FieldType::Double: {
+    double x;
+    return parseFloat(ctx, x) && (out = x, true);
+  }
+  case FieldType::Float: {
+    float x;
+    return parseFloat(ctx, x) && (out = x, true);
+  }
+  case FieldType::Bool: {
+    bool x;
+    return parseBool(ctx, x) && (out = x, true);
+  }
+  case FieldType::String: {
+    auto *s = std::get_if<std::string>(&out);
+    if (s == nullptr)
+      s = &out.emplace<std::string>();
+    return parseString(ctx, *s);
+  }
+  case FieldType::Bytes: {
+    std::string s;
+    if (!parseString(ctx, s))
+      return false;
+    out.emplace<std::vector<uint8_t>>(s.begin(), s.end());
+    return true;
+  }
+  default:
+    return failParse(ctx, "unknown field type for " + fd.name, ctx.pos);
+  }
+}
+
+// One value of field fieldIdx: the field, an element or a map entry
+static bool parseOne(ParseCtx &ctx, Message &msg, size_t fieldIdx) {
+  const FieldDesc &fd = msg.desc->fields[fieldIdx];
+  if (fd.type == FieldType::Map) {
+    Message entry(fd.nestedDesc);
+    if (!parseMessageBody(ctx, entry))
+      return false;
+    const ProtoDesc &ed = *fd.nestedDesc;
+    Value key = entry.has(0) ? Value(entry.valueAt(0).get())
+                             : defaultFor(ed.fields[0]);
+    Value value;
+    if (!entry.has(1))
+      value = defaultFor(ed.fields[1]);
+    else if (ed.layout().slots[1].isInline)
+      value = entry.valueAt(1).get();
+    else
+      value = std::move(entry.boxedAt(1));
+    if (!msg.has(fieldIdx))
+      msg.boxedAt(fieldIdx).emplace<MapVal>(ed.fields[0].type,
+                                            ed.fields[1].type);
+    std::get<MapVal>(msg.boxedAt(fieldIdx))
+        .insertOrAssign(std::move(key), std::move(value));
+    return true;
+  }
+
+  if (fd.type == FieldType::Message) {
+    Value &slot = fd.isRepeated ? msg.appendAt(fieldIdx)
+                                : msg.boxedAt(fieldIdx);
+    Message *nested = std::get_if<Message>(&slot);
+    if (nested != nullptr && nested->desc == fd.nestedDesc)
+      nested->clear();
+    else
+      nested = &slot.emplace<Message>(fd.nestedDesc);
+    return parseMessageBody(ctx, *nested);
+  }
+
+  if (fd.isRepeated)
+    return parseScalar(ctx, fd, msg.appendAt(fieldIdx));
+  if (msg.desc->layout().slots[fieldIdx].isInline) {
+    Value scalar;
+    return parseScalar(ctx, fd, scalar) &&
+           msg.setAt(fieldIdx, std::move(scalar));
+  }
+  return parseScalar(ctx, fd, msg.boxedAt(fieldIdx));
+}
+
+// Fields up to close, or to the end of the input at the top level (close 0)
+static bool parseFields(ParseCtx &ctx, Message &msg, char close) {
+  const ProtoDesc &desc = *msg.desc;
+  while (true) {
+    skipSpace(ctx);
+    if (ctx.pos == ctx.in.size()) {
+      if (close == 0)
+        return true;
+      return failParse(ctx, std::string("expected '") + close + "'",
+                       ctx.pos);
+    }
+    if (close != 0 && ctx.in[ctx.pos] == close) {
+      ++ctx.pos;
+      return true;
+    }
+
+    size_t nameStart = ctx.pos;
+    std::string_view name = identifier(ctx);
+    if (name.empty())
+      return failParse(ctx, "expected field name", nameStart);
+    std::optional<size_t> idx = desc.indexByName(std::string(name));
+    if (!idx.has_value())
+      return failParse(ctx, "unknown field " + std::string(name), nameStart);
+    const FieldDesc &fd = desc.fields[*idx];
+    bool isMessage =
+        fd.type == FieldType::Message || fd.type == FieldType::Map;
+    if (!consume(ctx, ':') && !isMessage)
+      return failParse(ctx, "expected ':'", ctx.pos);
+
+    bool many = fd.isRepeated || fd.type == FieldType::Map;
+    if (!many && msg.has(*idx))
+      return failParse(ctx, "field given twice: " + fd.name, nameStart);
+    if (fd.oneofIndex >= 0)
+      for (size_t member : desc.oneofs()[fd.oneofIndex].fields)
+        if (msg.has(member))
+          return failParse(ctx, "oneof already set: " + fd.oneof, nameStart);
+
+    if (consume(ctx, '[')) {
+      if (!many)
+        return failParse(ctx, "list for a singular field: " + fd.name,
+                         ctx.pos - 1);
+      if (!consume(ctx, ']')) {
+        do {
+          if (!parseOne(ctx, msg, *idx))
+            return false;
+        } while (consume(ctx, ','));
+        if (!expect(ctx, ']'))
+          return false;
+      }
+    } else if (!parseOne(ctx, msg, *idx)) {
+      return false;
+    }
+    if (!consume(ctx, ','))
+      consume(ctx, ';');
+  }
+}
+
+std::pair<std::optional<Message>, TextError>
+parseText(std::string_view text, std::shared_ptr<const ProtoDesc> desc,
+          const TextOptions &opts) {
+  ParseCtx ctx{text, opts, 0, 0, {}};
+  Message msg(std::move(desc));
+  if (!parseFields(ctx, msg, 0))
+    return {std::nullopt, std::move(ctx.err)};
+  return {std::move(msg), TextError{}};
+}
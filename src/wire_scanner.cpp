@@ -0,0 +1,95 @@
+#include "wire_scanner.h"
+#include "wire_util.h"
+
+// At most ten bytes, the tenth 0 or 1
+bool scanVarint(const uint8_t *&p, const uint8_t *end, uint64_t &out) {
+  if (p < end && *p < 0x80) { // one-byte tags and small values
+    out = *p++;
+    return true;
+  }
+  uint64_t v = 0;
+  const uint8_t *q = p;
+  for (int shift = 0; q < end && shift < 70; shift += 7) {
+    uint8_t b = *q++;
+    if (shift == 63 && (b & 0xFE) != 0)
+      return false;
+    v |= uint64_t(b & 0x7F) << shift;
+    if ((b & 0x80) == 0) {
+      out = v;
+      p = q;
+      return true;
+    }
+  }
+  return false;
+}
+
+static uint64_t loadLittle(const uint8_t *p, size_t width) {
+  uint64_t v = 0;
+  for (size_t k = 0; k < width; ++k)
+    v |= uint64_t(p[k]) << (8 * k);
+  return v;
+}
+
+bool WireScanner::fail(DecodeErrc code, const uint8_t *at) {
+  err = code;
+  pos = at;
+  end = at; // later calls see the end
+  return false;
+}
+
+bool WireScanner::next(WireField &f) {
+  if (pos == end)
+    return false;
+  const uint8_t *tagStart = pos;
+  uint64_t tag;
+  if (!scanVarint(pos, end, tag))
+    return fail(DecodeErrc::Malformed, tagStart);
+  uint64_t number = tag >> 3;
+  if (number == 0 || number > kMaxFieldNumber)
+    return fail(DecodeErrc::InvalidTag, pos);
+
+  f.number = static_cast<uint32_t>(number);
+  f.wire = static_cast<WireType>(tag & 0x7);
+  f.offset = base + size_t(tagStart - begin);
+  f.data = pos;
+  switch (f.wire) {
+  case VARINT:
+    if (!scanVarint(pos, end, f.value))
+      return fail(DecodeErrc::Malformed, f.data);
+    f.size = size_t(pos - f.data);
+    break;
+  case I64:
+  case I32:
+    f.size = f.wire == I64 ? 8 : 4;
+    if (size_t(end - pos) < f.size)
+      return fail(DecodeErrc::Malformed, f.data);
+    f.value = loadLittle(pos, f.size);
+    pos += f.size;
+    break;
+  case LEN:
+    if (!scanVarint(pos, end, f.value) || f.value > uint64_t(end - pos))
+      return fail(DecodeErrc::Malformed, f.data);
+    f.data = pos;
+    f.size = static_cast<size_t>(f.value);
+    pos += f.size;
+    break;
+  default:
+    return fail(DecodeErrc::InvalidTag, f.data);
+  }
+  f.desc = nullptr;
+  if (desc != nullptr)
+    if (auto idx = desc->indexByNumber(f.number))
+      f.desc = &desc->fields[*idx];
+  return true;
+}
+
+WireScanner WireScanner::descend(const WireField &f) const {
+  const ProtoDesc *nested =
+      f.desc != nullptr && (f.desc->type == FieldType::Message ||
+                            f.desc->type == FieldType::Map)
+          ? f.desc->nestedDesc.get()
+          : nullptr;
+  WireScanner inner(f.data, f.wire == LEN ? f.size : 0, nested);
+  inner.base = base + size_t(f.data - begin);
+  return inner;
+}
@@ -0,0 +1,68 @@
+#pragma once
+// Wire-format helpers shared by the codecs in src/. Internal: nothing in
+// include/ may depend on it.
+#include "encoder.h"
+#include "message_encoder.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+inline constexpr uint64_t kMaxFieldNumber = (uint64_t(1) << 29) - 1;
+
+// Wire type of one element of a field of this type; packed runs are LEN
+inline WireType wireOf(FieldType type) {
+  switch (type) {
+  case FieldType::Double:
+  case FieldType::Fixed64:
+  case FieldType::SFixed64:
+    return I64;
+  case FieldType::Float:
+  case FieldType::Fixed32:
+  case FieldType::SFixed32:
+    return I32;
+  case FieldType::String:
+  case FieldType::Bytes:
+  case FieldType::Message:
+  case FieldType::Map:
+    return LEN;
+  default:
+    return VARINT;
+  }
+}
+
+// False for a FieldType value no codec handles, e.g. from a bad cast
+inline bool knownType(FieldType type) {
+  return static_cast<int>(type) >= 0 &&
+         static_cast<int>(type) <= static_cast<int>(FieldType::SFixed64);
+}
+
+// Reads a LEN prefix whose payload lies within [idx, end). On failure idx
+// is unchanged.
+inline bool readLenPrefix(const std::vector<uint8_t> &data, size_t &idx,
+                          size_t end, size_t &len) {
+  auto [n, next] = decodeVarint(data, idx);
+  if (!n.has_value() || next > end || *n > end - next)
+    return false;
+  len = static_cast<size_t>(*n);
+  idx = next;
+  return true;
+}
+
+// cp must be a Unicode scalar value
+inline void appendUtf8(std::string &out, uint32_t cp) {
+  if (cp < 0x80) {
+    out += char(cp);
+  } else if (cp < 0x800) {
+    out += char(0xC0 | cp >> 6);
+    out += char(0x80 | (cp & 0x3F));
+  } else if (cp < 0x10000) {
+    out += char(0xE0 | cp >> 12);
+    out += char(0x80 | (cp >> 6 & 0x3F));
+    out += char(0x80 | (cp & 0x3F));
+  } else {
+    out += char(0xF0 | cp >> 18);
+    out += char(0x80 | (cp >> 12 & 0x3F));
+    out += char(0x80 | (cp >> 6 & 0x3F));
+    out += char(0x80 | (cp & 0x3F));
+  }
+}
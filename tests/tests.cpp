@@ -1,8 +1,68 @@
+#include "alloc_accounting.h"
+#include "columnar.h"
+#include "descriptor_pool.h"
 #include "encoder.h"
+#include "json_format.h"
 #include "message_encoder.h"
+#include "message_hash.h"
+#include "metrics.h"
+#include "predicate.h"
 #include "proto_desc.h"
+#include "proto_schema.h"
+#include "text_format.h"
+#include "wire_scanner.h"
+#include <cmath>
+#include <cstdlib>
 #include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <gtest/gtest.h>
+#include <new>
+#include <sstream>
+#include <thread>
+
+// Heap allocations made by this thread, for tests that assert a path
+// allocates nothing; also reported to AllocationTrace
+static thread_local size_t allocationCount = 0;
+
+void *operator new(size_t n) {
+  ++allocationCount;
+  accountAllocation(n);
+  if (void *p = std::malloc(n == 0 ? 1 : n))
+    return p;
+  throw std::bad_alloc();
+}
+void *operator new(size_t n, const std::nothrow_t &) noexcept {
+  ++allocationCount;
+  accountAllocation(n);
+  return std::malloc(n == 0 ? 1 : n);
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+// With PB_FUZZ_CORPUS set, every message a test encodes is also written
+// there as a fuzzing seed (see `make fuzz-corpus`).
+static void dumpFuzzSeed(const std::vector<uint8_t> &bytes) {
+  static const char *dir = std::getenv("PB_FUZZ_CORPUS");
+  static int counter = 0;
+  if (dir == nullptr)
+    return;
+  const auto *info = ::testing::UnitTest::GetInstance()->current_test_info();
+  std::filesystem::path path = std::filesystem::path(dir) /
+                               (std::string(info->test_suite_name()) + "." +
+                                info->name() + "." + std::to_string(counter++));
+  std::ofstream(path, std::ios::binary)
+      .write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+}
+
+static std::vector<uint8_t> mustEncode(const Message &m,
+                                       const EncodeOptions &opts = {}) {
+  auto [bytes, err] = encodeMessage(m, opts);
+  EXPECT_TRUE(bytes.has_value()) << "encode failed at " << err.fieldPath;
+  if (bytes.has_value())
+    dumpFuzzSeed(*bytes);
+  return bytes.value_or(std::vector<uint8_t>{});
+}
 
 TEST(Varint, RoundTripKeyValues) {
   std::vector<uint64_t> vals = {
@@ -19,7 +79,7 @@ TEST(Varint, RoundTripKeyValues) {
     auto [dec, next] = decodeVarint(enc, 0);
     ASSERT_TRUE(dec.has_value()) << "Failed to decode v=" << v;
     EXPECT_EQ(*dec, v);
-    EXPECT_EQ(next, static_cast<int>(enc.size()));
+    EXPECT_EQ(next, enc.size());
   }
 }
 
@@ -28,7 +88,7 @@ TEST(Varint, RejectTruncatedContinuation) {
   std::vector<uint8_t> bad = {0x80};
   auto [dec, next] = decodeVarint(bad, 0);
   EXPECT_FALSE(dec.has_value());
-  EXPECT_EQ(next, 0);
+  EXPECT_EQ(next, 0u);
 }
 
 TEST(Varint, ZeroIsSingleByte) {
@@ -43,7 +103,7 @@ TEST(Varint, RejectTooLongVarint) {
   bad.back() = 0x00;
   auto [dec, next] = decodeVarint(bad, 0);
   EXPECT_FALSE(dec.has_value());
-  EXPECT_EQ(next, 0);
+  EXPECT_EQ(next, 0u);
 }
 
 TEST(Varint, RejectTooLargeTenthByte) {
@@ -52,7 +112,7 @@ TEST(Varint, RejectTooLargeTenthByte) {
   bad.back() = 0x7F;
   auto [dec, next] = decodeVarint(bad, 0);
   EXPECT_FALSE(dec.has_value());
-  EXPECT_EQ(next, 0);
+  EXPECT_EQ(next, 0u);
 }
 
 TEST(Varint, DecodesFromOffsetAndAdvances) {
@@ -70,7 +130,33 @@ TEST(Varint, DecodesFromOffsetAndAdvances) {
   auto [db, j] = decodeVarint(buf, i);
   ASSERT_TRUE(db.has_value());
   EXPECT_EQ(*db, static_cast<uint64_t>(300));
-  EXPECT_EQ(j, (int)buf.size());
+  EXPECT_EQ(j, buf.size());
+}
+
+TEST(Varint32, BoundedDecode) {
+  auto [v, next] = decodeVarint32({0xAC, 0x02}, 0);
+  ASSERT_TRUE(v.has_value());
+  EXPECT_EQ(*v, 300u);
+  EXPECT_EQ(next, 2u);
+
+  std::vector<uint8_t> max = {0xFF, 0xFF, 0xFF, 0xFF, 0x0F};
+  EXPECT_EQ(decodeVarint32(max, 0).first, UINT32_MAX);
+
+  // int32 -1 as written by protobuf: sign-extended to ten bytes
+  std::vector<uint8_t> minusOne(9, 0xFF);
+  minusOne.push_back(0x01);
+  auto [neg, negNext] = decodeVarint32(minusOne, 0);
+  EXPECT_EQ(neg, UINT32_MAX);
+  EXPECT_EQ(negNext, 10u);
+
+  std::vector<uint8_t> tooLong(10, 0xFF);
+  tooLong.push_back(0x01);
+  EXPECT_FALSE(decodeVarint32(tooLong, 0).first.has_value());
+  EXPECT_FALSE(decodeVarint32({0xFF, 0xFF}, 0).first.has_value());
+
+  for (int32_t x : {0, 1, -1, INT32_MAX, INT32_MIN})
+    EXPECT_EQ(unzigzag32(zigzag32(x)), x);
+  EXPECT_EQ(zigzag32(-1), 1u);
 }
 
 TEST(SignedVarint, RoundTripKeyValues) {
@@ -85,7 +171,7 @@ TEST(SignedVarint, RoundTripKeyValues) {
     auto [dec, next] = decodeSignedVarint(enc, 0);
     ASSERT_TRUE(dec.has_value()) << "Failed to decode v=" << v;
     EXPECT_EQ(*dec, v);
-    EXPECT_EQ(next, static_cast<int>(enc.size()));
+    EXPECT_EQ(next, enc.size());
   }
 }
 
@@ -175,7 +261,7 @@ TEST(String, RoundTrip) {
     auto [dec, next] = decodeStr(enc, 0);
     ASSERT_TRUE(dec.has_value());
     EXPECT_EQ(*dec, s);
-    EXPECT_EQ(next, static_cast<int>(enc.size()));
+    EXPECT_EQ(next, enc.size());
   }
 }
 
@@ -184,7 +270,7 @@ TEST(String, RejectTruncatedPayload) {
   enc.pop_back(); // remove one byte
   auto [dec, next] = decodeStr(enc, 0);
   EXPECT_FALSE(dec.has_value());
-  EXPECT_EQ(next, 0);
+  EXPECT_EQ(next, 0u);
 }
 
 TEST(String, EmptyIsJustLengthZero) {
@@ -194,7 +280,7 @@ TEST(String, EmptyIsJustLengthZero) {
   auto [dec, next] = decodeStr(enc, 0);
   ASSERT_TRUE(dec.has_value());
   EXPECT_EQ(*dec, "");
-  EXPECT_EQ(next, (int)enc.size());
+  EXPECT_EQ(next, enc.size());
 }
 
 TEST(Bytes, RoundTrip) {
@@ -210,7 +296,7 @@ TEST(Bytes, RoundTrip) {
     auto [dec, next] = decodeBytes(enc, 0);
     ASSERT_TRUE(dec.has_value());
     EXPECT_EQ(*dec, b);
-    EXPECT_EQ(next, static_cast<int>(enc.size()));
+    EXPECT_EQ(next, enc.size());
   }
 }
 
@@ -406,12 +492,12 @@ TEST(MessageCodec, RoundTripBasic) {
   ASSERT_TRUE(m.push("tags", std::int64_t(10)));
   ASSERT_TRUE(m.push("tags", std::int64_t(20)));
 
-  auto bytes = encodeMessage(m);
+  auto bytes = mustEncode(m);
   // std::cout << ".|" << bytes.size() << "|.\n";
   auto [decodedOpt, next] = decodeMessage(bytes, desc);
 
   ASSERT_TRUE(decodedOpt.has_value());
-  EXPECT_EQ(next, (int)bytes.size());
+  EXPECT_EQ(next, bytes.size());
 
   const Message &d = *decodedOpt;
 
@@ -456,11 +542,11 @@ TEST(MessageCodec, RoundTripRepeatedUnpackedInt) {
   ASSERT_TRUE(m.push("tags", int64_t(20)));
   ASSERT_TRUE(m.push("tags", int64_t(-5)));
 
-  auto bytes = encodeMessage(m);
+  auto bytes = mustEncode(m);
   auto [decodedOpt, next] = decodeMessage(bytes, desc);
 
   ASSERT_TRUE(decodedOpt.has_value());
-  EXPECT_EQ(next, (int)bytes.size());
+  EXPECT_EQ(next, bytes.size());
 
   auto t0 = decodedOpt->getByIndex("tags", 0);
   auto t1 = decodedOpt->getByIndex("tags", 1);
@@ -485,11 +571,11 @@ TEST(MessageCodec, RoundTripRepeatedUnpackedString) {
   ASSERT_TRUE(m.push("names", std::string("bb")));
   ASSERT_TRUE(m.push("names", std::string("")));
 
-  auto bytes = encodeMessage(m);
+  auto bytes = mustEncode(m);
   auto [decodedOpt, next] = decodeMessage(bytes, desc);
 
   ASSERT_TRUE(decodedOpt.has_value());
-  EXPECT_EQ(next, (int)bytes.size());
+  EXPECT_EQ(next, bytes.size());
 
   auto n0 = decodedOpt->getByIndex("names", 0);
   auto n1 = decodedOpt->getByIndex("names", 1);
@@ -527,11 +613,11 @@ TEST(MessageCodec, RoundTripNestedMessage) {
   ASSERT_TRUE(nested.set("nested_id", int64_t(123)));
   ASSERT_TRUE(m.set("nested_msg", nested));
 
-  auto bytes = encodeMessage(m);
+  auto bytes = mustEncode(m);
   auto [decodedOpt, next] = decodeMessage(bytes, desc);
 
   ASSERT_TRUE(decodedOpt.has_value());
-  EXPECT_EQ(next, (int)bytes.size());
+  EXPECT_EQ(next, bytes.size());
 
   auto id = decodedOpt->get("id");
   ASSERT_TRUE(id.has_value());
@@ -563,10 +649,10 @@ TEST(MessageCodec, NestedMessageEncodingIsLengthDelimited) {
   Message m(desc);
   ASSERT_TRUE(m.set("nested_msg", nested));
 
-  auto got = encodeMessage(m);
+  auto got = mustEncode(m);
 
   // Expected: key(field 2, LEN) + len(payload) + payload
-  auto payload = encodeMessage(nested);
+  auto payload = mustEncode(nested);
   std::vector<uint8_t> expected;
   append(expected, encodeVarint((uint64_t(2) << 3) | uint64_t(WireType::LEN)));
   append(expected, encodeVarint(payload.size()));
@@ -595,11 +681,11 @@ TEST(MessageCodec, RoundTripRepeatedNestedMessages) {
   ASSERT_TRUE(parent.push("children", c1));
   ASSERT_TRUE(parent.push("children", c2));
 
-  auto bytes = encodeMessage(parent);
+  auto bytes = mustEncode(parent);
   auto [decodedOpt, next] = decodeMessage(bytes, parentDesc);
 
   ASSERT_TRUE(decodedOpt.has_value());
-  EXPECT_EQ(next, (int)bytes.size());
+  EXPECT_EQ(next, bytes.size());
 
   auto e0 = decodedOpt->getByIndex("children", 0);
   auto e1 = decodedOpt->getByIndex("children", 1);
@@ -633,7 +719,7 @@ TEST(MessageCodec, SkipsUnknownFieldInsideNestedMessage) {
   // Build nested payload: ok="x" plus unknown field #99 LEN "zz"
   Message nested(nestedDesc);
   ASSERT_TRUE(nested.set("ok", std::string("x")));
-  auto payload = encodeMessage(nested);
+  auto payload = mustEncode(nested);
   append(payload, encodeVarint((uint64_t(99) << 3) | uint64_t(WireType::LEN)));
   append(payload, encodeStr("zz")); // includes its own length prefix
 
@@ -645,7 +731,7 @@ TEST(MessageCodec, SkipsUnknownFieldInsideNestedMessage) {
 
   auto [decodedOpt, next] = decodeMessage(bytes, desc);
   ASSERT_TRUE(decodedOpt.has_value());
-  EXPECT_EQ(next, (int)bytes.size());
+  EXPECT_EQ(next, bytes.size());
 
   auto nm = decodedOpt->get("nested_msg");
   ASSERT_TRUE(nm.has_value());
@@ -674,7 +760,7 @@ TEST(MessageCodec, RejectsMessageFieldWithWrongWireType) {
 
   auto [decodedOpt, idx] = decodeMessage(bytes, desc);
   EXPECT_FALSE(decodedOpt.has_value());
-  EXPECT_EQ(idx, 1); // start of value (right after tag)
+  EXPECT_EQ(idx, 1u); // start of value (right after tag)
 }
 
 TEST(MessageCodec, RejectsTruncatedNestedPayload) {
@@ -708,7 +794,7 @@ TEST(MessageCodec, SkipsUnknownVarintField) {
   ASSERT_TRUE(m.set("id", std::int64_t(7)));
   ASSERT_TRUE(m.set("name", std::string("ok")));
 
-  auto bytes = encodeMessage(m);
+  auto bytes = mustEncode(m);
 
   // Append an unknown field #99 with VARINT wire type and value 150.
   // key = (99 << 3) | 0
@@ -720,7 +806,7 @@ TEST(MessageCodec, SkipsUnknownVarintField) {
 
   auto [decodedOpt, next] = decodeMessage(bytes, desc);
   ASSERT_TRUE(decodedOpt.has_value());
-  EXPECT_EQ(next, (int)bytes.size());
+  EXPECT_EQ(next, bytes.size());
 
   const Message &d = *decodedOpt;
 
@@ -741,7 +827,7 @@ TEST(MessageCodec, SkipsUnknownLenField) {
   Message m(desc);
   ASSERT_TRUE(m.set("id", std::int64_t(42)));
 
-  auto bytes = encodeMessage(m);
+  auto bytes = mustEncode(m);
 
   // Append unknown field #50 length-delimited with payload "xyz".
   auto key = encodeVarint((uint64_t(50) << 3) | uint64_t(WireType::LEN));
@@ -751,7 +837,7 @@ TEST(MessageCodec, SkipsUnknownLenField) {
 
   auto [decodedOpt, next] = decodeMessage(bytes, desc);
   ASSERT_TRUE(decodedOpt.has_value());
-  EXPECT_EQ(next, (int)bytes.size());
+  EXPECT_EQ(next, bytes.size());
 
   auto id = decodedOpt->get("id");
   ASSERT_TRUE(id.has_value());
@@ -766,7 +852,7 @@ TEST(MessageCodec, SkipsUnknownFixed32Field) {
   Message m(desc);
   ASSERT_TRUE(m.set("id", std::int64_t(42)));
 
-  auto bytes = encodeMessage(m);
+  auto bytes = mustEncode(m);
 
   // Append unknown field #77 with I32 wire type and 4-byte payload.
   auto key = encodeVarint((uint64_t(77) << 3) | uint64_t(WireType::I32));
@@ -776,7 +862,7 @@ TEST(MessageCodec, SkipsUnknownFixed32Field) {
 
   auto [decodedOpt, next] = decodeMessage(bytes, desc);
   ASSERT_TRUE(decodedOpt.has_value());
-  EXPECT_EQ(next, (int)bytes.size());
+  EXPECT_EQ(next, bytes.size());
 
   auto id = decodedOpt->get("id");
   ASSERT_TRUE(id.has_value());
@@ -799,7 +885,7 @@ TEST(MessageCodec, RejectsKnownFieldWithWrongWireType) {
   EXPECT_FALSE(decodedOpt.has_value());
   EXPECT_EQ(
       next,
-      1); // your decode returns {nullopt, index} where index is current start
+      1u); // your decode returns {nullopt, index} where index is current start
 }
 
 TEST(MessageCodec, RejectsFieldNumberZero) {
@@ -841,11 +927,11 @@ TEST(MessageCodec, RoundTripMissingFields) {
   Message m(desc);
   ASSERT_TRUE(m.set("name", std::string("only_name")));
 
-  auto bytes = encodeMessage(m);
+  auto bytes = mustEncode(m);
   auto [decodedOpt, next] = decodeMessage(bytes, desc);
 
   ASSERT_TRUE(decodedOpt.has_value());
-  EXPECT_EQ(next, (int)bytes.size());
+  EXPECT_EQ(next, bytes.size());
 
   EXPECT_FALSE(decodedOpt->get("id").has_value());
   EXPECT_FALSE(decodedOpt->get("value").has_value());
@@ -866,11 +952,11 @@ TEST(MessageCodec, RoundTripFloatAndBytes) {
   std::vector<uint8_t> blob = {0x00, 0xAB, 0xCD};
   ASSERT_TRUE(m.set("blob", blob));
 
-  auto bytes = encodeMessage(m);
+  auto bytes = mustEncode(m);
   auto [decodedOpt, next] = decodeMessage(bytes, desc);
 
   ASSERT_TRUE(decodedOpt.has_value());
-  EXPECT_EQ(next, (int)bytes.size());
+  EXPECT_EQ(next, bytes.size());
 
   auto ratio = decodedOpt->get("ratio");
   ASSERT_TRUE(ratio.has_value());
@@ -883,6 +969,2688 @@ TEST(MessageCodec, RoundTripFloatAndBytes) {
   EXPECT_EQ(std::get<std::vector<uint8_t>>(blobOut->get()), blob);
 }
 
+TEST(Canonical, OrdersFieldsByNumber) {
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"b", 2, FieldType::UInt},
+      {"a", 1, FieldType::UInt},
+  });
+
+  Message m(desc);
+  ASSERT_TRUE(m.set("b", std::uint64_t(2)));
+  ASSERT_TRUE(m.set("a", std::uint64_t(1)));
+
+  // Declaration order puts field 2 first; canonical order puts field 1 first.
+  std::vector<uint8_t> declared = {0x10, 0x02, 0x08, 0x01};
+  std::vector<uint8_t> canonical = {0x08, 0x01, 0x10, 0x02};
+  EXPECT_EQ(mustEncode(m), declared);
+  EXPECT_EQ(mustEncode(m, {.canonical = true}), canonical);
+}
+
+TEST(Canonical, EmptyRepeatedMatchesUnset) {
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"id", 1, FieldType::Int},
+      {"tags", 2, FieldType::Int, /*repeated=*/true},
+  });
+
+  Message a(desc);
+  Message b(desc);
+  ASSERT_TRUE(a.set("id", std::int64_t(5)));
+  ASSERT_TRUE(b.set("id", std::int64_t(5)));
+  ASSERT_TRUE(b.set("tags", RepeatedVal{FieldType::Int, {}}));
+
+  EXPECT_EQ(mustEncode(a, {.canonical = true}),
+            mustEncode(b, {.canonical = true}));
+  EXPECT_TRUE(messagesEqual(a, b));
+  EXPECT_EQ(hashMessage(a), hashMessage(b));
+}
+
+TEST(Canonical, HashAndEqualityFollowContent) {
+  auto nestedDesc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"name", 1, FieldType::String},
+      {"ratio", 2, FieldType::Double},
+  });
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"id", 1, FieldType::Int},
+      {"nested", 2, FieldType::Message, /*repeated=*/false,
+       /*packed=*/false, nestedDesc},
+      {"tags", 3, FieldType::UInt, /*repeated=*/true},
+  });
+
+  auto build = [&](const std::string &name, double ratio) {
+    Message n(nestedDesc);
+    EXPECT_TRUE(n.set("ratio", ratio));
+    EXPECT_TRUE(n.set("name", name));
+    Message m(desc);
+    EXPECT_TRUE(m.push("tags", std::uint64_t(3)));
+    EXPECT_TRUE(m.set("nested", n));
+    EXPECT_TRUE(m.set("id", std::int64_t(-9)));
+    return m;
+  };
+
+  Message a = build("x", 1.5);
+  Message b = build("x", 1.5);
+  Message c = build("y", 1.5);
+  Message d = build("x", -0.0);
+  Message e = build("x", 0.0);
+
+  EXPECT_TRUE(messagesEqual(a, b));
+  EXPECT_EQ(hashMessage(a), hashMessage(b));
+  EXPECT_EQ(mustEncode(a, {.canonical = true}),
+            mustEncode(b, {.canonical = true}));
+
+  EXPECT_FALSE(messagesEqual(a, c));
+  EXPECT_NE(hashMessage(a), hashMessage(c));
+
+  // Floating point compares bitwise, matching the wire bytes.
+  EXPECT_FALSE(messagesEqual(d, e));
+  Message nan1 = build("x", std::numeric_limits<double>::quiet_NaN());
+  Message nan2 = build("x", std::numeric_limits<double>::quiet_NaN());
+  EXPECT_TRUE(messagesEqual(nan1, nan2));
+  EXPECT_EQ(hashMessage(nan1), hashMessage(nan2));
+}
+
+TEST(Canonical, DifferentPresenceNotEqual) {
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"a", 1, FieldType::UInt},
+      {"b", 2, FieldType::UInt},
+  });
+
+  Message a(desc);
+  Message b(desc);
+  ASSERT_TRUE(a.set("a", std::uint64_t(0)));
+  ASSERT_TRUE(b.set("b", std::uint64_t(0)));
+
+  EXPECT_FALSE(messagesEqual(a, b));
+  EXPECT_FALSE(messagesEqual(a, Message(desc)));
+  EXPECT_TRUE(messagesEqual(Message(desc), Message(desc)));
+}
+
+TEST(EncodedSize, VarintSizeMatchesEncoding) {
+  std::vector<uint64_t> vals = {0ULL,         1ULL,         127ULL,
+                                128ULL,       16383ULL,     16384ULL,
+                                (1ULL << 35), (1ULL << 63), UINT64_MAX};
+  for (auto v : vals)
+    EXPECT_EQ(varintSize(v), encodeVarint(v).size()) << "v=" << v;
+  std::vector<int64_t> signedVals = {0, -1, 63, -64, 64, INT64_MIN, INT64_MAX};
+  for (auto v : signedVals)
+    EXPECT_EQ(signedVarintSize(v), encodeSignedVarint(v).size()) << "v=" << v;
+}
+
+TEST(EncodedSize, MatchesEncodeMessage) {
+  auto childDesc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"name", 1, FieldType::String},
+      {"blob", 2, FieldType::Bytes},
+  });
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"id", 1, FieldType::Int},
+      {"value", 2, FieldType::Double},
+      {"ratio", 3, FieldType::Float},
+      {"active", 4, FieldType::Bool},
+      {"tags", 5, FieldType::UInt, /*repeated=*/true},
+      {"ids", 6, FieldType::Int, /*repeated=*/true, /*packed=*/false},
+      {"children", 300, FieldType::Message, /*repeated=*/true,
+       /*packed=*/false, childDesc},
+      {"empty", 7, FieldType::UInt, /*repeated=*/true},
+  });
+
+  Message m(desc);
+  ASSERT_TRUE(m.set("id", std::int64_t(-123456)));
+  ASSERT_TRUE(m.set("value", 2.5));
+  ASSERT_TRUE(m.set("ratio", 0.5f));
+  ASSERT_TRUE(m.set("active", true));
+  for (uint64_t t : std::vector<uint64_t>{1, 300, UINT64_MAX})
+    ASSERT_TRUE(m.push("tags", std::uint64_t(t)));
+  ASSERT_TRUE(m.push("ids", std::int64_t(-1)));
+  ASSERT_TRUE(m.set("empty", RepeatedVal{FieldType::UInt, {}}));
+  for (int i = 0; i < 3; ++i) {
+    Message c(childDesc);
+    ASSERT_TRUE(c.set("name", std::string(size_t(i) * 100, 'n')));
+    ASSERT_TRUE(c.set("blob", std::vector<uint8_t>(200, 0xAB)));
+    ASSERT_TRUE(m.push("children", c));
+  }
+
+  EXPECT_EQ(byteSize(m), mustEncode(m).size());
+  EncodeOptions canonical{.canonical = true};
+  EXPECT_EQ(byteSize(m, canonical), mustEncode(m, canonical).size());
+  EXPECT_EQ(byteSize(Message(desc)), 0u);
+}
+
+TEST(EncodedSize, PerFieldBreakdown) {
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"name", 2, FieldType::String},
+      {"id", 1, FieldType::UInt},
+      {"unset", 3, FieldType::Double},
+  });
+
+  Message m(desc);
+  ASSERT_TRUE(m.set("id", std::uint64_t(300)));
+  ASSERT_TRUE(m.set("name", std::string("abc")));
+
+  auto parts = byteSizeByField(m, {.canonical = true});
+  ASSERT_EQ(parts.size(), 2u);
+  EXPECT_EQ(parts[0].number, 1u);
+  EXPECT_EQ(parts[0].fieldIndex, 1u);
+  EXPECT_EQ(parts[0].bytes, 3u); // tag + 2-byte varint
+  EXPECT_EQ(parts[1].number, 2u);
+  EXPECT_EQ(parts[1].bytes, 5u); // tag + length + "abc"
+  EXPECT_EQ(parts[0].bytes + parts[1].bytes, byteSize(m));
+}
+
+TEST(EncodeErrors, TypeMismatchReportsFieldAndOffset) {
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"id", 1, FieldType::Int},
+      {"name", 2, FieldType::String},
+  });
+
+  Message m(desc);
+  ASSERT_TRUE(m.set("id", std::int64_t(1)));
+  m.boxedAt(1) = Value(3.5); // bypass set() type checks
+
+  auto [bytes, err] = encodeMessage(m);
+  EXPECT_FALSE(bytes.has_value());
+  EXPECT_EQ(err.code, EncodeErrc::TypeMismatch);
+  EXPECT_EQ(err.fieldPath, "name");
+  EXPECT_EQ(err.offset, 2u); // after id's tag + value
+}
+
+TEST(EncodeErrors, NestedPathIncludesRepeatedIndex) {
+  auto childDesc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"name", 1, FieldType::String},
+  });
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"children", 1, FieldType::Message, /*repeated=*/true,
+       /*packed=*/false, childDesc},
+  });
+
+  Message good(childDesc);
+  ASSERT_TRUE(good.set("name", std::string("ok")));
+  Message bad(childDesc);
+  bad.boxedAt(0) = Value(std::int64_t(5));
+
+  Message m(desc);
+  ASSERT_TRUE(m.push("children", good));
+  ASSERT_TRUE(m.push("children", bad));
+
+  auto [bytes, err] = encodeMessage(m);
+  EXPECT_FALSE(bytes.has_value());
+  EXPECT_EQ(err.code, EncodeErrc::TypeMismatch);
+  EXPECT_EQ(err.fieldPath, "children[1].name");
+  EXPECT_EQ(err.offset, 8u); // 6 bytes of children[0], then tag + length
+}
+
+TEST(EncodeErrors, PackedLenTypeRejected) {
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"names", 1, FieldType::String, /*repeated=*/true, /*packed=*/true},
+  });
+
+  Message m(desc);
+  ASSERT_TRUE(m.push("names", std::string("a")));
+
+  auto [bytes, err] = encodeMessage(m);
+  EXPECT_FALSE(bytes.has_value());
+  EXPECT_EQ(err.code, EncodeErrc::NotPackable);
+  EXPECT_EQ(err.fieldPath, "names");
+}
+
+TEST(EncodeErrors, SuccessCarriesNoError) {
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"id", 1, FieldType::Int},
+  });
+  Message m(desc);
+  ASSERT_TRUE(m.set("id", std::int64_t(1)));
+
+  auto [bytes, err] = encodeMessage(m);
+  ASSERT_TRUE(bytes.has_value());
+  EXPECT_EQ(err.code, EncodeErrc::None);
+  EXPECT_TRUE(err.fieldPath.empty());
+}
+
+static std::shared_ptr<const ProtoDesc> chainDesc(int levels) {
+  // Each level holds an id and an optional child of the next level down
+  std::shared_ptr<const ProtoDesc> d = std::make_shared<ProtoDesc>(
+      std::vector<FieldDesc>{{"id", 1, FieldType::UInt}});
+  for (int i = 1; i < levels; ++i) {
+    d = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+        {"id", 1, FieldType::UInt},
+        {"child", 2, FieldType::Message, /*repeated=*/false,
+         /*packed=*/false, d},
+    });
+  }
+  return d;
+}
+
+static Message chainMessage(const std::shared_ptr<const ProtoDesc> &d) {
+  Message m(d);
+  EXPECT_TRUE(m.set("id", std::uint64_t(1)));
+  if (const FieldDesc *child = d->findByName("child")) {
+    EXPECT_TRUE(m.set("child", chainMessage(child->nestedDesc)));
+  }
+  return m;
+}
+
+TEST(DecodeLimits, MaxDepth) {
+  auto desc = chainDesc(5);
+  auto bytes = mustEncode(chainMessage(desc));
+
+  DecodeOptions opts;
+  opts.maxDepth = 4;
+  auto [ok, okErr] = decodeMessage(bytes, desc, opts);
+  EXPECT_TRUE(ok.has_value());
+
+  opts.maxDepth = 3;
+  auto [msg, err] = decodeMessage(bytes, desc, opts);
+  EXPECT_FALSE(msg.has_value());
+  EXPECT_EQ(err.code, DecodeErrc::DepthExceeded);
+  EXPECT_EQ(err.fieldPath, "child.child.child.child");
+}
+
+TEST(DecodeLimits, MaxFieldSizeCheckedBeforeAllocating) {
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"id", 1, FieldType::UInt},
+      {"name", 2, FieldType::String},
+  });
+  Message m(desc);
+  ASSERT_TRUE(m.set("id", std::uint64_t(1)));
+  ASSERT_TRUE(m.set("name", std::string(100, 'x')));
+  auto bytes = mustEncode(m);
+
+  DecodeOptions opts;
+  opts.maxFieldSize = 10;
+  auto [msg, err] = decodeMessage(bytes, desc, opts);
+  EXPECT_FALSE(msg.has_value());
+  EXPECT_EQ(err.code, DecodeErrc::FieldTooLarge);
+  EXPECT_EQ(err.fieldPath, "name");
+  EXPECT_EQ(err.offset, 4u); // id (2 bytes), tag, 1-byte length
+}
+
+TEST(DecodeLimits, MaxRepeatedAcrossPackedRuns) {
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"tags", 1, FieldType::UInt, /*repeated=*/true},
+  });
+  Message m(desc);
+  for (uint64_t i = 0; i < 3; ++i)
+    ASSERT_TRUE(m.push("tags", i));
+  auto bytes = mustEncode(m);
+  // A second packed run appends to the same field
+  auto again = bytes;
+  append(bytes, again);
+
+  DecodeOptions opts;
+  opts.maxRepeated = 5;
+  auto [msg, err] = decodeMessage(bytes, desc, opts);
+  EXPECT_FALSE(msg.has_value());
+  EXPECT_EQ(err.code, DecodeErrc::TooManyElements);
+  EXPECT_EQ(err.fieldPath, "tags[5]");
+
+  opts.maxRepeated = 6;
+  auto [ok, okErr] = decodeMessage(bytes, desc, opts);
+  ASSERT_TRUE(ok.has_value());
+  EXPECT_EQ(std::get<RepeatedVal>(ok->get("tags")->get()).values.size(), 6u);
+}
+
+TEST(DecodeLimits, MaxTotalBytesAndAllocations) {
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"names", 1, FieldType::String, /*repeated=*/true, /*packed=*/false},
+  });
+  Message m(desc);
+  for (int i = 0; i < 4; ++i)
+    ASSERT_TRUE(m.push("names", std::string("n")));
+  auto bytes = mustEncode(m);
+
+  DecodeOptions opts;
+  opts.maxTotalBytes = bytes.size() - 1;
+  auto [tooBig, bigErr] = decodeMessage(bytes, desc, opts);
+  EXPECT_FALSE(tooBig.has_value());
+  EXPECT_EQ(bigErr.code, DecodeErrc::TotalSizeExceeded);
+
+  opts = DecodeOptions{};
+  opts.maxAllocations = 3; // the repeated field itself + two strings
+  auto [msg, err] = decodeMessage(bytes, desc, opts);
+  EXPECT_FALSE(msg.has_value());
+  EXPECT_EQ(err.code, DecodeErrc::TooManyAllocations);
+  EXPECT_EQ(err.fieldPath, "names[2]");
+}
+
+TEST(DecodeLimits, HugeLengthsDoNotOverflow) {
+  std::vector<uint8_t> str;
+  append(str, encodeVarint(std::numeric_limits<uint64_t>::max() - 1));
+  str.push_back('a');
+  EXPECT_FALSE(decodeStr(str, 0).first.has_value());
+  EXPECT_FALSE(decodeBytes(str, 0).first.has_value());
+
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"id", 1, FieldType::UInt},
+  });
+  // Unknown LEN field #2 and known-typed nested garbage with 2^63 lengths
+  std::vector<uint8_t> bytes;
+  append(bytes, encodeVarint((uint64_t(2) << 3) | uint64_t(WireType::LEN)));
+  append(bytes, encodeVarint(uint64_t(1) << 63));
+  bytes.push_back(0x00);
+
+  auto [msg, err] = decodeMessage(bytes, desc, DecodeOptions{});
+  EXPECT_FALSE(msg.has_value());
+  EXPECT_EQ(err.code, DecodeErrc::Malformed);
+}
+
+TEST(DecodeErrors, NestedFailureReportsPath) {
+  auto nestedDesc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"flag", 1, FieldType::Bool},
+  });
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"nested_msg", 2, FieldType::Message, /*repeated=*/false,
+       /*packed=*/false, nestedDesc},
+  });
+
+  // nested_msg { flag: 7 } -- bools must be 0 or 1
+  std::vector<uint8_t> bytes = {0x12, 0x02, 0x08, 0x07};
+  auto [msg, err] = decodeMessage(bytes, desc, DecodeOptions{});
+  EXPECT_FALSE(msg.has_value());
+  EXPECT_EQ(err.code, DecodeErrc::InvalidValue);
+  EXPECT_EQ(err.fieldPath, "nested_msg.flag");
+  EXPECT_EQ(err.offset, 3u);
+}
+
+TEST(CopyCounters, DecodeAndEncodeMakeNoDeepCopies) {
+  if (!PROTO_COPY_COUNTERS)
+    GTEST_SKIP() << "copy counters are compiled out (NDEBUG)";
+
+  auto leafDesc = chainDesc(4);
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"tags", 1, FieldType::UInt, /*repeated=*/true},
+      {"names", 2, FieldType::String, /*repeated=*/true, /*packed=*/false},
+      {"chains", 3, FieldType::Message, /*repeated=*/true, /*packed=*/false,
+       leafDesc},
+      {"chain", 4, FieldType::Message, /*repeated=*/false, /*packed=*/false,
+       leafDesc},
+  });
+
+  Message m(desc);
+  for (uint64_t i = 0; i < 3; ++i) {
+    ASSERT_TRUE(m.push("tags", i));
+    ASSERT_TRUE(m.push("names", std::string(40, 'a' + char(i))));
+  }
+  // Built in place so construction itself copies nothing either
+  resetCopyStats();
+  for (int i = 0; i < 3; ++i) {
+    Message *chain = m.addMessage("chains");
+    ASSERT_NE(chain, nullptr);
+    *chain = chainMessage(leafDesc); // move-assigned
+  }
+  Message *single = m.mutableMessage("chain");
+  ASSERT_NE(single, nullptr);
+  ASSERT_TRUE(single->set("id", std::uint64_t(9)));
+  EXPECT_EQ(copyStats().messages, 0u);
+
+  resetCopyStats();
+  auto bytes = mustEncode(m);
+  EXPECT_EQ(copyStats().messages, 0u);
+  EXPECT_EQ(copyStats().repeated, 0u);
+
+  resetCopyStats();
+  auto [decoded, err] = decodeMessage(bytes, desc, DecodeOptions{});
+  ASSERT_TRUE(decoded.has_value());
+  EXPECT_EQ(copyStats().messages, 0u);
+  EXPECT_EQ(copyStats().repeated, 0u);
+  EXPECT_TRUE(messagesEqual(m, *decoded));
+
+  // The counters do see real copies: copying the message shares its
+  // out-of-line values, and the first write clones the repeated field
+  resetCopyStats();
+  Message copy = *decoded;
+  EXPECT_EQ(copyStats().messages, 1u);
+  EXPECT_EQ(copyStats().repeated, 0u);
+  ASSERT_TRUE(copy.push("tags", std::uint64_t(7)));
+  EXPECT_EQ(copyStats().repeated, 1u);
+}
+
+TEST(Message, InPlaceNestedAccessorsCheckFieldKind) {
+  auto nestedDesc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"x", 1, FieldType::Int},
+  });
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"one", 1, FieldType::Message, /*repeated=*/false, /*packed=*/false,
+       nestedDesc},
+      {"many", 2, FieldType::Message, /*repeated=*/true, /*packed=*/false,
+       nestedDesc},
+      {"id", 3, FieldType::Int},
+  });
+
+  Message m(desc);
+  EXPECT_EQ(m.mutableMessage("many"), nullptr);
+  EXPECT_EQ(m.addMessage("one"), nullptr);
+  EXPECT_EQ(m.mutableMessage("id"), nullptr);
+  EXPECT_EQ(m.addMessage("missing"), nullptr);
+
+  Message *one = m.mutableMessage("one");
+  ASSERT_NE(one, nullptr);
+  ASSERT_TRUE(one->set("x", std::int64_t(5)));
+  EXPECT_EQ(m.mutableMessage("one"), one); // same slot on second call
+
+  ASSERT_NE(m.addMessage("many"), nullptr);
+  ASSERT_NE(m.addMessage("many"), nullptr);
+  EXPECT_TRUE(m.getByIndex("many", 1).has_value());
+
+  const Message &got = std::get<Message>(m.get("one")->get());
+  EXPECT_EQ(std::get<std::int64_t>(got.get("x")->get()), 5);
+}
+
+TEST(Layout, ScalarsPackInlineByWidth) {
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"flag", 1, FieldType::Bool},
+      {"name", 2, FieldType::String},
+      {"ratio", 3, FieldType::Float},
+      {"id", 4, FieldType::Int},
+      {"tags", 5, FieldType::UInt, /*repeated=*/true},
+      {"score", 6, FieldType::Double},
+  });
+
+  const MessageLayout &lay = desc->layout();
+  EXPECT_EQ(lay.presenceWords, 1u);
+  EXPECT_EQ(lay.scalarWords, 3u); // 8 + 8 + 4 + 1 bytes
+  EXPECT_EQ(lay.boxedCount, 2u);  // name, tags
+  EXPECT_TRUE(lay.slots[3].isInline);
+  EXPECT_EQ(lay.slots[3].offset, 0u);
+  EXPECT_EQ(lay.slots[5].offset, 8u);
+  EXPECT_EQ(lay.slots[2].offset, 16u);
+  EXPECT_EQ(lay.slots[0].offset, 20u);
+  EXPECT_FALSE(lay.slots[1].isInline);
+  EXPECT_FALSE(lay.slots[4].isInline);
+
+  Message m(desc);
+  EXPECT_FALSE(m.get("flag").has_value());
+  ASSERT_TRUE(m.set("flag", true));
+  ASSERT_TRUE(m.set("ratio", 1.5f));
+  ASSERT_TRUE(m.set("id", std::int64_t(-7)));
+  ASSERT_TRUE(m.set("score", 2.25));
+  EXPECT_FALSE(m.set("id", 2.25)); // still type-checked
+  EXPECT_EQ(std::get<bool>(m.get("flag")->get()), true);
+  EXPECT_EQ(std::get<float>(m.get("ratio")->get()), 1.5f);
+  EXPECT_EQ(std::get<std::int64_t>(m.get("id")->get()), -7);
+  EXPECT_EQ(std::get<double>(m.get("score")->get()), 2.25);
+  EXPECT_FALSE(m.get("name").has_value());
+  EXPECT_THROW(m.boxedAt(0), std::logic_error);
+
+  // Header plus presence word plus three scalar words plus two pointers
+  EXPECT_LE(sizeof(Message), 3 * sizeof(void *));
+  EXPECT_EQ(m.spaceUsed(), sizeof(Message) + 6 * sizeof(uint64_t));
+}
+
+TEST(Layout, CopiesAreDeepAndRoundTrip) {
+  auto childDesc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"x", 1, FieldType::Int},
+  });
+  std::vector<FieldDesc> fields;
+  for (uint32_t i = 1; i <= 70; ++i) // spans two presence words
+    fields.emplace_back("f" + std::to_string(i), i, FieldType::UInt);
+  fields.emplace_back("child", 71, FieldType::Message, false, false,
+                      childDesc);
+  fields.emplace_back("blob", 72, FieldType::Bytes);
+  auto desc = std::make_shared<ProtoDesc>(std::move(fields));
+  EXPECT_EQ(desc->layout().presenceWords, 2u);
+
+  Message m(desc);
+  ASSERT_TRUE(m.set("f1", std::uint64_t(1)));
+  ASSERT_TRUE(m.set("f70", std::uint64_t(70)));
+  ASSERT_NE(m.mutableMessage("child"), nullptr);
+  ASSERT_TRUE(m.mutableMessage("child")->set("x", std::int64_t(3)));
+  ASSERT_TRUE(m.set("blob", std::vector<uint8_t>{1, 2, 3}));
+
+  Message copy = m;
+  ASSERT_TRUE(copy.mutableMessage("child")->set("x", std::int64_t(4)));
+  ASSERT_TRUE(copy.set("f70", std::uint64_t(0)));
+  const Message &orig = std::get<Message>(m.get("child")->get());
+  EXPECT_EQ(std::get<std::int64_t>(orig.get("x")->get()), 3);
+  EXPECT_EQ(std::get<std::uint64_t>(m.get("f70")->get()), 70u);
+
+  auto bytes = mustEncode(m);
+  auto [decoded, err] = decodeMessage(bytes, desc, DecodeOptions{});
+  ASSERT_TRUE(decoded.has_value());
+  EXPECT_TRUE(messagesEqual(m, *decoded));
+  EXPECT_FALSE(decoded->get("f2").has_value());
+
+  copy = std::move(*decoded);
+  EXPECT_TRUE(messagesEqual(m, copy));
+}
+
+TEST(CopyOnWrite, CopiesShareUntilWritten) {
+  auto leafDesc = chainDesc(3);
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"chain", 1, FieldType::Message, /*repeated=*/false, /*packed=*/false,
+       leafDesc},
+      {"other", 2, FieldType::Message, /*repeated=*/false, /*packed=*/false,
+       leafDesc},
+      {"blob", 3, FieldType::Bytes},
+  });
+  Message m(desc);
+  *m.mutableMessage("chain") = chainMessage(leafDesc);
+  *m.mutableMessage("other") = chainMessage(leafDesc);
+  ASSERT_TRUE(m.set("blob", std::vector<uint8_t>(4096, 0xAB)));
+
+  auto addrOf = [](const Message &msg, const char *name) {
+    return &msg.get(name)->get();
+  };
+
+  Message copy = m;
+  EXPECT_EQ(addrOf(m, "chain"), addrOf(copy, "chain"));
+  EXPECT_EQ(addrOf(m, "blob"), addrOf(copy, "blob"));
+
+  // Writing two levels down clones that path and nothing else
+  Message *child = copy.mutableMessage("chain")->mutableMessage("child");
+  ASSERT_TRUE(child->set("id", std::uint64_t(42)));
+  EXPECT_NE(addrOf(m, "chain"), addrOf(copy, "chain"));
+  EXPECT_EQ(addrOf(m, "other"), addrOf(copy, "other"));
+  EXPECT_EQ(addrOf(m, "blob"), addrOf(copy, "blob"));
+  const Message &origChain = std::get<Message>(m.get("chain")->get());
+  const Message &copyChain = std::get<Message>(copy.get("chain")->get());
+  EXPECT_NE(addrOf(origChain, "child"), addrOf(copyChain, "child"));
+
+  const Message &origChild = std::get<Message>(origChain.get("child")->get());
+  EXPECT_EQ(std::get<std::uint64_t>(origChild.get("id")->get()), 1u);
+  EXPECT_FALSE(messagesEqual(m, copy));
+
+  // An unshared box is written in place
+  const Value *before = addrOf(copy, "chain");
+  ASSERT_TRUE(copy.mutableMessage("chain")->set("id", std::uint64_t(5)));
+  EXPECT_EQ(addrOf(copy, "chain"), before);
+}
+
+TEST(CopyOnWrite, ConcurrentCopiesOfSharedMessage) {
+  auto leafDesc = chainDesc(4);
+  auto shared = std::make_shared<const Message>(chainMessage(leafDesc));
+
+  std::vector<std::thread> threads;
+  std::vector<char> ok(4, 0); // one byte per thread, no shared words
+  for (size_t t = 0; t < ok.size(); ++t) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < 200; ++i) {
+        Message local = *shared;
+        local.mutableMessage("child")->set("id", std::uint64_t(100 + t));
+        if (messagesEqual(local, *shared))
+          return;
+      }
+      ok[t] = 1;
+    });
+  }
+  for (auto &th : threads)
+    th.join();
+  for (char b : ok)
+    EXPECT_TRUE(b);
+  EXPECT_TRUE(messagesEqual(*shared, chainMessage(leafDesc)));
+}
+
+TEST(Maps, OpenAddressingInsertFindErase) {
+  MapVal map(FieldType::Int, FieldType::String);
+  for (int64_t k = 0; k < 1000; ++k)
+    ASSERT_TRUE(map.insertOrAssign(k * 7919, "v" + std::to_string(k)));
+  EXPECT_EQ(map.size(), 1000u);
+  EXPECT_FALSE(map.insertOrAssign(std::uint64_t(1), std::string("x")));
+  EXPECT_FALSE(map.insertOrAssign(std::int64_t(1), 2.0));
+
+  for (int64_t k = 0; k < 1000; k += 2)
+    ASSERT_TRUE(map.erase(k * 7919));
+  EXPECT_FALSE(map.erase(std::int64_t(0)));
+  EXPECT_EQ(map.size(), 500u);
+  for (int64_t k = 0; k < 1000; ++k) {
+    const Value *v = map.find(k * 7919);
+    if (k % 2 == 0) {
+      EXPECT_EQ(v, nullptr);
+    } else {
+      ASSERT_NE(v, nullptr);
+      EXPECT_EQ(std::get<std::string>(*v), "v" + std::to_string(k));
+    }
+  }
+
+  ASSERT_TRUE(map.insertOrAssign(std::int64_t(7919), std::string("new")));
+  EXPECT_EQ(map.size(), 500u);
+  EXPECT_EQ(std::get<std::string>(*map.find(std::int64_t(7919))), "new");
+  map.clear();
+  EXPECT_TRUE(map.empty());
+  EXPECT_EQ(map.find(std::int64_t(7919)), nullptr);
+
+  EXPECT_THROW(FieldDesc::map("bad", 1, FieldType::Double, FieldType::Int),
+               std::runtime_error);
+}
+
+TEST(Maps, WireCompatibleWithRepeatedEntries) {
+  auto entryDesc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"key", 1, FieldType::String},
+      {"value", 2, FieldType::UInt},
+  });
+  auto asEntries = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"id", 1, FieldType::Int},
+      {"counts", 2, FieldType::Message, /*repeated=*/true, /*packed=*/false,
+       entryDesc},
+  });
+  auto asMap = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"id", 1, FieldType::Int},
+      FieldDesc::map("counts", 2, FieldType::String, FieldType::UInt),
+  });
+
+  Message viaEntries(asEntries);
+  Message viaMap(asMap);
+  ASSERT_TRUE(viaEntries.set("id", std::int64_t(3)));
+  ASSERT_TRUE(viaMap.set("id", std::int64_t(3)));
+  MapVal *counts = viaMap.mutableMap("counts");
+  ASSERT_NE(counts, nullptr);
+  for (auto [k, v] : std::vector<std::pair<std::string, uint64_t>>{
+           {"b", 2}, {"a", 1}, {"c", 300}}) {
+    Message *entry = viaEntries.addMessage("counts");
+    ASSERT_TRUE(entry->set("key", k));
+    ASSERT_TRUE(entry->set("value", v));
+    ASSERT_TRUE(counts->insertOrAssign(k, v));
+  }
+
+  auto bytes = mustEncode(viaMap);
+  EXPECT_EQ(bytes, mustEncode(viaEntries));
+  EXPECT_EQ(byteSize(viaMap), bytes.size());
+
+  auto [decoded, err] = decodeMessage(bytes, asMap, DecodeOptions{});
+  ASSERT_TRUE(decoded.has_value());
+  EXPECT_TRUE(messagesEqual(viaMap, *decoded));
+  const auto &got = std::get<MapVal>(decoded->get("counts")->get());
+  EXPECT_EQ(std::get<std::uint64_t>(*got.find(std::string("c"))), 300u);
+  EXPECT_EQ(mustEncode(*decoded), bytes);
+}
+
+TEST(Maps, DeterministicKeyOrder) {
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      FieldDesc::map("m", 1, FieldType::Int, FieldType::Bool),
+  });
+  Message a(desc), b(desc);
+  for (int64_t k : {5, -1, 3})
+    ASSERT_TRUE(a.mutableMap("m")->insertOrAssign(k, k > 0));
+  for (int64_t k : {3, 5, -1})
+    ASSERT_TRUE(b.mutableMap("m")->insertOrAssign(k, k > 0));
+
+  EXPECT_NE(mustEncode(a), mustEncode(b));
+  EncodeOptions opts;
+  opts.deterministic = true;
+  auto sorted = mustEncode(a, opts);
+  EXPECT_EQ(sorted, mustEncode(b, opts));
+  EXPECT_EQ(sorted, mustEncode(a, EncodeOptions{.canonical = true}));
+  EXPECT_TRUE(messagesEqual(a, b));
+  EXPECT_EQ(hashMessage(a), hashMessage(b));
+
+  // Entries: -1 first (zigzag 1), then 3 and 5
+  std::vector<uint8_t> first = {0x0A, 0x04, 0x08, 0x01, 0x10, 0x00};
+  EXPECT_TRUE(std::equal(first.begin(), first.end(), sorted.begin()));
+}
+
+TEST(Maps, DecodeDefaultsDuplicatesAndMessageValues) {
+  auto valueDesc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"x", 1, FieldType::UInt},
+  });
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      FieldDesc::map("m", 1, FieldType::UInt, FieldType::Message, valueDesc),
+  });
+
+  std::vector<uint8_t> bytes = {
+      0x0A, 0x06, 0x12, 0x02, 0x08, 0x07, 0x08, 0x02, // value before key 2
+      0x0A, 0x02, 0x08, 0x04,                         // key 4, no value
+      0x0A, 0x00,                                     // no key, no value
+      0x0A, 0x06, 0x08, 0x02, 0x12, 0x02, 0x08, 0x09, // key 2 again
+  };
+  auto [decoded, err] = decodeMessage(bytes, desc, DecodeOptions{});
+  ASSERT_TRUE(decoded.has_value()) << err.fieldPath;
+  const auto &map = std::get<MapVal>(decoded->get("m")->get());
+  EXPECT_EQ(map.size(), 3u);
+  const Message &two = std::get<Message>(*map.find(std::uint64_t(2)));
+  EXPECT_EQ(std::get<std::uint64_t>(two.get("x")->get()), 9u);
+  const Message &four = std::get<Message>(*map.find(std::uint64_t(4)));
+  EXPECT_FALSE(four.get("x").has_value());
+  EXPECT_NE(map.find(std::uint64_t(0)), nullptr);
+
+  DecodeOptions limits;
+  limits.maxRepeated = 2;
+  auto [limited, limitErr] = decodeMessage(bytes, desc, limits);
+  EXPECT_FALSE(limited.has_value());
+  EXPECT_EQ(limitErr.code, DecodeErrc::TooManyElements);
+  EXPECT_EQ(limitErr.fieldPath, "m[2]");
+}
+
+static std::shared_ptr<const ProtoDesc> bigOneofDesc() {
+  auto leaf = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"x", 1, FieldType::UInt},
+  });
+  std::vector<FieldDesc> fields;
+  fields.emplace_back("id", 1, FieldType::Int);
+  for (uint32_t i = 0; i < 60; ++i) {
+    FieldType type = i % 3 == 0   ? FieldType::UInt
+                     : i % 3 == 1 ? FieldType::String
+                                  : FieldType::Message;
+    fields.push_back(
+        FieldDesc("alt" + std::to_string(i), 10 + i, type, false, false,
+                  type == FieldType::Message ? leaf : nullptr)
+            .inOneof("payload"));
+  }
+  fields.push_back(FieldDesc("on", 100, FieldType::Bool).inOneof("flag"));
+  fields.push_back(FieldDesc("ratio", 101, FieldType::Float).inOneof("flag"));
+  return std::make_shared<ProtoDesc>(std::move(fields));
+}
+
+TEST(Oneof, MembersShareOneSlot) {
+  auto desc = bigOneofDesc();
+  ASSERT_EQ(desc->oneofs().size(), 2u);
+  EXPECT_EQ(desc->oneofs()[0].fields.size(), 60u);
+  const MessageLayout &lay = desc->layout();
+  // id and payload value (8 each), payload case, flag value and flag case
+  // (4 each): 28 bytes instead of 62 per-member slots
+  EXPECT_EQ(lay.scalarWords, 4u);
+  EXPECT_EQ(lay.boxedCount, 1u); // one pointer for all 40 boxed members
+  EXPECT_EQ(lay.slots[2].offset, lay.slots[5].offset);
+
+  Message m(desc);
+  EXPECT_EQ(m.whichOneof("payload"), nullptr);
+  ASSERT_TRUE(m.set("alt1", std::string(100, 's')));
+  size_t withString = m.spaceUsed();
+  ASSERT_TRUE(m.set("alt0", std::uint64_t(7)));
+  EXPECT_FALSE(m.get("alt1").has_value());
+  EXPECT_EQ(m.whichOneof("payload")->name, "alt0");
+  EXPECT_LT(m.spaceUsed(), withString); // string released
+
+  Message *nested = m.mutableMessage("alt2");
+  ASSERT_NE(nested, nullptr);
+  ASSERT_TRUE(nested->set("x", std::uint64_t(3)));
+  EXPECT_FALSE(m.get("alt0").has_value());
+  ASSERT_TRUE(m.set("alt4", std::string("four")));
+  EXPECT_FALSE(m.get("alt2").has_value());
+  EXPECT_EQ(std::get<std::string>(m.get("alt4")->get()), "four");
+
+  ASSERT_TRUE(m.set("on", true));
+  ASSERT_TRUE(m.set("ratio", 0.5f));
+  EXPECT_FALSE(m.get("on").has_value());
+  EXPECT_EQ(m.whichOneof("payload")->name, "alt4"); // other group untouched
+
+  EXPECT_TRUE(m.clearOneof("payload"));
+  EXPECT_EQ(m.whichOneof("payload"), nullptr);
+  EXPECT_FALSE(m.get("alt4").has_value());
+  EXPECT_FALSE(m.clearOneof("missing"));
+
+  EXPECT_THROW(ProtoDesc({FieldDesc("r", 1, FieldType::Int, true)
+                              .inOneof("bad")}),
+               std::runtime_error);
+}
+
+TEST(Oneof, DecodeKeepsLastMember) {
+  auto desc = bigOneofDesc();
+  Message a(desc);
+  ASSERT_TRUE(a.set("alt1", std::string("first")));
+  Message b(desc);
+  ASSERT_TRUE(b.mutableMessage("alt5")->set("x", std::uint64_t(5)));
+
+  auto bytes = mustEncode(a);
+  auto more = mustEncode(b);
+  bytes.insert(bytes.end(), more.begin(), more.end());
+
+  auto [decoded, err] = decodeMessage(bytes, desc, DecodeOptions{});
+  ASSERT_TRUE(decoded.has_value());
+  EXPECT_EQ(decoded->whichOneof("payload")->name, "alt5");
+  EXPECT_FALSE(decoded->get("alt1").has_value());
+  EXPECT_TRUE(messagesEqual(*decoded, b));
+  EXPECT_EQ(mustEncode(*decoded), more);
+
+  // Copies share the slot until one switches member
+  Message copy = *decoded;
+  ASSERT_TRUE(copy.set("alt3", std::uint64_t(1)));
+  EXPECT_EQ(decoded->whichOneof("payload")->name, "alt5");
+  EXPECT_TRUE(messagesEqual(*decoded, b));
+}
+
+TEST(Enums, DenseAndSparseLookups) {
+  EnumDesc color("Color", {{"RED", 0}, {"GREEN", 1}, {"BLUE", 2},
+                           {"CRIMSON", 0}, {"NEG", -3}});
+  EXPECT_TRUE(color.isDense());
+  EXPECT_TRUE(color.isKnown(-3));
+  EXPECT_FALSE(color.isKnown(-2));
+  EXPECT_FALSE(color.isKnown(3));
+  EXPECT_FALSE(color.isKnown(INT32_MIN));
+  EXPECT_EQ(*color.nameOf(0), "RED"); // first alias
+  EXPECT_EQ(*color.nameOf(-3), "NEG");
+  EXPECT_EQ(color.nameOf(7), nullptr);
+  EXPECT_EQ(color.numberOf("CRIMSON"), 0);
+  EXPECT_FALSE(color.numberOf("PINK").has_value());
+
+  EnumDesc codes("Code", {{"OK", 0}, {"BIG", 1 << 20}, {"MIN", INT32_MIN}});
+  EXPECT_FALSE(codes.isDense());
+  EXPECT_TRUE(codes.isKnown(INT32_MIN));
+  EXPECT_FALSE(codes.isKnown(1));
+  EXPECT_EQ(*codes.nameOf(1 << 20), "BIG");
+}
+
+TEST(Enums, EncodeDecodePreservesUnknownNumbers) {
+  auto color = std::make_shared<EnumDesc>(
+      "Color", std::vector<EnumValueDesc>{{"RED", 0}, {"GREEN", 1}});
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      FieldDesc("color", 1, FieldType::Enum).withEnum(color),
+      FieldDesc("history", 2, FieldType::Enum, /*repeated=*/true)
+          .withEnum(color),
+  });
+
+  Message m(desc);
+  EXPECT_FALSE(m.set("color", std::int64_t(1)));
+  ASSERT_TRUE(m.set("color", std::int32_t(-1)));
+  for (int32_t v : {0, 1, 99, 1})
+    ASSERT_TRUE(m.push("history", v));
+
+  auto bytes = mustEncode(m);
+  std::vector<uint8_t> expected = {0x08, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+                                   0xFF, 0xFF, 0xFF, 0xFF, 0x01, // -1
+                                   0x12, 0x04, 0x00, 0x01, 0x63, 0x01};
+  EXPECT_EQ(bytes, expected);
+
+  auto [decoded, err] = decodeMessage(bytes, desc, DecodeOptions{});
+  ASSERT_TRUE(decoded.has_value());
+  EXPECT_EQ(std::get<std::int32_t>(decoded->get("color")->get()), -1);
+  EXPECT_EQ(std::get<std::int32_t>(decoded->getByIndex("history", 2)->get()),
+            99);
+  EXPECT_EQ(mustEncode(*decoded), bytes);
+
+  DecodeOptions closed;
+  closed.closedEnums = true;
+  auto [rejected, closedErr] = decodeMessage(bytes, desc, closed);
+  EXPECT_FALSE(rejected.has_value());
+  EXPECT_EQ(closedErr.code, DecodeErrc::InvalidValue);
+  EXPECT_EQ(closedErr.fieldPath, "color");
+}
+
+TEST(ScalarKinds, MatchProtobufEncodings) {
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"i32", 1, FieldType::Int32},
+      {"i64", 2, FieldType::Int64},
+      {"u32", 3, FieldType::UInt32},
+      {"s32", 4, FieldType::SInt32},
+      {"f32", 5, FieldType::Fixed32},
+      {"f64", 6, FieldType::Fixed64},
+      {"sf32", 7, FieldType::SFixed32},
+      {"sf64", 8, FieldType::SFixed64},
+  });
+  Message m(desc);
+  ASSERT_TRUE(m.set("i32", std::int32_t(-1)));
+  ASSERT_TRUE(m.set("i64", std::int64_t(-2)));
+  ASSERT_TRUE(m.set("u32", std::uint32_t(300)));
+  ASSERT_TRUE(m.set("s32", std::int32_t(-2)));
+  ASSERT_TRUE(m.set("f32", std::uint32_t(1)));
+  ASSERT_TRUE(m.set("f64", std::uint64_t(2)));
+  ASSERT_TRUE(m.set("sf32", std::int32_t(-1)));
+  ASSERT_TRUE(m.set("sf64", std::int64_t(-2)));
+  EXPECT_FALSE(m.set("u32", std::uint64_t(1)));
+
+  std::vector<uint8_t> expected = {
+      0x08, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x01,
+      0x10, 0xFE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x01,
+      0x18, 0xAC, 0x02,
+      0x20, 0x03,
+      0x2D, 0x01, 0x00, 0x00, 0x00,
+      0x31, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+      0x3D, 0xFF, 0xFF, 0xFF, 0xFF,
+      0x41, 0xFE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  };
+  auto bytes = mustEncode(m);
+  EXPECT_EQ(bytes, expected);
+  EXPECT_EQ(byteSize(m), bytes.size());
+
+  auto [decoded, err] = decodeMessage(bytes, desc, DecodeOptions{});
+  ASSERT_TRUE(decoded.has_value());
+  EXPECT_TRUE(messagesEqual(m, *decoded));
+  EXPECT_EQ(std::get<std::int32_t>(decoded->get("i32")->get()), -1);
+  EXPECT_EQ(std::get<std::int32_t>(decoded->get("s32")->get()), -2);
+  EXPECT_EQ(std::get<std::int64_t>(decoded->get("sf64")->get()), -2);
+}
+
+TEST(ScalarKinds, PackedRuns) {
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"f32", 1, FieldType::Fixed32, /*repeated=*/true},
+      {"s32", 2, FieldType::SInt32, /*repeated=*/true},
+      {"i64", 3, FieldType::Int64, /*repeated=*/true},
+  });
+  Message m(desc);
+  for (int32_t i = -3; i <= 3; ++i) {
+    ASSERT_TRUE(m.push("f32", std::uint32_t(i * 1000)));
+    ASSERT_TRUE(m.push("s32", i * 1000));
+    ASSERT_TRUE(m.push("i64", std::int64_t(i) << 40));
+  }
+  auto bytes = mustEncode(m);
+  EXPECT_EQ(bytes[1], 28u); // seven fixed32 elements in one run
+  auto [decoded, err] = decodeMessage(bytes, desc, DecodeOptions{});
+  ASSERT_TRUE(decoded.has_value());
+  EXPECT_TRUE(messagesEqual(m, *decoded));
+}
+
+TEST(MessageCodec, RepeatedAcceptsPackedAndUnpacked) {
+  auto fields = [](bool packed) {
+    return std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+        {"ids", 1, FieldType::Int, /*repeated=*/true, packed},
+        {"xs", 2, FieldType::Double, /*repeated=*/true, packed},
+        {"fs", 3, FieldType::Float, /*repeated=*/true, packed},
+    });
+  };
+  auto packedDesc = fields(true);
+  auto unpackedDesc = fields(false);
+
+  Message a(packedDesc), b(unpackedDesc);
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_TRUE(a.push("ids", std::int64_t(i - 1)));
+    ASSERT_TRUE(a.push("xs", i * 0.5));
+    ASSERT_TRUE(a.push("fs", i * 0.25f));
+    ASSERT_TRUE(b.push("ids", std::int64_t(100 + i)));
+    ASSERT_TRUE(b.push("xs", -i * 0.5));
+    ASSERT_TRUE(b.push("fs", -i * 0.25f));
+  }
+  // Packed runs, then single elements, then another packed run
+  auto bytes = mustEncode(a);
+  append(bytes, mustEncode(b));
+  append(bytes, mustEncode(a));
+
+  for (const auto &desc : {packedDesc, unpackedDesc}) {
+    auto [decoded, err] = decodeMessage(bytes, desc, DecodeOptions{});
+    ASSERT_TRUE(decoded.has_value()) << err.fieldPath;
+    const auto &ids = std::get<RepeatedVal>(decoded->get("ids")->get());
+    ASSERT_EQ(ids.values.size(), 9u);
+    EXPECT_EQ(std::get<int64_t>(ids.values[0]), -1);
+    EXPECT_EQ(std::get<int64_t>(ids.values[4]), 101);
+    EXPECT_EQ(std::get<int64_t>(ids.values[8]), 1);
+    const auto &xs = std::get<RepeatedVal>(decoded->get("xs")->get());
+    ASSERT_EQ(xs.values.size(), 9u);
+    EXPECT_EQ(std::get<double>(xs.values[5]), -1.0);
+    const auto &fs = std::get<RepeatedVal>(decoded->get("fs")->get());
+    ASSERT_EQ(fs.values.size(), 9u);
+    EXPECT_EQ(std::get<float>(fs.values[7]), 0.25f);
+  }
+
+  // Wire types that fit neither form are still rejected
+  std::vector<uint8_t> bad{(1 << 3) | 1, 0, 0, 0, 0, 0, 0, 0, 0};
+  auto [msg, err] = decodeMessage(bad, packedDesc, DecodeOptions{});
+  EXPECT_FALSE(msg.has_value());
+  EXPECT_EQ(err.code, DecodeErrc::WireTypeMismatch);
+  EXPECT_EQ(err.fieldPath, "ids[0]");
+}
+
+static const char *kSchemaSource = R"(
+// Orders service schema
+syntax = "proto3";
+package shop.v1;
+
+option java_package = "com.example.shop";
+
+enum Status {
+  option allow_alias = true;
+  STATUS_UNKNOWN = 0;
+  STATUS_OPEN = 1;
+  STATUS_ACTIVE = 1;
+  STATUS_CLOSED = -2 [deprecated = true];
+}
+
+message Order {
+  message Line {
+    string sku = 1;
+    uint32 quantity = 2;
+    sfixed64 cents = 3;
+  }
+  reserved 4, 8 to 10;
+  reserved "legacy";
+
+  uint64 id = 1;
+  repeated Line lines = 2;
+  Status status = 3;
+  repeated sint32 deltas = 5;
+  repeated fixed32 codes = 6 [packed = false];
+  map<string, Line> by_sku = 7;
+  map<int32, .shop.v1.Status> history = 11;
+  oneof payment {
+    string card = 12;
+    Customer.Wallet wallet = 13;
+  }
+  /* trailing comment */
+}
+
+message Customer {
+  message Wallet { bytes token = 1; }
+  string name = 1;
+  repeated Order orders = 2;
+}
+
+service Orders {
+  rpc Get (Order) returns (Order) { option deprecated = true; }
+}
+)";
+
+TEST(ProtoSchema, ParsesAndLinksTypes) {
+  auto [schema, err] = parseProto(kSchemaSource);
+  ASSERT_TRUE(schema.has_value()) << err.line << ":" << err.column << " "
+                                  << err.message;
+  EXPECT_EQ(schema->package, "shop.v1");
+  EXPECT_EQ(schema->messages.size(), 4u);
+  EXPECT_EQ(schema->enums.size(), 1u);
+
+  auto order = schema->message("shop.v1.Order");
+  auto line = schema->message("shop.v1.Order.Line");
+  auto wallet = schema->message("shop.v1.Customer.Wallet");
+  auto status = schema->enumType("shop.v1.Status");
+  ASSERT_TRUE(order && line && wallet && status);
+  EXPECT_EQ(status->numberOf("STATUS_ACTIVE"), 1);
+  EXPECT_EQ(*status->nameOf(-2), "STATUS_CLOSED");
+
+  EXPECT_EQ(order->findByName("id")->type, FieldType::UInt);
+  const FieldDesc *lines = order->findByName("lines");
+  EXPECT_TRUE(lines->isRepeated);
+  EXPECT_EQ(lines->nestedDesc, line); // linked, not copied
+  EXPECT_EQ(order->findByName("status")->enumDesc, status);
+  EXPECT_EQ(line->findByName("cents")->type, FieldType::SFixed64);
+  // proto3 packs repeated scalars unless told otherwise
+  EXPECT_TRUE(order->findByName("deltas")->isPacked);
+  EXPECT_FALSE(order->findByName("codes")->isPacked);
+
+  const FieldDesc *bySku = order->findByName("by_sku");
+  EXPECT_EQ(bySku->type, FieldType::Map);
+  EXPECT_EQ(bySku->mapKey().type, FieldType::String);
+  EXPECT_EQ(bySku->mapValue().nestedDesc, line);
+  EXPECT_EQ(order->findByName("history")->mapValue().enumDesc, status);
+
+  auto payment = order->oneofByName("payment");
+  ASSERT_TRUE(payment.has_value());
+  EXPECT_EQ(order->oneofs()[*payment].fields.size(), 2u);
+  EXPECT_EQ(order->findByName("wallet")->nestedDesc, wallet);
+  EXPECT_EQ(schema->message("shop.v1.Customer")
+                ->findByName("orders")
+                ->nestedDesc,
+            order);
+
+  // Parsed descriptors drive the codec like hand-built ones
+  Message m(order);
+  ASSERT_TRUE(m.set("id", std::uint64_t(42)));
+  Message *l = m.addMessage("lines");
+  ASSERT_TRUE(l->set("sku", std::string("A-1")));
+  ASSERT_TRUE(m.push("deltas", std::int32_t(-3)));
+  ASSERT_TRUE(m.mutableMap("history")->insertOrAssign(std::int32_t(7),
+                                                      std::int32_t(1)));
+  ASSERT_TRUE(m.mutableMessage("wallet")->set(
+      "token", std::vector<uint8_t>{1, 2}));
+  auto bytes = mustEncode(m);
+  auto [decoded, derr] = decodeMessage(bytes, order, DecodeOptions{});
+  ASSERT_TRUE(decoded.has_value());
+  EXPECT_TRUE(messagesEqual(m, *decoded));
+}
+
+TEST(ProtoSchema, Proto2DefaultsToUnpacked) {
+  auto [schema, err] = parseProto(R"(
+    message Sample {
+      repeated int64 plain = 1;
+      repeated double packed = 2 [packed = true];
+      optional float ratio = 3;
+      required bool ok = 4;
+    }
+  )");
+  ASSERT_TRUE(schema.has_value()) << err.message;
+  EXPECT_TRUE(schema->package.empty());
+  auto sample = schema->message("Sample");
+  ASSERT_TRUE(sample);
+  EXPECT_FALSE(sample->findByName("plain")->isPacked);
+  EXPECT_TRUE(sample->findByName("packed")->isPacked);
+  EXPECT_EQ(sample->findByName("plain")->type, FieldType::Int64);
+  EXPECT_FALSE(sample->findByName("ratio")->isRepeated);
+}
+
+TEST(ProtoSchema, ReportsErrorPositions) {
+  struct Case {
+    const char *source;
+    size_t line, column;
+    const char *message;
+  };
+  const Case cases[] = {
+      {"message A {\n  Missing m = 1;\n}", 2, 3, "unknown type: Missing"},
+      {"message A {\n  int32 x = 1;\n  int32 y = 1;\n}", 1, 9,
+       "A: duplicate field number: 1"},
+      {"message A { B b = 1; }\nmessage B { A a = 1; }", 2, 13,
+       "recursive message types need a DescriptorPool: B.a"},
+      {"message A { int32 x = 0; }", 1, 23, "field number out of range: 0"},
+      {"message A { string s = 1 [packed = true]; }", 1, 27,
+       "[packed] needs a repeated scalar field: s"},
+      {"message A { map<float, int32> m = 1; }", 1, 17,
+       "invalid map key type: float"},
+      {"syntax = \"proto3\";\nimport \"other.proto\";", 2, 1,
+       "unsupported statement: import"},
+      {"message A { int32 x = 1; } /* open", 1, 28, "unterminated comment"},
+      {"message A { int32 x = 1 }", 1, 25, "expected ';'"},
+  };
+  for (const Case &c : cases) {
+    auto [schema, err] = parseProto(c.source);
+    EXPECT_FALSE(schema.has_value()) << c.source;
+    EXPECT_EQ(err.message, c.message) << c.source;
+    EXPECT_EQ(err.line, c.line) << c.source;
+    EXPECT_EQ(err.column, c.column) << c.source;
+  }
+}
+
+// Field-by-field comparison of two linked descriptors
+static void expectSameDesc(const ProtoDesc &a, const ProtoDesc &b) {
+  ASSERT_EQ(a.fields.size(), b.fields.size());
+  for (size_t i = 0; i < a.fields.size(); ++i) {
+    const FieldDesc &x = a.fields[i], &y = b.fields[i];
+    EXPECT_EQ(x.name, y.name);
+    EXPECT_EQ(x.number, y.number);
+    EXPECT_EQ(x.type, y.type);
+    EXPECT_EQ(x.isRepeated, y.isRepeated);
+    EXPECT_EQ(x.isPacked, y.isPacked);
+    EXPECT_EQ(x.oneof, y.oneof);
+    EXPECT_EQ(bool(x.nestedDesc), bool(y.nestedDesc));
+    EXPECT_EQ(bool(x.enumDesc), bool(y.enumDesc));
+    if (x.enumDesc && y.enumDesc) {
+      EXPECT_EQ(x.enumDesc->name(), y.enumDesc->name());
+    }
+  }
+}
+
+TEST(SchemaCache, RoundTripsParsedSchema) {
+  auto [schema, err] = parseProto(kSchemaSource);
+  ASSERT_TRUE(schema.has_value());
+  auto cache = serializeSchema(*schema);
+  dumpFuzzSeed(cache);
+
+  auto [loaded, lerr] = loadSchema(cache);
+  ASSERT_TRUE(loaded.has_value()) << lerr.message << " at " << lerr.offset;
+  EXPECT_EQ(loaded->package, "shop.v1");
+  ASSERT_EQ(loaded->messages.size(), schema->messages.size());
+  for (const auto &[name, desc] : schema->messages) {
+    ASSERT_TRUE(loaded->message(name)) << name;
+    expectSameDesc(*desc, *loaded->message(name));
+  }
+  // Links survive: shared types are shared again after loading
+  auto order = loaded->message("shop.v1.Order");
+  EXPECT_EQ(order->findByName("lines")->nestedDesc,
+            loaded->message("shop.v1.Order.Line"));
+  EXPECT_EQ(order->findByName("status")->enumDesc,
+            loaded->enumType("shop.v1.Status"));
+  EXPECT_EQ(*loaded->enumType("shop.v1.Status")->nameOf(1), "STATUS_OPEN");
+  EXPECT_EQ(serializeSchema(*loaded), cache);
+
+  // Messages written with the parsed schema decode with the loaded one
+  Message m(schema->message("shop.v1.Order"));
+  ASSERT_TRUE(m.set("status", std::int32_t(-2)));
+  ASSERT_TRUE(m.push("codes", std::uint32_t(9)));
+  auto [decoded, derr] = decodeMessage(mustEncode(m), order, DecodeOptions{});
+  ASSERT_TRUE(decoded.has_value());
+  EXPECT_EQ(std::get<int32_t>(decoded->get("status")->get()), -2);
+}
+
+TEST(SchemaCache, StoresUnnamedNestedDescriptors) {
+  auto inner = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"v", 1, FieldType::Int32},
+  });
+  ProtoSchema schema;
+  schema.messages["Outer"] = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"a", 1, FieldType::Message, false, false, inner},
+      {"b", 2, FieldType::Message, true, false, inner},
+  });
+  auto [loaded, err] = loadSchema(serializeSchema(schema));
+  ASSERT_TRUE(loaded.has_value()) << err.message;
+  EXPECT_EQ(loaded->messages.size(), 1u);
+  auto outer = loaded->message("Outer");
+  ASSERT_TRUE(outer->fields[0].nestedDesc);
+  EXPECT_EQ(outer->fields[0].nestedDesc, outer->fields[1].nestedDesc);
+}
+
+TEST(SchemaCache, RejectsCorruptInput) {
+  auto [schema, err] = parseProto(kSchemaSource);
+  ASSERT_TRUE(schema.has_value());
+  auto cache = serializeSchema(*schema);
+
+  for (size_t n = 0; n < cache.size(); ++n) {
+    auto [loaded, lerr] = loadSchema(cache.data(), n);
+    EXPECT_FALSE(loaded.has_value()) << "prefix " << n;
+    EXPECT_LE(lerr.offset, n);
+  }
+  auto extra = cache;
+  extra.push_back(0);
+  EXPECT_FALSE(loadSchema(extra).first.has_value());
+
+  auto badMagic = cache;
+  badMagic[0] = 'X';
+  auto [loaded, lerr] = loadSchema(badMagic);
+  EXPECT_FALSE(loaded.has_value());
+  EXPECT_EQ(lerr.message, "not a descriptor cache");
+
+  // Flipping any single byte must fail cleanly or load something consistent
+  for (size_t i = 0; i < cache.size(); ++i) {
+    auto flipped = cache;
+    flipped[i] ^= 0x5A;
+    auto [ok, ferr] = loadSchema(flipped);
+    if (ok.has_value()) {
+      EXPECT_TRUE(loadSchema(serializeSchema(*ok)).first.has_value());
+    }
+  }
+}
+
+TEST(DescriptorPool, RecursiveTypes) {
+  DescriptorPool pool;
+  pool.add("tree.Node",
+           {
+               {"value", 1, FieldType::Int32},
+               FieldDesc("children", 2, FieldType::Message, /*repeated=*/true,
+                         /*packed=*/false)
+                   .ofType("tree.Node"),
+               FieldDesc::map("by_name", 3, FieldType::String,
+                              FieldType::Message)
+                   .ofType(".tree.Node"),
+           });
+  const ProtoDesc *node = pool.find("tree.Node");
+  ASSERT_NE(node, nullptr);
+  EXPECT_EQ(node->findByName("children")->nestedDesc.get(), node);
+  EXPECT_EQ(node->findByName("by_name")->mapValue().nestedDesc.get(), node);
+
+  Message root(node);
+  ASSERT_TRUE(root.set("value", std::int32_t(1)));
+  Message *child = root.addMessage("children");
+  ASSERT_TRUE(child->set("value", std::int32_t(2)));
+  ASSERT_TRUE(child->addMessage("children")->set("value", std::int32_t(3)));
+  Message leaf(node);
+  ASSERT_TRUE(leaf.set("value", std::int32_t(4)));
+  ASSERT_TRUE(root.mutableMap("by_name")->insertOrAssign(std::string("x"),
+                                                         std::move(leaf)));
+
+  auto bytes = mustEncode(root);
+  auto [decoded, err] = decodeMessage(bytes, borrowed(node), DecodeOptions{});
+  ASSERT_TRUE(decoded.has_value()) << err.fieldPath;
+  EXPECT_TRUE(messagesEqual(root, *decoded));
+
+  // Pool descriptors are borrowed: no control block, no refcount traffic
+  EXPECT_EQ(decoded->desc.use_count(), 0);
+  const auto &kids = std::get<RepeatedVal>(decoded->get("children")->get());
+  EXPECT_EQ(std::get<Message>(kids.values[0]).desc.get(), node);
+  EXPECT_EQ(std::get<Message>(kids.values[0]).desc.use_count(), 0);
+}
+
+TEST(DescriptorPool, ResolvesForwardReferencesOnFind) {
+  DescriptorPool pool;
+  pool.add("A", {
+                    FieldDesc("b", 1, FieldType::Message).ofType("B"),
+                    FieldDesc("kind", 2, FieldType::Enum).ofType("Kind"),
+                });
+  // B and Kind are missing: nothing is linked, and the pool stays usable
+  EXPECT_THROW(pool.find("A"), std::runtime_error);
+  pool.add("B", {FieldDesc("a", 1, FieldType::Message).ofType("A")});
+  EXPECT_THROW(pool.find("A"), std::runtime_error);
+  pool.addEnum("Kind", {{"NONE", 0}, {"SOME", 1}});
+
+  const ProtoDesc *a = pool.find("A");
+  ASSERT_NE(a, nullptr);
+  const ProtoDesc *b = a->findByName("b")->nestedDesc.get();
+  EXPECT_EQ(b, pool.find("B"));
+  EXPECT_EQ(b->findByName("a")->nestedDesc.get(), a);
+  EXPECT_EQ(a->findByName("kind")->enumDesc.get(), pool.findEnum("Kind"));
+  EXPECT_EQ(pool.find("Missing"), nullptr);
+  EXPECT_THROW(pool.add("B", {}), std::runtime_error);
+  EXPECT_THROW(pool.addEnum("A", {{"X", 0}}), std::runtime_error);
+}
+
+TEST(DescriptorPool, InternSharesIdenticalDescriptors) {
+  DescriptorPool pool;
+  auto point = [&pool] {
+    return pool.intern({
+        {"x", 1, FieldType::Double},
+        {"y", 2, FieldType::Double},
+    });
+  };
+  const ProtoDesc *p1 = point();
+  const ProtoDesc *p2 = point();
+  EXPECT_EQ(p1, p2);
+  EXPECT_NE(p1, pool.intern({{"x", 1, FieldType::Float}}));
+
+  // Identical children make identical parents, whole subtrees collapse
+  auto line = [&](const ProtoDesc *pt) {
+    return pool.intern({
+        {"from", 1, FieldType::Message, false, false, borrowed(pt)},
+        FieldDesc::map("tags", 2, FieldType::String, FieldType::Message,
+                       borrowed(pt)),
+    });
+  };
+  EXPECT_EQ(line(p1), line(p2));
+  EXPECT_EQ(pool.size(), 3u);
+  EXPECT_THROW(
+      pool.intern({FieldDesc("n", 1, FieldType::Message).ofType("Node")}),
+      std::runtime_error);
+}
+
+TEST(ProtoSchema, ParsesRecursiveTypesIntoPool) {
+  DescriptorPool pool;
+  const char *fsProto = R"(
+    syntax = "proto3";
+    package fs;
+    enum Kind { FILE = 0; DIR = 1; }
+    message Entry {
+      string name = 1;
+      Kind kind = 2;
+      repeated Entry children = 3;
+      map<string, Entry> links = 4;
+    }
+  )";
+  // A second file refers to the first one's types through the pool
+  const char *backupProto = R"(
+    syntax = "proto3";
+    package backup;
+    message Snapshot {
+      fs.Entry root = 1;
+      repeated .fs.Kind kinds = 2;
+    }
+  )";
+  SchemaError err = parseProto(fsProto, pool);
+  ASSERT_TRUE(err.message.empty()) << err.message;
+  err = parseProto(backupProto, pool);
+  ASSERT_TRUE(err.message.empty()) << err.message;
+
+  const ProtoDesc *snapshot = pool.find("backup.Snapshot");
+  const ProtoDesc *entry = pool.find("fs.Entry");
+  ASSERT_TRUE(snapshot && entry);
+  EXPECT_EQ(snapshot->findByName("root")->nestedDesc.get(), entry);
+  EXPECT_EQ(entry->findByName("children")->nestedDesc.get(), entry);
+  EXPECT_EQ(entry->findByName("links")->mapValue().nestedDesc.get(), entry);
+  EXPECT_EQ(entry->findByName("kind")->enumDesc.get(),
+            pool.findEnum("fs.Kind"));
+  EXPECT_TRUE(snapshot->findByName("kinds")->isPacked);
+
+  // A bad file registers nothing
+  size_t before = pool.size();
+  err = parseProto("message Ok {}\nmessage Bad { Nope n = 1; }", pool);
+  EXPECT_EQ(err.message, "unknown type: Nope");
+  EXPECT_EQ(err.line, 2u);
+  EXPECT_FALSE(pool.contains("Ok"));
+  EXPECT_EQ(pool.size(), before);
+  err = parseProto("package fs; message Entry {}", pool);
+  EXPECT_EQ(err.message, "duplicate type name: fs.Entry");
+
+  // The binary cache holds trees only
+  ProtoSchema schema;
+  schema.messages["fs.Entry"] = borrowed(entry);
+  EXPECT_THROW(serializeSchema(schema), std::runtime_error);
+}
+
+TEST(Message, ClearKeepsStorage) {
+  auto inner = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"name", 1, FieldType::String},
+  });
+  std::vector<FieldDesc> fields{
+      {"id", 1, FieldType::Int},
+      {"title", 2, FieldType::String},
+      {"child", 3, FieldType::Message, false, false, inner},
+      {"kids", 4, FieldType::Message, /*repeated=*/true, false, inner},
+  };
+  fields.push_back(
+      FieldDesc("a", 5, FieldType::Message, false, false, inner).inOneof("o"));
+  fields.push_back(
+      FieldDesc("b", 6, FieldType::Message, false, false, inner).inOneof("o"));
+  auto desc = std::make_shared<ProtoDesc>(std::move(fields));
+
+  const std::string longTitle(100, 't');
+  Message m(desc);
+  ASSERT_TRUE(m.set("id", int64_t(7)));
+  ASSERT_TRUE(m.set("title", longTitle));
+  ASSERT_TRUE(m.mutableMessage("child")->set("name", longTitle));
+  ASSERT_TRUE(m.addMessage("kids")->set("name", std::string("k")));
+  ASSERT_TRUE(m.mutableMessage("a")->set("name", std::string("in a")));
+  auto bytes = mustEncode(m);
+  const Message *child = &std::get<Message>(m.get("child")->get());
+  const std::string *title = &std::get<std::string>(m.get("title")->get());
+
+  m.clear();
+  for (size_t i = 0; i < desc->fields.size(); ++i)
+    EXPECT_FALSE(m.has(i)) << i;
+  EXPECT_EQ(m.whichOneof("o"), nullptr);
+  EXPECT_TRUE(mustEncode(m).empty());
+
+  // Refilled fields land in the storage they had before the clear
+  ASSERT_TRUE(m.set("id", int64_t(8)));
+  Message *refilled = m.mutableMessage("child");
+  EXPECT_EQ(refilled, child);
+  EXPECT_FALSE(refilled->get("name").has_value());
+  Message *kid = m.addMessage("kids");
+  ASSERT_NE(kid, nullptr);
+  EXPECT_FALSE(kid->get("name").has_value());
+  // Another oneof member of the same type starts empty
+  Message *b = m.mutableMessage("b");
+  ASSERT_NE(b, nullptr);
+  EXPECT_FALSE(b->get("name").has_value());
+  EXPECT_EQ(m.whichOneof("o")->name, "b");
+
+  ASSERT_EQ(decodeInto(m, bytes).code, DecodeErrc::None);
+  EXPECT_EQ(&std::get<std::string>(m.get("title")->get()), title);
+  EXPECT_EQ(mustEncode(m), bytes);
+
+  // Storage shared with a copy is released, not emptied
+  Message copy = m;
+  m.clear();
+  EXPECT_EQ(mustEncode(copy), bytes);
+  EXPECT_EQ(std::get<std::string>(copy.get("title")->get()), longTitle);
+}
+
+TEST(MessageCodec, DecodeIntoReusesStorage) {
+  auto inner = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"name", 1, FieldType::String},
+      {"tags", 2, FieldType::String, /*repeated=*/true, false},
+  });
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"id", 1, FieldType::Int},
+      {"title", 2, FieldType::String},
+      {"blob", 3, FieldType::Bytes},
+      {"child", 4, FieldType::Message, false, false, inner},
+      {"kids", 5, FieldType::Message, /*repeated=*/true, false, inner},
+      {"nums", 6, FieldType::UInt, /*repeated=*/true},
+      {"names", 7, FieldType::String, /*repeated=*/true, false},
+  });
+
+  auto build = [&](int kids, bool withBlob) {
+    Message m(desc);
+    m.set("id", int64_t(kids));
+    m.set("title", std::string(40 + kids, 'x'));
+    if (withBlob)
+      m.set("blob", std::vector<uint8_t>(64, 0xab));
+    m.mutableMessage("child")->set("name", std::string(30, 'c'));
+    for (int i = 0; i < kids; ++i) {
+      Message *k = m.addMessage("kids");
+      k->set("name", std::string(20 + i, 'k'));
+      k->push("tags", std::string(25, 'g'));
+      m.push("nums", uint64_t(1000 * i));
+      m.push("names", std::string(30, 'n'));
+    }
+    return mustEncode(m);
+  };
+  std::vector<uint8_t> big = build(4, true), small = build(2, false);
+
+  Message m(desc);
+  ASSERT_EQ(decodeInto(m, big).code, DecodeErrc::None);
+  EXPECT_EQ(mustEncode(m), big);
+  ASSERT_EQ(decodeInto(m, small).code, DecodeErrc::None);
+  EXPECT_EQ(mustEncode(m), small); // nothing left over from big
+
+  size_t before = allocationCount;
+  for (int i = 0; i < 10; ++i) {
+    decodeInto(m, big);
+    decodeInto(m, small);
+  }
+  EXPECT_EQ(allocationCount, before);
+  EXPECT_EQ(mustEncode(m), small);
+
+  // Limits and errors work as in decodeMessage
+  DecodeOptions tight;
+  tight.maxRepeated = 3;
+  DecodeError err = decodeInto(m, big, tight);
+  EXPECT_EQ(err.code, DecodeErrc::TooManyElements);
+  EXPECT_EQ(decodeInto(m, small, tight).code, DecodeErrc::None);
+  EXPECT_EQ(mustEncode(m), small);
+}
+
+TEST(MessageCodec, EncodeChainReferencesLargePayloads) {
+  auto inner = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"blob", 1, FieldType::Bytes},
+      {"note", 2, FieldType::String},
+  });
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"id", 1, FieldType::Int},
+      {"body", 2, FieldType::String},
+      {"child", 3, FieldType::Message, false, false, inner},
+      {"parts", 4, FieldType::Bytes, /*repeated=*/true, false},
+  });
+
+  Message m(desc);
+  m.set("id", int64_t(5));
+  m.set("body", std::string(5000, 'b'));
+  Message *child = m.mutableMessage("child");
+  child->set("blob", std::vector<uint8_t>(1 << 20, 0x5a));
+  child->set("note", std::string("short"));
+  m.push("parts", std::vector<uint8_t>(2000, 1));
+  m.push("parts", std::vector<uint8_t>(10, 2));
+
+  auto flat = mustEncode(m);
+  auto [chain, err] = encodeChain(m);
+  ASSERT_TRUE(chain.has_value()) << err.fieldPath;
+  EXPECT_EQ(chain->size(), flat.size());
+  EXPECT_EQ(chain->flatten(), flat);
+  // Only generated bytes and the short payloads are copied
+  EXPECT_LT(chain->inlineBytes.size(), 64u);
+
+  const void *blob =
+      std::get<std::vector<uint8_t>>(child->get("blob")->get()).data();
+  const void *body = std::get<std::string>(m.get("body")->get()).data();
+  std::vector<OutputSegment> segs = chain->segments();
+  ASSERT_EQ(segs.size(), 7u); // 3 referenced payloads and the runs between
+  EXPECT_EQ(segs[1].base, body);
+  EXPECT_EQ(segs[3].base, blob);
+  EXPECT_EQ(segs[3].len, size_t(1) << 20);
+
+  // Canonical order applies as usual
+  EncodeOptions canonical{.canonical = true};
+  EXPECT_EQ(encodeChain(m, canonical, 1).first->flatten(),
+            mustEncode(m, canonical));
+
+  // Error offsets are positions in the flat output
+  m.boxedAt(3) = int64_t(1); // "parts" no longer holds a RepeatedVal
+  auto [bad, badErr] = encodeChain(m);
+  EXPECT_FALSE(bad.has_value());
+  EXPECT_EQ(badErr.code, EncodeErrc::NotRepeated);
+  EXPECT_EQ(badErr.offset, encodeMessage(m).second.offset);
+  EXPECT_GT(badErr.offset, size_t(1) << 20);
+}
+
+static std::string toJson(const Message &m, const JsonOptions &opts = {}) {
+  std::string out;
+  JsonError err = messageToJson(m, out, opts);
+  EXPECT_TRUE(err.message.empty()) << err.message;
+  return out;
+}
+
+TEST(Json, WritesProto3Mapping) {
+  auto [schema, err] = parseProto(kSchemaSource);
+  ASSERT_TRUE(schema.has_value()) << err.message;
+  auto order = schema->message("shop.v1.Order");
+
+  Message m(order);
+  m.set("id", uint64_t(1234));
+  Message *line = m.addMessage("lines");
+  line->set("sku", std::string("a\"b"));
+  line->set("quantity", uint32_t(2));
+  line->set("cents", int64_t(-5));
+  m.set("status", int32_t(1));
+  m.push("deltas", int32_t(-1));
+  m.push("deltas", int32_t(2));
+  m.mutableMap("by_sku")->tryEmplace(std::string("x"))->emplace<Message>(
+      line->desc);
+  m.mutableMap("history")->insertOrAssign(int32_t(3), int32_t(-2));
+  m.set("card", std::string("\xc3\xa9\n\x01"));
+  m.mutableMap("by_sku"); // empty fields are left out, as are unset ones
+  m.set("codes", RepeatedVal{FieldType::Fixed32, {}});
+
+  EXPECT_EQ(toJson(m),
+            R"({"id":"1234","lines":[{"sku":"a\"b","quantity":2,)"
+            R"("cents":"-5"}],"status":"STATUS_OPEN","deltas":[-1,2],)"
+            R"("bySku":{"x":{}},"history":{"3":"STATUS_CLOSED"},)"
+            "\"card\":\"\xc3\xa9\\n\\u0001\"}");
+  std::string out = "prefix ";
+  messageToJson(m, out, {.useProtoNames = true, .enumsAsInts = true});
+  EXPECT_EQ(out.substr(0, 7), "prefix "); // appends
+  EXPECT_NE(out.find(R"("by_sku":)"), std::string::npos);
+  EXPECT_NE(out.find(R"("status":1,)"), std::string::npos);
+
+  auto scalars = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"ratio", 1, FieldType::Double},
+      {"f", 2, FieldType::Float},
+      {"blob", 3, FieldType::Bytes},
+      {"flag", 4, FieldType::Bool},
+      {"doubles", 5, FieldType::Double, true},
+  });
+  Message s(scalars);
+  s.set("ratio", 0.1);
+  s.set("f", 1.1f); // shortest form of the float, not of the double
+  s.set("blob", std::vector<uint8_t>{0xfb, 0xff, 0x00, 0x61});
+  s.set("flag", true);
+  s.push("doubles", std::numeric_limits<double>::quiet_NaN());
+  s.push("doubles", -std::numeric_limits<double>::infinity());
+  s.push("doubles", 1e300);
+  EXPECT_EQ(toJson(s), R"({"ratio":0.1,"f":1.1,"blob":"+/8AYQ==","flag":true,)"
+                       R"("doubles":["NaN","-Infinity",1e+300]})");
+
+  // Strings must be UTF-8; values must match their field types
+  std::string bad;
+  m.set("card", std::string("\xc3("));
+  EXPECT_FALSE(messageToJson(m, bad).message.empty());
+  s.boxedAt(2) = std::string("not bytes");
+  EXPECT_FALSE(messageToJson(s, bad).message.empty());
+}
+
+TEST(Json, ParsesWhatItWrites) {
+  auto [schema, err] = parseProto(kSchemaSource);
+  ASSERT_TRUE(schema.has_value()) << err.message;
+  auto order = schema->message("shop.v1.Order");
+
+  const char *json = R"( {
+    "id": 18446744073709551615, "lines": [{"sku": "é😀",
+    "quantity": "7", "cents": -1e2}, {}], "status": "STATUS_CLOSED",
+    "deltas": [1, -2], "codes": null, "by_sku": {"k": {"quantity": 1}},
+    "history": {"-4": 1}, "wallet": {"token": "_-8"}
+  } )";
+  auto [m, perr] = jsonToMessage(json, order);
+  ASSERT_TRUE(m.has_value()) << perr.message << " at " << perr.offset;
+  EXPECT_EQ(std::get<uint64_t>(m->get("id")->get()), UINT64_MAX);
+  const auto &lines = std::get<RepeatedVal>(m->get("lines")->get()).values;
+  ASSERT_EQ(lines.size(), 2u);
+  const Message &first = std::get<Message>(lines[0]);
+  EXPECT_EQ(std::get<std::string>(first.get("sku")->get()),
+            "\xc3\xa9\xf0\x9f\x98\x80");
+  EXPECT_EQ(std::get<uint32_t>(first.get("quantity")->get()), 7u);
+  EXPECT_EQ(std::get<int64_t>(first.get("cents")->get()), -100);
+  EXPECT_EQ(std::get<int32_t>(m->get("status")->get()), -2);
+  EXPECT_FALSE(m->get("codes").has_value());
+  const auto &history = std::get<MapVal>(m->get("history")->get());
+  EXPECT_EQ(std::get<int32_t>(*history.find(int32_t(-4))), 1);
+  EXPECT_EQ(m->whichOneof("payment")->name, "wallet");
+
+  // Writing and parsing again gives the same message
+  std::string text = toJson(*m);
+  auto [again, aerr] = jsonToMessage(text, order);
+  ASSERT_TRUE(again.has_value()) << aerr.message;
+  EXPECT_EQ(toJson(*again), text);
+  EXPECT_EQ(hashMessage(*again), hashMessage(*m));
+
+  auto fails = [&](std::string_view bad, const JsonOptions &opts = {}) {
+    auto [r, e] = jsonToMessage(bad, order, opts);
+    return !r.has_value() && !e.message.empty();
+  };
+  EXPECT_TRUE(fails(R"({"id": -1})"));
+  EXPECT_TRUE(fails(R"({"id": 18446744073709551616})"));
+  EXPECT_TRUE(fails(R"({"deltas": [1.5]})"));
+  EXPECT_TRUE(fails(R"({"deltas": [2147483648]})"));
+  EXPECT_TRUE(fails(R"({"deltas": [2.147483648e9]})"));
+  EXPECT_TRUE(fails(R"({"lines": [{"cents": 9.3e18}]})"));
+  EXPECT_FALSE(fails(R"({"lines": [{"cents": -9.2e18}]})"));
+  EXPECT_TRUE(fails(R"({"status": "STATUS_NOPE"})"));
+  EXPECT_TRUE(fails(R"({"id": 01})"));
+  EXPECT_TRUE(fails(R"({"card": "\ud800"})"));
+  EXPECT_TRUE(fails("{\"card\": \"\xc0\xaf\"}")); // overlong UTF-8
+  EXPECT_TRUE(fails(R"({"id": 1,})"));
+  EXPECT_TRUE(fails(R"({"id": 1} x)"));
+  EXPECT_TRUE(fails(R"({"extra": [1, {"a": 2}]})"));
+  EXPECT_FALSE(fails(R"({"extra": [1, {"a": 2}]})",
+                     {.ignoreUnknownFields = true}));
+  std::string deep = R"({"lines": [{"sku": "x"}]})";
+  EXPECT_TRUE(fails(deep, {.maxDepth = 0}));
+  EXPECT_FALSE(fails(deep, {.maxDepth = 1}));
+
+  auto [where, werr] = jsonToMessage(R"({"id": 1, "status": true})", order);
+  EXPECT_FALSE(where.has_value());
+  EXPECT_EQ(werr.offset, 20u); // at the bad value
+
+  auto floats = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"f", 1, FieldType::Float},
+      {"d", 2, FieldType::Double},
+  });
+  auto [fm, ferr] =
+      jsonToMessage(R"({"f": 3.4028235e38, "d": "-Infinity"})", floats);
+  ASSERT_TRUE(fm.has_value()) << ferr.message;
+  EXPECT_EQ(std::get<float>(fm->get("f")->get()),
+            std::numeric_limits<float>::max());
+  EXPECT_TRUE(std::isinf(std::get<double>(fm->get("d")->get())));
+  EXPECT_FALSE(jsonToMessage(R"({"f": 1e39})", floats).first.has_value());
+}
+
+// binaryToJson must agree with decodeMessage + messageToJson on every
+// input, including the non-canonical encodings the decoder accepts
+TEST(Json, BinaryTranscodeMatchesDecode) {
+  auto [schema, err] = parseProto(kSchemaSource);
+  ASSERT_TRUE(schema.has_value()) << err.message;
+  auto order = schema->message("shop.v1.Order");
+
+  Message m(order);
+  m.set("id", uint64_t(99));
+  m.addMessage("lines")->set("sku", std::string("one"));
+  m.addMessage("lines")->set("quantity", uint32_t(3));
+  m.push("deltas", int32_t(-7));
+  m.push("codes", uint32_t(1));
+  m.push("codes", uint32_t(2));
+  m.mutableMap("history")->insertOrAssign(int32_t(1), int32_t(1));
+  m.set("card", std::string("c"));
+  std::vector<uint8_t> bytes = mustEncode(m);
+
+  auto same = [&](const std::vector<uint8_t> &input) {
+    auto [decoded, derr] = decodeMessage(input, order);
+    std::string direct;
+    JsonError jerr = binaryToJson(input, *order, direct);
+    if (!decoded.has_value())
+      return !jerr.message.empty();
+    std::string expected;
+    JsonError merr = messageToJson(*decoded, expected);
+    if (!merr.message.empty())
+      return !jerr.message.empty();
+    EXPECT_EQ(direct, expected);
+    return jerr.message.empty() && direct == expected;
+  };
+  EXPECT_TRUE(same(bytes));
+  EXPECT_TRUE(same({}));
+
+  auto with = [&](std::vector<uint8_t> tail) {
+    std::vector<uint8_t> b = bytes;
+    b.insert(b.end(), tail.begin(), tail.end());
+    return b;
+  };
+  EXPECT_TRUE(same(with({0x08, 0x05})));             // id again: last wins
+  EXPECT_TRUE(same(with({0x28, 0x03})));             // unpacked delta
+  EXPECT_TRUE(same(with({0x32, 0x04, 9, 0, 0, 0}))); // packed codes
+  EXPECT_TRUE(same(with({0x2a, 0x00})));             // empty packed run
+  EXPECT_TRUE(same(with({0x5a, 0x02, 0x08, 0x01}))); // history[1] = default
+  EXPECT_TRUE(same(with({0x5a, 0x02, 0x10, 0x05}))); // history[0] = 5
+  EXPECT_TRUE(same(with({0x6a, 0x00})));             // wallet replaces card
+  EXPECT_TRUE(same(with({0x62, 0x01, 0xff})));       // invalid UTF-8 card
+  EXPECT_TRUE(same(with({0x62, 0x01, 0xff, 0x62, 0x01, 'x'}))); // superseded
+  EXPECT_TRUE(same(with({0xf8, 0x01, 0x00})));       // unknown field
+  EXPECT_TRUE(same(with({0x08})));                   // truncated
+  EXPECT_TRUE(same(with({0x0a, 0x00})));             // wrong wire type
+  EXPECT_TRUE(same(with({0x5a, 0x02, 0x10, 0x80})));  // bad map value
+  EXPECT_TRUE(same(with({0x0b})));                   // group
+  for (size_t cut = 0; cut < bytes.size(); ++cut) {
+    std::vector<uint8_t> prefix(bytes.begin(), bytes.begin() + cut);
+    EXPECT_TRUE(same(prefix)) << cut;
+  }
+}
+
+// A map entry without a key has the zero key, the same one an explicit
+// zero key names, whatever the key's JSON spelling
+TEST(Json, BinaryTranscodeMergesMissingMapKeys) {
+  auto [schema, err] = parseProto(R"(
+    syntax = "proto3";
+    message Keys {
+      map<int32, int32> small = 1;
+      map<int64, int32> big = 2;
+      map<uint64, int32> ubig = 3;
+      map<bool, int32> flags = 4;
+    }
+  )");
+  ASSERT_TRUE(schema.has_value()) << err.message;
+  auto keys = schema->message("Keys");
+
+  for (uint8_t tag : {0x0a, 0x12, 0x1a, 0x22}) {
+    // {value: 5} then {key: 0, value: 7}, and the other way round
+    std::vector<uint8_t> input = {tag, 0x02, 0x10, 0x05, tag,
+                                  0x04, 0x08, 0x00, 0x10, 0x07};
+    for (int pass = 0; pass < 2; ++pass) {
+      auto [decoded, derr] = decodeMessage(input, keys);
+      ASSERT_TRUE(decoded.has_value()) << derr;
+      std::string expected, direct;
+      ASSERT_TRUE(messageToJson(*decoded, expected).message.empty());
+      JsonError jerr = binaryToJson(input, *keys, direct);
+      ASSERT_TRUE(jerr.message.empty()) << jerr.message;
+      EXPECT_EQ(direct, expected) << int(tag);
+      // Only the later value survives
+      EXPECT_EQ(direct.find(pass == 0 ? "\":5" : "\":7"), std::string::npos)
+          << direct;
+      std::rotate(input.begin(), input.begin() + 4, input.end());
+    }
+  }
+}
+
+TEST(TextFormat, PrintsAndParsesMessages) {
+  auto [schema, err] = parseProto(kSchemaSource);
+  ASSERT_TRUE(schema.has_value()) << err.message;
+  auto order = schema->message("shop.v1.Order");
+
+  Message m(order);
+  m.set("id", uint64_t(1234));
+  Message *line = m.addMessage("lines");
+  line->set("sku", std::string("a\"b\n\xc3\xa9"));
+  line->set("cents", int64_t(-5));
+  m.set("status", int32_t(1));
+  m.push("deltas", int32_t(-1));
+  m.push("deltas", int32_t(2));
+  m.mutableMap("history")->insertOrAssign(int32_t(3), int32_t(7));
+  m.mutableMessage("wallet")->set("token", std::vector<uint8_t>{0, 'k'});
+
+  std::ostringstream os;
+  TextError perr = printText(m, os);
+  ASSERT_TRUE(perr.message.empty()) << perr.message;
+  const char *golden = R"(id: 1234
+lines {
+  sku: "a\"b\n\303\251"
+  cents: -5
+}
+status: STATUS_OPEN
+deltas: -1
+deltas: 2
+history {
+  key: 3
+  value: 7
+}
+wallet {
+  token: "\000k"
+}
+)";
+  EXPECT_EQ(os.str(), golden);
+
+  std::ostringstream line1;
+  line1 << *line;
+  EXPECT_EQ(line1.str(), R"(sku: "a\"b\n\303\251" cents: -5)");
+
+  auto [parsed, parseErr] = parseText(golden, order);
+  ASSERT_TRUE(parsed.has_value()) << parseErr.line << ":" << parseErr.column
+                                  << " " << parseErr.message;
+  EXPECT_TRUE(messagesEqual(*parsed, m));
+
+  // The parser also takes the looser forms people write by hand
+  auto [loose, looseErr] = parseText(R"(
+    # a fixture
+    id: 0x10, deltas: [1, -0x2, 010]; status: 1
+    lines < sku: 'x' "y" cents: -9223372036854775808 >
+    lines: {}
+    by_sku { key: "k" value { quantity: 4 } }
+    by_sku { key: "k" }
+    history [{key: -1}, {value: STATUS_CLOSED}]
+    card: "\x41é\101\?"
+  )",
+                                     order);
+  ASSERT_TRUE(loose.has_value()) << looseErr.line << ":" << looseErr.column
+                                 << " " << looseErr.message;
+  EXPECT_EQ(std::get<uint64_t>(loose->get("id")->get()), 16u);
+  auto deltas = std::get<RepeatedVal>(loose->get("deltas")->get()).values;
+  EXPECT_EQ(std::get<int32_t>(deltas[2]), 8);
+  const auto &lines = std::get<RepeatedVal>(loose->get("lines")->get()).values;
+  ASSERT_EQ(lines.size(), 2u);
+  EXPECT_EQ(std::get<std::string>(std::get<Message>(lines[0]).get("sku")->get()),
+            "xy");
+  const auto &bySku = std::get<MapVal>(loose->get("by_sku")->get());
+  EXPECT_EQ(bySku.size(), 1u); // the later entry replaced the value
+  EXPECT_FALSE(std::get<Message>(*bySku.find(std::string("k"))).has(1));
+  const auto &history = std::get<MapVal>(loose->get("history")->get());
+  EXPECT_EQ(std::get<int32_t>(*history.find(int32_t(0))), -2);
+  EXPECT_EQ(std::get<std::string>(loose->get("card")->get()),
+            "A\xc3\xa9"
+            "A?");
+
+  auto failsAt = [&](std::string_view text, size_t line, size_t column) {
+    auto [r, e] = parseText(text, order);
+    EXPECT_FALSE(r.has_value()) << text;
+    EXPECT_EQ(e.line, line) << text << ": " << e.message;
+    EXPECT_EQ(e.column, column) << text << ": " << e.message;
+  };
+  failsAt("id: 1\nid: 2", 2, 1);              // singular twice
+  failsAt("id: -1", 1, 5);                    // out of range
+  failsAt("deltas: 2147483648", 1, 9);        // out of range
+  failsAt("card: \"a\"\nwallet {}", 2, 1);    // second oneof member
+  failsAt("lines { sku: \"x\"", 1, 17);       // unterminated
+  failsAt("nope: 1", 1, 1);                   // unknown field
+  failsAt("status: STATUS_NOPE", 1, 9);       // unknown enum value
+  failsAt("card: \"a\nb\"", 1, 9);            // newline in string
+  failsAt("id: [1]", 1, 5);                   // list for singular
+  failsAt("lines { lines {} }", 1, 9);        // Line has no lines
+  auto [deep, deepErr] = parseText("lines {}", order, {.maxDepth = 0});
+  EXPECT_FALSE(deep.has_value());
+}
+
+TEST(TextFormat, PrintsBinaryWithUnknownFields) {
+  auto [schema, err] = parseProto(kSchemaSource);
+  ASSERT_TRUE(schema.has_value()) << err.message;
+  auto order = schema->message("shop.v1.Order");
+
+  Message m(order);
+  m.set("id", uint64_t(7));
+  m.addMessage("lines")->set("quantity", uint32_t(2));
+  m.push("deltas", int32_t(-3));
+  m.push("codes", uint32_t(9));
+  (*m.mutableMap("by_sku")->tryEmplace(std::string("s"))) =
+      Message(schema->message("shop.v1.Order.Line"));
+  m.set("card", std::string("c"));
+  std::vector<uint8_t> bytes = mustEncode(m);
+
+  // Valid input prints as the decoded message does
+  std::ostringstream fromMessage, fromBytes;
+  printText(m, fromMessage);
+  ASSERT_TRUE(printText(bytes, *order, fromBytes).message.empty());
+  EXPECT_EQ(fromBytes.str(), fromMessage.str());
+
+  // Unknown fields and wire type mismatches print by number
+  std::vector<uint8_t> extra = {
+      0xa0, 0x06, 0x96, 0x01,             // 100: 150
+      0xa9, 0x06, 1, 0, 0, 0, 0, 0, 0, 0, // 101: fixed64
+      0xb5, 0x06, 0xff, 0, 0, 0,          // 102: fixed32
+      0xba, 0x06, 0x02, 'h', 0x80,        // 103: bytes
+      0x0d, 1, 2, 3, 4,                   // id as fixed32
+  };
+  std::vector<uint8_t> withExtra = bytes;
+  withExtra.insert(withExtra.end(), extra.begin(), extra.end());
+  std::ostringstream os;
+  ASSERT_TRUE(printText(withExtra, *order, os, {.singleLine = true})
+                  .message.empty());
+  EXPECT_NE(os.str().find(R"(card: "c" 100: 150 101: 0x0000000000000001 )"
+                          R"(102: 0x000000ff 103: "h\200" 1: 0x04030201)"),
+            std::string::npos)
+      << os.str();
+
+  // Framing errors report the input offset
+  std::vector<uint8_t> truncated(bytes.begin(), bytes.end() - 1);
+  std::ostringstream partial;
+  TextError terr = printText(truncated, *order, partial);
+  EXPECT_FALSE(terr.message.empty());
+  EXPECT_LE(terr.offset, truncated.size());
+  std::ostringstream group;
+  EXPECT_FALSE(printText({0x0b}, *order, group).message.empty());
+}
+
+TEST(Columnar, DecodesRowsIntoArrowLayout) {
+  auto [schema, err] = parseProto(kSchemaSource);
+  ASSERT_TRUE(schema.has_value()) << err.message;
+  auto order = schema->message("shop.v1.Order");
+
+  Message first(order);
+  first.set("id", uint64_t(7));
+  first.addMessage("lines")->set("sku", std::string("ab"));
+  first.addMessage("lines")->set("quantity", uint32_t(2));
+  first.push("codes", uint32_t(5));
+  first.push("codes", uint32_t(6));
+  first.mutableMap("history")->insertOrAssign(int32_t(4), int32_t(1));
+  first.set("card", std::string("c"));
+  Message second(order); // everything unset
+  Message third(order);
+  third.set("status", int32_t(-2));
+  third.push("deltas", int32_t(-3));
+  third.mutableMessage("wallet")->set("token", std::vector<uint8_t>{1});
+  (*third.mutableMap("by_sku")->tryEmplace(std::string("k"))) =
+      Message(schema->message("shop.v1.Order.Line"));
+
+  auto [batch, derr] = decodeColumns(
+      {mustEncode(first), mustEncode(second), mustEncode(third)}, order);
+  ASSERT_TRUE(batch.has_value()) << derr.fieldPath;
+  EXPECT_EQ(batch->rows, 3u);
+  ASSERT_EQ(batch->columns.size(), order->fields.size());
+  EXPECT_EQ(batch->column("nope"), nullptr);
+
+  // proto3 scalars are null where the encoder left them out
+  const Column &id = *batch->column("id");
+  EXPECT_EQ(id.length, 3u);
+  EXPECT_EQ(id.nullCount, 2u);
+  EXPECT_TRUE(id.isValid(0));
+  EXPECT_FALSE(id.isValid(1));
+  EXPECT_EQ(id.valuesAs<uint64_t>()[0], 7u);
+  EXPECT_EQ(id.valuesAs<uint64_t>()[1], 0u);
+  EXPECT_EQ(batch->column("status")->valuesAs<int32_t>()[2], -2);
+
+  // Repeated fields: offsets per row, elements in the child
+  const Column &lines = *batch->column("lines");
+  EXPECT_TRUE(lines.isList);
+  EXPECT_EQ(lines.nullCount, 0u);
+  EXPECT_EQ(lines.offsets, (std::vector<int32_t>{0, 2, 2, 2}));
+  const Column &line = lines.children[0];
+  EXPECT_EQ(line.length, 2u);
+  const Column &sku = line.children[0];
+  EXPECT_EQ(sku.bytesAt(0), "ab");
+  EXPECT_FALSE(sku.isValid(1));
+  EXPECT_EQ(line.children[1].valuesAs<uint32_t>()[1], 2u);
+  const Column &codes = batch->column("codes")->children[0];
+  EXPECT_EQ(codes.length, 2u);
+  EXPECT_EQ(codes.valuesAs<uint32_t>()[1], 6u);
+  EXPECT_EQ(batch->column("deltas")->children[0].valuesAs<int32_t>()[0], -3);
+
+  // Maps: a list of key/value structs, missing values take their default
+  const Column &history = *batch->column("history");
+  EXPECT_EQ(history.offsets, (std::vector<int32_t>{0, 1, 1, 1}));
+  const Column &entries = history.children[0];
+  EXPECT_EQ(entries.name, "entries");
+  EXPECT_EQ(entries.children[0].valuesAs<int32_t>()[0], 4);
+  EXPECT_EQ(entries.children[1].valuesAs<int32_t>()[0], 1);
+  const Column &bySku = batch->column("by_sku")->children[0];
+  EXPECT_EQ(bySku.children[0].bytesAt(0), "k");
+  EXPECT_TRUE(bySku.children[1].isValid(0));
+
+  // Oneof members are separate columns, null in rows where another is set
+  const Column &card = *batch->column("card");
+  const Column &wallet = *batch->column("wallet");
+  EXPECT_TRUE(card.isValid(0));
+  EXPECT_FALSE(card.isValid(2));
+  EXPECT_FALSE(wallet.isValid(0));
+  EXPECT_TRUE(wallet.isValid(2));
+  EXPECT_EQ(wallet.children[0].bytesAt(2), std::string_view("\x01", 1));
+  EXPECT_EQ(wallet.children[0].nullCount, 2u);
+
+  // Bools are bit-packed
+  auto flags = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"on", 1, FieldType::Bool},
+      {"bits", 2, FieldType::Bool, /*repeated=*/true},
+  });
+  std::vector<std::vector<uint8_t>> rows(10, {0x08, 0x01});
+  rows[3] = {0x08, 0x00, 0x12, 0x03, 1, 0, 1};
+  auto [bools, berr] = decodeColumns(rows, flags);
+  ASSERT_TRUE(bools.has_value());
+  EXPECT_EQ(bools->columns[0].values.size(), 2u);
+  EXPECT_TRUE(bools->columns[0].boolAt(9));
+  EXPECT_FALSE(bools->columns[0].boolAt(3));
+  const Column &bits = bools->columns[1].children[0];
+  EXPECT_TRUE(bits.boolAt(0) && !bits.boolAt(1) && bits.boolAt(2));
+
+  // Recursive types have no finite layout
+  DescriptorPool pool;
+  pool.add("Node", {FieldDesc("next", 1, FieldType::Message).ofType("Node")});
+  EXPECT_THROW(ColumnarDecoder(borrowed(pool.find("Node"))),
+               std::runtime_error);
+}
+
+TEST(Columnar, RejectsWhatDecodeRejects) {
+  auto [schema, err] = parseProto(kSchemaSource);
+  ASSERT_TRUE(schema.has_value()) << err.message;
+  auto order = schema->message("shop.v1.Order");
+
+  Message m(order);
+  m.set("id", uint64_t(99));
+  m.addMessage("lines")->set("sku", std::string("one"));
+  m.push("deltas", int32_t(-7));
+  m.push("codes", uint32_t(1));
+  m.mutableMap("history")->insertOrAssign(int32_t(1), int32_t(1));
+  m.set("card", std::string("c"));
+  std::vector<uint8_t> bytes = mustEncode(m);
+
+  // A rejected row leaves the batch exactly as it was
+  ColumnarDecoder decoder(order);
+  ASSERT_EQ(decoder.append(bytes).code, DecodeErrc::None);
+  auto agrees = [&](const std::vector<uint8_t> &input) {
+    auto [decoded, derr] = decodeMessage(input, order, DecodeOptions{});
+    size_t rows = decoder.rows();
+    DecodeError cerr = decoder.append(input);
+    EXPECT_EQ(cerr.code, derr.code);
+    EXPECT_EQ(cerr.fieldPath, derr.fieldPath);
+    EXPECT_EQ(decoder.rows(), rows + decoded.has_value());
+    return cerr.code == derr.code;
+  };
+  auto with = [&](std::vector<uint8_t> tail) {
+    std::vector<uint8_t> b = bytes;
+    b.insert(b.end(), tail.begin(), tail.end());
+    return b;
+  };
+  EXPECT_TRUE(agrees(with({0x08, 0x05})));             // id again
+  EXPECT_TRUE(agrees(with({0x2a, 0x00})));             // empty packed run
+  EXPECT_TRUE(agrees(with({0x32, 0x04, 9, 0, 0, 0}))); // packed codes
+  EXPECT_TRUE(agrees(with({0x32, 0x03, 9, 0, 0})));    // ragged packed run
+  EXPECT_TRUE(agrees(with({0x5a, 0x02, 0x10, 0x05}))); // default key
+  EXPECT_TRUE(agrees(with({0x5a, 0x02, 0x10, 0x80}))); // bad map value
+  EXPECT_TRUE(agrees(with({0x5a, 0x02, 0x00, 0x01}))); // field 0 in entry
+  EXPECT_TRUE(agrees(with({0x6a, 0x00})));             // wallet replaces card
+  EXPECT_TRUE(agrees(with({0x12, 0x02, 0x10, 0x80}))); // bad line
+  EXPECT_TRUE(agrees(with({0xf8, 0x01, 0x00})));       // unknown field
+  EXPECT_TRUE(agrees(with({0x0a, 0x00})));             // wrong wire type
+  EXPECT_TRUE(agrees(with({0x0b})));                   // group
+  for (size_t cut = 0; cut < bytes.size(); ++cut)
+    EXPECT_TRUE(agrees({bytes.begin(), bytes.begin() + cut})) << cut;
+
+  ColumnBatch batch = decoder.finish();
+  EXPECT_EQ(decoder.rows(), 0u);
+  for (const Column &c : batch.columns) {
+    EXPECT_EQ(c.length, batch.rows) << c.name;
+    EXPECT_EQ(c.validity.size(), (batch.rows + 7) / 8) << c.name;
+  }
+  const Column &codes = batch.column("codes")->children[0];
+  EXPECT_EQ(codes.length, size_t(batch.column("codes")->offsets.back()));
+
+  // Limits apply per row and errors name the row
+  DecodeOptions opts;
+  opts.maxRepeated = 1;
+  auto [limited, lerr] =
+      decodeColumns({bytes, with({0x28, 0x02})}, order, opts);
+  EXPECT_FALSE(limited.has_value());
+  EXPECT_EQ(lerr.code, DecodeErrc::TooManyElements);
+  EXPECT_EQ(lerr.fieldPath, "[1].deltas[1]");
+  opts = {};
+  opts.maxDepth = 0;
+  auto [shallow, serr] = decodeColumns({bytes}, order, opts);
+  EXPECT_EQ(serr.code, DecodeErrc::DepthExceeded);
+  EXPECT_EQ(serr.fieldPath, "[0].lines[0]");
+}
+
+TEST(Columnar, EncodesRowsFromColumns) {
+  auto [schema, err] = parseProto(kSchemaSource);
+  ASSERT_TRUE(schema.has_value()) << err.message;
+  auto order = schema->message("shop.v1.Order");
+
+  Message full(order);
+  full.set("id", uint64_t(300));
+  full.addMessage("lines")->set("sku", std::string("ab"));
+  Message *line = full.addMessage("lines");
+  line->set("quantity", uint32_t(2));
+  line->set("cents", int64_t(-1));
+  full.set("status", int32_t(-2));
+  full.push("deltas", int32_t(-3));
+  full.push("deltas", int32_t(1 << 20));
+  full.push("codes", uint32_t(5));
+  full.push("codes", uint32_t(6));
+  (*full.mutableMap("by_sku")->tryEmplace(std::string("k"))) =
+      Message(schema->message("shop.v1.Order.Line"));
+  full.mutableMap("history")->insertOrAssign(int32_t(-4), int32_t(1));
+  full.mutableMessage("wallet")->set("token", std::vector<uint8_t>{1, 0});
+  Message sparse(order);
+  sparse.set("card", std::string("c"));
+  std::vector<std::vector<uint8_t>> inputs = {
+      mustEncode(full), mustEncode(Message(order)), mustEncode(sparse)};
+
+  // Rows come back byte for byte as encodeMessage writes them
+  auto [batch, derr] = decodeColumns(inputs, order);
+  ASSERT_TRUE(batch.has_value()) << derr.fieldPath;
+  auto [rows, eerr] = encodeColumns(*batch);
+  ASSERT_TRUE(rows.has_value()) << eerr.fieldPath;
+  EXPECT_EQ(*rows, inputs);
+
+  std::vector<uint8_t> stream = {0xff};
+  ASSERT_EQ(encodeColumnsDelimited(*batch, stream).code, EncodeErrc::None);
+  size_t at = 1;
+  for (const auto &row : inputs) {
+    auto [len, next] = decodeVarint(stream, at);
+    ASSERT_TRUE(len.has_value());
+    EXPECT_EQ(std::vector<uint8_t>(stream.begin() + next,
+                                   stream.begin() + next + *len),
+              row);
+    at = next + *len;
+  }
+  EXPECT_EQ(at, stream.size());
+
+  // Columns filled in by hand
+  auto desc = std::make_shared<ProtoDesc>(std::vector<FieldDesc>{
+      {"id", 1, FieldType::UInt},
+      {"name", 2, FieldType::String},
+      {"vals", 3, FieldType::Double, /*repeated=*/true},
+  });
+  ColumnBatch built = makeColumnBatch(desc);
+  built.rows = 2;
+  Column &id = built.columns[0];
+  uint64_t ids[] = {150, 0};
+  id.values.assign(reinterpret_cast<const uint8_t *>(ids),
+                   reinterpret_cast<const uint8_t *>(ids + 2));
+  id.validity = {0b01};
+  id.length = 2;
+  Column &name = built.columns[1];
+  name.validity = {0b11};
+  name.offsets = {0, 0, 2};
+  name.data = {'h', 'i'};
+  name.length = 2;
+  Column &vals = built.columns[2];
+  vals.validity = {0b11};
+  vals.offsets = {0, 2, 2};
+  vals.length = 2;
+  double ds[] = {1.5, -2};
+  vals.children[0].values.assign(reinterpret_cast<const uint8_t *>(ds),
+                                 reinterpret_cast<const uint8_t *>(ds + 2));
+  vals.children[0].validity = {0b11};
+  vals.children[0].length = 2;
+  auto [builtRows, berr] = encodeColumns(built);
+  ASSERT_TRUE(builtRows.has_value()) << berr.fieldPath;
+  Message first(desc);
+  first.set("id", uint64_t(150));
+  first.set("name", std::string());
+  first.push("vals", 1.5);
+  first.push("vals", -2.0);
+  Message second(desc);
+  second.set("name", std::string("hi"));
+  EXPECT_EQ((*builtRows)[0], mustEncode(first));
+  EXPECT_EQ((*builtRows)[1], mustEncode(second));
+
+  // Buffers that do not fit are reported by path, and nothing is written
+  auto rejects = [&](ColumnBatch b, const std::string &path) {
+    std::vector<uint8_t> out = {1, 2};
+    EncodeError e = encodeColumnsDelimited(b, out);
+    EXPECT_EQ(e.code, EncodeErrc::MalformedColumn) << path;
+    EXPECT_EQ(e.fieldPath, path);
+    EXPECT_EQ(out, (std::vector<uint8_t>{1, 2}));
+    EXPECT_FALSE(encodeColumns(b).first.has_value()) << path;
+  };
+  ColumnBatch bad = built;
+  bad.columns[1].offsets[2] = 3; // past the data
+  rejects(bad, "name");
+  bad = built;
+  bad.columns[2].children[0].validity = {0b01}; // null element
+  rejects(bad, "vals");
+  bad = built;
+  bad.columns[0].values.resize(8);
+  rejects(bad, "id");
+  bad = *batch;
+  bad.columns[1].children[0].children[0].offsets[1] = -1;
+  rejects(bad, "lines.sku");
+  bad = *batch;
+  bad.columns[0].type = FieldType::Int;
+  rejects(bad, "id");
+}
+
+TEST(WireScanner, WalksFieldsWithoutAllocating) {
+  auto [schema, err] = parseProto(kSchemaSource);
+  ASSERT_TRUE(schema.has_value()) << err.message;
+  auto order = schema->message("shop.v1.Order");
+
+  Message m(order);
+  m.set("id", uint64_t(300));
+  m.addMessage("lines")->set("sku", std::string("ab"));
+  m.addMessage("lines")->set("cents", int64_t(-2));
+  m.push("deltas", int32_t(-1));
+  m.mutableMap("history")->insertOrAssign(int32_t(3), int32_t(1));
+  m.set("card", std::string("c"));
+  std::vector<uint8_t> bytes = mustEncode(m);
+  bytes.insert(bytes.end(), {0xa1, 0x06, 0, 0, 0, 0, 0, 0, 0xf0, 0x3f});
+
+  size_t before = allocationCount;
+  WireScanner scan(bytes, order.get());
+  size_t fields = 0, lineFields = 0;
+  uint64_t id = 0;
+  int64_t cents = 0;
+  std::string_view sku, card;
+  WireField f, g;
+  while (scan.next(f)) {
+    ++fields;
+    if (f.number == 1)
+      id = f.value;
+    if (f.desc != nullptr && f.desc->name == "lines") {
+      for (WireScanner line = scan.descend(f); line.next(g); ++lineFields) {
+        EXPECT_NE(g.desc, nullptr);
+        if (g.number == 1)
+          sku = g.asBytes();
+        if (g.number == 3)
+          cents = int64_t(g.value);
+      }
+    }
+    if (f.number == 12)
+      card = f.asBytes();
+  }
+  EXPECT_EQ(allocationCount, before);
+  EXPECT_TRUE(scan.done());
+  EXPECT_EQ(scan.offset(), bytes.size());
+  EXPECT_EQ(fields, 7u); // id, 2 lines, deltas, history, card, field 100
+  EXPECT_EQ(lineFields, 2u);
+  EXPECT_EQ(id, 300u);
+  EXPECT_EQ(sku, "ab");
+  EXPECT_EQ(cents, -2);
+  EXPECT_EQ(card, "c");
+  EXPECT_EQ(f.number, 100u); // unknown to the descriptor
+  EXPECT_EQ(f.desc, nullptr);
+  EXPECT_EQ(f.wire, I64);
+  EXPECT_EQ(f.asDouble(), 1.0);
+  EXPECT_EQ(f.offset, bytes.size() - 10);
+
+  // Map entries descend with the entry type; offsets stay absolute
+  WireScanner again(bytes, order.get());
+  while (again.next(f) && f.number != 11) {
+  }
+  WireScanner entry = again.descend(f);
+  ASSERT_TRUE(entry.next(g));
+  ASSERT_NE(g.desc, nullptr);
+  EXPECT_EQ(g.desc->name, "key");
+  EXPECT_EQ(g.asInt32(), 3);
+  EXPECT_EQ(bytes[g.offset], 0x08);
+
+  // Framing errors stop the scan with decodeMessage's codes
+  auto failsWith = [](std::vector<uint8_t> in, DecodeErrc code,
+                      size_t offset) {
+    WireScanner s(in);
+    WireField w;
+    while (s.next(w)) {
+    }
+    EXPECT_EQ(s.error(), code);
+    EXPECT_EQ(s.offset(), offset);
+    EXPECT_FALSE(s.done());
+    EXPECT_FALSE(s.next(w));
+  };
+  failsWith({0x08}, DecodeErrc::Malformed, 1);             // no value
+  failsWith({0x08, 0x01, 0x12, 0x05, 1}, DecodeErrc::Malformed, 3);
+  failsWith({0x08, 0x01, 0x0b}, DecodeErrc::InvalidTag, 3); // group
+  failsWith({0x00, 0x00}, DecodeErrc::InvalidTag, 1);       // field 0
+  failsWith({0x80}, DecodeErrc::Malformed, 0);              // cut tag
+  std::vector<uint8_t> tooLong = {0x08};
+  tooLong.insert(tooLong.end(), 9, 0xff);
+  tooLong.push_back(0x02); // tenth byte above 1
+  failsWith(tooLong, DecodeErrc::Malformed, 1);
+}
+
+TEST(Predicate, EvaluatesOnEncodedBytes) {
+  auto [schema, err] = parseProto(kSchemaSource);
+  ASSERT_TRUE(schema.has_value()) << err.message;
+  auto order = schema->message("shop.v1.Order");
+
+  Message open(order);
+  open.set("id", uint64_t(7));
+  open.set("status", int32_t(1));
+  open.push("deltas", int32_t(-3));
+  open.push("deltas", int32_t(4));
+  open.set("card", std::string("visa"));
+  Message closed(order);
+  closed.set("id", uint64_t(900));
+  closed.set("status", int32_t(-2));
+  closed.mutableMessage("wallet")->set("token", std::vector<uint8_t>{'e'});
+  Message empty(order);
+  std::vector<std::vector<uint8_t>> records = {
+      mustEncode(open), mustEncode(closed), mustEncode(empty)};
+
+  auto select = [&](std::string_view expr) {
+    auto [pred, perr] = compilePredicate(expr, order);
+    EXPECT_TRUE(pred.has_value()) << expr << ": " << perr.message;
+    if (!pred.has_value())
+      return std::string();
+    std::vector<uint8_t> bits = pred->select(records);
+    std::string out;
+    for (size_t i = 0; i < records.size(); ++i) {
+      bool hit = bits[i / 8] >> (i % 8) & 1;
+      EXPECT_EQ(hit, pred->matches(records[i])) << expr;
+      out += hit ? '1' : '0';
+    }
+    return out;
+  };
+  EXPECT_EQ(select("status == STATUS_OPEN"), "100");
+  EXPECT_EQ(select("status == 0"), "001"); // unset is the default
+  EXPECT_EQ(select("status < 1"), "011");
+  EXPECT_EQ(select("id >= 7 && id != 900"), "100");
+  EXPECT_EQ(select("!(id > 100) || card == \"x\""), "101");
+  EXPECT_EQ(select("has(card) || has(wallet)"), "110");
+  EXPECT_EQ(select("wallet.token == \"e\""), "010");
+  EXPECT_EQ(select("wallet.token == \"\" && card != \"\""), "100");
+  EXPECT_EQ(select("has(wallet.token)"), "010");
+  EXPECT_EQ(select("deltas == 4"), "100"); // any element
+  EXPECT_EQ(select("deltas < 0 && !has(lines)"), "100");
+  EXPECT_EQ(select("card >= \"v\" || id == 0x384"), "110");
+  EXPECT_EQ(select("(((status == -2)))"), "010");
+
+  // Last occurrence wins, and a later oneof member unsets card
+  auto [pred, perr] = compilePredicate("id == 1 && card == \"\"", order);
+  ASSERT_TRUE(pred.has_value()) << perr.message;
+  std::vector<uint8_t> twice = {0x08, 0x05, 0x62, 0x01, 'c', 0x6a, 0x00,
+                                0x08, 0x01};
+  EXPECT_TRUE(pred->matches(twice));
+  twice.back() = 0x02;
+  EXPECT_FALSE(pred->matches(twice));
+
+  // A later occurrence of a message field replaces the earlier one, as
+  // decodeMessage does, whether or not the oneof switched in between
+  auto [token, terr] = compilePredicate(
+      "wallet.token == \"a\" && has(wallet.token)", order);
+  ASSERT_TRUE(token.has_value()) << terr.message;
+  std::vector<uint8_t> replaced = {0x6a, 0x03, 0x0a, 0x01, 'a', 0x6a, 0x00};
+  EXPECT_FALSE(token->matches(replaced));
+  std::vector<uint8_t> switched = {0x6a, 0x03, 0x0a, 0x01, 'a', 0x62,
+                                   0x01, 'c',  0x6a, 0x00};
+  EXPECT_FALSE(token->matches(switched));
+  auto [fresh, ferr] = compilePredicate(
+      "has(wallet) && !has(wallet.token) && wallet.token == \"\"", order);
+  ASSERT_TRUE(fresh.has_value()) << ferr.message;
+  EXPECT_TRUE(fresh->matches(switched));
+  EXPECT_TRUE(fresh->matches(replaced));
+  replaced = {0x6a, 0x00, 0x6a, 0x03, 0x0a, 0x01, 'a'};
+  EXPECT_TRUE(token->matches(replaced));
+
+  // Malformed where read never matches, even under '!'
+  auto [negated, nerr] = compilePredicate("!(id == 3)", order);
+  ASSERT_TRUE(negated.has_value());
+  EXPECT_TRUE(negated->matches(std::vector<uint8_t>{0x08, 0x01}));
+  EXPECT_FALSE(negated->matches(std::vector<uint8_t>{0x08}));
+  EXPECT_FALSE(negated->matches(std::vector<uint8_t>{0x0a, 0x00}));
+  EXPECT_FALSE(negated->matches(std::vector<uint8_t>{0x08, 0x01, 0x0b}));
+  // ...but an unread nested message is not checked
+  EXPECT_TRUE(negated->matches(std::vector<uint8_t>{0x12, 0x01, 0xff}));
+
+  // Long chains compile without deep nesting
+  std::string chain = "id == 0";
+  for (int i = 1; i < 5000; ++i)
+    chain += " || id == " + std::to_string(2 * i + 1); // 7, not 900
+  auto [wide, werr] = compilePredicate(chain, order);
+  ASSERT_TRUE(wide.has_value()) << werr.message;
+  EXPECT_EQ(wide->select(records), std::vector<uint8_t>{0b101});
+
+  auto failsAt = [&](std::string_view expr, size_t offset) {
+    auto [r, e] = compilePredicate(expr, order);
+    EXPECT_FALSE(r.has_value()) << expr;
+    EXPECT_EQ(e.offset, offset) << expr << ": " << e.message;
+  };
+  failsAt("nope == 1", 0);                 // unknown field
+  failsAt("id == -1", 6);                  // out of range for uint64
+  failsAt("id == 1.5", 6);                 // not an integer
+  failsAt("status == STATUS_NOPE", 10);    // unknown enum value
+  failsAt("lines.sku == \"a\"", 0);        // through a repeated field
+  failsAt("wallet == 1", 0);               // a message as a value
+  failsAt("card == 1", 8);                 // number for a string
+  failsAt("id == 1 &&", 10);               // missing operand
+  failsAt("id == 1)", 7);                  // trailing text
+  failsAt("(id == 1", 8);                  // unclosed
+  failsAt(std::string(200, '(') + "id == 1", 100);
+}
+
+static const char *kMergeSchema = R"(
+syntax = "proto3";
+message Leaf { string token = 1; repeated uint32 xs = 2; }
+message W {
+  string token = 1;
+  repeated uint32 xs = 2;
+  Leaf leaf = 3;
+}
+message Top {
+  uint64 id = 1;
+  W w = 2;
+  oneof pay {
+    string card = 4;
+    W wallet = 5;
+  }
+}
+)";
+
+TEST(Predicate, ReadsTheLastOccurrenceOfMessages) {
+  auto [schema, err] = parseProto(kMergeSchema);
+  ASSERT_TRUE(schema.has_value()) << err.message;
+  auto top = schema->message("Top");
+  auto matches = [&](std::string_view expr, std::vector<uint8_t> record) {
+    auto [pred, perr] = compilePredicate(expr, top);
+    EXPECT_TRUE(pred.has_value()) << expr << ": " << perr.message;
+    return pred.has_value() && pred->matches(record);
+  };
+
+  // w{token: "a"} then w{xs: 5}: decodeMessage keeps only the second
+  std::vector<uint8_t> split = {0x12, 0x03, 0x0a, 0x01, 'a',
+                                0x12, 0x02, 0x10, 0x05};
+  auto [decoded, derr] = decodeMessage(split, top, DecodeOptions{});
+  ASSERT_TRUE(decoded.has_value());
+  EXPECT_FALSE(std::get<Message>(decoded->get("w")->get()).get("token"));
+  EXPECT_FALSE(matches("w.token == \"a\"", split));
+  EXPECT_TRUE(matches("w.token == \"\" && !has(w.token)", split));
+  EXPECT_TRUE(matches("w.xs == 5", split));
+
+  std::vector<uint8_t> twice = {0x12, 0x03, 0x0a, 0x01, 'a',
+                                0x12, 0x03, 0x0a, 0x01, 'b'};
+  EXPECT_TRUE(matches("w.token == \"b\"", twice));
+  EXPECT_FALSE(matches("w.token == \"a\"", twice));
+
+  // Repeated children come from the last occurrence only, packed or not
+  std::vector<uint8_t> elems = {0x12, 0x02, 0x10, 0x01, 0x12,
+                                0x04, 0x12, 0x02, 0x07, 0x09};
+  EXPECT_FALSE(matches("w.xs == 1", elems));
+  EXPECT_TRUE(matches("w.xs == 7 && w.xs == 9", elems));
+  EXPECT_FALSE(matches("w.xs == 3", elems));
+
+  // Two levels down: w.leaf is the last w's leaf
+  std::vector<uint8_t> deep = {0x12, 0x05, 0x1a, 0x03, 0x0a, 0x01, 'x',
+                               0x08, 0x01, 0x12, 0x04, 0x1a, 0x02, 0x10,
+                               0x02};
+  EXPECT_TRUE(matches("w.leaf.token == \"\" && w.leaf.xs == 2", deep));
+  EXPECT_FALSE(matches("w.leaf.token == \"x\"", deep));
+  EXPECT_TRUE(matches("id == 1 && !has(w.token)", deep));
+
+  // Oneof members: the last occurrence wins, and a member set after it
+  // unsets it
+  std::vector<uint8_t> wallet = {0x2a, 0x03, 0x0a, 0x01, 'a',
+                                 0x2a, 0x02, 0x10, 0x01};
+  EXPECT_TRUE(matches("wallet.token == \"\" && wallet.xs == 1", wallet));
+  EXPECT_FALSE(matches("wallet.token == \"a\"", wallet));
+  std::vector<uint8_t> reset = {0x2a, 0x03, 0x0a, 0x01, 'a', 0x22, 0x01,
+                                'c',  0x2a, 0x02, 0x10, 0x01};
+  EXPECT_TRUE(matches("has(wallet) && !has(wallet.token)", reset));
+  EXPECT_TRUE(matches("wallet.xs == 1 && card == \"\"", reset));
+  reset.resize(8); // ends with card
+  EXPECT_TRUE(matches("!has(wallet) && card == \"c\"", reset));
+  EXPECT_TRUE(matches("wallet.token == \"\" && !(wallet.xs >= 0)", reset));
+}
+
+TEST(Predicate, ShortCircuitsPastMalformedMessages) {
+  auto [schema, err] = parseProto(kMergeSchema);
+  ASSERT_TRUE(schema.has_value()) << err.message;
+  auto [pred, perr] =
+      compilePredicate("id == 1 || w.token == \"a\"", schema->message("Top"));
+  ASSERT_TRUE(pred.has_value()) << perr.message;
+
+  // w's token runs past w: only noticed when w is read
+  std::vector<uint8_t> bad = {0x08, 0x01, 0x12, 0x02, 0x0a, 0x05};
+  EXPECT_TRUE(pred->matches(bad));
+  bad[1] = 0x02;
+  EXPECT_FALSE(pred->matches(bad));
+  auto [skip, serr] = compilePredicate("!(id == 2 && w.token == \"a\")",
+                                       schema->message("Top"));
+  ASSERT_TRUE(skip.has_value()) << serr.message;
+  EXPECT_FALSE(skip->matches(bad)); // read, so malformed
+  bad[1] = 0x01;
+  EXPECT_TRUE(skip->matches(bad)); // never read
+  // The last occurrence is the one read
+  EXPECT_FALSE(pred->matches(std::vector<uint8_t>{
+      0x12, 0x03, 0x0a, 0x01, 'a', 0x12, 0x01, 0x10}));
+
+  std::vector<std::vector<uint8_t>> batch = {
+      {0x08, 0x01},                               // match
+      {0x08},                                     // truncated
+      {0x08, 0x02, 0x12, 0x03, 0x0a, 0x01, 'a'},  // match through w
+      {0x08, 0x02, 0x12, 0x02, 0x0a, 0x05},       // w read, malformed
+      {0x08, 0x01, 0x12, 0x02, 0x0a, 0x05},       // w never read
+      {0x08, 0x02},                               // no match
+      {0x08, 0x01, 0x12, 0x03, 0x0a, 0x01, 'a', 0x0b}, // bad trailing tag
+      {},                                         // defaults
+      {0x12, 0x03, 0x0a, 0x01, 'a', 0x08, 0x01},  // match
+  };
+  EXPECT_EQ(pred->select(batch), (std::vector<uint8_t>{0x15, 0x01}));
+  for (size_t i = 0; i < batch.size(); ++i)
+    EXPECT_EQ(pred->matches(batch[i]), i == 0 || i == 2 || i == 4 || i == 8)
+        << i;
+}
+
+TEST(Metrics, CountsPerDescriptorAcrossThreads) {
+  if (!PROTO_METRICS)
+    GTEST_SKIP() << "metrics are compiled out";
+  EXPECT_EQ(LatencyHistogram::bucketOf(0), 0u);
+  EXPECT_EQ(LatencyHistogram::bucketOf(256), 0u);
+  EXPECT_EQ(LatencyHistogram::bucketOf(257), 1u);
+  EXPECT_EQ(LatencyHistogram::bucketOf(1024), 2u);
+  EXPECT_EQ(LatencyHistogram::bucketOf(UINT64_MAX),
+            LatencyHistogram::kBuckets - 1);
+
+  auto [schema, err] = parseProto(kSchemaSource);
+  ASSERT_TRUE(schema.has_value()) << err.message;
+  auto order = schema->message("shop.v1.Order");
+  nameMetrics(*schema);
+  Message m(order);
+  m.set("id", uint64_t(3));
+  m.mutableMessage("wallet")->set("token", std::vector<uint8_t>{'t'});
+
+  resetMetrics();
+  enableMetrics(true);
+  std::vector<uint8_t> bytes = mustEncode(m);
+  ASSERT_TRUE(encodeChain(m).first.has_value());
+  bytes.insert(bytes.end(), {0xc0, 0x3e, 0x01}); // field 1000, unknown
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t)
+    threads.emplace_back([&] {
+      Message into(order);
+      for (int i = 0; i < 25; ++i)
+        ASSERT_EQ(decodeInto(into, bytes).code, DecodeErrc::None);
+    });
+  for (std::thread &t : threads)
+    t.join(); // their counts outlive them
+  std::vector<uint8_t> truncated(bytes.begin(), bytes.end() - 1);
+  EXPECT_FALSE(decodeMessage(truncated, order, DecodeOptions{}).first);
+  EXPECT_TRUE(decodeMessage(bytes, order, DecodeOptions{}).first);
+  enableMetrics(false);
+  EXPECT_TRUE(decodeMessage(bytes, order, DecodeOptions{}).first);
+
+  std::vector<DescMetrics> all = metricsSnapshot();
+  ASSERT_EQ(all.size(), 1u);
+  const DescMetrics &stats = all[0];
+  EXPECT_EQ(stats.desc, order.get());
+  EXPECT_EQ(stats.name, "shop.v1.Order");
+  EXPECT_EQ(stats.encoded, 2u);
+  EXPECT_EQ(stats.encodedBytes, 2 * (bytes.size() - 3));
+  EXPECT_EQ(stats.encodeFailures, 0u);
+  EXPECT_EQ(stats.decoded, 101u);
+  EXPECT_EQ(stats.decodedBytes, 101 * bytes.size());
+  EXPECT_EQ(stats.unknownFields, 101u);
+  EXPECT_EQ(stats.maxDepth, 1u); // wallet
+  EXPECT_EQ(stats.decodeFailures[size_t(DecodeErrc::Malformed)], 1u);
+  EXPECT_EQ(stats.encodeLatency.count(), 2u);
+  EXPECT_EQ(stats.decodeLatency.count(), 102u);
+
+  std::ostringstream text;
+  writePrometheus(text);
+  std::string out = text.str();
+  for (const char *line :
+       {"# TYPE protoenc_decoded_messages_total counter\n",
+        "protoenc_decoded_messages_total{desc=\"shop.v1.Order\"} 101\n",
+        "protoenc_decode_failures_total{desc=\"shop.v1.Order\","
+        "reason=\"malformed\"} 1\n",
+        "protoenc_decode_max_depth{desc=\"shop.v1.Order\"} 1\n",
+        "# TYPE protoenc_decode_duration_seconds histogram\n",
+        "protoenc_decode_duration_seconds_bucket{desc=\"shop.v1.Order\","
+        "le=\"2.56e-07\"} ",
+        "protoenc_encode_duration_seconds_bucket{desc=\"shop.v1.Order\","
+        "le=\"+Inf\"} 2\n",
+        "protoenc_decode_duration_seconds_count{desc=\"shop.v1.Order\"} "
+        "102\n"})
+    EXPECT_NE(out.find(line), std::string::npos) << line;
+
+  resetMetrics();
+  EXPECT_EQ(metricsSnapshot()[0].decoded, 0u);
+  EXPECT_EQ(metricsSnapshot()[0].name, "shop.v1.Order");
+
+  // Map keys and values are not unknown fields
+  std::vector<uint8_t> maps = {
+      0x3a, 0x07, 0x0a, 0x01, 'a', 0x12, 0x02, 0x10, 0x02, // by_sku
+      0x3a, 0x07, 0x0a, 0x01, 'b', 0x12, 0x02, 0x10, 0x03,
+      0x5a, 0x04, 0x08, 0x01, 0x10, 0x01}; // history
+  enableMetrics(true);
+  ASSERT_TRUE(decodeMessage(maps, order, DecodeOptions{}).first);
+  ASSERT_EQ(metricsSnapshot().size(), 1u);
+  EXPECT_EQ(metricsSnapshot()[0].decoded, 1u);
+  EXPECT_EQ(metricsSnapshot()[0].unknownFields, 0u);
+  // ...but a field Line does not declare, inside a map value, is
+  maps.insert(maps.end(), {0x3a, 0x09, 0x0a, 0x01, 'c', 0x12, 0x04, 0x10,
+                           0x02, 0x48, 0x01});
+  ASSERT_TRUE(decodeMessage(maps, order, DecodeOptions{}).first);
+  EXPECT_EQ(metricsSnapshot()[0].unknownFields, 1u);
+  enableMetrics(false);
+  resetMetrics();
+}
+
+TEST(AllocationTrace, AttributesToStageAndField) {
+  if (!PROTO_ALLOC_ACCOUNTING)
+    GTEST_SKIP() << "allocation accounting is compiled out (NDEBUG)";
+  auto [schema, err] = parseProto(kSchemaSource);
+  ASSERT_TRUE(schema.has_value()) << err.message;
+  auto order = schema->message("shop.v1.Order");
+
+  AllocationTrace built;
+  Message m(order);
+  m.set("id", uint64_t(3));
+  for (int i = 0; i < 3; ++i)
+    m.addMessage("lines")->set("sku", std::string(32, 'a' + char(i)));
+  m.mutableMessage("wallet")->set("token", std::vector<uint8_t>(40, 't'));
+  AllocationReport mutated = built.report();
+  ASSERT_NE(mutated.find(AllocStage::Mutate, "lines"), nullptr);
+  // Paths start at the message a mutator is called on
+  ASSERT_NE(mutated.find(AllocStage::Mutate, "sku"), nullptr);
+  EXPECT_GE(mutated.find(AllocStage::Mutate, "sku")->allocations, 3u);
+  EXPECT_EQ(mutated.find(AllocStage::Mutate, "id"), nullptr); // inline
+  EXPECT_EQ(mutated.copies(), 0u);
+
+  std::vector<uint8_t> bytes;
+  {
+    AllocationTrace encoding; // nested: the outer trace is not charged
+    bytes = encodeMessage(m).first.value();
+    AllocationReport encoded = encoding.report();
+    const AllocationSite *output = encoded.find(AllocStage::Encode, "");
+    ASSERT_NE(output, nullptr);
+    EXPECT_GE(output->bytes, bytes.size());
+    EXPECT_EQ(encoded.allocations(), output->allocations);
+  }
+  EXPECT_EQ(built.report().find(AllocStage::Encode, ""), nullptr);
+
+  AllocationTrace decoding;
+  auto [decoded, decodeErr] = decodeMessage(bytes, order, DecodeOptions{});
+  ASSERT_TRUE(decoded.has_value());
+  AllocationReport report = decoding.report();
+  const AllocationSite *sku = report.find(AllocStage::Decode, "lines.sku");
+  ASSERT_NE(sku, nullptr);
+  EXPECT_GE(sku->allocations, 3u);
+  EXPECT_GE(sku->bytes, 3 * 32u);
+  EXPECT_NE(report.find(AllocStage::Decode, "wallet.token"), nullptr);
+  EXPECT_EQ(report.find(AllocStage::Mutate, "sku"), nullptr); // setAt
+  EXPECT_EQ(report.copies(), 0u);
+  uint64_t allocations = 0;
+  for (const AllocationSite &site : report.sites)
+    allocations += site.allocations;
+  EXPECT_EQ(report.allocations(), allocations);
+  std::ostringstream text;
+  text << '\n' << report;
+  EXPECT_NE(text.str().find("\ndecode\tlines.sku\t"), std::string::npos)
+      << text.str();
+
+  AllocationTrace copying;
+  Message copy = *decoded;
+  AllocationReport copied = copying.report();
+  ASSERT_NE(copied.find(AllocStage::Other, ""), nullptr);
+  EXPECT_EQ(copied.find(AllocStage::Other, "")->messageCopies, 1u);
+  EXPECT_EQ(copied.copies(), 1u);
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();